@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <termios.h>
+
+#include "send2tv.h"
+
+/*
+ * Adaptive bitrate for live output.
+ *
+ * The writer reports how long each write to the data socket blocked,
+ * how full the socket send buffer is and which output timestamp the
+ * encoder has reached.  Every ABR_WINDOW_US the controller looks at the
+ * window as a whole.  Blocking on its own is normal: a TV that has
+ * buffered enough throttles its reads to playback speed.  The link is
+ * congested only when output falls behind real time while writes block
+ * or the send buffer stays full; then the bitrate drops by a quarter,
+ * or to what the link actually carried if that is lower.  After
+ * ABR_UP_WINDOWS windows in a row that keep up with real time, and not
+ * within ABR_HOLD_US of the last drop, it climbs back by a tenth of the
+ * configured rate.
+ */
+
+/*
+ * Start at the configured rate kbps, which is also the ceiling.
+ */
+void
+abr_init(abr_ctx_t *a, int kbps)
+{
+	memset(a, 0, sizeof(*a));
+	a->max_kbps = kbps;
+	a->min_kbps = kbps / ABR_MIN_DIV;
+	if (a->min_kbps < ABR_MIN_KBPS)
+		a->min_kbps = ABR_MIN_KBPS < kbps ? ABR_MIN_KBPS : kbps;
+	a->cur_kbps = kbps;
+	a->win_start = -1;
+	a->last_down = -1;
+	a->pts_start = -1;
+	a->pts_last = -1;
+}
+
+/*
+ * Account one write of len bytes that took stall_us, with the send
+ * buffer queue_pct full afterwards (-1 if unknown).
+ */
+void
+abr_note_write(abr_ctx_t *a, size_t len, int64_t stall_us, int queue_pct)
+{
+	a->bytes += len;
+	a->stall_us += stall_us;
+	if (queue_pct > a->queue_pct)
+		a->queue_pct = queue_pct;
+}
+
+/*
+ * Account the output timestamp (AV_TIME_BASE units) of an encoded
+ * video frame.
+ */
+void
+abr_note_pts(abr_ctx_t *a, int64_t pts_us)
+{
+	if (a->pts_start < 0)
+		a->pts_start = pts_us;
+	a->pts_last = pts_us;
+}
+
+static void
+abr_window_reset(abr_ctx_t *a, int64_t now_us)
+{
+	a->win_start = now_us;
+	a->bytes = 0;
+	a->stall_us = 0;
+	a->queue_pct = 0;
+	a->pts_start = a->pts_last;
+}
+
+/*
+ * Evaluate the window once it is complete.  Returns the new bitrate in
+ * kbps if it changed, 0 otherwise.
+ */
+int
+abr_update(abr_ctx_t *a, int64_t now_us)
+{
+	int64_t		 elapsed, media_us;
+	int		 stall_pct, pace_pct, sent_kbps, next;
+	const char	*why;
+
+	if (a->win_start < 0) {
+		abr_window_reset(a, now_us);
+		return 0;
+	}
+	elapsed = now_us - a->win_start;
+	if (elapsed < ABR_WINDOW_US)
+		return 0;
+
+	media_us = a->pts_start >= 0 ? a->pts_last - a->pts_start : 0;
+	stall_pct = (int)(a->stall_us * 100 / elapsed);
+	pace_pct = (int)(media_us * 100 / elapsed);
+	sent_kbps = (int)(a->bytes * 8 * 1000 / elapsed);
+
+	next = a->cur_kbps;
+	why = NULL;
+	if (pace_pct < ABR_PACE_LOW && (stall_pct >= ABR_STALL_HIGH ||
+	    a->queue_pct >= ABR_QUEUE_HIGH)) {
+		a->clear = 0;
+		next = a->cur_kbps * 3 / 4;
+		/* Leave room for audio and muxing overhead */
+		if (sent_kbps > 0 && sent_kbps * 8 / 10 < next)
+			next = sent_kbps * 8 / 10;
+		if (next < a->min_kbps)
+			next = a->min_kbps;
+		why = "congested";
+	} else if (pace_pct >= ABR_PACE_OK) {
+		if (++a->clear >= ABR_UP_WINDOWS &&
+		    (a->last_down < 0 ||
+		    now_us - a->last_down >= ABR_HOLD_US)) {
+			a->clear = 0;
+			next = a->cur_kbps + a->max_kbps / 10;
+			if (next > a->max_kbps)
+				next = a->max_kbps;
+			why = "recovered";
+		}
+	} else
+		a->clear = 0;
+
+	if (next != a->cur_kbps) {
+		DPRINTF("abr: %s, %d -> %d kbps (stall %d%%, queue %d%%, "
+		    "pace %d%%, sent %d kbps)\n", why, a->cur_kbps, next,
+		    stall_pct, a->queue_pct, pace_pct, sent_kbps);
+		if (next < a->cur_kbps)
+			a->last_down = now_us;
+		a->cur_kbps = next;
+	} else
+		next = 0;
+
+	abr_window_reset(a, now_us);
+	return next;
+}
+
+/*
+ * How full the send buffer of socket fd is, in percent, or -1 where
+ * the system does not tell.
+ */
+int
+abr_queue_pct(int fd)
+{
+#ifdef TIOCOUTQ
+	int		 queued, size;
+	socklen_t	 len = sizeof(size);
+
+	if (ioctl(fd, TIOCOUTQ, &queued) < 0 ||
+	    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) < 0 ||
+	    size <= 0)
+		return -1;
+	if (queued >= size)
+		return 100;
+	return (int)((long long)queued * 100 / size);
+#else
+	(void)fd;
+	return -1;
+#endif
+}
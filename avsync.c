@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send2tv.h"
+
+/*
+ * A/V clock bookkeeping for screen capture.
+ *
+ * Video frames and audio packets are stamped with the monotonic clock
+ * when they are captured, relative to a common origin t0.  For each one
+ * the encoder position it is written at is compared with that capture
+ * time: the position error of a stream is how far its output timeline
+ * runs ahead of the capture clock.  The A/V offset is the audio error
+ * minus the video error, positive when sound plays late.  Latency is the
+ * time from capture until the data reaches the muxer.  Both are
+ * collected per AVSYNC_WINDOW_US window and reported in debug output.
+ */
+
+static void
+avsync_window_reset(avsync_ctx_t *s, int64_t now_us)
+{
+	s->win_start = now_us;
+	s->av_n = 0;
+	s->av_sum = 0;
+	s->av_min = INT64_MAX;
+	s->av_max = INT64_MIN;
+	s->vlat_n = 0;
+	s->vlat_sum = 0;
+	s->vlat_max = 0;
+	s->alat_n = 0;
+	s->alat_sum = 0;
+	s->alat_max = 0;
+}
+
+/*
+ * Start the capture clock at t0 (av_gettime_relative()).
+ */
+void
+avsync_init(avsync_ctx_t *s, int64_t t0)
+{
+	memset(s, 0, sizeof(*s));
+	s->t0 = t0;
+	avsync_window_reset(s, t0);
+}
+
+/*
+ * Account a video frame captured at cap_us, written at output position
+ * pos_us (AV_TIME_BASE units), reaching the muxer at now_us.
+ */
+void
+avsync_note_video(avsync_ctx_t *s, int64_t pos_us, int64_t cap_us,
+    int64_t now_us)
+{
+	int64_t	 lat = now_us - cap_us;
+
+	s->vpos_us = pos_us - (cap_us - s->t0);
+	s->have_video = 1;
+	s->vlat_n++;
+	s->vlat_sum += lat;
+	if (lat > s->vlat_max)
+		s->vlat_max = lat;
+}
+
+/*
+ * Account audio captured at cap_us, written at output position pos_us,
+ * reaching the muxer at now_us.
+ */
+void
+avsync_note_audio(avsync_ctx_t *s, int64_t pos_us, int64_t cap_us,
+    int64_t now_us)
+{
+	int64_t	 lat = now_us - cap_us, off;
+
+	s->alat_n++;
+	s->alat_sum += lat;
+	if (lat > s->alat_max)
+		s->alat_max = lat;
+	if (!s->have_video)
+		return;
+
+	off = (pos_us - (cap_us - s->t0)) - s->vpos_us;
+	s->av_n++;
+	s->av_sum += off;
+	if (off < s->av_min)
+		s->av_min = off;
+	if (off > s->av_max)
+		s->av_max = off;
+}
+
+/*
+ * Close the window once it is complete: the averages are kept in
+ * av_us, vlat_us and alat_us and printed in debug output.  Returns 1 if
+ * a window was closed.
+ */
+int
+avsync_update(avsync_ctx_t *s, int64_t now_us)
+{
+	if (now_us - s->win_start < AVSYNC_WINDOW_US)
+		return 0;
+
+	s->av_us = s->av_n > 0 ? s->av_sum / s->av_n : 0;
+	s->vlat_us = s->vlat_n > 0 ? s->vlat_sum / s->vlat_n : 0;
+	s->alat_us = s->alat_n > 0 ? s->alat_sum / s->alat_n : 0;
+	if (s->av_n > 0)
+		DPRINTF("avsync: a/v offset %+d ms (%+d..%+d), latency video "
+		    "%d ms (max %d), audio %d ms (max %d), %d audio packets "
+		    "dropped\n", (int)(s->av_us / 1000),
+		    (int)(s->av_min / 1000), (int)(s->av_max / 1000),
+		    (int)(s->vlat_us / 1000), (int)(s->vlat_max / 1000),
+		    (int)(s->alat_us / 1000), (int)(s->alat_max / 1000),
+		    s->dropped);
+	else
+		DPRINTF("avsync: latency video %d ms (max %d), no audio\n",
+		    (int)(s->vlat_us / 1000), (int)(s->vlat_max / 1000));
+	avsync_window_reset(s, now_us);
+	return 1;
+}
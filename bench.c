@@ -0,0 +1,869 @@
+/*
+ * Benchmarks for the transcode pipeline.
+ *
+ * Usage: bench <name> [args...]
+ *
+ *   chunk <file> [maxjobs]	chunked transcode with 1, 2, 4 ... maxjobs
+ *				local workers, output discarded
+ *   convert [frames]		BGRA to YUV420P conversion stage of the
+ *				software filter graph at 1080p, 1440p and
+ *				2160p with 1, 2, 4 ... all cores
+ *   grab [display] [frames]	screen capture through x11grab and the
+ *				native grabber: time to the first frame
+ *				and CPU time per frame (try under Xvfb)
+ *   lockon <file> [sec...]	stream from the start and each seek target
+ *				and tune in like a TV: time and bytes
+ *				until a picture can be decoded
+ *   probe <file...>		probe each file with the adaptive probe
+ *				and with FFmpeg's default sizes, from a
+ *				cold page cache: probe time and bytes
+ *				read, time to the first picture
+ *   profile <file> [sec]	transcode the first sec seconds (default
+ *				20) with each pipeline profile: time to
+ *				first picture, wall and CPU time
+ *   shm [MB]			MB MiB (default 1024) of TS output from
+ *				a client to a server thread over the data
+ *				socket and through a shared-memory ring:
+ *				throughput, CPU and sleeps
+ *   tsout [sec]		output of sec seconds (default 600) of a
+ *				2 Mbit/s stream written per chunk and
+ *				coalesced per profile: syscalls and CPU
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "send2tv.h"
+
+int verbose = 0;
+volatile int running = 1;
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_media_init(media_ctx_t *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->mode = MODE_FILE;
+	m->running = 1;
+	m->pipe_rd = -1;
+	m->pipe_wr = -1;
+	m->ctrl_fd = -1;
+	m->cache_fd = -1;
+	m->bitrate = 2000;
+	m->vcodec = VCODEC_H264;
+}
+
+/*
+ * Scaling of chunked transcoding with the number of local workers.
+ */
+static int
+bench_chunk(int argc, char **argv)
+{
+	media_ctx_t	 tmpl;
+	double		 t, base = 0;
+	int		 jobs, maxjobs, fd, n;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench chunk <file> [maxjobs]\n");
+		return 1;
+	}
+	maxjobs = argc > 1 ? atoi(argv[1]) :
+	    (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (maxjobs <= 0)
+		maxjobs = 1;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+	bench_media_init(&tmpl);
+
+	printf("%-6s %8s %8s %8s\n", "jobs", "chunks", "seconds", "speedup");
+	for (jobs = 1; ; jobs *= 2) {
+		if (jobs > maxjobs)
+			jobs = maxjobs;
+		t = now();
+		n = chunk_transcode(&tmpl, argv[0], 1, jobs, NULL, 0, fd);
+		t = now() - t;
+		if (n < 0) {
+			fprintf(stderr, "chunk: transcode failed\n");
+			close(fd);
+			return 1;
+		}
+		if (base == 0)
+			base = t;
+		printf("%-6d %8d %8.2f %7.2fx\n", jobs, n, t, base / t);
+		if (jobs == maxjobs)
+			break;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Milliseconds per frame to push frames width x height BGRA frames
+ * through the conversion stage on threads threads, or -1 on error.
+ */
+static double
+bench_convert_run(int width, int height, int threads, int frames)
+{
+	AVFilterGraph	*graph;
+	AVFilterContext	*src = NULL, *sink = NULL;
+	AVFilterInOut	*inputs = NULL, *outputs = NULL;
+	AVFrame		*in = NULL, *out = NULL;
+	char		 args[128];
+	double		 t = -1;
+	int		 i;
+
+	graph = avfilter_graph_alloc();
+	if (graph == NULL)
+		return -1;
+	graph->nb_threads = threads;
+
+	snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:"
+	    "time_base=1/30", width, height, AV_PIX_FMT_BGR0);
+	if (avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"),
+	    "in", args, NULL, graph) < 0 ||
+	    avfilter_graph_create_filter(&sink,
+	    avfilter_get_by_name("buffersink"), "out", NULL, NULL, graph) < 0)
+		goto done;
+
+	inputs = avfilter_inout_alloc();
+	outputs = avfilter_inout_alloc();
+	if (inputs == NULL || outputs == NULL)
+		goto done;
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = src;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = sink;
+	/* Same stage as init_video_filters() builds */
+	if (avfilter_graph_parse_ptr(graph, "format=yuv420p",
+	    &inputs, &outputs, NULL) < 0 ||
+	    avfilter_graph_config(graph, NULL) < 0)
+		goto done;
+
+	in = av_frame_alloc();
+	out = av_frame_alloc();
+	if (in == NULL || out == NULL)
+		goto done;
+	in->width = width;
+	in->height = height;
+	in->format = AV_PIX_FMT_BGR0;
+	if (av_frame_get_buffer(in, 0) < 0)
+		goto done;
+	for (i = 0; i < height; i++)
+		memset(in->data[0] + (size_t)i * in->linesize[0], i & 0xff,
+		    (size_t)width * 4);
+
+	t = now();
+	for (i = 0; i < frames; i++) {
+		in->pts = i;
+		if (av_buffersrc_add_frame_flags(src, in,
+		    AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
+			t = -1;
+			goto done;
+		}
+		while (av_buffersink_get_frame(sink, out) >= 0)
+			av_frame_unref(out);
+	}
+	t = (now() - t) * 1000 / frames;
+
+done:
+	av_frame_free(&in);
+	av_frame_free(&out);
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	avfilter_graph_free(&graph);
+	return t;
+}
+
+/*
+ * Cost of the colorspace conversion per frame against thread count.
+ */
+static int
+bench_convert(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		int		 width, height;
+	} sizes[] = {
+		{ "1080p", 1920, 1080 },
+		{ "1440p", 2560, 1440 },
+		{ "2160p", 3840, 2160 }
+	};
+	double		 ms, base;
+	int		 i, threads, ncpu, frames;
+
+	frames = argc > 0 ? atoi(argv[0]) : 100;
+	if (frames <= 0)
+		frames = 100;
+	ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu <= 0)
+		ncpu = 1;
+
+	printf("%-6s %8s %8s %8s %8s\n", "size", "threads", "ms/frame",
+	    "fps", "speedup");
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		base = 0;
+		for (threads = 1; ; threads *= 2) {
+			if (threads > ncpu)
+				threads = ncpu;
+			ms = bench_convert_run(sizes[i].width,
+			    sizes[i].height, threads, frames);
+			if (ms < 0) {
+				fprintf(stderr, "convert: filter graph "
+				    "failed\n");
+				return 1;
+			}
+			if (base == 0)
+				base = ms;
+			printf("%-6s %8d %8.2f %8.1f %7.2fx\n", sizes[i].name,
+			    threads, ms, ms > 0 ? 1000 / ms : 0, base / ms);
+			if (threads == ncpu)
+				break;
+		}
+	}
+	return 0;
+}
+
+static double
+cpu_time(void)
+{
+	struct rusage	 ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Open x11grab the way media_open_screen() falls back to it and read
+ * frames frames.  Fills in the seconds to the first frame and the CPU
+ * seconds per frame after it.
+ */
+static int
+bench_grab_x11grab(const char *display, int frames, double *start,
+    double *cpu)
+{
+	AVFormatContext	*ifmt = NULL;
+	AVDictionary	*opts = NULL;
+	AVPacket	*pkt;
+	double		 t, c = 0;
+	int		 i, ret = -1;
+
+	t = now();
+	av_dict_set(&opts, "framerate", "30", 0);
+	av_dict_set(&opts, "draw_mouse", "1", 0);
+	if (avformat_open_input(&ifmt, display,
+	    av_find_input_format("x11grab"), &opts) < 0) {
+		av_dict_free(&opts);
+		return -1;
+	}
+	av_dict_free(&opts);
+	ifmt->probesize = 50 * 1024 * 1024;
+	pkt = av_packet_alloc();
+	if (pkt == NULL || avformat_find_stream_info(ifmt, NULL) < 0)
+		goto done;
+	for (i = 0; i <= frames; i++) {
+		if (av_read_frame(ifmt, pkt) < 0)
+			goto done;
+		av_packet_unref(pkt);
+		if (i == 0) {
+			*start = now() - t;
+			c = cpu_time();
+		}
+	}
+	*cpu = (cpu_time() - c) / frames;
+	ret = 0;
+done:
+	av_packet_free(&pkt);
+	avformat_close_input(&ifmt);
+	return ret;
+}
+
+static int
+bench_grab_xshm(const char *display, int frames, double *start,
+    double *cpu)
+{
+	xshm_ctx_t	*x;
+	AVFrame		*frame;
+	double		 t, c = 0;
+	int		 i, ret = -1;
+
+	t = now();
+	x = xshm_open(display, 30, 1);
+	if (x == NULL)
+		return -1;
+	frame = av_frame_alloc();
+	if (frame == NULL)
+		goto done;
+	for (i = 0; i <= frames; i++) {
+		if (xshm_grab(x, frame) < 0)
+			goto done;
+		av_frame_unref(frame);
+		if (i == 0) {
+			*start = now() - t;
+			c = cpu_time();
+		}
+	}
+	*cpu = (cpu_time() - c) / frames;
+	ret = 0;
+done:
+	av_frame_free(&frame);
+	xshm_close(x);
+	return ret;
+}
+
+/*
+ * Startup and per-frame cost of both screen capture backends.
+ */
+static int
+bench_grab(int argc, char **argv)
+{
+	const char	*display;
+	double		 start, cpu;
+	int		 frames;
+
+	display = argc > 0 ? argv[0] : getenv("DISPLAY");
+	if (display == NULL)
+		display = ":0.0";
+	frames = argc > 1 ? atoi(argv[1]) : 150;
+	if (frames <= 0)
+		frames = 150;
+	avdevice_register_all();
+
+	printf("%-8s %12s %14s\n", "backend", "startup ms", "cpu ms/frame");
+	if (bench_grab_x11grab(display, frames, &start, &cpu) == 0)
+		printf("%-8s %12.1f %14.3f\n", "x11grab", start * 1000,
+		    cpu * 1000);
+	else
+		printf("%-8s %12s\n", "x11grab", "unavailable");
+	if (bench_grab_xshm(display, frames, &start, &cpu) == 0)
+		printf("%-8s %12.1f %14.3f\n", "xshm", start * 1000,
+		    cpu * 1000);
+	else
+		printf("%-8s %12s\n", "xshm", "unavailable");
+	return 0;
+}
+
+/*
+ * Start streaming at sec and read the output until tslock locks on.
+ * Returns 0 and the time and stream bytes to lock-on, or -1 on error.
+ */
+static int
+bench_lockon_run(media_ctx_t *m, int sec, double *ms, long long *bytes)
+{
+	uint8_t		 buf[SEND2TV_BUF_SIZE];
+	tslock_t	 t;
+	double		 t0;
+	ssize_t		 n;
+	int		 locked = 0;
+
+	tslock_init(&t);
+	t0 = now();
+	m->running = 1;
+	m->start_sec = sec;
+	av_seek_frame(m->ifmt_ctx, -1, (int64_t)sec * AV_TIME_BASE,
+	    AVSEEK_FLAG_BACKWARD);
+	if (m->needs_transcode) {
+		if (media_open_transcode(m) < 0 ||
+		    pthread_create(&m->thread, NULL, media_transcode_thread,
+		    m) != 0)
+			return -1;
+	} else {
+		if (media_open_remux(m) < 0 ||
+		    pthread_create(&m->thread, NULL, media_remux_thread,
+		    m) != 0)
+			return -1;
+	}
+
+	while ((n = read(m->pipe_rd, buf, sizeof(buf))) > 0) {
+		if (!locked && tslock_feed(&t, buf, n)) {
+			locked = 1;
+			*ms = (now() - t0) * 1000;
+			*bytes = t.lock_off;
+			m->running = 0;
+		}
+	}
+	pthread_join(m->thread, NULL);
+	media_close_transcode_state(m);
+	return locked ? 0 : -1;
+}
+
+/*
+ * Time to first picture at the start of a file and after seeks.
+ */
+static int
+bench_lockon(int argc, char **argv)
+{
+	media_ctx_t	 m;
+	double		 ms;
+	long long	 bytes;
+	int		 i, sec;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench lockon <file> [sec...]\n");
+		return 1;
+	}
+	bench_media_init(&m);
+	if (media_probe(&m, argv[0], 0) < 0) {
+		fprintf(stderr, "lockon: %s: cannot probe\n", argv[0]);
+		return 1;
+	}
+
+	/* Start at 0, then at each target (default 10 s) */
+	printf("%s\n", m.needs_transcode ? "transcode" : "remux");
+	printf("%-8s %10s %12s\n", "start", "ms", "bytes");
+	for (i = 0; i < (argc > 1 ? argc : 2); i++) {
+		sec = i == 0 ? 0 : argc > 1 ? atoi(argv[i]) : 10;
+		if (bench_lockon_run(&m, sec, &ms, &bytes) < 0)
+			printf("%-8d %10s\n", sec, "no lock");
+		else
+			printf("%-8d %10.1f %12lld\n", sec, ms, bytes);
+	}
+	media_close(&m);
+	return 0;
+}
+
+/*
+ * Probe file from a cold page cache, then stream it until a picture can
+ * be decoded.  Returns 0, or -1 if it cannot be probed.
+ */
+static int
+bench_probe_run(const char *file, int full, media_ctx_t *m, double *probe_ms,
+    double *lock_ms)
+{
+	long long	 bytes;
+	double		 t0;
+	int		 fd;
+
+	/* The first probe would warm the cache for the second */
+	if ((fd = open(file, O_RDONLY)) >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	bench_media_init(m);
+	m->full_probe = full;
+	t0 = now();
+	if (media_probe(m, file, 0) < 0)
+		return -1;
+	*probe_ms = (now() - t0) * 1000;
+	if (bench_lockon_run(m, 0, lock_ms, &bytes) < 0)
+		*lock_ms = -1;
+	else
+		*lock_ms += *probe_ms;
+	media_close(m);
+	return 0;
+}
+
+/*
+ * Adaptive probing against FFmpeg's default probe sizes over a set of
+ * files: probe time and bytes read, and time to the first picture,
+ * probe included.
+ */
+static int
+bench_probe(int argc, char **argv)
+{
+	media_ctx_t	 m;
+	double		 probe_ms[2], lock_ms, tot_ms[2] = { 0, 0 };
+	long long	 bytes[2], tot_bytes[2] = { 0, 0 };
+	int		 i, full, n = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench probe <file...>\n");
+		return 1;
+	}
+	printf("%-32s %-9s %5s %10s %12s %10s\n", "file", "probe", "tries",
+	    "probe ms", "bytes", "picture ms");
+	for (i = 0; i < argc; i++) {
+		for (full = 0; full < 2; full++) {
+			if (bench_probe_run(argv[i], full, &m, &probe_ms[full],
+			    &lock_ms) < 0) {
+				printf("%-32.32s %-9s %5s\n", argv[i],
+				    full ? "default" : "adaptive", "-");
+				break;
+			}
+			printf("%-32.32s %-9s %5d %10.1f %12lld ", argv[i],
+			    full ? "default" : "adaptive", m.probe_tries,
+			    probe_ms[full], (long long)m.probe_bytes);
+			if (lock_ms < 0)
+				printf("%10s\n", "no lock");
+			else
+				printf("%10.1f\n", lock_ms);
+			bytes[full] = m.probe_bytes;
+		}
+		if (full < 2)
+			continue;
+		for (full = 0; full < 2; full++) {
+			tot_ms[full] += probe_ms[full];
+			tot_bytes[full] += bytes[full];
+		}
+		n++;
+	}
+	if (n == 0)
+		return 1;
+	for (full = 0; full < 2; full++)
+		printf("%-32s %-9s %5s %10.1f %12lld\n", "mean",
+		    full ? "default" : "adaptive", "", tot_ms[full] / n,
+		    tot_bytes[full] / n);
+	return 0;
+}
+
+/*
+ * Latency and cost of each pipeline profile: transcode the first sec
+ * seconds of a file, reading the output as fast as a TV on a good link.
+ */
+static int
+bench_profile(int argc, char **argv)
+{
+	uint8_t		 buf[SEND2TV_BUF_SIZE];
+	media_ctx_t	 m;
+	const profile_t	*p;
+	tslock_t	 t;
+	double		 t0, lock, wall, cpu;
+	ssize_t		 n;
+	int		 sec;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench profile <file> [sec]\n");
+		return 1;
+	}
+	sec = argc > 1 ? atoi(argv[1]) : 20;
+	if (sec <= 0)
+		sec = 20;
+	bench_media_init(&m);
+	if (media_probe(&m, argv[0], 1) < 0) {
+		fprintf(stderr, "profile: %s: cannot probe\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-12s %10s %10s %12s\n", "profile", "first ms", "wall s",
+	    "cpu s/s");
+	for (p = profiles; p->name != NULL; p++) {
+		m.profile = p;
+		m.running = 1;
+		m.end_us = (int64_t)sec * AV_TIME_BASE;
+		av_seek_frame(m.ifmt_ctx, -1, 0, AVSEEK_FLAG_BACKWARD);
+		tslock_init(&t);
+		lock = -1;
+		t0 = now();
+		cpu = cpu_time();
+		if (media_open_transcode(&m) < 0 ||
+		    pthread_create(&m.thread, NULL, media_transcode_thread,
+		    &m) != 0) {
+			fprintf(stderr, "profile: %s: cannot start\n",
+			    p->name);
+			media_close(&m);
+			return 1;
+		}
+		while ((n = read(m.pipe_rd, buf, sizeof(buf))) > 0)
+			if (lock < 0 && tslock_feed(&t, buf, n))
+				lock = (now() - t0) * 1000;
+		pthread_join(m.thread, NULL);
+		wall = now() - t0;
+		cpu = cpu_time() - cpu;
+		media_close_transcode_state(&m);
+		printf("%-12s %10.1f %10.2f %12.3f\n", p->name, lock, wall,
+		    cpu / sec);
+	}
+	media_close(&m);
+	return 0;
+}
+
+/*
+ * Sink for bench_tsout: poll() and writev() like the media output.
+ */
+static int
+bench_tsout_sink(void *opaque, const struct iovec *iov, int n)
+{
+	struct pollfd	 pfd;
+	int		*fd = opaque;
+
+	pfd.fd = *fd;
+	pfd.events = POLLOUT;
+	poll(&pfd, 1, -1);
+	return writev(*fd, iov, n) < 0 ? -1 : 0;
+}
+
+static void *
+bench_tsout_reader(void *arg)
+{
+	uint8_t	 buf[SEND2TV_BUF_SIZE];
+	int	*fd = arg;
+
+	while (read(*fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+/*
+ * Feed sec seconds of a 2 Mbit/s, 30 fps stream with 48 kHz AAC the way
+ * the muxer hands it out (a flush per packet through a 4 KiB AVIO
+ * buffer) to tsout with pkts/budget_us, timed by the stream clock.
+ */
+static int
+bench_tsout_run(int pkts, int64_t budget_us, int sec, int64_t *calls,
+    int64_t *writes, int64_t *bytes, double *cpu)
+{
+	static uint8_t	 ts[SEND2TV_AVIO_SIZE];
+	tsout_t		 o;
+	pthread_t	 reader;
+	int64_t		 t, next_v = 0, next_a = 0;
+	int		 fds[2], len, n, fill;
+
+	if (pipe(fds) < 0)
+		return -1;
+	if (tsout_init(&o, pkts, budget_us, bench_tsout_sink,
+	    &fds[1]) < 0 ||
+	    pthread_create(&reader, NULL, bench_tsout_reader, &fds[0]) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	memset(ts, 0x47, sizeof(ts));
+
+	*cpu = cpu_time();
+	while ((t = next_v < next_a ? next_v : next_a) <
+	    (int64_t)sec * 1000000) {
+		if (t == next_v) {
+			len = 45 * 188;		/* 8.3 KB frame */
+			next_v += 1000000 / 30;
+		} else {
+			len = 2 * 188;		/* 1024 samples */
+			next_a += 1024 * 1000000 / 48000;
+		}
+		for (fill = 0; len > 0; len -= n) {
+			n = len < (int)sizeof(ts) - fill ? len :
+			    (int)sizeof(ts) - fill;
+			fill += n;
+			if (fill == (int)sizeof(ts) || len == n) {
+				tsout_write(&o, ts, fill, t);
+				fill = 0;
+			}
+		}
+		tsout_tick(&o, t);
+	}
+	tsout_flush(&o);
+	*cpu = cpu_time() - *cpu;
+	*calls = o.calls;
+	*writes = o.writes;
+	*bytes = o.bytes;
+
+	close(fds[1]);
+	pthread_join(reader, NULL);
+	close(fds[0]);
+	tsout_free(&o);
+	return 0;
+}
+
+/*
+ * Syscalls and CPU of the coalesced output against a write per chunk.
+ */
+static int
+bench_tsout(int argc, char **argv)
+{
+	const profile_t	*p;
+	int64_t		 calls, writes, bytes;
+	double		 cpu;
+	int		 sec;
+
+	sec = argc > 0 ? atoi(argv[0]) : 600;
+	if (sec <= 0)
+		sec = 600;
+
+	printf("%-12s %10s %10s %10s %12s\n", "output", "chunks", "syscalls",
+	    "bytes/wr", "cpu us/s");
+	if (bench_tsout_run(0, 0, sec, &calls, &writes, &bytes, &cpu) < 0)
+		return 1;
+	/* poll() and write() per chunk */
+	printf("%-12s %10lld %10lld %10lld %12.1f\n", "unbuffered",
+	    (long long)calls, (long long)writes * 2,
+	    (long long)(bytes / writes), cpu * 1e6 / sec);
+	for (p = profiles; p->name != NULL; p++) {
+		if (bench_tsout_run(p->coalesce_pkts, p->coalesce_us, sec,
+		    &calls, &writes, &bytes, &cpu) < 0)
+			return 1;
+		printf("%-12s %10lld %10lld %10lld %12.1f\n", p->name,
+		    (long long)calls, (long long)writes * 2,
+		    (long long)(bytes / writes), cpu * 1e6 / sec);
+	}
+	return 0;
+}
+
+/*
+ * Reader side of bench_shm: the server sending to the TV, here to
+ * /dev/null.
+ */
+struct bench_shm_reader {
+	int		 sock;
+	shmring_t	*ring;
+	int		 out;
+};
+
+static void *
+bench_shm_reader(void *arg)
+{
+	struct bench_shm_reader	*r = arg;
+	uint8_t			 buf[SEND2TV_BUF_SIZE];
+	const uint8_t		*p;
+	size_t			 len;
+	ssize_t			 n;
+
+	if (r->ring == NULL) {
+		while ((n = read(r->sock, buf, sizeof(buf))) > 0)
+			(void)write(r->out, buf, n);
+		return NULL;
+	}
+	while ((p = shmring_peek(r->ring, sizeof(buf), &len, &running,
+	    r->sock)) != NULL) {
+		(void)write(r->out, p, len);
+		shmring_consume(r->ring, len);
+	}
+	return NULL;
+}
+
+/*
+ * Push mb MiB of coalesced TS output (21 packets a write, as in the
+ * balanced profile) from a client thread to a server thread, over the
+ * data socket or through a ring.  Fills in wall and CPU seconds and the
+ * voluntary context switches, the sleeps of either side.
+ */
+static int
+bench_shm_run(int use_ring, int mb, double *wall, double *cpu,
+    long *csw)
+{
+	static uint8_t		 ts[21 * 188];
+	struct bench_shm_reader	 r;
+	struct rusage		 ru;
+	struct iovec		 iov;
+	pthread_t		 reader;
+	shmring_t		*ring = NULL;
+	long long		 left;
+	char			 hello[16];
+	ssize_t			 n;
+	int			 sv[2], ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+	memset(&r, 0, sizeof(r));
+	r.sock = sv[1];
+	if ((r.out = open("/dev/null", O_WRONLY)) < 0)
+		return -1;
+	if (use_ring) {
+		if ((ring = shmring_create(SHMRING_SIZE)) == NULL ||
+		    shmring_send(ring, sv[0]) < 0 ||
+		    (r.ring = shmring_accept(sv[1], hello, sizeof(hello),
+		    &n)) == NULL) {
+			fprintf(stderr, "shm: no shared memory ring\n");
+			return -1;
+		}
+	}
+	memset(ts, 0x47, sizeof(ts));
+	iov.iov_base = ts;
+	iov.iov_len = sizeof(ts);
+
+	getrusage(RUSAGE_SELF, &ru);
+	*csw = ru.ru_nvcsw;
+	*cpu = cpu_time();
+	*wall = now();
+	if (pthread_create(&reader, NULL, bench_shm_reader, &r) != 0)
+		return -1;
+	for (left = (long long)mb << 20; left > 0; left -= sizeof(ts)) {
+		if (ring != NULL)
+			ret = shmring_write(ring, &iov, 1, &running, sv[0]);
+		else
+			ret = writev(sv[0], &iov, 1) < 0 ? -1 : 0;
+		if (ret < 0)
+			break;
+	}
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(reader, NULL);
+	*wall = now() - *wall;
+	*cpu = cpu_time() - *cpu;
+	getrusage(RUSAGE_SELF, &ru);
+	*csw = ru.ru_nvcsw - *csw;
+
+	shmring_free(ring);
+	shmring_free(r.ring);
+	close(sv[0]);
+	close(sv[1]);
+	close(r.out);
+	return ret;
+}
+
+/*
+ * Client to server transport: data socket against shared-memory ring.
+ */
+static int
+bench_shm(int argc, char **argv)
+{
+	double	 wall, cpu;
+	long	 csw;
+	int	 mb, i;
+
+	mb = argc > 0 ? atoi(argv[0]) : 1024;
+	if (mb <= 0)
+		mb = 1024;
+
+	printf("%-8s %10s %10s %12s %10s\n", "path", "MB/s", "wall s",
+	    "cpu ms/MB", "sleeps");
+	for (i = 0; i < 2; i++) {
+		if (bench_shm_run(i, mb, &wall, &cpu, &csw) < 0)
+			return 1;
+		printf("%-8s %10.0f %10.2f %12.3f %10ld\n",
+		    i ? "ring" : "socket", mb / wall, wall, cpu * 1e3 / mb,
+		    csw);
+	}
+	return 0;
+}
+
+static const struct {
+	const char	*name;
+	int		(*fn)(int, char **);
+} benches[] = {
+	{ "chunk",	bench_chunk },
+	{ "convert",	bench_convert },
+	{ "grab",	bench_grab },
+	{ "lockon",	bench_lockon },
+	{ "probe",	bench_probe },
+	{ "profile",	bench_profile },
+	{ "shm",	bench_shm },
+	{ "tsout",	bench_tsout },
+	{ NULL,		NULL }
+};
+
+int
+main(int argc, char **argv)
+{
+	int	 i;
+
+	if (argc >= 2) {
+		for (i = 0; benches[i].name != NULL; i++)
+			if (strcmp(argv[1], benches[i].name) == 0)
+				return benches[i].fn(argc - 2, argv + 2);
+	}
+
+	fprintf(stderr, "usage: bench <name> [args...]\n\nbenchmarks:");
+	for (i = 0; benches[i].name != NULL; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	return 1;
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "send2tv.h"
+
+/*
+ * On-disk transcode cache.
+ *
+ * While a file is transcoded from the beginning, the MPEG-TS output is
+ * also written to <dir>/<key>.ts.part.  If the transcode reaches the end
+ * of the input uninterrupted, the file is renamed to <key>.ts and can be
+ * served as a plain file afterwards (byte-range seekable, no CPU).  The
+ * key covers the source identity and every setting that changes the
+ * output.  The directory is kept below a size cap by evicting the least
+ * recently used entries (file mtime is bumped on every hit).
+ */
+
+/*
+ * 64-bit FNV-1a hash.
+ */
+uint64_t
+cache_hash(const char *s)
+{
+	uint64_t	 h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * mkdir -p dir.  Returns 0 on success, -1 on failure.
+ */
+int
+cache_mkdir(const char *dir)
+{
+	char	 path[PATH_MAX], *p;
+
+	strlcpy(path, dir, sizeof(path));
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/*
+ * Initialize the cache in dir (created if missing) with a size cap.
+ * Returns 0 on success, -1 if the directory is unusable.
+ */
+int
+cache_init(cache_ctx_t *c, const char *dir, long long max_bytes)
+{
+	memset(c, 0, sizeof(*c));
+	c->wfd = -1;
+	c->max_bytes = max_bytes;
+	strlcpy(c->dir, dir, sizeof(c->dir));
+
+	if (cache_mkdir(dir) < 0) {
+		fprintf(stderr, "Cannot create cache directory %s: %s\n",
+		    dir, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Build the cache key for a probed file: source path, size and mtime
+ * plus the encoder settings that affect the transcoded output.
+ * Returns 0 on success, -1 if the source cannot be identified.
+ */
+int
+cache_key(const media_ctx_t *ctx, char *key, size_t keysz)
+{
+	char		 real[PATH_MAX];
+	char		 desc[PATH_MAX + 256];
+	struct stat	 st;
+	int		 n, i;
+
+	if (ctx->filepath == NULL || realpath(ctx->filepath, real) == NULL ||
+	    stat(real, &st) < 0)
+		return -1;
+
+	n = snprintf(desc, sizeof(desc),
+	    "%s|%lld|%lld|b=%d|c=%d|h=%d|a=%s|m=",
+	    real, (long long)st.st_size, (long long)st.st_mtime,
+	    ctx->bitrate, ctx->vcodec, ctx->max_height,
+	    ctx->audio_selector ? ctx->audio_selector : "");
+	if (ctx->has_channelmap)
+		for (i = 0; i < 6 && n < (int)sizeof(desc) - 4; i++)
+			n += snprintf(desc + n, sizeof(desc) - n, "%d,",
+			    ctx->channelmap[i]);
+
+	snprintf(key, keysz, "%016llx",
+	    (unsigned long long)cache_hash(desc));
+	return 0;
+}
+
+/*
+ * Look up a complete entry.  On a hit, writes its path and marks it as
+ * recently used.  Returns 0 on hit, -1 on miss.
+ */
+int
+cache_lookup(cache_ctx_t *c, const char *key, char *path, size_t pathsz)
+{
+	struct stat	 st;
+
+	snprintf(path, pathsz, "%s/%s.ts", c->dir, key);
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return -1;
+	utimes(path, NULL);
+	DPRINTF("cache: hit %s (%lld bytes)\n", path,
+	    (long long)st.st_size);
+	return 0;
+}
+
+/*
+ * Start writing a new entry.  Only one entry is written at a time.
+ * Returns the fd to tee the MPEG-TS output into, or -1.
+ */
+int
+cache_begin(cache_ctx_t *c, const char *key)
+{
+	char	 path[PATH_MAX];
+
+	if (c->wfd >= 0)
+		cache_abort(c);
+
+	strlcpy(c->wkey, key, sizeof(c->wkey));
+	snprintf(path, sizeof(path), "%s/%s.ts.part", c->dir, key);
+	c->wfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (c->wfd < 0) {
+		DPRINTF("cache: cannot create %s: %s\n", path,
+		    strerror(errno));
+		return -1;
+	}
+	DPRINTF("cache: writing %s\n", path);
+	return c->wfd;
+}
+
+/*
+ * Publish the entry being written and enforce the size cap.
+ */
+void
+cache_commit(cache_ctx_t *c)
+{
+	char	 part[PATH_MAX], path[PATH_MAX];
+
+	if (c->wfd < 0)
+		return;
+	close(c->wfd);
+	c->wfd = -1;
+
+	snprintf(part, sizeof(part), "%s/%s.ts.part", c->dir, c->wkey);
+	snprintf(path, sizeof(path), "%s/%s.ts", c->dir, c->wkey);
+	if (rename(part, path) < 0) {
+		unlink(part);
+		return;
+	}
+	DPRINTF("cache: stored %s\n", path);
+	cache_trim(c);
+}
+
+/*
+ * Discard the entry being written (seek, skip, error).
+ */
+void
+cache_abort(cache_ctx_t *c)
+{
+	char	 part[PATH_MAX];
+
+	if (c->wfd < 0)
+		return;
+	close(c->wfd);
+	c->wfd = -1;
+
+	snprintf(part, sizeof(part), "%s/%s.ts.part", c->dir, c->wkey);
+	unlink(part);
+	DPRINTF("cache: discarded %s\n", part);
+}
+
+/*
+ * Delete least recently used entries until the cache fits max_bytes.
+ */
+void
+cache_trim(cache_ctx_t *c)
+{
+	DIR		*d;
+	struct dirent	*de;
+	struct stat	 st;
+	char		 path[PATH_MAX], oldest[PATH_MAX];
+	long long	 total;
+	time_t		 oldest_t;
+	size_t		 len;
+
+	for (;;) {
+		d = opendir(c->dir);
+		if (d == NULL)
+			return;
+		total = 0;
+		oldest[0] = '\0';
+		oldest_t = 0;
+		while ((de = readdir(d)) != NULL) {
+			len = strlen(de->d_name);
+			if (len < 4 ||
+			    strcmp(de->d_name + len - 3, ".ts") != 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", c->dir,
+			    de->d_name);
+			if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+				continue;
+			total += st.st_size;
+			if (oldest[0] == '\0' || st.st_mtime < oldest_t) {
+				strlcpy(oldest, path, sizeof(oldest));
+				oldest_t = st.st_mtime;
+			}
+		}
+		closedir(d);
+
+		if (total <= c->max_bytes || oldest[0] == '\0')
+			return;
+		DPRINTF("cache: %lld > %lld bytes, evicting %s\n",
+		    total, c->max_bytes, oldest);
+		if (unlink(oldest) < 0)
+			return;
+	}
+}
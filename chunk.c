@@ -0,0 +1,1069 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "send2tv.h"
+
+/*
+ * Chunked batch transcoding.
+ *
+ * --prepare fills the transcode cache ahead of time.  A source is split
+ * at video keyframes from the demuxer index into chunks of about
+ * CHUNK_SEC seconds.  Local worker threads and remote "send2tv --worker"
+ * processes take chunks off a shared queue until it is empty.  Each
+ * chunk goes through the regular pipeline (media_open_transcode(), so
+ * the encoder settings are those of playback), with its output timeline
+ * starting where the chunk sits in the file.  The chunks are then
+ * remuxed into one MPEG-TS with continuous timestamps.
+ *
+ * Remote workers open the source by path: they must see the files under
+ * the same name, e.g. on a shared mount.  A worker only serves
+ * coordinators that know its key (net.c handshake), only opens regular
+ * files, and serves at most CHUNK_SERVE_MAX connections at a time.
+ */
+
+#define CHUNK_SERVE_MAX		32
+
+static pthread_mutex_t	 chunk_serve_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		 chunk_serving;
+
+typedef struct {
+	chunk_job_t		*job;
+	const chunk_remote_t	*remote;	/* NULL for a local worker */
+	pthread_t		 thread;
+} chunk_worker_t;
+
+/* Memory buffer read by the stitcher's demuxer */
+typedef struct {
+	const uint8_t	*data;
+	size_t		 len;
+	size_t		 pos;
+} chunk_membuf_t;
+
+/*
+ * Split [t0, t0 + duration_us) into chunks of at least target_us that
+ * start on keyframes kf[] (sorted, AV_TIME_BASE units).  Without a
+ * keyframe index, chunks start every target_us and the decoder catches
+ * up from the preceding keyframe.  A short tail is merged into the last
+ * chunk.  Returns the number of chunks (at least 1) stored in a
+ * malloc'd *out, or -1 on allocation failure.
+ */
+static int
+chunk_plan(const int64_t *kf, int nkf, int64_t t0, int64_t duration_us,
+    int64_t target_us, chunk_t **out)
+{
+	chunk_t		*chunks = NULL, *nchunks;
+	int64_t		 start = t0, next, end = t0 + duration_us;
+	int		 n = 0, cap = 0, i = 0;
+
+	for (;;) {
+		if (nkf > 0) {
+			next = -1;
+			for (; i < nkf; i++) {
+				if (kf[i] >= start + target_us) {
+					next = kf[i];
+					break;
+				}
+			}
+		} else
+			next = duration_us > 0 ? start + target_us : -1;
+
+		/* Last chunk runs to EOF */
+		if (next < 0 || (duration_us > 0 &&
+		    next >= end - target_us / 4))
+			next = 0;
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			nchunks = reallocarray(chunks, cap, sizeof(*chunks));
+			if (nchunks == NULL) {
+				free(chunks);
+				return -1;
+			}
+			chunks = nchunks;
+		}
+		memset(&chunks[n], 0, sizeof(chunks[n]));
+		chunks[n].start_us = start;
+		chunks[n].end_us = next;
+		chunks[n].origin_us = start - t0;
+		chunks[n].state = CHUNK_PENDING;
+		n++;
+
+		if (next == 0)
+			break;
+		start = next;
+	}
+
+	*out = chunks;
+	return n;
+}
+
+/*
+ * Collect video keyframe positions from the demuxer index.  Formats
+ * that load their index lazily (Matroska cues) get a seek to the end
+ * first.  Returns the number of keyframes in a malloc'd *out.
+ */
+static int
+chunk_keyframes(media_ctx_t *m, int64_t **out)
+{
+	AVStream		*st;
+	const AVIndexEntry	*e;
+	int64_t			*kf;
+	int			 i, n, k = 0;
+
+	*out = NULL;
+	if (m->video_idx < 0)
+		return 0;
+	st = m->ifmt_ctx->streams[m->video_idx];
+
+	if (avformat_index_get_entries_count(st) < 2 &&
+	    m->ifmt_ctx->duration > 0) {
+		av_seek_frame(m->ifmt_ctx, -1, m->ifmt_ctx->duration,
+		    AVSEEK_FLAG_BACKWARD);
+		av_seek_frame(m->ifmt_ctx, -1, 0, AVSEEK_FLAG_BACKWARD);
+	}
+
+	n = avformat_index_get_entries_count(st);
+	if (n <= 0 || (kf = calloc(n, sizeof(*kf))) == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		e = avformat_index_get_entry(st, i);
+		if (e == NULL || !(e->flags & AVINDEX_KEYFRAME) ||
+		    e->timestamp == AV_NOPTS_VALUE)
+			continue;
+		kf[k++] = av_rescale_q(e->timestamp, st->time_base,
+		    AV_TIME_BASE_Q);
+	}
+	*out = kf;
+	return k;
+}
+
+/*
+ * Hand out the next pending chunk.  Blocks while chunks are out with
+ * workers that may still give them back.  Returns -1 once every chunk
+ * is done or the job failed.
+ */
+static int
+chunk_next(chunk_job_t *job)
+{
+	int	 i, busy;
+
+	pthread_mutex_lock(&job->lock);
+	while (job->active && running) {
+		busy = 0;
+		for (i = 0; i < job->nchunks; i++) {
+			if (job->chunks[i].state == CHUNK_PENDING) {
+				job->chunks[i].state = CHUNK_RUNNING;
+				pthread_mutex_unlock(&job->lock);
+				return i;
+			}
+			if (job->chunks[i].state == CHUNK_RUNNING)
+				busy = 1;
+		}
+		if (!busy)
+			break;
+		pthread_cond_wait(&job->cond, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return -1;
+}
+
+static void
+chunk_finish(chunk_job_t *job, int i, uint8_t *data, size_t len)
+{
+	pthread_mutex_lock(&job->lock);
+	if (data != NULL) {
+		job->chunks[i].data = data;
+		job->chunks[i].len = len;
+		job->chunks[i].state = CHUNK_DONE;
+		job->ndone++;
+	} else
+		job->chunks[i].state = CHUNK_PENDING;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void
+chunk_fail(chunk_job_t *job)
+{
+	pthread_mutex_lock(&job->lock);
+	job->active = 0;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * A worker is leaving: if it was the last one, nobody is left to pick
+ * up chunks given back by failed remotes.
+ */
+static void
+chunk_worker_exit(chunk_job_t *job)
+{
+	pthread_mutex_lock(&job->lock);
+	if (--job->nworkers == 0 && job->ndone < job->nchunks)
+		job->active = 0;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *
+chunk_local_thread(void *arg)
+{
+	chunk_worker_t	*w = arg;
+	chunk_job_t	*job = w->job;
+	chunk_t		*c;
+	media_ctx_t	 m;
+	uint8_t		*data;
+	size_t		 len;
+	int		 i;
+
+	media_from_template(&m, job->tmpl, job->filepath);
+	m.threads = job->threads;
+	if (media_probe(&m, job->filepath, job->force_transcode) < 0) {
+		chunk_fail(job);
+		chunk_worker_exit(job);
+		return NULL;
+	}
+
+	while ((i = chunk_next(job)) >= 0) {
+		c = &job->chunks[i];
+		m.origin_us = c->origin_us;
+		if (media_encode_window(&m, c->start_us, c->end_us,
+		    CHUNK_MAX_BYTES, &job->active, &data, &len) < 0) {
+			if (running && job->active)
+				fprintf(stderr, "chunk %d of %s failed\n", i,
+				    job->filepath);
+			chunk_finish(job, i, NULL, 0);
+			chunk_fail(job);
+			break;
+		}
+		chunk_finish(job, i, data, len);
+	}
+
+	media_close(&m);
+	chunk_worker_exit(job);
+	return NULL;
+}
+
+static int
+chunk_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+	ssize_t		 n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+chunk_read_full(int fd, void *buf, size_t len)
+{
+	uint8_t	*p = buf;
+	ssize_t	 n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read a newline-terminated line (newline stripped).
+ * Returns the length, or -1 on EOF, error or overlong line.
+ */
+static int
+chunk_read_line(int fd, char *buf, size_t bufsz)
+{
+	size_t	 n = 0;
+	char	 c;
+
+	while (n + 1 < bufsz) {
+		if (chunk_read_full(fd, &c, 1) < 0)
+			return -1;
+		if (c == '\n') {
+			buf[n] = '\0';
+			return (int)n;
+		}
+		buf[n++] = c;
+	}
+	return -1;
+}
+
+static int
+chunk_connect(const char *host, int port)
+{
+	struct addrinfo	 hints, *res, *ai;
+	char		 portstr[16];
+	int		 fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	if (getaddrinfo(host, portstr, &hints, &res) != 0)
+		return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/*
+ * Format a chunk request:
+ * CHUNK start end origin bitrate vcodec maxh force threads cmap|- sel|- path
+ */
+static void
+chunk_format_request(char *buf, size_t bufsz, const chunk_job_t *job,
+    const chunk_t *c, int threads)
+{
+	const media_ctx_t	*t = job->tmpl;
+	char			 cmap[32];
+
+	if (t->has_channelmap)
+		snprintf(cmap, sizeof(cmap), "%d,%d,%d,%d,%d,%d",
+		    t->channelmap[0], t->channelmap[1], t->channelmap[2],
+		    t->channelmap[3], t->channelmap[4], t->channelmap[5]);
+	else
+		strlcpy(cmap, "-", sizeof(cmap));
+
+	snprintf(buf, bufsz, "CHUNK %lld %lld %lld %d %d %d %d %d %s %s %s\n",
+	    (long long)c->start_us, (long long)c->end_us,
+	    (long long)c->origin_us, t->bitrate, t->vcodec, t->max_height,
+	    job->force_transcode, threads, cmap,
+	    t->audio_selector != NULL ? t->audio_selector : "-",
+	    job->filepath);
+}
+
+/*
+ * Parse a chunk request into the window, the settings (written to m)
+ * and the path.  Returns 0 on success, -1 on a malformed request.
+ */
+static int
+chunk_parse_request(const char *line, chunk_t *c, media_ctx_t *m,
+    int *force, char *sel, size_t selsz, char *path, size_t pathsz)
+{
+	long long	 start, end, origin;
+	char		 cmap[32], selbuf[64];
+	int		 off = 0, map[6];
+
+	if (sscanf(line, "CHUNK %lld %lld %lld %d %d %d %d %d %31s %63s %n",
+	    &start, &end, &origin, &m->bitrate, &m->vcodec, &m->max_height,
+	    force, &m->threads, cmap, selbuf, &off) != 10 || off == 0 ||
+	    line[off] == '\0')
+		return -1;
+	if (start < 0 || end < 0 || m->bitrate <= 0)
+		return -1;
+
+	memset(c, 0, sizeof(*c));
+	c->start_us = start;
+	c->end_us = end;
+	c->origin_us = origin;
+
+	m->has_channelmap = 0;
+	if (strcmp(cmap, "-") != 0) {
+		if (sscanf(cmap, "%d,%d,%d,%d,%d,%d", &map[0], &map[1],
+		    &map[2], &map[3], &map[4], &map[5]) != 6)
+			return -1;
+		memcpy(m->channelmap, map, sizeof(m->channelmap));
+		m->has_channelmap = 1;
+	}
+	if (strcmp(selbuf, "-") == 0)
+		sel[0] = '\0';
+	else
+		strlcpy(sel, selbuf, selsz);
+	strlcpy(path, line + off, pathsz);
+	return 0;
+}
+
+/*
+ * Have a remote worker encode one chunk.
+ * Returns 0 with the MPEG-TS in *data, or -1 if the worker failed.
+ */
+static int
+chunk_remote_encode(int fd, const chunk_job_t *job, const chunk_t *c,
+    int threads, uint8_t **data, size_t *len)
+{
+	char		 line[2048];
+	long long	 n;
+	uint8_t		*buf;
+
+	chunk_format_request(line, sizeof(line), job, c, threads);
+	if (chunk_write_all(fd, line, strlen(line)) < 0 ||
+	    chunk_read_line(fd, line, sizeof(line)) < 0)
+		return -1;
+	if (sscanf(line, "OK %lld", &n) != 1 || n <= 0 ||
+	    n > CHUNK_MAX_BYTES) {
+		fprintf(stderr, "chunk: worker: %s\n", line);
+		return -1;
+	}
+	if ((buf = malloc(n)) == NULL)
+		return -1;
+	if (chunk_read_full(fd, buf, n) < 0) {
+		free(buf);
+		return -1;
+	}
+	*data = buf;
+	*len = n;
+	return 0;
+}
+
+static void *
+chunk_remote_thread(void *arg)
+{
+	chunk_worker_t		*w = arg;
+	chunk_job_t		*job = w->job;
+	const chunk_remote_t	*r = w->remote;
+	uint8_t			*data;
+	size_t			 len;
+	int			 fd, i;
+
+	fd = chunk_connect(r->host, r->port);
+	if (fd < 0) {
+		fprintf(stderr, "chunk: cannot reach worker %s:%d\n",
+		    r->host, r->port);
+		chunk_worker_exit(job);
+		return NULL;
+	}
+	if (net_auth_connect(fd, r->key) < 0) {
+		fprintf(stderr, "chunk: worker %s:%d refused us\n",
+		    r->host, r->port);
+		close(fd);
+		chunk_worker_exit(job);
+		return NULL;
+	}
+
+	while ((i = chunk_next(job)) >= 0) {
+		/* One connection per remote job: share its cores */
+		if (chunk_remote_encode(fd, job, &job->chunks[i],
+		    r->jobs > 1 ? 1 : 0, &data, &len) < 0) {
+			fprintf(stderr, "chunk: worker %s:%d failed, "
+			    "chunk %d goes back to the queue\n",
+			    r->host, r->port, i);
+			chunk_finish(job, i, NULL, 0);
+			break;
+		}
+		chunk_finish(job, i, data, len);
+	}
+
+	close(fd);
+	chunk_worker_exit(job);
+	return NULL;
+}
+
+static int
+chunk_mem_read(void *opaque, uint8_t *buf, int size)
+{
+	chunk_membuf_t	*mb = opaque;
+	size_t		 n = mb->len - mb->pos;
+
+	if (n == 0)
+		return AVERROR_EOF;
+	if (n > (size_t)size)
+		n = size;
+	memcpy(buf, mb->data + mb->pos, n);
+	mb->pos += n;
+	return (int)n;
+}
+
+static int
+chunk_fd_write(void *opaque, const uint8_t *buf, int size)
+{
+	int	*fd = opaque;
+
+	if (chunk_write_all(*fd, buf, size) < 0)
+		return AVERROR(errno);
+	return size;
+}
+
+static void
+chunk_close_input(AVFormatContext *fmt)
+{
+	AVIOContext	*pb = fmt->pb;
+
+	avformat_close_input(&fmt);
+	if (pb != NULL) {
+		av_free(pb->buffer);
+		avio_context_free(&pb);
+	}
+}
+
+/*
+ * Open an encoded chunk for demuxing.
+ */
+static AVFormatContext *
+chunk_open_input(chunk_membuf_t *mb)
+{
+	AVFormatContext	*fmt;
+	AVIOContext	*pb;
+	uint8_t		*buf;
+
+	if ((buf = av_malloc(SEND2TV_BUF_SIZE)) == NULL)
+		return NULL;
+	pb = avio_alloc_context(buf, SEND2TV_BUF_SIZE, 0, mb,
+	    chunk_mem_read, NULL, NULL);
+	if (pb == NULL) {
+		av_free(buf);
+		return NULL;
+	}
+	if ((fmt = avformat_alloc_context()) == NULL)
+		goto fail;
+	fmt->pb = pb;
+	fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+	/* Frees fmt on failure, but not our pb */
+	if (avformat_open_input(&fmt, NULL, av_find_input_format("mpegts"),
+	    NULL) < 0)
+		goto fail;
+	if (avformat_find_stream_info(fmt, NULL) < 0) {
+		chunk_close_input(fmt);
+		return NULL;
+	}
+	return fmt;
+
+fail:
+	av_free(pb->buffer);
+	avio_context_free(&pb);
+	return NULL;
+}
+
+/*
+ * Remux the encoded chunks, in order, into one MPEG-TS written to
+ * out_fd.  Chunk timestamps already continue each other; the muxer
+ * delay of the first chunk is taken off, and packets that overlap the
+ * previous chunk (audio frames straddling a boundary) are dropped.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+chunk_stitch(const chunk_t *chunks, int nchunks, int out_fd)
+{
+	AVFormatContext	*ofmt = NULL, *ifmt;
+	AVPacket	*pkt = NULL;
+	chunk_membuf_t	 mb;
+	uint8_t		*obuf;
+	int64_t		 base = 0, off;
+	int64_t		 last_dts[CHUNK_MAX_STREAMS];
+	int		 map[CHUNK_MAX_STREAMS];
+	int		 i, s, o, ret = -1, header = 0;
+	AVStream	*ist, *ost;
+
+	if (avformat_alloc_output_context2(&ofmt, NULL, "mpegts",
+	    NULL) < 0)
+		return -1;
+	if ((obuf = av_malloc(SEND2TV_BUF_SIZE)) == NULL)
+		goto done;
+	ofmt->pb = avio_alloc_context(obuf, SEND2TV_BUF_SIZE, 1, &out_fd,
+	    NULL, chunk_fd_write, NULL);
+	if (ofmt->pb == NULL) {
+		av_free(obuf);
+		goto done;
+	}
+	ofmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+	if ((pkt = av_packet_alloc()) == NULL)
+		goto done;
+	for (s = 0; s < CHUNK_MAX_STREAMS; s++)
+		last_dts[s] = AV_NOPTS_VALUE;
+
+	for (i = 0; i < nchunks; i++) {
+		mb.data = chunks[i].data;
+		mb.len = chunks[i].len;
+		mb.pos = 0;
+		if ((ifmt = chunk_open_input(&mb)) == NULL) {
+			fprintf(stderr, "chunk %d: cannot demux\n", i);
+			goto done;
+		}
+
+		/* The first chunk defines the output streams */
+		for (s = 0; s < (int)ifmt->nb_streams &&
+		    s < CHUNK_MAX_STREAMS; s++) {
+			enum AVMediaType type =
+			    ifmt->streams[s]->codecpar->codec_type;
+
+			map[s] = -1;
+			if (type != AVMEDIA_TYPE_VIDEO &&
+			    type != AVMEDIA_TYPE_AUDIO)
+				continue;
+			if (i == 0) {
+				ost = avformat_new_stream(ofmt, NULL);
+				if (ost == NULL ||
+				    avcodec_parameters_copy(ost->codecpar,
+				    ifmt->streams[s]->codecpar) < 0) {
+					chunk_close_input(ifmt);
+					goto done;
+				}
+				ost->codecpar->codec_tag = 0;
+				ost->time_base = ifmt->streams[s]->time_base;
+				map[s] = ost->index;
+				continue;
+			}
+			for (o = 0; o < (int)ofmt->nb_streams; o++)
+				if (ofmt->streams[o]->codecpar->codec_type ==
+				    type)
+					map[s] = o;
+		}
+		if (i == 0) {
+			if (ifmt->start_time != AV_NOPTS_VALUE)
+				base = ifmt->start_time;
+			if (avformat_write_header(ofmt, NULL) < 0) {
+				chunk_close_input(ifmt);
+				goto done;
+			}
+			header = 1;
+		}
+
+		while (av_read_frame(ifmt, pkt) >= 0) {
+			s = pkt->stream_index;
+			if (s >= CHUNK_MAX_STREAMS || map[s] < 0) {
+				av_packet_unref(pkt);
+				continue;
+			}
+			ist = ifmt->streams[s];
+			ost = ofmt->streams[map[s]];
+			off = av_rescale_q(base, AV_TIME_BASE_Q, ist->time_base);
+			if (pkt->pts != AV_NOPTS_VALUE)
+				pkt->pts -= off;
+			if (pkt->dts != AV_NOPTS_VALUE)
+				pkt->dts -= off;
+			av_packet_rescale_ts(pkt, ist->time_base,
+			    ost->time_base);
+			if (pkt->dts != AV_NOPTS_VALUE &&
+			    last_dts[map[s]] != AV_NOPTS_VALUE &&
+			    pkt->dts <= last_dts[map[s]]) {
+				av_packet_unref(pkt);
+				continue;
+			}
+			if (pkt->dts != AV_NOPTS_VALUE)
+				last_dts[map[s]] = pkt->dts;
+			pkt->stream_index = map[s];
+			pkt->pos = -1;
+			if (av_interleaved_write_frame(ofmt, pkt) < 0) {
+				chunk_close_input(ifmt);
+				goto done;
+			}
+		}
+		chunk_close_input(ifmt);
+	}
+
+	if (av_write_trailer(ofmt) == 0 && ofmt->pb->error == 0)
+		ret = 0;
+
+done:
+	if (ret < 0 && header)
+		av_write_trailer(ofmt);
+	av_packet_free(&pkt);
+	if (ofmt->pb != NULL) {
+		av_free(ofmt->pb->buffer);
+		avio_context_free(&ofmt->pb);
+	}
+	avformat_free_context(ofmt);
+	return ret;
+}
+
+/*
+ * Transcode one file in chunks on jobs local threads plus the remote
+ * workers and write the stitched MPEG-TS to out_fd.  Returns the number
+ * of chunks on success, -1 on failure.
+ */
+int
+chunk_transcode(const media_ctx_t *tmpl, const char *filepath,
+    int force_transcode, int jobs, const chunk_remote_t *remotes,
+    int nremotes, int out_fd)
+{
+	chunk_job_t	 job;
+	chunk_worker_t	*workers;
+	media_ctx_t	 m;
+	int64_t		*kf, t0, duration;
+	int		 nkf, nworkers, i, j, w, ncpu, ret = -1;
+
+	/* Plan on the keyframe index */
+	media_from_template(&m, tmpl, filepath);
+	if (media_probe(&m, filepath, force_transcode) < 0)
+		return -1;
+	nkf = chunk_keyframes(&m, &kf);
+	t0 = m.ifmt_ctx->start_time != AV_NOPTS_VALUE ?
+	    m.ifmt_ctx->start_time : 0;
+	duration = m.ifmt_ctx->duration > 0 ? m.ifmt_ctx->duration : 0;
+	media_close(&m);
+
+	memset(&job, 0, sizeof(job));
+	job.nchunks = chunk_plan(kf, nkf, t0, duration,
+	    (int64_t)CHUNK_SEC * AV_TIME_BASE, &job.chunks);
+	free(kf);
+	if (job.nchunks < 0)
+		return -1;
+	DPRINTF("chunk: %s: %d keyframes, %d chunks\n", filepath, nkf,
+	    job.nchunks);
+
+	job.tmpl = tmpl;
+	job.filepath = filepath;
+	job.force_transcode = force_transcode;
+	job.active = 1;
+	/* Split the cores between local workers; each codec gets a share */
+	ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	job.threads = ncpu > jobs && jobs > 0 ? ncpu / jobs : 1;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	nworkers = jobs;
+	for (i = 0; i < nremotes; i++)
+		nworkers += remotes[i].jobs;
+	workers = calloc(nworkers, sizeof(*workers));
+	if (workers == NULL)
+		goto done;
+
+	job.nworkers = nworkers;
+	w = 0;
+	for (i = 0; i < jobs; i++, w++) {
+		workers[w].job = &job;
+		if (pthread_create(&workers[w].thread, NULL,
+		    chunk_local_thread, &workers[w]) != 0)
+			break;
+	}
+	for (i = 0; i < nremotes; i++) {
+		for (j = 0; j < remotes[i].jobs; j++, w++) {
+			workers[w].job = &job;
+			workers[w].remote = &remotes[i];
+			if (pthread_create(&workers[w].thread, NULL,
+			    chunk_remote_thread, &workers[w]) != 0)
+				break;
+		}
+	}
+	/* Account for workers that never started */
+	pthread_mutex_lock(&job.lock);
+	job.nworkers -= nworkers - w;
+	if (job.nworkers <= 0)
+		job.active = 0;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+
+	for (i = 0; i < w; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+
+	if (job.active && running && job.ndone == job.nchunks &&
+	    chunk_stitch(job.chunks, job.nchunks, out_fd) == 0)
+		ret = job.nchunks;
+
+done:
+	for (i = 0; i < job.nchunks; i++)
+		free(job.chunks[i].data);
+	free(job.chunks);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+	return ret;
+}
+
+/*
+ * Whether a coordinator may have path opened: a regular file, not a URL
+ * the worker would fetch on its behalf, nor a device.
+ */
+static int
+chunk_path_ok(const char *path)
+{
+	struct stat	 st;
+
+	return strstr(path, "://") == NULL && stat(path, &st) == 0 &&
+	    S_ISREG(st.st_mode);
+}
+
+/* One connection of chunk_serve() */
+typedef struct {
+	int		 fd;
+	const char	*key;
+} chunk_conn_t;
+
+/*
+ * Serve chunk requests on one connection, one at a time.  The probed
+ * input is kept while requests stay on the same file and settings.
+ */
+static void *
+chunk_serve_thread(void *arg)
+{
+	chunk_conn_t	*conn = arg;
+	int		 fd = conn->fd;
+	media_ctx_t	 m, req;
+	chunk_t		 c;
+	char		 line[2048], hdr[64], sel[64], path[1024];
+	char		 cur_sel[64], cur_path[1024];
+	uint8_t		*data;
+	size_t		 len;
+	int		 force, cur_force = -1, probed = 0;
+
+	memset(&m, 0, sizeof(m));
+	cur_path[0] = '\0';
+	cur_sel[0] = '\0';
+
+	if (net_auth_accept(fd, conn->key) < 0) {
+		fprintf(stderr, "worker: connection refused, bad key\n");
+		goto done;
+	}
+	DPRINTF("worker: coordinator connected\n");
+
+	while (running && chunk_read_line(fd, line, sizeof(line)) >= 0) {
+		memset(&req, 0, sizeof(req));
+		if (chunk_parse_request(line, &c, &req, &force, sel,
+		    sizeof(sel), path, sizeof(path)) < 0) {
+			chunk_write_all(fd, "ERR bad request\n", 16);
+			break;
+		}
+
+		if (!chunk_path_ok(path)) {
+			chunk_write_all(fd, "ERR not a file\n", 15);
+			continue;
+		}
+
+		/* The selector and forcing change the probe result */
+		if (!probed || strcmp(path, cur_path) != 0 ||
+		    strcmp(sel, cur_sel) != 0 || force != cur_force) {
+			if (probed)
+				media_close(&m);
+			strlcpy(cur_path, path, sizeof(cur_path));
+			strlcpy(cur_sel, sel, sizeof(cur_sel));
+			cur_force = force;
+			media_from_template(&m, &req, cur_path);
+			m.audio_selector = cur_sel[0] != '\0' ? cur_sel : NULL;
+			probed = media_probe(&m, cur_path, force) == 0;
+			if (!probed) {
+				media_close(&m);
+				chunk_write_all(fd, "ERR cannot open\n", 16);
+				continue;
+			}
+			DPRINTF("worker: opened %s\n", cur_path);
+		}
+		m.bitrate = req.bitrate;
+		m.vcodec = req.vcodec;
+		m.max_height = req.max_height;
+		m.threads = req.threads;
+		memcpy(m.channelmap, req.channelmap, sizeof(m.channelmap));
+		m.has_channelmap = req.has_channelmap;
+		m.origin_us = c.origin_us;
+
+		DPRINTF("worker: %s %lld..%lld\n", cur_path,
+		    (long long)c.start_us, (long long)c.end_us);
+		if (media_encode_window(&m, c.start_us, c.end_us,
+		    CHUNK_MAX_BYTES, &running, &data, &len) < 0) {
+			chunk_write_all(fd, "ERR transcode failed\n", 21);
+			continue;
+		}
+		snprintf(hdr, sizeof(hdr), "OK %zu\n", len);
+		if (chunk_write_all(fd, hdr, strlen(hdr)) < 0 ||
+		    chunk_write_all(fd, data, len) < 0) {
+			free(data);
+			break;
+		}
+		free(data);
+	}
+
+	if (probed)
+		media_close(&m);
+done:
+	close(fd);
+	free(conn);
+	pthread_mutex_lock(&chunk_serve_lock);
+	chunk_serving--;
+	pthread_mutex_unlock(&chunk_serve_lock);
+	return NULL;
+}
+
+/*
+ * Run as a chunk worker for "send2tv --prepare --remote" coordinators,
+ * which must know key.  Returns 0 on clean shutdown, -1 without a key or
+ * if the port cannot be opened.
+ */
+int
+chunk_serve(int port, const char *key)
+{
+	struct sockaddr_in	 sin;
+	struct pollfd		 pfd;
+	chunk_conn_t		*conn;
+	pthread_t		 t;
+	int			 lfd, fd, on = 1, full;
+
+	if (key == NULL) {
+		fprintf(stderr, "worker: a key is required (key= or --key)\n");
+		return -1;
+	}
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return -1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 16) < 0) {
+		fprintf(stderr, "worker: cannot listen on port %d: %s\n",
+		    port, strerror(errno));
+		close(lfd);
+		return -1;
+	}
+	printf("Worker: listening on port %d\n", port);
+
+	pfd.fd = lfd;
+	pfd.events = POLLIN;
+	while (running) {
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		pthread_mutex_lock(&chunk_serve_lock);
+		if (!(full = chunk_serving >= CHUNK_SERVE_MAX))
+			chunk_serving++;
+		pthread_mutex_unlock(&chunk_serve_lock);
+		if (full) {
+			fprintf(stderr, "worker: %d connections already, "
+			    "refused\n", CHUNK_SERVE_MAX);
+			close(fd);
+			continue;
+		}
+		if ((conn = malloc(sizeof(*conn))) != NULL) {
+			conn->fd = fd;
+			conn->key = key;
+		}
+		if (conn == NULL || pthread_create(&t, NULL,
+		    chunk_serve_thread, conn) != 0) {
+			free(conn);
+			close(fd);
+			pthread_mutex_lock(&chunk_serve_lock);
+			chunk_serving--;
+			pthread_mutex_unlock(&chunk_serve_lock);
+			continue;
+		}
+		pthread_detach(t);
+	}
+
+	close(lfd);
+	return 0;
+}
+
+/*
+ * Parse a remote worker spec "host[:port][/jobs]".
+ * Returns 0 on success, -1 if malformed.
+ */
+int
+chunk_parse_remote(const char *spec, chunk_remote_t *r)
+{
+	char	 buf[256], *p;
+
+	if (strlcpy(buf, spec, sizeof(buf)) >= sizeof(buf))
+		return -1;
+	r->port = CHUNK_DEFAULT_PORT;
+	r->jobs = 1;
+	r->key = NULL;
+	if ((p = strchr(buf, '/')) != NULL) {
+		*p++ = '\0';
+		r->jobs = atoi(p);
+		if (r->jobs <= 0)
+			return -1;
+	}
+	if ((p = strrchr(buf, ':')) != NULL) {
+		*p++ = '\0';
+		r->port = atoi(p);
+		if (r->port <= 0 || r->port > 65535)
+			return -1;
+	}
+	if (buf[0] == '\0')
+		return -1;
+	strlcpy(r->host, buf, sizeof(r->host));
+	return 0;
+}
+
+/*
+ * Batch mode: transcode files[] in chunks into the transcode cache,
+ * skipping files that play natively or are cached already.
+ * Returns 0 if every file is cached afterwards, 1 otherwise.
+ */
+int
+chunk_prepare(const media_ctx_t *tmpl, char *const *files, int nfiles,
+    int force_transcode, int jobs, const chunk_remote_t *remotes,
+    int nremotes, cache_ctx_t *cache)
+{
+	media_ctx_t	 m;
+	struct timespec	 t0, t1;
+	char		 key[32], path[1024];
+	double		 secs;
+	int		 i, fd, n, needs, duration, failed = 0;
+
+	for (i = 0; i < nfiles && running; i++) {
+		printf("[%d/%d] %s\n", i + 1, nfiles, files[i]);
+
+		media_from_template(&m, tmpl, files[i]);
+		if (media_probe(&m, files[i], force_transcode) < 0) {
+			failed = 1;
+			continue;
+		}
+		needs = m.needs_transcode;
+		n = needs ? cache_key(&m, key, sizeof(key)) : 0;
+		duration = m.duration_sec;
+		media_close(&m);
+		if (!needs) {
+			printf("Plays natively, nothing to do\n");
+			continue;
+		}
+		if (n < 0) {
+			failed = 1;
+			continue;
+		}
+		if (cache_lookup(cache, key, path, sizeof(path)) == 0) {
+			printf("Already cached\n");
+			continue;
+		}
+
+		fd = cache_begin(cache, key);
+		if (fd < 0) {
+			failed = 1;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		n = chunk_transcode(tmpl, files[i], force_transcode, jobs,
+		    remotes, nremotes, fd);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (n < 0) {
+			cache_abort(cache);
+			fprintf(stderr, "Failed to prepare %s\n", files[i]);
+			failed = 1;
+			continue;
+		}
+		cache_commit(cache);
+
+		secs = (t1.tv_sec - t0.tv_sec) +
+		    (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("%d chunks in %.1fs", n, secs);
+		if (duration > 0 && secs > 0)
+			printf(" (%.1fx realtime)", duration / secs);
+		printf("\n");
+	}
+
+	return failed || !running;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "send2tv.h"
+
+/*
+ * Static-content detection for screen capture.
+ *
+ * Each captured frame is compared against a copy of the previous one in
+ * tiles of DEDUPE_TILE_W x DEDUPE_TILE_H pixels.  A tile is dirty as
+ * soon as one of its rows differs; only dirty tiles are copied into the
+ * reference, so a static desktop costs one read of the frame and no
+ * writes.  The caller skips the filter graph and the encoder for frames
+ * without dirty tiles.
+ *
+ * Only packed pixel formats (x11grab delivers BGR0) are handled.
+ */
+
+/*
+ * Compare len bytes.  Rows are OR-accumulated and tested once, so the
+ * common all-equal case has no branch per vector.
+ */
+static int
+row_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+#ifdef __SSE2__
+	__m128i		 acc = _mm_setzero_si128();
+
+	for (; len >= 16; a += 16, b += 16, len -= 16)
+		acc = _mm_or_si128(acc, _mm_xor_si128(
+		    _mm_loadu_si128((const __m128i *)a),
+		    _mm_loadu_si128((const __m128i *)b)));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc,
+	    _mm_setzero_si128())) != 0xffff)
+		return 0;
+#else
+	uint64_t	 acc = 0, x, y;
+
+	for (; len >= 8; a += 8, b += 8, len -= 8) {
+		memcpy(&x, a, 8);
+		memcpy(&y, b, 8);
+		acc |= x ^ y;
+	}
+	if (acc != 0)
+		return 0;
+#endif
+	return len == 0 || memcmp(a, b, len) == 0;
+}
+
+/*
+ * Start over with a frame of a new size; the whole frame is dirty.
+ */
+static int
+dedupe_reset(dedupe_ctx_t *d, const uint8_t *data, int linesize, int width,
+    int height, int bpp)
+{
+	size_t	 row = (size_t)width * bpp;
+	int	 y;
+
+	free(d->prev);
+	d->prev = malloc(row * height);
+	if (d->prev == NULL) {
+		d->width = 0;
+		return -1;
+	}
+	for (y = 0; y < height; y++)
+		memcpy(d->prev + row * y, data + (size_t)linesize * y, row);
+	d->width = width;
+	d->height = height;
+	d->bpp = bpp;
+	d->tiles = ((width + DEDUPE_TILE_W - 1) / DEDUPE_TILE_W) *
+	    ((height + DEDUPE_TILE_H - 1) / DEDUPE_TILE_H);
+	d->x0 = 0;
+	d->y0 = 0;
+	d->x1 = width;
+	d->y1 = height;
+	return d->tiles;
+}
+
+/*
+ * Compare a width x height frame of bpp bytes per pixel against the
+ * previous one and take it as the new reference.  Returns the number of
+ * dirty tiles (0 if the frame is unchanged), or -1 if out of memory.
+ * The dirty rectangle of the last changed frame is kept in x0/y0 to
+ * x1/y1.
+ */
+int
+dedupe_frame(dedupe_ctx_t *d, const uint8_t *data, int linesize, int width,
+    int height, int bpp)
+{
+	const uint8_t	*src;
+	uint8_t		*ref;
+	size_t		 row = (size_t)width * bpp, len;
+	int		 tx, ty, y, h, w, dirty = 0;
+	int		 x0 = width, y0 = height, x1 = 0, y1 = 0;
+
+	d->frames++;
+	if (d->prev == NULL || width != d->width || height != d->height ||
+	    bpp != d->bpp) {
+		dirty = dedupe_reset(d, data, linesize, width, height, bpp);
+		if (dirty > 0)
+			d->dirty_tiles += dirty;
+		d->last_dirty = dirty;
+		return dirty;
+	}
+
+	for (ty = 0; ty < height; ty += DEDUPE_TILE_H) {
+		h = height - ty < DEDUPE_TILE_H ? height - ty : DEDUPE_TILE_H;
+		for (tx = 0; tx < width; tx += DEDUPE_TILE_W) {
+			w = width - tx < DEDUPE_TILE_W ? width - tx :
+			    DEDUPE_TILE_W;
+			len = (size_t)w * bpp;
+			for (y = ty; y < ty + h; y++) {
+				src = data + (size_t)linesize * y +
+				    (size_t)tx * bpp;
+				ref = d->prev + row * y + (size_t)tx * bpp;
+				if (!row_equal(src, ref, len))
+					break;
+			}
+			if (y == ty + h)
+				continue;
+
+			/* Rows above y matched already */
+			for (; y < ty + h; y++)
+				memcpy(d->prev + row * y + (size_t)tx * bpp,
+				    data + (size_t)linesize * y +
+				    (size_t)tx * bpp, len);
+			dirty++;
+			if (tx < x0)
+				x0 = tx;
+			if (ty < y0)
+				y0 = ty;
+			if (tx + w > x1)
+				x1 = tx + w;
+			if (ty + h > y1)
+				y1 = ty + h;
+		}
+	}
+
+	d->last_dirty = dirty;
+	d->dirty_tiles += dirty;
+	if (dirty > 0) {
+		d->x0 = x0;
+		d->y0 = y0;
+		d->x1 = x1;
+		d->y1 = y1;
+	}
+	return dirty;
+}
+
+/*
+ * Print the statistics so far.
+ */
+void
+dedupe_report(const dedupe_ctx_t *d)
+{
+	if (d->frames == 0 || d->tiles == 0)
+		return;
+	DPRINTF("dedupe: %lld frames, %lld%% skipped, %lld%% of tiles dirty, "
+	    "last change %dx%d+%d+%d\n", (long long)d->frames,
+	    (long long)(d->skipped * 100 / d->frames),
+	    (long long)(d->dirty_tiles * 100 / (d->frames * d->tiles)),
+	    d->x1 - d->x0, d->y1 - d->y0, d->x0, d->y0);
+}
+
+void
+dedupe_free(dedupe_ctx_t *d)
+{
+	free(d->prev);
+	memset(d, 0, sizeof(*d));
+}
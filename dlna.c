@@ -11,24 +11,33 @@
  * DLNA.ORG_OP:    "ab" where a=time-seek, b=byte-seek (each 0 or 1)
  * DLNA.ORG_CI:    conversion indicator (0=original, 1=transcoded)
  * DLNA.ORG_FLAGS: 32-hex-char primary+reserved flags
+ *
+ * A stream with is_streaming DLNA_TIMESHIFT is live but time-seekable
+ * within a window whose start and end both move on (s0-increasing and
+ * sN-increasing).
  */
 void
 build_dlna_features(char *buf, size_t buflen, const char *dlna_profile,
     int is_streaming)
 {
+	const char	*op, *flags;
+
+	if (is_streaming == DLNA_TIMESHIFT) {
+		op = "10";
+		flags = "0D700000000000000000000000000000";
+	} else {
+		op = is_streaming ? "00" : "01";
+		flags = "01700000000000000000000000000000";
+	}
+
 	if (dlna_profile != NULL && dlna_profile[0] != '\0')
 		snprintf(buf, buflen,
 		    "DLNA.ORG_PN=%s;DLNA.ORG_OP=%s;DLNA.ORG_CI=%s;"
-		    "DLNA.ORG_FLAGS="
-		    "01700000000000000000000000000000",
-		    dlna_profile,
-		    is_streaming ? "00" : "01",
-		    is_streaming ? "1" : "0");
+		    "DLNA.ORG_FLAGS=%s",
+		    dlna_profile, op, is_streaming ? "1" : "0", flags);
 	else
 		snprintf(buf, buflen,
 		    "DLNA.ORG_OP=%s;DLNA.ORG_CI=%s;"
-		    "DLNA.ORG_FLAGS="
-		    "01700000000000000000000000000000",
-		    is_streaming ? "00" : "01",
-		    is_streaming ? "1" : "0");
+		    "DLNA.ORG_FLAGS=%s",
+		    op, is_streaming ? "1" : "0", flags);
 }
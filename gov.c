@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send2tv.h"
+
+/*
+ * CPU governor for software encoding.
+ *
+ * The encoding threads report the time they spend working (not blocked
+ * on output) and every encoded video frame.  At each GOP boundary the
+ * governor compares the work against the frame deadline.  If encoding
+ * takes more than GOV_HIGH percent of real time for GOV_DOWN_GOPS GOPs
+ * in a row, it moves down the ladder below, straight to the first rung
+ * whose estimated cost fits GOV_TARGET.  It moves back up one rung
+ * once the rung above has been estimated to fit for GOV_UP_GOPS GOPs in
+ * a row.  The cost of a rung is estimated as pixels per second.
+ */
+
+static const struct {
+	int	 max_height;	/* 0 = source height */
+	int	 fps_div;	/* only for sources of 48 fps or more */
+	int	 aac_fast;
+} gov_ladder[] = {
+	{    0, 1, 0 },		/* source */
+	{    0, 1, 1 },		/* AAC fast coder */
+	{ 1440, 1, 1 },
+	{ 1080, 1, 1 },
+	{ 1080, 2, 1 },
+	{  720, 2, 1 },
+	{  540, 2, 1 }
+};
+
+/*
+ * Set up the ladder for a width x height source at fps_num/fps_den.
+ * Rungs that would not change anything for this source are left out.
+ */
+void
+gov_init(gov_ctx_t *g, int width, int height, int fps_num, int fps_den)
+{
+	gov_rung_t	*r, *prev;
+	int		 i, fps;
+
+	memset(g, 0, sizeof(*g));
+	g->fps_num = fps_num;
+	g->fps_den = fps_den > 0 ? fps_den : 1;
+	fps = fps_num / g->fps_den;
+	if (fps <= 0)
+		fps = 30;
+	g->gop_pts = -1;
+
+	for (i = 0; i < (int)(sizeof(gov_ladder) / sizeof(gov_ladder[0]));
+	    i++) {
+		r = &g->rungs[g->nrungs];
+		r->width = width;
+		r->height = height;
+		if (gov_ladder[i].max_height > 0 &&
+		    height > gov_ladder[i].max_height) {
+			r->height = gov_ladder[i].max_height;
+			r->width = (int)((int64_t)width * r->height /
+			    height) & ~1;
+		}
+		r->fps_div = 1;
+		if (gov_ladder[i].fps_div > 1 && fps >= 48 &&
+		    fps % gov_ladder[i].fps_div == 0)
+			r->fps_div = gov_ladder[i].fps_div;
+		r->aac_fast = gov_ladder[i].aac_fast;
+		r->cost = (int64_t)r->width * r->height * fps / r->fps_div;
+		if (r->aac_fast)
+			r->cost = r->cost * 95 / 100;
+
+		prev = g->nrungs > 0 ? &g->rungs[g->nrungs - 1] : NULL;
+		if (prev != NULL && prev->width == r->width &&
+		    prev->height == r->height &&
+		    prev->fps_div == r->fps_div &&
+		    prev->aac_fast == r->aac_fast)
+			continue;
+		g->nrungs++;
+	}
+}
+
+/*
+ * Account us of encoding work.
+ */
+void
+gov_note_busy(gov_ctx_t *g, int64_t us)
+{
+	if (us > 0)
+		g->busy_us += us;
+}
+
+/*
+ * Account one encoded video frame.
+ */
+void
+gov_note_frame(gov_ctx_t *g)
+{
+	g->frames++;
+}
+
+/*
+ * Evaluate the GOP that just ended.  Returns the rung to switch to, or
+ * -1 to stay.
+ */
+int
+gov_update(gov_ctx_t *g)
+{
+	const gov_rung_t	*cur = &g->rungs[g->rung];
+	int64_t			 deadline, load;
+	int			 r, next = -1;
+
+	if (g->frames == 0 || g->fps_num <= 0) {
+		g->busy_us = 0;
+		return -1;
+	}
+	deadline = (int64_t)g->frames * 1000000 * g->fps_den *
+	    cur->fps_div / g->fps_num;
+	load = deadline > 0 ? g->busy_us * 100 / deadline : 0;
+	g->busy_us = 0;
+	g->frames = 0;
+
+	if (load > GOV_HIGH) {
+		g->under = 0;
+		if (++g->over >= GOV_DOWN_GOPS && g->rung < g->nrungs - 1) {
+			for (r = g->rung + 1; r < g->nrungs - 1; r++)
+				if (load * g->rungs[r].cost / cur->cost <=
+				    GOV_TARGET)
+					break;
+			next = r;
+		}
+	} else {
+		g->over = 0;
+		if (g->rung > 0 && load * g->rungs[g->rung - 1].cost /
+		    cur->cost <= GOV_TARGET) {
+			if (++g->under >= GOV_UP_GOPS)
+				next = g->rung - 1;
+		} else
+			g->under = 0;
+	}
+
+	if (next < 0)
+		return -1;
+	DPRINTF("gov: load %d%%, rung %d -> %d: %dx%d, %s frame rate, "
+	    "AAC %s coder\n", (int)load, g->rung, next,
+	    g->rungs[next].width, g->rungs[next].height,
+	    g->rungs[next].fps_div > 1 ? "half" : "full",
+	    g->rungs[next].aac_fast ? "fast" : "default");
+	g->rung = next;
+	g->over = 0;
+	g->under = 0;
+	return next;
+}
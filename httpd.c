@@ -11,6 +11,10 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "send2tv.h"
 
@@ -37,13 +41,14 @@ send_all(int fd, const void *buf, size_t len)
 }
 
 /*
- * Send HTTP response headers.
+ * Send HTTP response headers, and extra ones (CRLF-terminated lines) if
+ * not NULL.
  */
 static void
 send_headers(int fd, int status, const char *status_text,
     const char *content_type, off_t content_length,
     off_t range_start, off_t range_end, off_t total_size,
-    int is_streaming, const char *dlna_profile)
+    int is_streaming, const char *dlna_profile, const char *extra)
 {
 	char	 hdrs[2048];
 	char	 dlna_features[256];
@@ -72,10 +77,44 @@ send_headers(int fd, int status, const char *status_text,
 		    "Content-Length: %lld\r\n",
 		    (long long)content_length);
 
+	if (extra != NULL)
+		strlcat(hdrs, extra, sizeof(hdrs));
 	strlcat(hdrs, "\r\n", sizeof(hdrs));
 	send_all(fd, hdrs, strlen(hdrs));
 }
 
+/*
+ * Send bytes off..total-1 of file fd with sendfile(), straight from the
+ * page cache.  Returns 0 when done or the client is gone, -1 if the
+ * file has to be copied instead.
+ */
+static int
+send_file_range(int client_fd, int fd, off_t off, off_t total)
+{
+#ifdef __linux__
+	off_t	 start = off;
+	ssize_t	 n;
+
+	while (off < total) {
+		n = sendfile(client_fd, fd, &off, total - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && off == start &&
+		    (errno == EINVAL || errno == ENOSYS))
+			return -1;
+		if (n <= 0)
+			break;
+	}
+	return 0;
+#else
+	(void)client_fd;
+	(void)fd;
+	(void)off;
+	(void)total;
+	return -1;
+#endif
+}
+
 /*
  * Serve a file directly (passthrough mode).
  */
@@ -94,7 +133,7 @@ serve_file(int client_fd, media_ctx_t *media, int head_only,
 
 	if (stat(media->filepath, &st) < 0) {
 		send_headers(client_fd, 404, "Not Found",
-		    "text/plain", 9, -1, -1, -1, 0, NULL);
+		    "text/plain", 9, -1, -1, -1, 0, NULL, NULL);
 		if (!head_only)
 			send_all(client_fd, "Not Found", 9);
 		return;
@@ -108,11 +147,11 @@ serve_file(int client_fd, media_ctx_t *media, int head_only,
 	if (range_start > 0)
 		send_headers(client_fd, 206, "Partial Content",
 		    media->mime_type, -1, range_start, end, total, 0,
-		    media->dlna_profile);
+		    media->dlna_profile, NULL);
 	else
 		send_headers(client_fd, 200, "OK",
 		    media->mime_type, total, -1, -1, -1, 0,
-		    media->dlna_profile);
+		    media->dlna_profile, NULL);
 
 	if (head_only)
 		return;
@@ -121,6 +160,10 @@ serve_file(int client_fd, media_ctx_t *media, int head_only,
 	if (fd < 0)
 		return;
 
+	if (send_file_range(client_fd, fd, range_start, total) == 0) {
+		close(fd);
+		return;
+	}
 	if (range_start > 0)
 		lseek(fd, range_start, SEEK_SET);
 
@@ -133,43 +176,403 @@ serve_file(int client_fd, media_ctx_t *media, int head_only,
 }
 
 /*
- * Serve from a pipe (transcoded or captured stream).
+ * Send what the client puts into its shared-memory ring until the data
+ * connection ends.  Returns -1 if the TV connection failed.
+ */
+static int
+serve_ring(int client_fd, media_ctx_t *media, shmring_t *ring)
+{
+	const uint8_t	*p;
+	size_t		 len;
+
+	while ((p = shmring_peek(ring, SEND2TV_BUF_SIZE, &len,
+	    &media->running, media->pipe_rd)) != NULL) {
+		if (send_all(client_fd, p, len) < 0)
+			return -1;
+		shmring_consume(ring, len);
+	}
+	return 0;
+}
+
+/*
+ * Wait up to ms milliseconds for src->splice_cond.  Called with
+ * src->splice_lock held.
  */
 static void
-serve_pipe(int client_fd, media_ctx_t *media, int head_only)
+src_wait(httpd_src_t *src, int ms)
 {
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&src->splice_cond, &src->splice_lock, &ts);
+}
+
+/*
+ * Attach to data connection fd: a ring it hands over is returned, and
+ * kept in src for further requests on the same connection.  Otherwise
+ * NULL is returned with the first bytes of the stream in buf, *n of
+ * them (-1 if it has already ended).
+ */
+static shmring_t *
+pipe_attach(httpd_src_t *src, int fd, void *buf, size_t len, ssize_t *n)
+{
+	struct stat	 st;
+
+	*n = 0;
+	if (fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return NULL;
+	if (src->ring == NULL || src->ring_ino != st.st_ino) {
+		shmring_free(src->ring);
+		src->ring = shmring_accept(fd, buf, len, n);
+		src->ring_ino = st.st_ino;
+		if (src->ring == NULL && *n == 0)
+			*n = -1;
+	}
+	return src->ring;
+}
+
+/*
+ * Keep a segment whose data has ended open for up to HTTPD_LINGER_MS,
+ * until the next one is queued: a TV only moves on to the URI given
+ * with SetNextAVTransportURI while it is still playing.
+ */
+static void
+pipe_linger(httpd_src_t *src, int gen)
+{
+	media_ctx_t	*media = src->media;
+	struct timespec	 start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&src->splice_lock);
+	while (media->running && src->gen == gen && src->next_seg == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000 >= HTTPD_LINGER_MS)
+			break;
+		src_wait(src, 100);
+	}
+	pthread_mutex_unlock(&src->splice_lock);
+}
+
+/*
+ * Serve from a pipe (transcoded or captured stream).  In server mode
+ * the pipe is the client's data connection, which may hand over a ring
+ * first.  Called with src->pipe_lock held.
+ */
+static void
+serve_pipe(int client_fd, httpd_src_t *src)
+{
+	media_ctx_t	*media = src->media;
+	shmring_t	*ring;
 	char		 buf[SEND2TV_BUF_SIZE];
 	ssize_t		 n;
+	int		 gen;
+
+	pthread_mutex_lock(&src->splice_lock);
+	src->live = 1;
+	gen = src->gen;
+	pthread_mutex_unlock(&src->splice_lock);
+
+	ring = pipe_attach(src, media->pipe_rd, buf, sizeof(buf), &n);
+	if (n < 0 || (n > 0 && send_all(client_fd, buf, n) < 0))
+		goto done;
+	if (ring != NULL) {
+		n = serve_ring(client_fd, media, ring);
+	} else {
+		while (media->running) {
+			n = read(media->pipe_rd, buf, sizeof(buf));
+			if (n <= 0)
+				break;
+			if (send_all(client_fd, buf, n) < 0) {
+				n = -1;
+				break;
+			}
+		}
+	}
+	if (n == 0 && media->queue_next)
+		pipe_linger(src, gen);
+
+done:
+	pthread_mutex_lock(&src->splice_lock);
+	src->live = 0;
+	pthread_mutex_unlock(&src->splice_lock);
+}
+
+/*
+ * Seconds of a DLNA npt time, "ss.sss" or "hh:mm:ss.sss".  Returns -1 if
+ * it is neither.
+ */
+static double
+parse_npt(const char *s)
+{
+	double	 v = 0, f;
+	char	*end;
+	int	 i;
+
+	for (i = 0; i < 3; i++) {
+		f = strtod(s, &end);
+		if (end == s || f < 0)
+			return -1;
+		v = v * 60 + f;
+		if (*end != ':')
+			return v;
+		s = end + 1;
+	}
+	return -1;
+}
 
-	DPRINTF("httpd: serving from pipe, mime=%s\n", media->mime_type);
+/*
+ * Serve a live segment from its time-shift window: from the time asked
+ * for with TimeSeekRange.dlna.org (npt >= 0), from a byte offset still
+ * in the window, or else from the newest keyframe.
+ */
+static void
+serve_tshift(int client_fd, media_ctx_t *media, tshift_t *t, int head_only,
+    off_t range_start, double npt)
+{
+	char		 buf[SEND2TV_BUF_SIZE], extra[64] = "";
+	int64_t		 off;
+	double		 at;
+	ssize_t		 n;
 
-	send_headers(client_fd, 200, "OK",
-	    media->mime_type, -1, -1, -1, -1, 1,
-	    media->dlna_profile);
+	if (npt >= 0) {
+		off = tshift_seek(t, npt, &at);
+		snprintf(extra, sizeof(extra),
+		    "TimeSeekRange.dlna.org: npt=%.3f-\r\n", at);
+	} else if (range_start > 0 && tshift_holds(t, range_start))
+		off = range_start;
+	else
+		off = tshift_live(t);
+	DPRINTF("httpd: time-shift from byte %lld\n", (long long)off);
 
+	send_headers(client_fd, 200, "OK", media->mime_type, -1, -1, -1, -1,
+	    DLNA_TIMESHIFT, media->dlna_profile,
+	    extra[0] != '\0' ? extra : NULL);
 	if (head_only)
 		return;
-
-	while (media->running) {
-		n = read(media->pipe_rd, buf, sizeof(buf));
-		if (n <= 0)
-			break;
+	while ((n = tshift_read(t, &off, buf, sizeof(buf))) > 0)
 		if (send_all(client_fd, buf, n) < 0)
 			break;
+}
+
+/* The time-shift window of src, held, or NULL */
+static tshift_t *
+src_tshift(httpd_src_t *src)
+{
+	tshift_t	*t;
+
+	pthread_mutex_lock(&src->splice_lock);
+	if ((t = src->tshift) != NULL)
+		tshift_hold(t);
+	pthread_mutex_unlock(&src->splice_lock);
+	return t;
+}
+
+/*
+ * Make the queued segment seg the one served: its data connection
+ * replaces the pipe.  Returns its read-ahead, NULL if seg is not queued
+ * (any more).  Called with src->pipe_lock held.
+ */
+static prefetch_t *
+queue_take(httpd_src_t *src, int seg)
+{
+	media_ctx_t	*media = src->media;
+	prefetch_t	*p;
+	int		 old;
+
+	pthread_mutex_lock(&src->splice_lock);
+	if ((p = src->prefetch) == NULL || src->next_seg != seg) {
+		pthread_mutex_unlock(&src->splice_lock);
+		return NULL;
 	}
+	src->prefetch = NULL;
+	src->next_seg = 0;
+	old = media->pipe_rd;
+	media->pipe_rd = p->fd;
+	strlcpy(media->mime_type, src->next_mime, sizeof(media->mime_type));
+	strlcpy(media->dlna_profile, src->next_dlna,
+	    sizeof(media->dlna_profile));
+	pthread_mutex_unlock(&src->splice_lock);
+
+	if (old >= 0)
+		close(old);
+	prefetch_stop(p);
+	if (p->ring != NULL) {
+		shmring_free(src->ring);
+		src->ring = p->ring;
+		src->ring_ino = p->ino;
+		p->ring = NULL;
+	}
+	DPRINTF("httpd: segment %d taken, %zu bytes read ahead\n", seg,
+	    p->len);
+	return p;
+}
+
+/*
+ * Rewrite len bytes of an item and send what is ready.
+ */
+static int
+splice_send(int client_fd, splice_t *sp, const uint8_t *p, size_t len,
+    uint8_t *out)
+{
+	size_t	 n;
+
+	n = splice_feed(sp, p, len, out);
+	return n > 0 ? send_all(client_fd, out, n) : 0;
 }
 
 /*
- * Handle one HTTP request.
+ * Send one item of a continuous stream from data connection fd, until
+ * it ends, is cut or the stream is dropped.  Returns -1 if the TV
+ * connection failed.
+ */
+static int
+serve_item(int client_fd, httpd_src_t *src, int fd, int gen, splice_t *sp,
+    uint8_t *buf, uint8_t *out)
+{
+	media_ctx_t	*media = src->media;
+	shmring_t	*ring;
+	const uint8_t	*p;
+	size_t		 len;
+	ssize_t		 n;
+
+	ring = pipe_attach(src, fd, buf, SEND2TV_BUF_SIZE, &n);
+	if (n < 0)
+		return 0;
+	if (n > 0 && splice_send(client_fd, sp, buf, n, out) < 0)
+		return -1;
+	while (media->running && src->gen == gen && !src->cut) {
+		if (ring != NULL) {
+			p = shmring_peek(ring, SEND2TV_BUF_SIZE, &len,
+			    &media->running, fd);
+			if (p == NULL)
+				break;
+			n = splice_send(client_fd, sp, p, len, out);
+			shmring_consume(ring, len);
+		} else {
+			if ((n = read(fd, buf, SEND2TV_BUF_SIZE)) <= 0)
+				break;
+			n = splice_send(client_fd, sp, buf, n, out);
+		}
+		if (n < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Serve a continuous stream: the items httpd_splice() queues follow the
+ * current one on this connection, rewritten into one stream by
+ * splice.c.  Called with src->pipe_lock held.
+ */
+static void
+serve_splice(int client_fd, httpd_src_t *src)
+{
+	media_ctx_t	*media = src->media;
+	splice_t	*sp;
+	uint8_t		*buf, *out;
+	int		 fd, old, gen;
+
+	sp = malloc(sizeof(*sp));
+	buf = malloc(SEND2TV_BUF_SIZE);
+	out = malloc(SEND2TV_BUF_SIZE + 188);
+	if (sp == NULL || buf == NULL || out == NULL)
+		goto done;
+	splice_init(sp);
+
+	pthread_mutex_lock(&src->splice_lock);
+	src->live = 1;
+	gen = src->gen;
+	fd = media->pipe_rd;
+	pthread_mutex_unlock(&src->splice_lock);
+
+	while (fd >= 0) {
+		splice_next(sp);
+		if (serve_item(client_fd, src, fd, gen, sp, buf, out) < 0)
+			break;
+
+		/* The next item, once the session has one */
+		pthread_mutex_lock(&src->splice_lock);
+		while (media->running && src->gen == gen &&
+		    src->next_fd < 0)
+			src_wait(src, 100);
+		old = fd = -1;
+		if (media->running && src->gen == gen) {
+			old = media->pipe_rd;
+			media->pipe_rd = fd = src->next_fd;
+			src->next_fd = -1;
+			src->cut = 0;
+		}
+		pthread_mutex_unlock(&src->splice_lock);
+		if (old >= 0)
+			close(old);
+		if (fd >= 0)
+			DPRINTF("httpd: item %d after %lld packets\n",
+			    sp->item + 1, (long long)sp->packets);
+	}
+
+	pthread_mutex_lock(&src->splice_lock);
+	src->live = 0;
+	pthread_mutex_unlock(&src->splice_lock);
+done:
+	free(sp);
+	free(buf);
+	free(out);
+}
+
+/*
+ * The source a request path after "/media" is for, or NULL.
+ */
+static httpd_src_t *
+request_src(httpd_ctx_t *ctx, const char *path)
+{
+	char	*end;
+	long	 i;
+
+	if (*path != '/')
+		return &ctx->src[0];
+	i = strtol(path + 1, &end, 10);
+	if (end == path + 1 || (*end != '/' && *end != ' ' && *end != '?') ||
+	    i < 0 || i >= ctx->nsrc)
+		return NULL;
+	return &ctx->src[i];
+}
+
+/*
+ * The segment a request path after "/media/<source>" is for, 0 if it
+ * names none.
+ */
+static int
+request_seg(const char *path)
+{
+	if (*path != '/')
+		return 0;
+	path += 1 + strspn(path + 1, "0123456789");
+	return *path == '/' ? atoi(path + 1) : 0;
+}
+
+/*
+ * Handle one HTTP request: /media/<source>/<segment>, or /media for
+ * the first source.
  */
 static void
 handle_request(int client_fd, httpd_ctx_t *ctx)
 {
-	media_ctx_t	*media = ctx->media;
-	char		 req[4096];
+	httpd_src_t	*src;
+	media_ctx_t	*media;
+	prefetch_t	*pre = NULL;
+	tshift_t	*t;
+	char		 req[4096], mime[64], dlna[64];
 	ssize_t		 n;
-	int		 head_only = 0;
+	int		 head_only = 0, seg;
 	off_t		 range_start = -1;
+	double		 npt = -1;
 	char		*line, *p;
 
 	n = recv(client_fd, req, sizeof(req) - 1, 0);
@@ -185,7 +588,7 @@ handle_request(int client_fd, httpd_ctx_t *ctx)
 		head_only = 1;
 	else if (strncmp(req, "GET ", 4) != 0) {
 		send_headers(client_fd, 405, "Method Not Allowed",
-		    "text/plain", 0, -1, -1, -1, 0, NULL);
+		    "text/plain", 0, -1, -1, -1, 0, NULL, NULL);
 		return;
 	}
 
@@ -194,14 +597,17 @@ handle_request(int client_fd, httpd_ctx_t *ctx)
 	if (p != NULL)
 		p++;
 
-	/* Check path is /media */
-	if (p == NULL || strncmp(p, "/media", 6) != 0) {
+	/* Check path is /media or /media/<source>/... */
+	if (p == NULL || strncmp(p, "/media", 6) != 0 ||
+	    (src = request_src(ctx, p + 6)) == NULL) {
 		send_headers(client_fd, 404, "Not Found",
-		    "text/plain", 9, -1, -1, -1, 0, NULL);
+		    "text/plain", 9, -1, -1, -1, 0, NULL, NULL);
 		if (!head_only)
 			send_all(client_fd, "Not Found", 9);
 		return;
 	}
+	media = src->media;
+	seg = request_seg(p + 6);
 
 	/* Parse Range header */
 	line = strcasestr(req, "Range:");
@@ -212,19 +618,97 @@ handle_request(int client_fd, httpd_ctx_t *ctx)
 			range_start = strtoll(p, NULL, 10);
 		}
 	}
+	line = strcasestr(req, "TimeSeekRange.dlna.org:");
+	if (line != NULL && (p = strstr(line, "npt=")) != NULL)
+		npt = parse_npt(p + 4);
+
+	/* A live segment is read from its window, by any number of GETs */
+	if ((t = src_tshift(src)) != NULL) {
+		serve_tshift(client_fd, media, t, head_only, range_start, npt);
+		tshift_release(t);
+		return;
+	}
 
 	if (media->needs_transcode || media->mode == MODE_SCREEN ||
 	    media->mode == MODE_SINK ||
 	    (media->filepath != NULL &&
 	     (strncmp(media->filepath, "http://", 7) == 0 ||
-	      strncmp(media->filepath, "https://", 8) == 0)))
-		serve_pipe(client_fd, media, head_only);
-	else
+	      strncmp(media->filepath, "https://", 8) == 0))) {
+		/* The segment queued on the TV is announced as queued */
+		pthread_mutex_lock(&src->splice_lock);
+		if (seg != 0 && seg == src->next_seg) {
+			strlcpy(mime, src->next_mime, sizeof(mime));
+			strlcpy(dlna, src->next_dlna, sizeof(dlna));
+		} else {
+			strlcpy(mime, media->mime_type, sizeof(mime));
+			strlcpy(dlna, media->dlna_profile, sizeof(dlna));
+		}
+		pthread_mutex_unlock(&src->splice_lock);
+		DPRINTF("httpd: serving from pipe, mime=%s\n", mime);
+		send_headers(client_fd, 200, "OK", mime, -1, -1, -1, -1, 1,
+		    dlna, NULL);
+		if (head_only)
+			return;
+		/*
+		 * A second GET waits until the first one is done; one for
+		 * the queued segment then takes it over.
+		 */
+		pthread_mutex_lock(&src->pipe_lock);
+		if (seg != 0)
+			pre = queue_take(src, seg);
+		if (pre == NULL || pre->len == 0 ||
+		    send_all(client_fd, pre->buf, pre->len) == 0) {
+			if (media->mode == MODE_SINK && media->continuous)
+				serve_splice(client_fd, src);
+			else
+				serve_pipe(client_fd, src);
+		}
+		pthread_mutex_unlock(&src->pipe_lock);
+		if (pre != NULL) {
+			prefetch_free(pre);
+			free(pre);
+		}
+	} else
 		serve_file(client_fd, media, head_only, range_start);
 }
 
 /*
- * HTTP server thread.
+ * Worker: handle the connections the acceptor queues.  A stream keeps
+ * its worker for as long as it runs.
+ */
+static void *
+httpd_worker(void *arg)
+{
+	httpd_ctx_t	*ctx = arg;
+	int		 client_fd, flag = 1;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (ctx->running && ctx->qlen == 0)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->running)
+			break;
+		client_fd = ctx->queue[ctx->qhead];
+		ctx->qhead = (ctx->qhead + 1) % HTTPD_QUEUE;
+		ctx->qlen--;
+		ctx->idle--;
+		pthread_mutex_unlock(&ctx->lock);
+
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &flag,
+		    sizeof(flag));
+		handle_request(client_fd, ctx);
+		close(client_fd);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->idle++;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+/*
+ * HTTP server thread: accept connections for all sources and queue them
+ * for the workers.
  */
 static void *
 httpd_thread(void *arg)
@@ -248,27 +732,80 @@ httpd_thread(void *arg)
 		if (client_fd < 0)
 			continue;
 
-		{ int flag = 1; setsockopt(client_fd, IPPROTO_TCP,
-		    TCP_NODELAY, &flag, sizeof(flag)); }
-		handle_request(client_fd, ctx);
-		close(client_fd);
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx->qlen == HTTPD_QUEUE) {
+			pthread_mutex_unlock(&ctx->lock);
+			DPRINTF("httpd: all workers busy\n");
+			send_headers(client_fd, 503, "Service Unavailable",
+			    "text/plain", 0, -1, -1, -1, 0, NULL, NULL);
+			close(client_fd);
+			continue;
+		}
+		ctx->queue[(ctx->qhead + ctx->qlen) % HTTPD_QUEUE] = client_fd;
+		ctx->qlen++;
+		if (ctx->qlen > ctx->idle)
+			DPRINTF("httpd: %d connections wait for a worker\n",
+			    ctx->qlen - ctx->idle);
+		pthread_cond_signal(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
 	}
 
 	return NULL;
 }
 
 /*
- * Start the HTTP server.
+ * Stop and join the workers and the accept thread.
+ */
+static void
+httpd_join(httpd_ctx_t *ctx, int accept_thread)
+{
+	int	 i;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->running = 0;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	if (accept_thread)
+		pthread_join(ctx->thread, NULL);
+	for (i = 0; i < ctx->nworkers; i++)
+		pthread_join(ctx->workers[i], NULL);
+	ctx->nworkers = 0;
+	while (ctx->qlen > 0) {
+		close(ctx->queue[ctx->qhead]);
+		ctx->qhead = (ctx->qhead + 1) % HTTPD_QUEUE;
+		ctx->qlen--;
+	}
+}
+
+/*
+ * Start the HTTP server for nmedia sources, media[i] served under
+ * /media/<i>/, with a pool of workers sized for them.
  */
 int
-httpd_start(httpd_ctx_t *ctx, media_ctx_t *media, int port)
+httpd_start(httpd_ctx_t *ctx, media_ctx_t **media, int nmedia, int port)
 {
 	struct sockaddr_in	 addr;
 	socklen_t		 addr_len;
-	int			 opt = 1;
+	int			 opt = 1, i, nworkers;
 
-	ctx->media = media;
+	if (nmedia < 1 || nmedia > HTTPD_MAX_SRC)
+		return -1;
+	memset(ctx->src, 0, sizeof(ctx->src));
+	for (i = 0; i < nmedia; i++) {
+		ctx->src[i].media = media[i];
+		ctx->src[i].next_fd = -1;
+		pthread_mutex_init(&ctx->src[i].pipe_lock, NULL);
+		pthread_mutex_init(&ctx->src[i].splice_lock, NULL);
+		pthread_cond_init(&ctx->src[i].splice_cond, NULL);
+	}
+	ctx->nsrc = nmedia;
 	ctx->running = 1;
+	ctx->nworkers = 0;
+	ctx->qhead = 0;
+	ctx->qlen = 0;
+	ctx->idle = 0;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
 
 	ctx->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (ctx->listen_fd < 0) {
@@ -291,7 +828,7 @@ httpd_start(httpd_ctx_t *ctx, media_ctx_t *media, int port)
 		return -1;
 	}
 
-	if (listen(ctx->listen_fd, 5) < 0) {
+	if (listen(ctx->listen_fd, 5 * nmedia) < 0) {
 		perror("listen");
 		close(ctx->listen_fd);
 		return -1;
@@ -304,8 +841,20 @@ httpd_start(httpd_ctx_t *ctx, media_ctx_t *media, int port)
 
 	DPRINTF("httpd: listening on port %d\n", ctx->port);
 
-	if (pthread_create(&ctx->thread, NULL, httpd_thread, ctx) != 0) {
+	/* Every TV streams and probes or reconnects, one spare for HEAD */
+	nworkers = HTTPD_WORKERS_PER_SRC * nmedia + 1;
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&ctx->workers[i], NULL, httpd_worker,
+		    ctx) != 0)
+			break;
+		ctx->nworkers++;
+	}
+	/* Nothing is queued yet, the workers are all waiting */
+	ctx->idle = ctx->nworkers;
+	if (ctx->nworkers < nworkers ||
+	    pthread_create(&ctx->thread, NULL, httpd_thread, ctx) != 0) {
 		perror("pthread_create");
+		httpd_join(ctx, 0);
 		close(ctx->listen_fd);
 		return -1;
 	}
@@ -316,7 +865,175 @@ httpd_start(httpd_ctx_t *ctx, media_ctx_t *media, int port)
 void
 httpd_stop(httpd_ctx_t *ctx)
 {
-	ctx->running = 0;
+	int	 i;
+
+	httpd_join(ctx, 1);
 	close(ctx->listen_fd);
-	pthread_join(ctx->thread, NULL);
+	for (i = 0; i < ctx->nsrc; i++) {
+		shmring_free(ctx->src[i].ring);
+		ctx->src[i].ring = NULL;
+		if (ctx->src[i].next_fd >= 0)
+			close(ctx->src[i].next_fd);
+		ctx->src[i].next_fd = -1;
+		if (ctx->src[i].prefetch != NULL) {
+			prefetch_free(ctx->src[i].prefetch);
+			close(ctx->src[i].prefetch->fd);
+			free(ctx->src[i].prefetch);
+			ctx->src[i].prefetch = NULL;
+		}
+		/* Its data connection is shut down by now */
+		if (ctx->src[i].tshift != NULL) {
+			tshift_close(ctx->src[i].tshift);
+			ctx->src[i].tshift = NULL;
+		}
+		pthread_mutex_destroy(&ctx->src[i].pipe_lock);
+		pthread_mutex_destroy(&ctx->src[i].splice_lock);
+		pthread_cond_destroy(&ctx->src[i].splice_cond);
+	}
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_cond_destroy(&ctx->cond);
+}
+
+/*
+ * Queue data connection fd as the next item of source src's continuous
+ * stream: after the current item or, with cut, in place of its rest.
+ * Returns 0, or -1 if no continuous stream is being sent; fd is then
+ * left to the caller.
+ */
+int
+httpd_splice(httpd_ctx_t *ctx, int src, int fd, int cut)
+{
+	httpd_src_t	*s = &ctx->src[src];
+	int		 ret = -1;
+
+	pthread_mutex_lock(&s->splice_lock);
+	if (s->live && s->media->running) {
+		if (s->next_fd >= 0)
+			close(s->next_fd);
+		s->next_fd = fd;
+		if (cut)
+			s->cut = 1;
+		pthread_cond_signal(&s->splice_cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&s->splice_lock);
+	return ret;
+}
+
+/*
+ * Close source src's data connection and any item or segment queued
+ * after it; a continuous stream being sent ends.
+ */
+void
+httpd_drop_pipe(httpd_ctx_t *ctx, int src)
+{
+	httpd_src_t	*s = &ctx->src[src];
+	prefetch_t	*p;
+	tshift_t	*t;
+	int		 fd;
+
+	pthread_mutex_lock(&s->splice_lock);
+	t = s->tshift;
+	s->tshift = NULL;
+	if ((fd = s->media->pipe_rd) >= 0) {
+		/* Wakes a worker blocked reading it */
+		shutdown(fd, SHUT_RDWR);
+		if (t == NULL)
+			close(fd);
+		s->media->pipe_rd = -1;
+	}
+	if (s->next_fd >= 0) {
+		close(s->next_fd);
+		s->next_fd = -1;
+	}
+	p = s->prefetch;
+	s->prefetch = NULL;
+	s->next_seg = 0;
+	s->cut = 0;
+	s->gen++;
+	pthread_cond_signal(&s->splice_cond);
+	pthread_mutex_unlock(&s->splice_lock);
+
+	if (p != NULL) {
+		prefetch_free(p);
+		close(p->fd);
+		free(p);
+	}
+	/* The window drains the connection, it goes first */
+	if (t != NULL) {
+		tshift_close(t);
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+/*
+ * Give source src's live segment a time-shift window: its data
+ * connection is drained into it from now on.  Returns 0, or -1 if
+ * there is none to be had.
+ */
+int
+httpd_timeshift(httpd_ctx_t *ctx, int src)
+{
+	httpd_src_t	*s = &ctx->src[src];
+	int		 ret = -1;
+
+	if (ctx->tshift_size == 0)
+		return -1;
+	pthread_mutex_lock(&s->splice_lock);
+	if (s->tshift == NULL && s->media->pipe_rd >= 0 &&
+	    (s->tshift = tshift_open(s->media->pipe_rd, ctx->tshift_size,
+	    ctx->tshift_dir)) != NULL)
+		ret = 0;
+	pthread_mutex_unlock(&s->splice_lock);
+	return ret;
+}
+
+/*
+ * Whether a TV is receiving source src's stream, or is about to reach
+ * its end.
+ */
+int
+httpd_live(httpd_ctx_t *ctx, int src)
+{
+	httpd_src_t	*s = &ctx->src[src];
+	int		 live;
+
+	pthread_mutex_lock(&s->splice_lock);
+	live = s->live && s->media->running;
+	pthread_mutex_unlock(&s->splice_lock);
+	return live;
+}
+
+/*
+ * Queue data connection fd as segment seg of source src, which the TV
+ * was given with SetNextAVTransportURI: it is read ahead until the TV
+ * asks for it.  Returns 0, or -1 if the stream being sent has ended or
+ * a segment is queued already; fd is then left to the caller.
+ */
+int
+httpd_queue(httpd_ctx_t *ctx, int src, int fd, int seg, const char *mime,
+    const char *dlna)
+{
+	httpd_src_t	*s = &ctx->src[src];
+	prefetch_t	*p;
+	int		 ret = -1;
+
+	if ((p = malloc(sizeof(*p))) == NULL)
+		return -1;
+	pthread_mutex_lock(&s->splice_lock);
+	if (s->live && s->media->running && s->prefetch == NULL &&
+	    prefetch_start(p, fd, PREFETCH_MAX) == 0) {
+		s->prefetch = p;
+		s->next_seg = seg;
+		strlcpy(s->next_mime, mime, sizeof(s->next_mime));
+		strlcpy(s->next_dlna, dlna, sizeof(s->next_dlna));
+		/* The segment lingering for it can end */
+		pthread_cond_broadcast(&s->splice_cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&s->splice_lock);
+	if (ret < 0)
+		free(p);
+	return ret;
 }
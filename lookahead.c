@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "send2tv.h"
+
+/*
+ * Playlist look-ahead.
+ *
+ * While one item plays, a worker thread prepares the next
+ * LOOKAHEAD_ITEMS local files: it probes them and, for files that need
+ * a transcode (and are not in the transcode cache), encodes the opening
+ * seconds into memory.  When the main loop reaches a prepared item it
+ * takes over the probed input, sends the buffer to the TV first and
+ * continues the transcode right behind it, like a speculative seek hit.
+ */
+
+/*
+ * Seconds to pre-encode at bitrate kbps: up to LOOKAHEAD_SEC, as long
+ * as the estimated stream (video plus ~384 kbps audio and muxing
+ * overhead) stays within half the byte budget.
+ */
+static int
+lookahead_window_sec(int bitrate)
+{
+	long long	 bps = ((long long)bitrate + 384) * 125;
+	long long	 sec;
+
+	if (bps <= 0)
+		return LOOKAHEAD_SEC;
+	sec = (LOOKAHEAD_MAX_BYTES / 2) / bps;
+	if (sec > LOOKAHEAD_SEC)
+		sec = LOOKAHEAD_SEC;
+	if (sec < SPEC_SNIPPET_SEC)
+		sec = SPEC_SNIPPET_SEC;
+	return (int)sec;
+}
+
+static int
+lookahead_eligible(const char *file)
+{
+	/* URLs need yt-dlp and may expire; local files only */
+	return strstr(file, "://") == NULL;
+}
+
+/*
+ * Release whatever an item slot holds.  Caller holds la->lock and the
+ * slot is not being prepared.
+ */
+static void
+lookahead_clear(lookahead_item_t *it)
+{
+	/* A taken item's input belongs to the main loop now */
+	if (it->state != LA_EMPTY && it->state != LA_TAKEN)
+		media_close(&it->media);
+	free(it->data);
+	it->data = NULL;
+	it->len = 0;
+	it->sec = 0;
+	it->idx = -1;
+	it->state = LA_EMPTY;
+}
+
+/*
+ * Next file index within the look-ahead window that has no slot yet, or
+ * -1 if the window is fully prepared.  Caller holds la->lock.
+ */
+static int
+lookahead_next_index(lookahead_ctx_t *la)
+{
+	int	 i;
+
+	for (i = la->current + 1; i <= la->current + LOOKAHEAD_ITEMS &&
+	    i < la->nfiles; i++) {
+		if (!lookahead_eligible(la->files[i]))
+			continue;
+		if (la->items[i % LOOKAHEAD_ITEMS].idx != i)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Probe an item and pre-encode its opening.  Runs without la->lock; the
+ * slot is owned by the worker while it is LA_BUSY.  Returns the state
+ * the slot ends up in.
+ */
+static int
+lookahead_prepare(lookahead_ctx_t *la, lookahead_item_t *it)
+{
+	media_ctx_t	*m = &it->media;
+	char		 key[32], path[1024];
+	int64_t		 t0;
+	int		 sec;
+
+	/* Played as it is, so with all settings of the template */
+	media_from_template(m, &la->tmpl, la->files[it->idx]);
+	if (media_probe(m, m->filepath, la->force_transcode) < 0)
+		return LA_FAILED;
+
+	/* Remuxing starts fast enough; cached transcodes need no work */
+	if (!m->needs_transcode)
+		return LA_READY;
+	if (la->cache != NULL && cache_key(m, key, sizeof(key)) == 0 &&
+	    cache_lookup(la->cache, key, path, sizeof(path)) == 0)
+		return LA_READY;
+
+	sec = lookahead_window_sec(m->bitrate);
+	DPRINTF("lookahead: pre-encoding first %ds of %s\n", sec,
+	    m->filepath);
+	t0 = media_start_us(m);
+	if (media_encode_window(m, t0, t0 + (int64_t)sec * AV_TIME_BASE,
+	    LOOKAHEAD_MAX_BYTES, &it->wanted, &it->data, &it->len) == 0) {
+		it->sec = sec;
+		DPRINTF("lookahead: %zu bytes ready for %s\n", it->len,
+		    m->filepath);
+	}
+	return LA_READY;
+}
+
+static void *
+lookahead_thread(void *arg)
+{
+	lookahead_ctx_t		*la = arg;
+	lookahead_item_t	*it;
+	int			 idx, state;
+
+#ifdef __linux__
+	/* Per-thread nice on Linux; the playing item comes first */
+	setpriority(PRIO_PROCESS, 0, 10);
+#endif
+
+	pthread_mutex_lock(&la->lock);
+	while (la->running) {
+		idx = lookahead_next_index(la);
+		if (idx < 0) {
+			pthread_cond_wait(&la->cond, &la->lock);
+			continue;
+		}
+		it = &la->items[idx % LOOKAHEAD_ITEMS];
+		lookahead_clear(it);
+		it->idx = idx;
+		it->state = LA_BUSY;
+		it->wanted = 1;
+		pthread_mutex_unlock(&la->lock);
+
+		state = lookahead_prepare(la, it);
+
+		pthread_mutex_lock(&la->lock);
+		it->state = state;
+		/* Dropped while we worked on it */
+		if (!it->wanted || idx <= la->current)
+			lookahead_clear(it);
+	}
+	pthread_mutex_unlock(&la->lock);
+
+	return NULL;
+}
+
+/*
+ * Start preparing items of files[] ahead of the playing one.  tmpl
+ * carries the settings every file is played with.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+lookahead_start(lookahead_ctx_t *la, char *const *files, int nfiles,
+    const media_ctx_t *tmpl, int force_transcode, cache_ctx_t *cache)
+{
+	int	 i;
+
+	memset(la, 0, sizeof(*la));
+	for (i = 0; i < LOOKAHEAD_ITEMS; i++)
+		la->items[i].idx = -1;
+	la->files = files;
+	la->nfiles = nfiles;
+	la->current = -1;
+	la->tmpl = *tmpl;
+	la->force_transcode = force_transcode;
+	la->cache = cache;
+
+	pthread_mutex_init(&la->lock, NULL);
+	pthread_cond_init(&la->cond, NULL);
+	la->running = 1;
+	if (pthread_create(&la->thread, NULL, lookahead_thread, la) != 0) {
+		la->running = 0;
+		pthread_mutex_destroy(&la->lock);
+		pthread_cond_destroy(&la->cond);
+		return -1;
+	}
+	la->started = 1;
+	return 0;
+}
+
+/*
+ * Tell the worker that files[idx] is about to play: items before it
+ * are dropped (aborting work on them) and the window moves on.
+ */
+void
+lookahead_advance(lookahead_ctx_t *la, int idx)
+{
+	lookahead_item_t	*it;
+	int			 i;
+
+	if (!la->started)
+		return;
+
+	pthread_mutex_lock(&la->lock);
+	la->current = idx;
+	for (i = 0; i < LOOKAHEAD_ITEMS; i++) {
+		it = &la->items[i];
+		if (it->idx < 0 || it->idx > idx)
+			continue;
+		if (it->state == LA_BUSY)
+			it->wanted = 0;
+		else if (it->idx < idx)
+			lookahead_clear(it);
+	}
+	pthread_cond_signal(&la->cond);
+	pthread_mutex_unlock(&la->lock);
+}
+
+/*
+ * Take the prepared files[idx].  On a hit the probed input moves into
+ * *media (the caller owns it from now on) and, if the opening was
+ * pre-encoded, *data and *len hold it and *sec its length in seconds
+ * (otherwise *data is NULL).  Returns 0 on hit, -1 if the item is not
+ * ready.
+ */
+int
+lookahead_take(lookahead_ctx_t *la, int idx, media_ctx_t *media,
+    uint8_t **data, size_t *len, int *sec)
+{
+	lookahead_item_t	*it;
+
+	if (!la->started)
+		return -1;
+
+	pthread_mutex_lock(&la->lock);
+	it = &la->items[idx % LOOKAHEAD_ITEMS];
+	if (it->idx != idx || it->state != LA_READY) {
+		pthread_mutex_unlock(&la->lock);
+		return -1;
+	}
+	*media = it->media;
+	if (media->ifmt_ctx != NULL)
+		media->ifmt_ctx->interrupt_callback.opaque = media;
+	*data = it->data;
+	*len = it->len;
+	*sec = it->sec;
+	it->data = NULL;
+	it->len = 0;
+	/* The slot stays claimed by idx so it is not prepared again */
+	it->state = LA_TAKEN;
+	pthread_mutex_unlock(&la->lock);
+
+	DPRINTF("lookahead: hit for %s (%zu bytes pre-encoded)\n",
+	    media->filepath, *len);
+	return 0;
+}
+
+void
+lookahead_stop(lookahead_ctx_t *la)
+{
+	int	 i;
+
+	if (!la->started)
+		return;
+
+	pthread_mutex_lock(&la->lock);
+	la->running = 0;
+	for (i = 0; i < LOOKAHEAD_ITEMS; i++)
+		la->items[i].wanted = 0;
+	pthread_cond_signal(&la->cond);
+	pthread_mutex_unlock(&la->lock);
+	pthread_join(la->thread, NULL);
+
+	for (i = 0; i < LOOKAHEAD_ITEMS; i++)
+		lookahead_clear(&la->items[i]);
+	pthread_mutex_destroy(&la->lock);
+	pthread_cond_destroy(&la->cond);
+	la->started = 0;
+}
@@ -1,12 +1,54 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* F_SETPIPE_SZ */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "send2tv.h"
 
+/*
+ * Pipeline profiles.  interactive keeps as little as possible in flight
+ * between the encoder and the TV; balanced has the encoder and muxer
+ * settings send2tv always used; throughput lets every stage batch, for
+ * the most frames per CPU second when latency does not matter.
+ */
+const profile_t profiles[] = {
+	{ "interactive", "flush every packet, small buffers, slice threads",
+	    1, 0, SEND2TV_AVIO_SIZE, 16384, 1, 1, FF_THREAD_SLICE,
+	    7, 2000 },
+	{ "balanced", "flush every packet, system pipe buffer (default)",
+	    1, 0, SEND2TV_AVIO_SIZE, 0, 1, 1, 0,
+	    21, 10000 },
+	{ "throughput", "large buffers, encoder lookahead, frame threads",
+	    0, 1000000, SEND2TV_BUF_SIZE, 1 << 20, 4, 0, FF_THREAD_FRAME,
+	    348, 40000 },
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+const profile_t *
+profile_find(const char *name)
+{
+	const profile_t	*p;
+
+	for (p = profiles; p->name != NULL; p++)
+		if (strcmp(p->name, name) == 0)
+			return p;
+	return NULL;
+}
+
+static const profile_t *
+media_profile(const media_ctx_t *ctx)
+{
+	return ctx->profile != NULL ? ctx->profile : &profiles[1];
+}
+
 /*
  * FFmpeg interrupt callback: returns non-zero to abort blocking I/O.
  * Checks both the per-stream running flag and the global running flag
@@ -21,35 +63,167 @@ ffmpeg_interrupt_cb(void *opaque)
 }
 
 /*
- * Custom AVIO write callback: writes encoded data to a pipe fd.
+ * Output sink for tsout: writes the coalesced output to the pipe fd.
  */
 static int
-avio_write_pipe(void *opaque, const uint8_t *buf, int buf_size)
+write_pipev(void *opaque, const struct iovec *iov, int iovcnt)
 {
 	media_ctx_t	*ctx = opaque;
-	int		 total = 0;
+	struct iovec	 v[2];
+	size_t		 total = 0;
 	ssize_t		 n;
 	struct pollfd	 pfd;
+	int64_t		 t0 = 0, blocked;
+	int		 i = 0;
 
+	if (iovcnt > 2)
+		return AVERROR(EINVAL);
+	memcpy(v, iov, iovcnt * sizeof(*iov));
 	pfd.fd = ctx->pipe_wr;
 	pfd.events = POLLOUT;
 
-	while (total < buf_size) {
-		if (!ctx->running)
+	if (ctx->adaptive || ctx->governed)
+		t0 = av_gettime_relative();
+	if (ctx->ring != NULL) {
+		/* The data socket only tells whether the server is there */
+		for (i = 0; i < iovcnt; i++)
+			total += iov[i].iov_len;
+		if ((n = shmring_write(ctx->ring, iov, iovcnt,
+		    &ctx->running, ctx->pipe_wr)) < 0) {
+			ctx->cache_fd = -1;
+			return AVERROR(-n);
+		}
+		i = iovcnt;
+	}
+	for (; i < iovcnt; ) {
+		if (!ctx->running) {
+			ctx->cache_fd = -1;
 			return AVERROR(EINTR);
+		}
 
 		if (poll(&pfd, 1, 100) == 0)
 			continue;
 
-		n = write(ctx->pipe_wr, buf + total, buf_size - total);
+		n = writev(ctx->pipe_wr, v + i, iovcnt - i);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
+			/* Later output is dropped, the tee would be short */
+			ctx->cache_fd = -1;
 			return AVERROR(errno);
 		}
 		total += n;
+		/* Skip what was written */
+		for (; i < iovcnt && (size_t)n >= v[i].iov_len; i++)
+			n -= v[i].iov_len;
+		if (i < iovcnt) {
+			v[i].iov_base = (uint8_t *)v[i].iov_base + n;
+			v[i].iov_len -= n;
+		}
+	}
+	if (ctx->adaptive || ctx->governed) {
+		blocked = av_gettime_relative() - t0;
+		ctx->write_us += blocked;
+		if (ctx->adaptive)
+			abr_note_write(&ctx->abr, total, blocked,
+			    ctx->ring != NULL ? shmring_fill_pct(ctx->ring) :
+			    abr_queue_pct(ctx->pipe_wr));
+	}
+	return 0;
+}
+
+/*
+ * Hand output to the coalescing layer in front of the pipe fd, and tee
+ * it into the transcode cache.  Returns 0 or an AVERROR.
+ */
+static int
+write_out(media_ctx_t *ctx, const uint8_t *buf, int len)
+{
+	/* Give up on the cache on short writes */
+	if (ctx->cache_fd >= 0 && len > 0 &&
+	    write(ctx->cache_fd, buf, len) != len) {
+		DPRINTF("media: cache write failed, not caching\n");
+		ctx->cache_fd = -1;
+	}
+
+	if (!ctx->running) {
+		ctx->cache_fd = -1;
+		return AVERROR(EINTR);
+	}
+	return tsout_write(&ctx->out, buf, len, av_gettime_relative());
+}
+
+/*
+ * Custom AVIO write callback.  Behind a prefix the muxer output is
+ * spliced onto it, SPLICE_CHUNK bytes at a time.
+ */
+static int
+avio_write_pipe(void *opaque, const uint8_t *buf, int buf_size)
+{
+	media_ctx_t	*ctx = opaque;
+	uint8_t		 out[SPLICE_CHUNK + 188];
+	size_t		 n;
+	int		 off, take, ret;
+
+	if (ctx->splice == NULL) {
+		ret = write_out(ctx, buf, buf_size);
+		return ret < 0 ? ret : buf_size;
+	}
+	for (off = 0; off < buf_size; off += take) {
+		take = buf_size - off;
+		if (take > SPLICE_CHUNK)
+			take = SPLICE_CHUNK;
+		n = splice_feed(ctx->splice, buf + off, take, out);
+		if (n > 0 && (ret = write_out(ctx, out, (int)n)) < 0)
+			return ret;
+	}
+	return buf_size;
+}
+
+/*
+ * Start m as a context for filepath with every setting of the template
+ * tmpl (continuous, profile, threads, shm, read-ahead ...).  Only what
+ * belongs to one stream is reset; tmpl holds settings, no open input.
+ */
+void
+media_from_template(media_ctx_t *m, const media_ctx_t *tmpl,
+    const char *filepath)
+{
+	*m = *tmpl;
+	m->mode = MODE_FILE;
+	m->filepath = filepath;
+	m->running = 1;
+	m->pipe_rd = -1;
+	m->pipe_wr = -1;
+	m->ctrl_fd = -1;
+	m->cache_fd = -1;
+	m->prefix = NULL;
+	m->prefix_len = 0;
+	m->splice = NULL;
+}
+
+/*
+ * Send data (owned, free()d) ahead of the next transcode.  It comes
+ * from a muxer of its own, so both go through one splice: continuity
+ * counters and PAT/PMT versions go on across the seam and the first PCR
+ * behind it is flagged as a discontinuity.  Returns 0, or -1 with data
+ * freed if there is no memory for the splice.
+ */
+int
+media_set_prefix(media_ctx_t *ctx, uint8_t *data, size_t len)
+{
+	free(ctx->prefix);
+	ctx->prefix = NULL;
+	ctx->prefix_len = 0;
+	if (ctx->splice == NULL &&
+	    (ctx->splice = malloc(sizeof(*ctx->splice))) == NULL) {
+		free(data);
+		return -1;
 	}
-	return total;
+	splice_init(ctx->splice);
+	ctx->prefix = data;
+	ctx->prefix_len = len;
+	return 0;
 }
 
 /*
@@ -437,48 +611,286 @@ media_analyze(media_ctx_t *ctx, AVFormatContext *fmt, int force_transcode)
 }
 
 /*
- * Probe a media file to determine codecs and whether transcoding is needed.
+ * Stream info is read from a small start of the input first, and from
+ * more of it only if that leaves the streams we use incomplete, up to
+ * FFmpeg's defaults.
  */
-int
-media_probe(media_ctx_t *ctx, const char *filepath, int force_transcode)
+static const struct {
+	int64_t		 bytes;		/* probesize, 0 = default */
+	int64_t		 usec;		/* max_analyze_duration */
+} media_probe_steps[] = {
+	{ 256 * 1024,		 500000 },
+	{ 2 * 1024 * 1024,	2000000 },
+	{ 0,			      0 }
+};
+
+#define MEDIA_PROBE_STEPS \
+	(int)(sizeof(media_probe_steps) / sizeof(media_probe_steps[0]))
+
+/*
+ * Whether every program of fmt lists its streams, as an MPEG-TS does
+ * once its PMTs were read.
+ */
+static int
+media_probe_listed(const AVFormatContext *fmt)
 {
-	AVFormatContext		*fmt = NULL;
-	int			 ret;
+	unsigned int	 i;
 
-	fmt = avformat_alloc_context();
-	if (fmt == NULL)
+	if (fmt->nb_programs == 0)
+		return 0;
+	for (i = 0; i < fmt->nb_programs; i++)
+		if (fmt->programs[i]->nb_stream_indexes == 0)
+			return 0;
+	return 1;
+}
+
+/*
+ * Whether the streams media_analyze() picked have all the codec
+ * parameters decoding and muxing them takes.  prev_streams is the
+ * stream count of the try before, -1 on the first.
+ */
+static int
+media_probe_complete(const media_ctx_t *ctx, AVFormatContext *fmt,
+    int prev_streams)
+{
+	AVCodecParameters	*par;
+
+	if (ctx->video_idx < 0 && ctx->audio_idx < 0)
+		return 0;
+	/*
+	 * Without a header, a stream may only show up later: unless the
+	 * PMT listed them all or reading more found none, wait for both
+	 * kinds.
+	 */
+	if ((fmt->ctx_flags & AVFMTCTX_NOHEADER) &&
+	    (ctx->video_idx < 0 || ctx->audio_idx < 0) &&
+	    !media_probe_listed(fmt) &&
+	    (int)fmt->nb_streams != prev_streams)
+		return 0;
+	if (ctx->video_idx >= 0) {
+		par = fmt->streams[ctx->video_idx]->codecpar;
+		if (par->codec_id == AV_CODEC_ID_NONE || par->width <= 0 ||
+		    par->height <= 0 || par->format < 0 ||
+		    av_guess_frame_rate(fmt, fmt->streams[ctx->video_idx],
+		    NULL).num == 0)
+			return 0;
+	}
+	if (ctx->audio_idx >= 0) {
+		par = fmt->streams[ctx->audio_idx]->codecpar;
+		if (par->codec_id == AV_CODEC_ID_NONE ||
+		    par->sample_rate <= 0 || par->ch_layout.nb_channels <= 0 ||
+		    par->format < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read-ahead of network inputs: the demuxer reads from a ring that a
+ * thread of readahead.c fills from the real input.
+ */
+static int
+media_ra_interrupt(void *opaque)
+{
+	readahead_t	*ra = opaque;
+
+	return !ra->run || !running;
+}
+
+static int
+media_ra_read(void *opaque, uint8_t *buf, int size)
+{
+	int	 n;
+
+	n = avio_read_partial(opaque, buf, size);
+	return n == AVERROR_EOF ? 0 : n;
+}
+
+static int
+media_ra_seek(void *opaque, int64_t off)
+{
+	return avio_seek(opaque, off, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int
+media_ra_packet(void *opaque, uint8_t *buf, int size)
+{
+	int	 n;
+
+	n = readahead_read(opaque, buf, size);
+	return n == 0 ? AVERROR_EOF : n;
+}
+
+static int64_t
+media_ra_seek_packet(void *opaque, int64_t off, int whence)
+{
+	readahead_t	*ra = opaque;
+
+	if (whence & AVSEEK_SIZE)
+		return ra->src.size >= 0 ? ra->src.size : AVERROR(ENOSYS);
+	off = readahead_seek(ra, off, whence & ~AVSEEK_FORCE);
+	return off < 0 ? AVERROR(EIO) : off;
+}
+
+static void
+media_readahead_close(media_ctx_t *ctx)
+{
+	AVIOContext	*io;
+
+	if (ctx->avio_in != NULL) {
+		av_free(ctx->avio_in->buffer);
+		avio_context_free(&ctx->avio_in);
+	}
+	if (ctx->ra == NULL)
+		return;
+	io = ctx->ra->src.opaque;
+	readahead_close(ctx->ra);
+	ctx->ra = NULL;
+	avio_closep(&io);
+}
+
+/*
+ * Open url behind a read-ahead ring into ctx->avio_in, if it is a
+ * plain HTTP input: local files are read fast enough, and playlists
+ * (HLS, DASH) open their segments themselves.  Returns 0, or -1 if the
+ * input is to be opened as usual.
+ */
+static int
+media_readahead_open(media_ctx_t *ctx, const char *url)
+{
+	AVIOInterruptCB	 cb;
+	AVIOContext	*io = NULL;
+	readahead_src_t	 src;
+	uint8_t		*buf;
+
+	if (ctx->readahead_mb <= 0 || (strncmp(url, "http://", 7) != 0 &&
+	    strncmp(url, "https://", 8) != 0) ||
+	    strstr(url, ".m3u8") != NULL || strstr(url, ".mpd") != NULL)
 		return -1;
-	fmt->interrupt_callback.callback = ffmpeg_interrupt_cb;
-	fmt->interrupt_callback.opaque = ctx;
 
-	ret = avformat_open_input(&fmt, filepath, NULL, NULL);
-	if (ret < 0) {
-		/* fmt was freed by avformat_open_input on failure */
-		if (running)
-			fprintf(stderr, "Cannot open %s: %s\n", filepath,
-			    av_err2str(ret));
+	ctx->ra = readahead_new((size_t)ctx->readahead_mb << 20,
+	    ctx->readahead_low, ctx->readahead_high);
+	if (ctx->ra == NULL)
+		return -1;
+	cb.callback = media_ra_interrupt;
+	cb.opaque = ctx->ra;
+	if (avio_open2(&io, url, AVIO_FLAG_READ, &cb, NULL) < 0) {
+		readahead_close(ctx->ra);
+		ctx->ra = NULL;
+		return -1;
+	}
+	src.read = media_ra_read;
+	src.seek = io->seekable ? media_ra_seek : NULL;
+	src.opaque = io;
+	src.size = avio_size(io);
+	src.interrupt = ffmpeg_interrupt_cb;
+	src.interrupt_arg = ctx;
+	if (readahead_start(ctx->ra, &src) < 0) {
+		readahead_close(ctx->ra);
+		ctx->ra = NULL;
+		avio_closep(&io);
 		return -1;
 	}
 
-	ret = avformat_find_stream_info(fmt, NULL);
-	if (ret < 0) {
-		if (running)
-			fprintf(stderr, "Cannot find stream info: %s\n",
-			    av_err2str(ret));
-		avformat_close_input(&fmt);
+	if ((buf = av_malloc(SEND2TV_BUF_SIZE)) != NULL)
+		ctx->avio_in = avio_alloc_context(buf, SEND2TV_BUF_SIZE, 0,
+		    ctx->ra, media_ra_packet, NULL, media_ra_seek_packet);
+	if (ctx->avio_in == NULL) {
+		av_free(buf);
+		media_readahead_close(ctx);
 		return -1;
 	}
+	/* Unseekable, it can still go back to what the ring holds */
+	ctx->avio_in->seekable = src.seek != NULL ? AVIO_SEEKABLE_NORMAL : 0;
+	return 0;
+}
+
+/*
+ * Probe a media file to determine codecs and whether transcoding is needed.
+ */
+int
+media_probe(media_ctx_t *ctx, const char *filepath, int force_transcode)
+{
+	AVFormatContext		*fmt = NULL;
+	int64_t			 bytes = 0, from;
+	int			 ret, step, last, streams = -1;
+
+	media_readahead_open(ctx, filepath);
+	step = ctx->full_probe ? MEDIA_PROBE_STEPS - 1 : 0;
+	ctx->probe_tries = 0;
+	for (;; step++) {
+		last = step == MEDIA_PROBE_STEPS - 1;
+		ctx->probe_tries++;
+		fmt = avformat_alloc_context();
+		if (fmt == NULL)
+			goto fail;
+		fmt->interrupt_callback.callback = ffmpeg_interrupt_cb;
+		fmt->interrupt_callback.opaque = ctx;
+		if (media_probe_steps[step].bytes > 0) {
+			fmt->probesize = media_probe_steps[step].bytes;
+			fmt->max_analyze_duration =
+			    media_probe_steps[step].usec;
+		}
+		/* Another try starts over; the ring likely still has it */
+		if (ctx->avio_in != NULL &&
+		    avio_seek(ctx->avio_in, 0, SEEK_SET) < 0) {
+			media_readahead_close(ctx);
+			media_readahead_open(ctx, filepath);
+		}
+		from = 0;
+		if (ctx->avio_in != NULL) {
+			fmt->pb = ctx->avio_in;
+			fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+			from = ctx->avio_in->bytes_read;
+		}
+
+		ret = avformat_open_input(&fmt, filepath, NULL, NULL);
+		if (ret < 0) {
+			/* fmt was freed by avformat_open_input on failure */
+			if (running)
+				fprintf(stderr, "Cannot open %s: %s\n",
+				    filepath, av_err2str(ret));
+			goto fail;
+		}
+
+		ret = avformat_find_stream_info(fmt, NULL);
+		if (fmt->pb != NULL)
+			bytes += fmt->pb->bytes_read - from;
+		if (ret < 0 && last) {
+			if (running)
+				fprintf(stderr, "Cannot find stream info: %s\n",
+				    av_err2str(ret));
+			avformat_close_input(&fmt);
+			goto fail;
+		}
 
-	if (media_analyze(ctx, fmt, force_transcode) < 0) {
+		if (ret >= 0 && media_analyze(ctx, fmt, force_transcode) < 0) {
+			avformat_close_input(&fmt);
+			goto fail;
+		}
+		if (ret >= 0 && (last ||
+		    media_probe_complete(ctx, fmt, streams)))
+			break;
+		streams = ret >= 0 ? (int)fmt->nb_streams : -1;
+		DPRINTF("media: stream info incomplete after %lld bytes, "
+		    "probing further\n", (long long)bytes);
 		avformat_close_input(&fmt);
-		return -1;
+		if (!running)
+			goto fail;
 	}
+	ctx->probe_bytes = bytes;
+	DPRINTF("media: probed in %d tries, %lld bytes\n", ctx->probe_tries,
+	    (long long)bytes);
 
 	/* Always keep format context open (client mode may remux even for
 	 * passthrough files). */
 	ctx->ifmt_ctx = fmt;
 
 	return 0;
+
+fail:
+	media_readahead_close(ctx);
+	return -1;
 }
 
 /*
@@ -533,9 +945,12 @@ init_vaapi(media_ctx_t *ctx)
 
 /*
  * Set up the video filter graph for VAAPI encoding:
- *   format=nv12,hwupload,scale_vaapi=format=nv12
+ *   format=nv12,hwupload,scale_vaapi=[w=W:h=H:]format=nv12
  * For software fallback:
- *   format=yuv420p
+ *   [scale=W:H,]format=yuv420p
+ * The scale to ctx->scale_width x ctx->scale_height is only inserted
+ * when set.  The graph slice-threads its stages on all cores unless
+ * ctx->threads limits it.
  */
 static int
 init_video_filters(media_ctx_t *ctx, int width, int height,
@@ -549,6 +964,9 @@ init_video_filters(media_ctx_t *ctx, int width, int height,
 	ctx->filter_graph = avfilter_graph_alloc();
 	if (ctx->filter_graph == NULL)
 		return -1;
+	/* Must be set before the first filter is created */
+	if (ctx->threads > 0)
+		ctx->filter_graph->nb_threads = ctx->threads;
 
 	buffersrc = avfilter_get_by_name("buffer");
 	buffersink = avfilter_get_by_name("buffersink");
@@ -580,7 +998,7 @@ init_video_filters(media_ctx_t *ctx, int width, int height,
 			goto fail;
 
 		DPRINTF("media: filter graph: "
-		    "format=nv12,hwupload,scale_vaapi=format=nv12\n");
+		    "format=nv12,hwupload,scale_vaapi\n");
 
 		/*
 		 * Build VAAPI filter chain manually so we can set
@@ -610,7 +1028,12 @@ init_video_filters(media_ctx_t *ctx, int width, int height,
 		ret = avfilter_init_str(hwup_ctx, NULL);
 		if (ret < 0)
 			goto fail;
-		ret = avfilter_init_str(scale_ctx, "format=nv12");
+		if (ctx->scale_height > 0)
+			snprintf(args, sizeof(args), "w=%d:h=%d:format=nv12",
+			    ctx->scale_width, ctx->scale_height);
+		else
+			strlcpy(args, "format=nv12", sizeof(args));
+		ret = avfilter_init_str(scale_ctx, args);
 		if (ret < 0)
 			goto fail;
 
@@ -630,7 +1053,13 @@ init_video_filters(media_ctx_t *ctx, int width, int height,
 	} else {
 		AVFilterInOut *inputs, *outputs;
 
-		DPRINTF("media: filter graph: format=yuv420p\n");
+		if (ctx->scale_height > 0)
+			snprintf(args, sizeof(args),
+			    "scale=%d:%d,format=yuv420p", ctx->scale_width,
+			    ctx->scale_height);
+		else
+			strlcpy(args, "format=yuv420p", sizeof(args));
+		DPRINTF("media: filter graph: %s\n", args);
 
 		inputs = avfilter_inout_alloc();
 		outputs = avfilter_inout_alloc();
@@ -651,7 +1080,7 @@ init_video_filters(media_ctx_t *ctx, int width, int height,
 		inputs->next = NULL;
 
 		ret = avfilter_graph_parse_ptr(ctx->filter_graph,
-		    "format=yuv420p", &inputs, &outputs, NULL);
+		    args, &inputs, &outputs, NULL);
 		avfilter_inout_free(&inputs);
 		avfilter_inout_free(&outputs);
 		if (ret < 0)
@@ -671,11 +1100,58 @@ fail:
 }
 
 /*
- * Set up the output muxer writing MPEG-TS to a pipe.
+ * Size the kernel buffer between us and the reader of fd: the pipe to
+ * the HTTP server, or the data socket in client mode.
+ */
+static void
+set_pipe_size(int fd, int bytes)
+{
+	struct stat	 st;
+
+	if (bytes <= 0 || fstat(fd, &st) < 0)
+		return;
+	if (S_ISFIFO(st.st_mode)) {
+#ifdef F_SETPIPE_SZ
+		if (fcntl(fd, F_SETPIPE_SZ, bytes) < 0)
+			DPRINTF("media: F_SETPIPE_SZ %d: %s\n", bytes,
+			    strerror(errno));
+#endif
+	} else if (S_ISSOCK(st.st_mode))
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+}
+
+/*
+ * Move the output to a shared-memory ring if the pipe is the Unix data
+ * socket to the server (client mode).  Sized like the pipe buffer of
+ * the profile.  Failing that, the socket is used.
+ */
+static void
+offer_ring(media_ctx_t *ctx, const profile_t *prof)
+{
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen = sizeof(ss);
+
+	if (getsockname(ctx->pipe_wr, (struct sockaddr *)&ss, &sslen) < 0 ||
+	    ss.ss_family != AF_UNIX)
+		return;
+	ctx->ring = shmring_create(prof->pipe_size > 0 ? prof->pipe_size :
+	    SHMRING_SIZE);
+	if (ctx->ring != NULL && shmring_send(ctx->ring, ctx->pipe_wr) < 0) {
+		shmring_free(ctx->ring);
+		ctx->ring = NULL;
+	}
+	if (ctx->ring == NULL)
+		DPRINTF("media: no shared memory ring, using the socket\n");
+}
+
+/*
+ * Create the MPEG-TS muxer writing to the pipe (created if the caller
+ * did not connect one), buffered as the profile says.
  */
 static int
-init_output(media_ctx_t *ctx, int has_video, int has_audio)
+open_output_muxer(media_ctx_t *ctx)
 {
+	const profile_t	*prof = media_profile(ctx);
 	int		 pipefd[2];
 	uint8_t		*avio_buf;
 	AVIOContext	*avio;
@@ -691,6 +1167,13 @@ init_output(media_ctx_t *ctx, int has_video, int has_audio)
 		DPRINTF("media: output pipe created (rd=%d, wr=%d)\n",
 		    ctx->pipe_rd, ctx->pipe_wr);
 	}
+	set_pipe_size(ctx->pipe_wr, prof->pipe_size);
+	if (ctx->use_shm && ctx->ring == NULL)
+		offer_ring(ctx, prof);
+	tsout_free(&ctx->out);
+	if (tsout_init(&ctx->out, prof->coalesce_pkts, prof->coalesce_us,
+	    write_pipev, ctx) < 0)
+		return -1;
 
 	ret = avformat_alloc_output_context2(&ctx->ofmt_ctx, NULL,
 	    "mpegts", NULL);
@@ -700,20 +1183,23 @@ init_output(media_ctx_t *ctx, int has_video, int has_audio)
 		return -1;
 	}
 
-	/* Reduce muxer latency: flush after each packet, no delay */
-	ctx->ofmt_ctx->flush_packets = 1;
+	/*
+	 * Reduce muxer latency: no delay, and unless the profile batches,
+	 * flush after each packet.  The muxer writes PAT/PMT first and
+	 * again in front of every video keyframe; the stream starts on a
+	 * keyframe (see video_started), so the TV can lock on from the
+	 * first packets.
+	 */
+	ctx->ofmt_ctx->flush_packets = prof->flush_packets;
 	ctx->ofmt_ctx->max_delay = 0;
-	ctx->ofmt_ctx->max_interleave_delta = 0;
-	/* Resend PAT/PMT and codec params so the TV can lock on faster */
-	av_opt_set(ctx->ofmt_ctx->priv_data, "mpegts_flags",
-	    "+resend_headers", AV_OPT_SEARCH_CHILDREN);
+	ctx->ofmt_ctx->max_interleave_delta = prof->interleave_us;
 
 	/* Custom AVIO writing to the pipe */
-	avio_buf = av_malloc(SEND2TV_AVIO_SIZE);
+	avio_buf = av_malloc(prof->avio_size);
 	if (avio_buf == NULL)
 		return -1;
 
-	avio = avio_alloc_context(avio_buf, SEND2TV_AVIO_SIZE, 1,
+	avio = avio_alloc_context(avio_buf, prof->avio_size, 1,
 	    ctx, NULL, avio_write_pipe, NULL);
 	if (avio == NULL) {
 		av_free(avio_buf);
@@ -722,6 +1208,18 @@ init_output(media_ctx_t *ctx, int has_video, int has_audio)
 
 	ctx->ofmt_ctx->pb = avio;
 	ctx->ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	DPRINTF("media: profile %s\n", prof->name);
+	return 0;
+}
+
+/*
+ * Set up the output muxer writing MPEG-TS to a pipe.
+ */
+static int
+init_output(media_ctx_t *ctx, int has_video, int has_audio)
+{
+	if (open_output_muxer(ctx) < 0)
+		return -1;
 
 	/* Add video output stream */
 	if (has_video && ctx->video_enc != NULL) {
@@ -759,44 +1257,10 @@ init_output(media_ctx_t *ctx, int has_video, int has_audio)
 static int
 init_output_remux(media_ctx_t *ctx)
 {
-	int		 pipefd[2];
-	uint8_t		*avio_buf;
-	AVIOContext	*avio;
 	int		 ret;
 
-	if (ctx->pipe_wr < 0) {
-		if (pipe(pipefd) < 0) {
-			perror("pipe");
-			return -1;
-		}
-		ctx->pipe_rd = pipefd[0];
-		ctx->pipe_wr = pipefd[1];
-	}
-
-	ret = avformat_alloc_output_context2(&ctx->ofmt_ctx, NULL,
-	    "mpegts", NULL);
-	if (ret < 0) {
-		fprintf(stderr, "Cannot create output context: %s\n",
-		    av_err2str(ret));
-		return -1;
-	}
-	ctx->ofmt_ctx->flush_packets = 1;
-	ctx->ofmt_ctx->max_delay = 0;
-	ctx->ofmt_ctx->max_interleave_delta = 0;
-	av_opt_set(ctx->ofmt_ctx->priv_data, "mpegts_flags",
-	    "+resend_headers", AV_OPT_SEARCH_CHILDREN);
-
-	avio_buf = av_malloc(SEND2TV_AVIO_SIZE);
-	if (avio_buf == NULL)
+	if (open_output_muxer(ctx) < 0)
 		return -1;
-	avio = avio_alloc_context(avio_buf, SEND2TV_AVIO_SIZE, 1,
-	    ctx, NULL, avio_write_pipe, NULL);
-	if (avio == NULL) {
-		av_free(avio_buf);
-		return -1;
-	}
-	ctx->ofmt_ctx->pb = avio;
-	ctx->ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
 
 	if (ctx->video_idx >= 0) {
 		AVStream *in_st = ctx->ifmt_ctx->streams[ctx->video_idx];
@@ -839,6 +1303,75 @@ media_open_remux(media_ctx_t *ctx)
 	return 0;
 }
 
+/*
+ * Hold back the start of a remuxed stream until the first video
+ * keyframe: video before it is dropped, audio is held and, once the
+ * keyframe is written, what plays from the keyframe on is written after
+ * it.  A seek lands anywhere, and a TV given a stream that starts
+ * mid-GOP shows nothing or garbage until the next keyframe.  Some
+ * streams never flag one (intra refresh, recovery points, an MP4 with a
+ * single sync sample): after VIDEO_HOLD_PKTS packets or VIDEO_HOLD_US
+ * the stream starts anyway.  pkt is in output timestamps.  Returns 1 if
+ * pkt was consumed.
+ */
+static int
+remux_hold(media_ctx_t *ctx, AVPacket *pkt, int vid_out, int aud_out)
+{
+	AVRational	 vtb, atb;
+	int64_t		 key;
+	int		 i;
+
+	if (ctx->video_started || vid_out < 0)
+		return 0;
+
+	if (pkt->stream_index == aud_out) {
+		if (ctx->nheld == AUDIO_HOLD) {
+			/* Keep the newest */
+			av_packet_free(&ctx->held[0]);
+			memmove(ctx->held, ctx->held + 1,
+			    (AUDIO_HOLD - 1) * sizeof(ctx->held[0]));
+			ctx->nheld--;
+		}
+		if ((ctx->held[ctx->nheld] = av_packet_clone(pkt)) != NULL)
+			ctx->nheld++;
+		av_packet_unref(pkt);
+		return 1;
+	}
+	key = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	vtb = ctx->ofmt_ctx->streams[vid_out]->time_base;
+	if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+		if (ctx->video_dropped++ == 0)
+			ctx->video_drop_ts = key;
+		if (ctx->video_dropped < VIDEO_HOLD_PKTS &&
+		    (key == AV_NOPTS_VALUE ||
+		    ctx->video_drop_ts == AV_NOPTS_VALUE ||
+		    av_rescale_q(key - ctx->video_drop_ts, vtb,
+		    AV_TIME_BASE_Q) < VIDEO_HOLD_US)) {
+			av_packet_unref(pkt);
+			return 1;
+		}
+		DPRINTF("remux: no keyframe in %d packets, starting "
+		    "anyway\n", ctx->video_dropped);
+	}
+
+	ctx->video_started = 1;
+	if (av_interleaved_write_frame(ctx->ofmt_ctx, pkt) < 0)
+		return -1;
+	for (i = 0; i < ctx->nheld; i++) {
+		atb = ctx->ofmt_ctx->streams[aud_out]->time_base;
+		if (key == AV_NOPTS_VALUE ||
+		    ctx->held[i]->pts == AV_NOPTS_VALUE ||
+		    av_compare_ts(ctx->held[i]->pts, atb, key, vtb) >= 0)
+			av_interleaved_write_frame(ctx->ofmt_ctx,
+			    ctx->held[i]);
+		av_packet_free(&ctx->held[i]);
+	}
+	ctx->nheld = 0;
+	DPRINTF("remux: starting at %.3fs\n",
+	    key == AV_NOPTS_VALUE ? 0.0 : key * av_q2d(vtb));
+	return 1;
+}
+
 void *
 media_remux_thread(void *arg)
 {
@@ -881,22 +1414,31 @@ media_remux_thread(void *arg)
 			    out_st->time_base);
 			pkt->stream_index = dst;
 			pkt->pos = -1;
-			if (av_interleaved_write_frame(ctx->ofmt_ctx,
-			    pkt) < 0)
+			ret = remux_hold(ctx, pkt, vid_out, aud_out);
+			if (ret < 0)
+				break;
+			if (ret == 0 && av_interleaved_write_frame(
+			    ctx->ofmt_ctx, pkt) < 0)
 				break;
+			tsout_tick(&ctx->out, av_gettime_relative());
 		} else {
 			av_packet_unref(pkt);
 		}
+		if (ctx->ra != NULL)
+			readahead_report(ctx->ra);
 	}
 
 	av_write_trailer(ctx->ofmt_ctx);
+	tsout_flush(&ctx->out);
 
 	/*
 	 * On natural stream end (not aborted by seek/quit), notify the server
 	 * to stop TV playback before the data socket closes so the TV
-	 * receives Stop before seeing the HTTP stream EOF.
+	 * receives Stop before seeing the HTTP stream EOF.  A continuous
+	 * stream, or one with the next item queued, goes on instead.
 	 */
-	if (ctx->running && running && ctx->ctrl_fd >= 0)
+	if (ctx->running && running && ctx->ctrl_fd >= 0 &&
+	    !ctx->continuous && !ctx->queue_next)
 		write(ctx->ctrl_fd, "STOP\n", 5);
 
 	if (ctx->pipe_wr >= 0) {
@@ -908,6 +1450,16 @@ media_remux_thread(void *arg)
 	return NULL;
 }
 
+/*
+ * VBV buffer size in bits for kbps: one second, or LOWLAT_VBV_MS in
+ * low-latency mode so that no frame can take long to send.
+ */
+static int
+vbv_bits(const media_ctx_t *ctx, int kbps)
+{
+	return kbps * (ctx->low_latency ? LOWLAT_VBV_MS : 1000);
+}
+
 /*
  * Set up video encoder (VAAPI or software fallback).
  * Supports H.264 and HEVC based on ctx->vcodec.
@@ -917,7 +1469,7 @@ init_video_encoder(media_ctx_t *ctx, int width, int height,
     AVRational time_base, AVRational framerate, int use_vaapi)
 {
 	const AVCodec	*codec;
-	int		 ret;
+	int		 ret, kbps;
 	int		 is_hevc = (ctx->vcodec == VCODEC_HEVC);
 
 	if (use_vaapi)
@@ -949,6 +1501,20 @@ init_video_encoder(media_ctx_t *ctx, int width, int height,
 	ctx->video_enc->gop_size = framerate.num > 0 ?
 	    framerate.num / framerate.den : 30;
 	ctx->video_enc->max_b_frames = 0;
+	if (ctx->threads > 0)
+		ctx->video_enc->thread_count = ctx->threads;
+	if (media_profile(ctx)->thread_type != 0)
+		ctx->video_enc->thread_type = media_profile(ctx)->thread_type;
+	if (ctx->low_latency)
+		ctx->video_enc->slices = LOWLAT_SLICES;
+
+	/* Adaptive output keeps its current rate across restarts */
+	kbps = ctx->bitrate;
+	if (ctx->adaptive) {
+		if (ctx->abr.max_kbps == 0)
+			abr_init(&ctx->abr, ctx->bitrate);
+		kbps = ctx->abr.cur_kbps;
+	}
 
 	if (use_vaapi) {
 		AVBufferRef *hw_frames_ref;
@@ -977,9 +1543,9 @@ init_video_encoder(media_ctx_t *ctx, int width, int height,
 		ctx->video_enc->hw_frames_ctx =
 		    av_buffer_ref(hw_frames_ref);
 		av_buffer_unref(&hw_frames_ref);
-		ctx->video_enc->bit_rate = (int64_t)ctx->bitrate * 1000;
-		ctx->video_enc->rc_max_rate = (int64_t)ctx->bitrate * 1000;
-		ctx->video_enc->rc_buffer_size = ctx->bitrate * 1000;
+		ctx->video_enc->bit_rate = (int64_t)kbps * 1000;
+		ctx->video_enc->rc_max_rate = (int64_t)kbps * 1000;
+		ctx->video_enc->rc_buffer_size = vbv_bits(ctx, kbps);
 		if (is_hevc) {
 			ctx->video_enc->profile = AV_PROFILE_HEVC_MAIN;
 			ctx->video_enc->level = 153; /* Level 5.1 */
@@ -987,32 +1553,50 @@ init_video_encoder(media_ctx_t *ctx, int width, int height,
 			ctx->video_enc->profile = AV_PROFILE_H264_HIGH;
 			ctx->video_enc->level = 41;
 		}
-		/* Minimize hardware encoder pipeline depth */
+		/* Hardware encoder pipeline depth */
 		av_opt_set_int(ctx->video_enc->priv_data,
-		    "async_depth", 1, 0);
+		    "async_depth", media_profile(ctx)->async_depth, 0);
 	} else {
 		ctx->video_enc->pix_fmt = AV_PIX_FMT_YUV420P;
-		ctx->video_enc->bit_rate = (int64_t)ctx->bitrate * 1000;
-		ctx->video_enc->rc_max_rate = (int64_t)ctx->bitrate * 1000;
-		ctx->video_enc->rc_buffer_size = ctx->bitrate * 1000;
+		ctx->video_enc->bit_rate = (int64_t)kbps * 1000;
+		ctx->video_enc->rc_max_rate = (int64_t)kbps * 1000;
+		ctx->video_enc->rc_buffer_size = vbv_bits(ctx, kbps);
 		if (is_hevc) {
 			av_opt_set(ctx->video_enc->priv_data, "preset",
 			    "ultrafast", 0);
-			av_opt_set(ctx->video_enc->priv_data, "tune",
-			    "zerolatency", 0);
+			if (media_profile(ctx)->zerolatency)
+				av_opt_set(ctx->video_enc->priv_data, "tune",
+				    "zerolatency", 0);
+			if (ctx->low_latency)
+				av_opt_set(ctx->video_enc->priv_data,
+				    "x265-params", "intra-refresh=1", 0);
 		} else {
 			av_opt_set(ctx->video_enc->priv_data, "preset",
 			    "ultrafast", 0);
-			av_opt_set(ctx->video_enc->priv_data, "tune",
-			    "zerolatency", 0);
+			if (media_profile(ctx)->zerolatency)
+				av_opt_set(ctx->video_enc->priv_data, "tune",
+				    "zerolatency", 0);
 			av_opt_set(ctx->video_enc->priv_data, "refs",
 			    "1", 0);
 			av_opt_set(ctx->video_enc->priv_data, "nal-hrd",
 			    "cbr", 0);
+			/* A forced I frame is an IDR, see encode_video_frame() */
+			av_opt_set_int(ctx->video_enc->priv_data,
+			    "forced-idr", 1, 0);
 			ctx->video_enc->profile = AV_PROFILE_H264_HIGH;
 			ctx->video_enc->level = 41;
 			av_opt_set(ctx->video_enc->priv_data, "profile",
 			    "high", 0);
+			/*
+			 * A column of intra blocks sweeps the picture once
+			 * per GOP instead of an IDR every GOP.  The first
+			 * frame of each sweep is flagged as a keyframe and
+			 * carries SPS/PPS; the muxer puts PAT/PMT in front
+			 * of it, so the TV can join at any sweep.
+			 */
+			if (ctx->low_latency)
+				av_opt_set_int(ctx->video_enc->priv_data,
+				    "intra-refresh", 1, 0);
 		}
 	}
 
@@ -1062,6 +1646,8 @@ init_audio_encoder(media_ctx_t *ctx, int sample_rate, int channels)
 	}
 	ctx->audio_enc->bit_rate = channels * 64000; /* 64 kbps per channel */
 	ctx->audio_enc->time_base = (AVRational){1, sample_rate};
+	if (ctx->aac_fast)
+		av_opt_set(ctx->audio_enc->priv_data, "aac_coder", "fast", 0);
 
 	av_channel_layout_default(&ch_layout, channels);
 	av_channel_layout_copy(&ctx->audio_enc->ch_layout, &ch_layout);
@@ -1077,8 +1663,11 @@ init_audio_encoder(media_ctx_t *ctx, int sample_rate, int channels)
 	DPRINTF("media: audio encoder: %s, %dHz, %dch\n",
 	    codec->name, sample_rate, channels);
 
-	ctx->audio_fifo = av_audio_fifo_alloc(ctx->audio_enc->sample_fmt,
-	    channels, ctx->audio_enc->frame_size);
+	/* A reopened encoder keeps the samples already buffered */
+	if (ctx->audio_fifo == NULL)
+		ctx->audio_fifo = av_audio_fifo_alloc(
+		    ctx->audio_enc->sample_fmt, channels,
+		    ctx->audio_enc->frame_size);
 	if (ctx->audio_fifo == NULL) {
 		fprintf(stderr, "Cannot allocate audio FIFO\n");
 		return -1;
@@ -1127,6 +1716,13 @@ init_audio_resampler(media_ctx_t *ctx, AVCodecContext *dec)
 	if (ctx->has_channelmap)
 		swr_set_channel_mapping(ctx->swr_ctx, ctx->channelmap);
 
+	/* Capture: stretch or pad to the capture clock, see clock_audio() */
+	if (ctx->mode == MODE_SCREEN) {
+		av_opt_set_double(ctx->swr_ctx, "async", AUDIO_ASYNC, 0);
+		/* Soft compensation needs the resampler at equal rates */
+		av_opt_set_int(ctx->swr_ctx, "flags", SWR_FLAG_RESAMPLE, 0);
+	}
+
 	ret = swr_init(ctx->swr_ctx);
 	if (ret < 0) {
 		fprintf(stderr, "Cannot init resampler: %s\n",
@@ -1138,16 +1734,73 @@ init_audio_resampler(media_ctx_t *ctx, AVCodecContext *dec)
 }
 
 /*
- * Set up transcoding pipeline for a file.
- * Assumes media_probe() already opened ifmt_ctx and set needs_transcode.
+ * Largest output height worth spending kbps on.
  */
-int
-media_open_transcode(media_ctx_t *ctx)
+static int
+auto_max_height(int kbps)
 {
-	const AVCodec	*dec;
-	AVStream	*in_st;
-	int		 ret, use_vaapi;
-	int		 width, height;
+	static const struct {
+		int	 kbps;
+		int	 height;
+	} ladder[] = {
+		{  1000,  480 },
+		{  2500,  720 },
+		{  6000, 1080 },
+		{ 12000, 1440 },
+		{     0, 2160 }
+	};
+	int	 i;
+
+	for (i = 0; ladder[i].kbps != 0; i++)
+		if (kbps < ladder[i].kbps)
+			break;
+	return ladder[i].height;
+}
+
+/*
+ * Encoded size for a width x height source: within what the announced
+ * DLNA profile allows (AVC HD at level 4.1, HEVC up to UHD), within
+ * ctx->max_height, or for auto (0) within what the bitrate can carry.
+ * Never upscales; keeps the aspect ratio and even dimensions.
+ */
+static void
+output_size(const media_ctx_t *ctx, int width, int height, int *out_w,
+    int *out_h)
+{
+	int	 max_w, max_h;
+
+	max_h = ctx->vcodec == VCODEC_HEVC ? 2160 : 1080;
+	if (ctx->max_height > 0 && ctx->max_height < max_h)
+		max_h = ctx->max_height;
+	else if (ctx->max_height == 0 && auto_max_height(ctx->bitrate) < max_h)
+		max_h = auto_max_height(ctx->bitrate);
+	max_w = max_h * 16 / 9;
+
+	*out_w = width;
+	*out_h = height;
+	if (*out_h > max_h) {
+		*out_w = (int)((int64_t)*out_w * max_h / *out_h);
+		*out_h = max_h;
+	}
+	if (*out_w > max_w) {
+		*out_h = (int)((int64_t)*out_h * max_w / *out_w);
+		*out_w = max_w;
+	}
+	*out_w &= ~1;
+	*out_h &= ~1;
+}
+
+/*
+ * Set up transcoding pipeline for a file.
+ * Assumes media_probe() already opened ifmt_ctx and set needs_transcode.
+ */
+int
+media_open_transcode(media_ctx_t *ctx)
+{
+	const AVCodec	*dec;
+	AVStream	*in_st;
+	int		 ret, use_vaapi;
+	int		 width, height, out_w, out_h;
 	AVRational	 tb, fr;
 	enum AVPixelFormat pix_fmt;
 	int		 has_audio;
@@ -1169,6 +1822,11 @@ media_open_transcode(media_ctx_t *ctx)
 		ctx->video_dec = avcodec_alloc_context3(dec);
 		avcodec_parameters_to_context(ctx->video_dec,
 		    in_st->codecpar);
+		if (ctx->threads > 0)
+			ctx->video_dec->thread_count = ctx->threads;
+		if (media_profile(ctx)->thread_type != 0)
+			ctx->video_dec->thread_type =
+			    media_profile(ctx)->thread_type;
 		ret = avcodec_open2(ctx->video_dec, dec, NULL);
 		if (ret < 0) {
 			fprintf(stderr, "Cannot open video decoder: %s\n",
@@ -1206,6 +1864,17 @@ media_open_transcode(media_ctx_t *ctx)
 		}
 	}
 
+	/* Encode at the capped size, the filter graph scales */
+	if (ctx->video_idx >= 0) {
+		output_size(ctx, width, height, &out_w, &out_h);
+		if (out_w != width || out_h != height) {
+			DPRINTF("media: scaling %dx%d to %dx%d\n", width,
+			    height, out_w, out_h);
+			ctx->scale_width = out_w;
+			ctx->scale_height = out_h;
+		}
+	}
+
 	/* Init VAAPI */
 	use_vaapi = 0;
 	if (ctx->video_idx >= 0 && init_vaapi(ctx) == 0)
@@ -1213,7 +1882,7 @@ media_open_transcode(media_ctx_t *ctx)
 
 	/* Init video encoder */
 	if (ctx->video_idx >= 0) {
-		if (init_video_encoder(ctx, width, height,
+		if (init_video_encoder(ctx, out_w, out_h,
 		    (AVRational){1, fr.num / fr.den}, fr, use_vaapi) < 0) {
 			if (use_vaapi) {
 				/* Retry with software */
@@ -1221,7 +1890,7 @@ media_open_transcode(media_ctx_t *ctx)
 				    "trying software\n");
 				av_buffer_unref(&ctx->hw_device_ctx);
 				use_vaapi = 0;
-				if (init_video_encoder(ctx, width, height,
+				if (init_video_encoder(ctx, out_w, out_h,
 				    (AVRational){1, fr.num / fr.den}, fr,
 				    0) < 0)
 					return -1;
@@ -1241,7 +1910,7 @@ media_open_transcode(media_ctx_t *ctx)
 				avcodec_free_context(&ctx->video_enc);
 				av_buffer_unref(&ctx->hw_device_ctx);
 				use_vaapi = 0;
-				if (init_video_encoder(ctx, width, height,
+				if (init_video_encoder(ctx, out_w, out_h,
 				    (AVRational){1, fr.num / fr.den}, fr,
 				    0) < 0)
 					return -1;
@@ -1256,6 +1925,9 @@ media_open_transcode(media_ctx_t *ctx)
 		}
 	}
 
+	if (ctx->governed && ctx->video_idx >= 0 && !use_vaapi)
+		gov_init(&ctx->gov, out_w, out_h, fr.num, fr.den);
+
 	/* Init audio encoder */
 	if (has_audio) {
 		if (init_audio_encoder(ctx,
@@ -1276,20 +1948,17 @@ media_open_transcode(media_ctx_t *ctx)
 }
 
 /*
- * Set up screen + sndio audio capture.
+ * Open the screen through x11grab, the fallback when the native grabber
+ * is not available.
  */
-int
-media_open_screen(media_ctx_t *ctx)
+static int
+open_x11grab(media_ctx_t *ctx)
 {
-	const AVInputFormat	*x11grab_fmt, *sndio_fmt;
+	const AVInputFormat	*x11grab_fmt;
 	AVDictionary		*opts = NULL;
 	const AVCodec		*dec;
 	AVStream		*st;
-	int			 ret, use_vaapi;
-	int			 width, height;
-	AVRational		 fr = {30, 1};
-
-	avdevice_register_all();
+	int			 ret;
 
 	/* Open X11 screen capture */
 	x11grab_fmt = av_find_input_format("x11grab");
@@ -1328,10 +1997,6 @@ media_open_screen(media_ctx_t *ctx)
 
 	ctx->video_idx = 0;
 	st = ctx->ifmt_ctx->streams[0];
-	width = st->codecpar->width;
-	height = st->codecpar->height;
-
-	DPRINTF("media: screen capture %dx%d\n", width, height);
 
 	/* Open x11grab decoder */
 	dec = avcodec_find_decoder(st->codecpar->codec_id);
@@ -1347,6 +2012,45 @@ media_open_screen(media_ctx_t *ctx)
 		    av_err2str(ret));
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Set up screen + sndio audio capture.
+ */
+int
+media_open_screen(media_ctx_t *ctx)
+{
+	const AVInputFormat	*sndio_fmt;
+	AVDictionary		*opts = NULL;
+	const AVCodec		*dec;
+	AVStream		*st;
+	int			 ret, use_vaapi;
+	int			 width, height, out_w, out_h;
+	AVRational		 fr = {30, 1}, in_tb = {1, 30};
+	enum AVPixelFormat	 in_fmt = AV_PIX_FMT_BGR0;
+	enum AVColorSpace	 in_space = AVCOL_SPC_UNSPECIFIED;
+	enum AVColorRange	 in_range = AVCOL_RANGE_UNSPECIFIED;
+
+	avdevice_register_all();
+
+	/* The native grabber knows the geometry without probing */
+	ctx->xshm = xshm_open(":0.0", fr.num / fr.den, 1);
+	if (ctx->xshm != NULL) {
+		ctx->video_idx = 0;
+		xshm_size(ctx->xshm, &width, &height);
+	} else {
+		if (open_x11grab(ctx) < 0)
+			return -1;
+		width = ctx->video_dec->width;
+		height = ctx->video_dec->height;
+		in_tb = ctx->ifmt_ctx->streams[0]->time_base;
+		in_fmt = ctx->video_dec->pix_fmt;
+		in_space = ctx->video_dec->colorspace;
+		in_range = ctx->video_dec->color_range;
+	}
+
+	DPRINTF("media: screen capture %dx%d\n", width, height);
 
 	/* Open sndio audio capture (monitor device) */
 	sndio_fmt = av_find_input_format("sndio");
@@ -1418,20 +2122,29 @@ media_open_screen(media_ctx_t *ctx)
 	    ctx->sndio_device ? ctx->sndio_device : "snd/default.mon",
 	    ctx->sndio_ctx ? "active" : "unavailable");
 
+	/* HiDPI screens are encoded at the capped size */
+	output_size(ctx, width, height, &out_w, &out_h);
+	if (out_w != width || out_h != height) {
+		DPRINTF("media: scaling %dx%d to %dx%d\n", width, height,
+		    out_w, out_h);
+		ctx->scale_width = out_w;
+		ctx->scale_height = out_h;
+	}
+
 	/* Init VAAPI */
 	use_vaapi = 0;
 	if (init_vaapi(ctx) == 0)
 		use_vaapi = 1;
 
 	/* Init video encoder */
-	if (init_video_encoder(ctx, width, height,
+	if (init_video_encoder(ctx, out_w, out_h,
 	    (AVRational){1, 30}, fr, use_vaapi) < 0) {
 		if (use_vaapi) {
 			fprintf(stderr, "VAAPI encoder failed, "
 			    "trying software\n");
 			av_buffer_unref(&ctx->hw_device_ctx);
 			use_vaapi = 0;
-			if (init_video_encoder(ctx, width, height,
+			if (init_video_encoder(ctx, out_w, out_h,
 			    (AVRational){1, 30}, fr, 0) < 0)
 				return -1;
 		} else {
@@ -1440,31 +2153,28 @@ media_open_screen(media_ctx_t *ctx)
 	}
 
 	/* Init video filter graph */
-	if (init_video_filters(ctx, width, height,
-	    ctx->ifmt_ctx->streams[0]->time_base,
-	    ctx->video_dec->pix_fmt, use_vaapi,
-	    ctx->video_dec->colorspace,
-	    ctx->video_dec->color_range) < 0) {
+	if (init_video_filters(ctx, width, height, in_tb, in_fmt, use_vaapi,
+	    in_space, in_range) < 0) {
 		if (use_vaapi) {
 			fprintf(stderr, "VAAPI filters failed, "
 			    "trying software\n");
 			avcodec_free_context(&ctx->video_enc);
 			av_buffer_unref(&ctx->hw_device_ctx);
 			use_vaapi = 0;
-			if (init_video_encoder(ctx, width, height,
+			if (init_video_encoder(ctx, out_w, out_h,
 			    (AVRational){1, 30}, fr, 0) < 0)
 				return -1;
-			if (init_video_filters(ctx, width, height,
-			    ctx->ifmt_ctx->streams[0]->time_base,
-			    ctx->video_dec->pix_fmt, 0,
-			    ctx->video_dec->colorspace,
-			    ctx->video_dec->color_range) < 0)
+			if (init_video_filters(ctx, width, height, in_tb,
+			    in_fmt, 0, in_space, in_range) < 0)
 				return -1;
 		} else {
 			return -1;
 		}
 	}
 
+	if (ctx->governed && !use_vaapi)
+		gov_init(&ctx->gov, out_w, out_h, fr.num, fr.den);
+
 	/* Init audio encoder if sndio is available */
 	int has_audio = 0;
 	if (ctx->sndio_dec != NULL) {
@@ -1504,6 +2214,223 @@ media_open_screen(media_ctx_t *ctx)
 	return 0;
 }
 
+/*
+ * Write the audio held back by hold_audio(), once the first video
+ * packet is out or no video is coming.
+ */
+static void
+release_audio(media_ctx_t *ctx)
+{
+	int	 i;
+
+	ctx->video_started = 1;
+	for (i = 0; i < ctx->nheld; i++) {
+		av_write_frame(ctx->ofmt_ctx, ctx->held[i]);
+		av_packet_free(&ctx->held[i]);
+	}
+	ctx->nheld = 0;
+}
+
+/*
+ * Every output, including a restart after a seek, starts with a video
+ * keyframe so the TV can lock on from the first packets.  Audio the
+ * encoder delivers before it is held and written right after it; the
+ * timestamps keep the two in sync.  Returns 1 if pkt was held.
+ */
+static int
+hold_audio(media_ctx_t *ctx, AVPacket *pkt)
+{
+	if (ctx->video_started || ctx->video_enc == NULL)
+		return 0;
+	if (ctx->nheld == AUDIO_HOLD) {
+		/* No video coming */
+		release_audio(ctx);
+		return 0;
+	}
+	ctx->held[ctx->nheld] = av_packet_clone(pkt);
+	if (ctx->held[ctx->nheld] == NULL)
+		return 0;
+	ctx->nheld++;
+	return 1;
+}
+
+/*
+ * Drain the video encoder into the output before it is replaced.
+ */
+static void
+flush_video_encoder(media_ctx_t *ctx, int out_stream_idx)
+{
+	AVCodecContext	*enc = ctx->video_enc;
+	AVPacket	*pkt;
+
+	pkt = av_packet_alloc();
+	avcodec_send_frame(enc, NULL);
+	while (pkt != NULL && avcodec_receive_packet(enc, pkt) == 0) {
+		av_packet_rescale_ts(pkt, enc->time_base,
+		    ctx->ofmt_ctx->streams[out_stream_idx]->time_base);
+		pkt->stream_index = out_stream_idx;
+		av_write_frame(ctx->ofmt_ctx, pkt);
+		av_packet_unref(pkt);
+		if (!ctx->video_started)
+			release_audio(ctx);
+	}
+	av_packet_free(&pkt);
+}
+
+/*
+ * Follow the adaptive bitrate controller before the frame at pts is
+ * encoded.  libx264 takes new rate limits between frames; other
+ * encoders are drained and reopened at the next GOP boundary, so the
+ * new encoder starts on the keyframe the stream was due for anyway.
+ * Returns 0 on success, -1 if the encoder could not be reopened.
+ */
+static int
+adapt_bitrate(media_ctx_t *ctx, int64_t pts, int out_stream_idx)
+{
+	AVCodecContext	*enc = ctx->video_enc;
+	AVRational	 time_base, framerate;
+	int		 width, height, use_vaapi;
+
+	abr_note_pts(&ctx->abr, av_rescale_q(pts, enc->time_base,
+	    AV_TIME_BASE_Q));
+	if (ctx->abr.pending == 0) {
+		ctx->abr.pending = abr_update(&ctx->abr,
+		    av_gettime_relative());
+		if (ctx->abr.pending == 0)
+			return 0;
+		/* The output no longer matches the cache key */
+		ctx->cache_fd = -1;
+	}
+
+	if (strcmp(enc->codec->name, "libx264") == 0) {
+		enc->bit_rate = (int64_t)ctx->abr.pending * 1000;
+		enc->rc_max_rate = (int64_t)ctx->abr.pending * 1000;
+		enc->rc_buffer_size = vbv_bits(ctx, ctx->abr.pending);
+		ctx->abr.pending = 0;
+		return 0;
+	}
+	if (enc->gop_size > 0 && pts % enc->gop_size != 0)
+		return 0;
+
+	DPRINTF("abr: reopening %s at %d kbps\n", enc->codec->name,
+	    ctx->abr.pending);
+	width = enc->width;
+	height = enc->height;
+	time_base = enc->time_base;
+	framerate = enc->framerate;
+	use_vaapi = enc->hw_frames_ctx != NULL;
+
+	flush_video_encoder(ctx, out_stream_idx);
+	avcodec_free_context(&ctx->video_enc);
+
+	ctx->abr.pending = 0;
+	return init_video_encoder(ctx, width, height, time_base, framerate,
+	    use_vaapi);
+}
+
+/*
+ * Let the CPU governor act before a decoded frame enters the filter
+ * graph.  Rung changes take effect on GOP boundaries: the video encoder
+ * is drained and reopened at the new size and frame rate, the filter
+ * graph is rebuilt to scale, and the audio encoder follows on its next
+ * frame.  Returns 1 if the frame is dropped for a lower frame rate,
+ * 0 if it goes on, -1 if the pipeline could not be rebuilt.
+ */
+static int
+govern_frame(media_ctx_t *ctx, AVFrame *frame, int64_t *vid_pts,
+    int out_stream_idx)
+{
+	gov_ctx_t		*g = &ctx->gov;
+	const gov_rung_t	*r;
+	AVRational		 old_tb, tb, fr;
+	int			 gop = ctx->video_enc->gop_size, rung;
+	int			 scale_w, scale_h;
+
+	if (gop > 0 && *vid_pts % gop == 0 && *vid_pts != g->gop_pts) {
+		g->gop_pts = *vid_pts;
+		if ((rung = gov_update(g)) >= 0) {
+			r = &g->rungs[rung];
+			/* The output no longer matches the cache key */
+			ctx->cache_fd = -1;
+
+			/* Same GOP length in seconds at the new rate */
+			fr = (AVRational){ g->fps_num, g->fps_den * r->fps_div };
+			tb = (AVRational){ 1, fr.num / fr.den };
+			old_tb = ctx->video_enc->time_base;
+			flush_video_encoder(ctx, out_stream_idx);
+			avcodec_free_context(&ctx->video_enc);
+			if (init_video_encoder(ctx, r->width, r->height, tb, fr,
+			    0) < 0)
+				return -1;
+			*vid_pts = av_rescale_q(*vid_pts, old_tb, tb);
+			g->gop_pts = *vid_pts;
+			g->drop = 0;
+
+			scale_w = r->width != frame->width ||
+			    r->height != frame->height ? r->width : 0;
+			scale_h = scale_w > 0 ? r->height : 0;
+			if (scale_h != ctx->scale_height) {
+				tb = av_buffersink_get_time_base(
+				    ctx->buffersink_ctx);
+				avfilter_graph_free(&ctx->filter_graph);
+				ctx->scale_width = scale_w;
+				ctx->scale_height = scale_h;
+				if (init_video_filters(ctx, frame->width,
+				    frame->height, tb, frame->format, 0,
+				    frame->colorspace, frame->color_range) < 0)
+					return -1;
+			}
+
+			if (r->aac_fast != ctx->aac_fast) {
+				ctx->aac_fast = r->aac_fast;
+				ctx->aac_reopen = ctx->audio_enc != NULL;
+			}
+		}
+	}
+
+	r = &g->rungs[g->rung];
+	if (r->fps_div > 1 && g->drop++ % r->fps_div != 0)
+		return 1;
+	return 0;
+}
+
+/*
+ * Screen capture: whether the frame at vid_pts shows the same as the
+ * previous one and need not go through the filter graph and encoder.
+ * GOP starts and every DEDUPE_KEEP-th frame are encoded regardless;
+ * for a static picture they are cheap skip frames that keep the TV's
+ * clock fed and the bitrate and governor boundaries in place.
+ */
+static int
+skip_static_frame(media_ctx_t *ctx, const AVFrame *frame, int64_t vid_pts)
+{
+	dedupe_ctx_t			*d = &ctx->dedupe;
+	const AVPixFmtDescriptor	*desc;
+	int				 dirty, gop = ctx->video_enc->gop_size;
+
+	desc = av_pix_fmt_desc_get(frame->format);
+	if (desc == NULL || (desc->flags & (AV_PIX_FMT_FLAG_PLANAR |
+	    AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) ||
+	    av_get_padded_bits_per_pixel(desc) % 8 != 0)
+		return 0;
+
+	if (ctx->screen_clean && d->prev != NULL) {
+		/* The grabber saw no damage, no need to compare */
+		d->frames++;
+		d->last_dirty = dirty = 0;
+	} else
+		dirty = dedupe_frame(d, frame->data[0], frame->linesize[0],
+		    frame->width, frame->height,
+		    av_get_padded_bits_per_pixel(desc) / 8);
+	if (d->frames % DEDUPE_REPORT == 0)
+		dedupe_report(d);
+	if (dirty != 0 || vid_pts % DEDUPE_KEEP == 0 ||
+	    (gop > 0 && vid_pts % gop == 0))
+		return 0;
+	d->skipped++;
+	return 1;
+}
+
 /*
  * Encode and write a filtered video frame.
  */
@@ -1514,8 +2441,16 @@ encode_video_frame(media_ctx_t *ctx, AVFrame *frame, int64_t *vid_pts,
 	AVPacket	*pkt;
 	int		 ret;
 
+	if (frame != NULL && ctx->adaptive &&
+	    adapt_bitrate(ctx, *vid_pts, out_stream_idx) < 0)
+		return AVERROR(EINVAL);
+	if (frame != NULL && ctx->gov.nrungs > 0)
+		gov_note_frame(&ctx->gov);
 	if (frame != NULL)
 		frame->pts = (*vid_pts)++;
+	/* A new encoder starts on an IDR whatever the source frame was */
+	if (frame != NULL && ctx->video_enc->frame_num == 0)
+		frame->pict_type = AV_PICTURE_TYPE_I;
 
 	ret = avcodec_send_frame(ctx->video_enc, frame);
 	if (ret < 0)
@@ -1528,6 +2463,8 @@ encode_video_frame(media_ctx_t *ctx, AVFrame *frame, int64_t *vid_pts,
 		pkt->stream_index = out_stream_idx;
 		av_write_frame(ctx->ofmt_ctx, pkt);
 		av_packet_unref(pkt);
+		if (!ctx->video_started)
+			release_audio(ctx);
 	}
 	av_packet_free(&pkt);
 
@@ -1549,6 +2486,11 @@ encode_audio_frame(media_ctx_t *ctx, AVFrame *frame, int out_stream_idx)
 
 	pkt = av_packet_alloc();
 	while (avcodec_receive_packet(ctx->audio_enc, pkt) == 0) {
+		if (ctx->audio_min_pts > 0 && pkt->pts != AV_NOPTS_VALUE &&
+		    pkt->pts < ctx->audio_min_pts) {
+			av_packet_unref(pkt);
+			continue;
+		}
 		av_packet_rescale_ts(pkt, ctx->audio_enc->time_base,
 		    ctx->ofmt_ctx->streams[out_stream_idx]->time_base);
 		if (pkt->pts != AV_NOPTS_VALUE && pkt->pts < 0)
@@ -1556,7 +2498,8 @@ encode_audio_frame(media_ctx_t *ctx, AVFrame *frame, int out_stream_idx)
 		if (pkt->dts != AV_NOPTS_VALUE && pkt->dts < 0)
 			pkt->dts = 0;
 		pkt->stream_index = out_stream_idx;
-		av_write_frame(ctx->ofmt_ctx, pkt);
+		if (!hold_audio(ctx, pkt))
+			av_write_frame(ctx->ofmt_ctx, pkt);
 		av_packet_unref(pkt);
 	}
 	av_packet_free(&pkt);
@@ -1564,6 +2507,74 @@ encode_audio_frame(media_ctx_t *ctx, AVFrame *frame, int out_stream_idx)
 	return 0;
 }
 
+/*
+ * Convert an input stream timestamp to AV_TIME_BASE units.
+ * Returns -1 for unknown timestamps so they are never trimmed away
+ * as "after the end".
+ */
+static int64_t
+input_time_us(media_ctx_t *ctx, int stream_idx, int64_t ts)
+{
+	if (ts == AV_NOPTS_VALUE)
+		return ctx->trim_us;
+	return av_rescale_q(ts, ctx->ifmt_ctx->streams[stream_idx]->time_base,
+	    AV_TIME_BASE_Q);
+}
+
+/*
+ * Filter and encode a decoded or grabbed video frame.  The frame is
+ * unreferenced.  Returns <0 if the pipeline broke.
+ */
+static int
+process_video_frame(media_ctx_t *ctx, AVFrame *frame, AVFrame *filt_frame,
+    int64_t *vid_pts, int out_stream_idx)
+{
+	int		 ret = 0;
+
+	/* Honour the transcode window (snippets / splicing) */
+	if (ctx->trim_us > 0 || ctx->end_us > 0) {
+		int64_t us = input_time_us(ctx, ctx->video_idx,
+		    frame->best_effort_timestamp);
+
+		if (ctx->end_us > 0 && us >= ctx->end_us)
+			ctx->past_end = 1;
+		if (us < ctx->trim_us || ctx->past_end)
+			goto done;
+	}
+
+	if (ctx->gov.nrungs > 0) {
+		ret = govern_frame(ctx, frame, vid_pts, out_stream_idx);
+		if (ret != 0)
+			goto done;
+	}
+
+	/* Unchanged screen: let the output clock run on */
+	if (ctx->mode == MODE_SCREEN &&
+	    skip_static_frame(ctx, frame, *vid_pts)) {
+		(*vid_pts)++;
+		if (ctx->gov.nrungs > 0)
+			gov_note_frame(&ctx->gov);
+		goto done;
+	}
+
+	/* Push through filter graph */
+	ret = av_buffersrc_add_frame_flags(ctx->buffersrc_ctx, frame,
+	    AV_BUFFERSRC_FLAG_KEEP_REF);
+	if (ret < 0)
+		goto done;
+
+	while (av_buffersink_get_frame(ctx->buffersink_ctx,
+	    filt_frame) >= 0) {
+		encode_video_frame(ctx, filt_frame, vid_pts,
+		    out_stream_idx);
+		av_frame_unref(filt_frame);
+	}
+
+done:
+	av_frame_unref(frame);
+	return ret < 0 ? ret : 0;
+}
+
 /*
  * Process video: decode, filter, encode.
  */
@@ -1582,19 +2593,9 @@ process_video_packet(media_ctx_t *ctx, AVPacket *pkt, int64_t *vid_pts,
 		goto done;
 
 	while (avcodec_receive_frame(ctx->video_dec, frame) == 0) {
-		/* Push through filter graph */
-		ret = av_buffersrc_add_frame_flags(ctx->buffersrc_ctx,
-		    frame, AV_BUFFERSRC_FLAG_KEEP_REF);
-		if (ret < 0)
-			goto done;
-
-		while (av_buffersink_get_frame(ctx->buffersink_ctx,
-		    filt_frame) >= 0) {
-			encode_video_frame(ctx, filt_frame, vid_pts,
-			    out_stream_idx);
-			av_frame_unref(filt_frame);
-		}
-		av_frame_unref(frame);
+		if (process_video_frame(ctx, frame, filt_frame, vid_pts,
+		    out_stream_idx) < 0)
+			break;
 	}
 
 done:
@@ -1603,6 +2604,32 @@ done:
 	return 0;
 }
 
+/*
+ * Reopen the audio encoder with the coder the governor chose.  The
+ * first packets of the new encoder overlap what was already sent and
+ * are dropped.  On failure the old encoder is kept.
+ */
+static void
+reopen_audio_encoder(media_ctx_t *ctx, int out_stream_idx,
+    int64_t audio_pts)
+{
+	AVCodecContext	*old = ctx->audio_enc;
+
+	ctx->aac_reopen = 0;
+	encode_audio_frame(ctx, NULL, out_stream_idx);
+	ctx->audio_enc = NULL;
+	if (init_audio_encoder(ctx, old->sample_rate,
+	    old->ch_layout.nb_channels) < 0) {
+		fprintf(stderr, "Cannot reopen audio encoder\n");
+		if (ctx->audio_enc != NULL)
+			avcodec_free_context(&ctx->audio_enc);
+		ctx->audio_enc = old;
+		return;
+	}
+	avcodec_free_context(&old);
+	ctx->audio_min_pts = audio_pts;
+}
+
 /*
  * Drain complete frames from audio FIFO and encode them.
  */
@@ -1612,6 +2639,9 @@ drain_audio_fifo(media_ctx_t *ctx, int out_stream_idx, int64_t *audio_pts)
 	int		 frame_size;
 	AVFrame		*out_frame;
 
+	if (ctx->aac_reopen)
+		reopen_audio_encoder(ctx, out_stream_idx, *audio_pts);
+
 	frame_size = ctx->audio_enc->frame_size;
 	if (frame_size <= 0)
 		frame_size = 1024;
@@ -1635,12 +2665,36 @@ drain_audio_fifo(media_ctx_t *ctx, int out_stream_idx, int64_t *audio_pts)
 	}
 }
 
+/*
+ * Screen capture: hand the resampler the capture time of the audio
+ * about to be converted, so it stretches, squeezes, pads or trims the
+ * output to stay on the capture clock instead of the sound card's.
+ */
+static void
+clock_audio(media_ctx_t *ctx, AVCodecContext *dec, int64_t cap_us,
+    int64_t audio_pts)
+{
+	int64_t		 rate = ctx->audio_enc->sample_rate, pos;
+
+	/* Output position of the next sample, before compensation */
+	pos = audio_pts + av_audio_fifo_size(ctx->audio_fifo) +
+	    swr_get_delay(ctx->swr_ctx, rate);
+	avsync_note_audio(&ctx->sync, av_rescale(pos, AV_TIME_BASE, rate),
+	    cap_us, av_gettime_relative());
+
+	/* In units of 1 / (input rate * output rate) */
+	swr_next_pts(ctx->swr_ctx, av_rescale(cap_us - ctx->sync.t0,
+	    dec->sample_rate * rate, AV_TIME_BASE));
+}
+
 /*
  * Process audio: decode, resample, buffer in FIFO, encode complete frames.
+ * Captured audio comes with its capture time cap_us, -1 otherwise.
  */
 static int
 process_audio_packet(media_ctx_t *ctx, AVPacket *pkt,
-    AVCodecContext *dec, int out_stream_idx, int64_t *audio_pts)
+    AVCodecContext *dec, int out_stream_idx, int64_t *audio_pts,
+    int64_t cap_us)
 {
 	AVFrame		*frame, *tmp_frame;
 	int		 ret;
@@ -1660,6 +2714,13 @@ process_audio_packet(media_ctx_t *ctx, AVPacket *pkt,
 			continue;
 		}
 
+		if (cap_us >= 0) {
+			clock_audio(ctx, dec, cap_us, *audio_pts);
+			/* Padding for a gap adds output */
+			max_out = swr_get_out_samples(ctx->swr_ctx,
+			    frame->nb_samples);
+		}
+
 		tmp_frame = av_frame_alloc();
 		tmp_frame->nb_samples = max_out;
 		tmp_frame->format = ctx->audio_enc->sample_fmt;
@@ -1707,10 +2768,26 @@ media_transcode_thread(void *arg)
 	int		 ret;
 	int64_t		 vid_pts = 0;
 	int64_t		 audio_pts = 0;
+	int64_t		 t0 = 0, w0 = 0;
 	int		 audio_out_idx;
 
 	DPRINTF("media: transcode thread started\n");
 
+	/* A pre-encoded snippet goes out first; we continue behind it */
+	if (ctx->prefix != NULL && ctx->prefix_len > 0) {
+		DPRINTF("media: sending %zu byte prefix\n", ctx->prefix_len);
+		if (ctx->splice != NULL)
+			splice_next(ctx->splice);
+		if (avio_write_pipe(ctx, ctx->prefix,
+		    (int)ctx->prefix_len) < 0) {
+			close(ctx->pipe_wr);
+			ctx->pipe_wr = -1;
+			return NULL;
+		}
+		if (ctx->splice != NULL)
+			splice_next(ctx->splice);
+	}
+
 	ret = avformat_write_header(ctx->ofmt_ctx, NULL);
 	if (ret < 0) {
 		fprintf(stderr, "Cannot write header: %s\n",
@@ -1721,8 +2798,9 @@ media_transcode_thread(void *arg)
 	}
 
 	/* Seek to start position if resuming from a non-zero offset */
-	if (ctx->start_sec > 0) {
-		int64_t ts = (int64_t)ctx->start_sec * AV_TIME_BASE;
+	if (ctx->start_sec > 0 || ctx->trim_us > 0) {
+		int64_t ts = ctx->trim_us > 0 ? ctx->trim_us :
+		    (int64_t)ctx->start_sec * AV_TIME_BASE;
 		av_seek_frame(ctx->ifmt_ctx, -1, ts,
 		    AVSEEK_FLAG_BACKWARD);
 		if (ctx->video_dec != NULL)
@@ -1734,16 +2812,62 @@ media_transcode_thread(void *arg)
 	/* Audio output stream index (video is 0 if present, audio is 1) */
 	audio_out_idx = (ctx->video_idx >= 0) ? 1 : 0;
 
+	/* Continue the output timeline of a snippet sent ahead of us */
+	ctx->past_end = 0;
+	ctx->completed = 0;
+	if (ctx->origin_us > 0) {
+		if (ctx->video_enc != NULL)
+			vid_pts = av_rescale_q(ctx->origin_us, AV_TIME_BASE_Q,
+			    ctx->video_enc->time_base);
+		if (ctx->audio_enc != NULL)
+			audio_pts = av_rescale_q(ctx->origin_us,
+			    AV_TIME_BASE_Q, ctx->audio_enc->time_base);
+	}
+
 	pkt = av_packet_alloc();
-	while (ctx->running && av_read_frame(ctx->ifmt_ctx, pkt) >= 0) {
+	while (ctx->running && !ctx->past_end &&
+	    av_read_frame(ctx->ifmt_ctx, pkt) >= 0) {
+		if (ctx->gov.nrungs > 0) {
+			t0 = av_gettime_relative();
+			w0 = ctx->write_us;
+		}
 		if (pkt->stream_index == ctx->video_idx) {
 			process_video_packet(ctx, pkt, &vid_pts, 0);
 		} else if (pkt->stream_index == ctx->audio_idx &&
 		    ctx->audio_dec != NULL) {
-			process_audio_packet(ctx, pkt, ctx->audio_dec,
-			    audio_out_idx, &audio_pts);
+			int64_t us = input_time_us(ctx, ctx->audio_idx,
+			    pkt->pts);
+			int	 keep = 1;
+
+			if (ctx->trim_us > 0 || ctx->end_us > 0) {
+				if (ctx->end_us > 0 && us >= ctx->end_us) {
+					if (ctx->video_idx < 0)
+						ctx->past_end = 1;
+					keep = 0;
+				}
+				if (us < ctx->trim_us)
+					keep = 0;
+			}
+			if (keep)
+				process_audio_packet(ctx, pkt,
+				    ctx->audio_dec, audio_out_idx,
+				    &audio_pts, -1);
 		}
+		/*
+		 * A video frame is out: the next read may wait (a live or
+		 * network input), its tail is not to wait with it.
+		 */
+		if (pkt->stream_index == ctx->video_idx)
+			tsout_push(&ctx->out, av_gettime_relative());
+		else
+			tsout_tick(&ctx->out, av_gettime_relative());
 		av_packet_unref(pkt);
+		if (ctx->ra != NULL)
+			readahead_report(ctx->ra);
+		/* Work on the packet, not time blocked on the TV */
+		if (ctx->gov.nrungs > 0)
+			gov_note_busy(&ctx->gov, av_gettime_relative() - t0 -
+			    (ctx->write_us - w0));
 	}
 
 	/* Flush remaining audio from FIFO and encoders */
@@ -1753,8 +2877,10 @@ media_transcode_thread(void *arg)
 		drain_audio_fifo(ctx, audio_out_idx, &audio_pts);
 		encode_audio_frame(ctx, NULL, audio_out_idx);
 	}
+	release_audio(ctx);
 
 	av_write_trailer(ctx->ofmt_ctx);
+	tsout_flush(&ctx->out);
 	av_packet_free(&pkt);
 
 	/*
@@ -1762,8 +2888,12 @@ media_transcode_thread(void *arg)
 	 * to stop TV playback before the data socket closes so the TV
 	 * receives Stop before seeing the HTTP stream EOF.
 	 */
-	if (ctx->running && running && ctx->ctrl_fd >= 0)
-		write(ctx->ctrl_fd, "STOP\n", 5);
+	if (ctx->running && running) {
+		ctx->completed = ctx->ofmt_ctx->pb->error == 0;
+		if (ctx->ctrl_fd >= 0 && !ctx->continuous &&
+		    !ctx->queue_next)
+			write(ctx->ctrl_fd, "STOP\n", 5);
+	}
 
 	close(ctx->pipe_wr);
 	ctx->pipe_wr = -1;
@@ -1773,17 +2903,131 @@ media_transcode_thread(void *arg)
 	return NULL;
 }
 
+/*
+ * Audio capture thread: read sndio at the pace of the device and queue
+ * the packets with the capture time of their first sample, so that a
+ * slow video step can neither overrun the device nor delay the audio
+ * it already delivered.  When the queue is full the oldest packet is
+ * dropped; the resampler pads the gap.
+ */
+static void *
+audio_capture_thread(void *arg)
+{
+	media_ctx_t		*ctx = arg;
+	audio_queue_t		*q = &ctx->audio_q;
+	AVCodecParameters	*par;
+	AVPacket		*pkt;
+	int64_t			 now, dur;
+	int			 frame_bytes, i;
+
+	par = ctx->sndio_ctx->streams[ctx->sndio_audio_idx]->codecpar;
+	frame_bytes = par->ch_layout.nb_channels *
+	    av_get_bits_per_sample(par->codec_id) / 8;
+
+	while (q->running && ctx->running) {
+		pkt = av_packet_alloc();
+		if (pkt == NULL || av_read_frame(ctx->sndio_ctx, pkt) < 0) {
+			av_packet_free(&pkt);
+			break;
+		}
+		/* The packet was complete just now */
+		now = av_gettime_relative();
+		dur = frame_bytes > 0 && par->sample_rate > 0 ?
+		    (int64_t)(pkt->size / frame_bytes) * AV_TIME_BASE /
+		    par->sample_rate : 0;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->len == AUDIO_QUEUE) {
+			av_packet_free(&q->pkt[q->head]);
+			q->head = (q->head + 1) % AUDIO_QUEUE;
+			q->len--;
+			q->dropped++;
+		}
+		i = (q->head + q->len) % AUDIO_QUEUE;
+		q->pkt[i] = pkt;
+		q->cap_us[i] = now - dur;
+		q->len++;
+		pthread_mutex_unlock(&q->lock);
+	}
+	DPRINTF("media: audio capture thread finished\n");
+	return NULL;
+}
+
+/*
+ * Take the oldest queued audio packet, or NULL if there is none.
+ */
+static AVPacket *
+audio_dequeue(media_ctx_t *ctx, int64_t *cap_us)
+{
+	audio_queue_t	*q = &ctx->audio_q;
+	AVPacket	*pkt = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->len > 0) {
+		pkt = q->pkt[q->head];
+		*cap_us = q->cap_us[q->head];
+		q->pkt[q->head] = NULL;
+		q->head = (q->head + 1) % AUDIO_QUEUE;
+		q->len--;
+	}
+	ctx->sync.dropped = q->dropped;
+	pthread_mutex_unlock(&q->lock);
+	return pkt;
+}
+
+static int
+audio_start(media_ctx_t *ctx)
+{
+	audio_queue_t	*q = &ctx->audio_q;
+
+	memset(q, 0, sizeof(*q));
+	if (pthread_mutex_init(&q->lock, NULL) != 0)
+		return -1;
+	q->running = 1;
+	if (pthread_create(&q->thread, NULL, audio_capture_thread,
+	    ctx) != 0) {
+		pthread_mutex_destroy(&q->lock);
+		q->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+audio_stop(media_ctx_t *ctx)
+{
+	audio_queue_t	*q = &ctx->audio_q;
+	AVPacket	*pkt;
+	int64_t		 cap_us;
+
+	q->running = 0;
+	pthread_join(q->thread, NULL);
+	while ((pkt = audio_dequeue(ctx, &cap_us)) != NULL)
+		av_packet_free(&pkt);
+	pthread_mutex_destroy(&q->lock);
+}
+
 /*
  * Screen + audio capture thread.
+ *
+ * Video frames and the audio queued by audio_capture_thread() are
+ * stamped with the monotonic clock when captured.  A video frame that
+ * arrives more than a frame late moves the output timestamps on to the
+ * clock rather than shifting everything after it; audio is resampled
+ * onto the same clock (clock_audio()).  The resulting A/V offset and
+ * the capture to muxer latency are reported by avsync_update().
  */
 void *
 media_capture_thread(void *arg)
 {
 	media_ctx_t	*ctx = arg;
 	AVPacket	*vid_pkt, *aud_pkt;
-	int		 ret;
+	AVFrame		*frame, *filt_frame;
+	int		 ret, has_audio;
 	int64_t		 vid_pts = 0;
 	int64_t		 audio_pts = 0;
+	int64_t		 t0 = 0, w0 = 0;
+	int64_t		 grab_us, cap_us, slot, pos_us;
 	int		 audio_out_idx = 1;
 
 	DPRINTF("media: capture thread started\n");
@@ -1798,35 +3042,73 @@ media_capture_thread(void *arg)
 	}
 
 	vid_pkt = av_packet_alloc();
-	aud_pkt = av_packet_alloc();
+	frame = av_frame_alloc();
+	filt_frame = av_frame_alloc();
+
+	avsync_init(&ctx->sync, av_gettime_relative());
+	has_audio = ctx->sndio_ctx != NULL && ctx->sndio_dec != NULL &&
+	    ctx->audio_enc != NULL && ctx->swr_ctx != NULL;
+	if (has_audio && audio_start(ctx) < 0) {
+		fprintf(stderr, "Cannot start audio capture thread "
+		    "(continuing without audio)\n");
+		has_audio = 0;
+	}
 
 	while (ctx->running) {
-		/* Read video frame from x11grab */
-		ret = av_read_frame(ctx->ifmt_ctx, vid_pkt);
+		/* Grab the next video frame */
+		if (ctx->xshm != NULL) {
+			ret = xshm_grab(ctx->xshm, frame);
+			ctx->screen_clean = ret == 0;
+		} else
+			ret = av_read_frame(ctx->ifmt_ctx, vid_pkt);
 		if (ret < 0)
 			break;
-
-		process_video_packet(ctx, vid_pkt, &vid_pts, 0);
-		av_packet_unref(vid_pkt);
-
-		/* Read available audio from sndio (non-blocking-ish) */
-		if (ctx->sndio_ctx != NULL && ctx->sndio_dec != NULL &&
-		    ctx->audio_enc != NULL && ctx->swr_ctx != NULL) {
-			while (av_read_frame(ctx->sndio_ctx,
-			    aud_pkt) >= 0) {
-				process_audio_packet(ctx, aud_pkt,
-				    ctx->sndio_dec, audio_out_idx,
-				    &audio_pts);
-				av_packet_unref(aud_pkt);
-
-				/*
-				 * Only process a few audio packets per
-				 * video frame to avoid falling behind.
-				 */
-				break;
-			}
+		grab_us = av_gettime_relative();
+
+		/* Frames were lost: stay on the capture clock */
+		slot = av_rescale_q(grab_us - ctx->sync.t0, AV_TIME_BASE_Q,
+		    ctx->video_enc->time_base);
+		if (slot - vid_pts >= 2)
+			vid_pts = slot;
+		pos_us = av_rescale_q(vid_pts, ctx->video_enc->time_base,
+		    AV_TIME_BASE_Q);
+
+		/* The grab waits for the next frame, time the work only */
+		if (ctx->gov.nrungs > 0) {
+			t0 = grab_us;
+			w0 = ctx->write_us;
+		}
+		if (ctx->xshm != NULL)
+			process_video_frame(ctx, frame, filt_frame, &vid_pts,
+			    0);
+		else {
+			process_video_packet(ctx, vid_pkt, &vid_pts, 0);
+			av_packet_unref(vid_pkt);
+		}
+		avsync_note_video(&ctx->sync, pos_us, grab_us,
+		    av_gettime_relative());
+
+		/* Everything the audio thread captured meanwhile */
+		while (has_audio &&
+		    (aud_pkt = audio_dequeue(ctx, &cap_us)) != NULL) {
+			/* Start the audio timeline where it was captured */
+			if (audio_pts == 0 &&
+			    av_audio_fifo_size(ctx->audio_fifo) == 0)
+				audio_pts = av_rescale(cap_us - ctx->sync.t0,
+				    ctx->audio_enc->sample_rate, AV_TIME_BASE);
+			process_audio_packet(ctx, aud_pkt, ctx->sndio_dec,
+			    audio_out_idx, &audio_pts, cap_us);
+			av_packet_free(&aud_pkt);
 		}
+		if (ctx->gov.nrungs > 0)
+			gov_note_busy(&ctx->gov, av_gettime_relative() - t0 -
+			    (ctx->write_us - w0));
+		avsync_update(&ctx->sync, av_gettime_relative());
+		/* The grab waits a frame interval: send the frame now */
+		tsout_push(&ctx->out, av_gettime_relative());
 	}
+	if (has_audio)
+		audio_stop(ctx);
 
 	/* Flush remaining audio from FIFO and encoders */
 	if (ctx->video_enc != NULL)
@@ -1835,11 +3117,15 @@ media_capture_thread(void *arg)
 		drain_audio_fifo(ctx, audio_out_idx, &audio_pts);
 		encode_audio_frame(ctx, NULL, audio_out_idx);
 	}
+	release_audio(ctx);
 
 	av_write_trailer(ctx->ofmt_ctx);
+	tsout_flush(&ctx->out);
+	dedupe_report(&ctx->dedupe);
 
 	av_packet_free(&vid_pkt);
-	av_packet_free(&aud_pkt);
+	av_frame_free(&frame);
+	av_frame_free(&filt_frame);
 
 	close(ctx->pipe_wr);
 	ctx->pipe_wr = -1;
@@ -1891,6 +3177,28 @@ media_close_transcode_state(media_ctx_t *ctx)
 		close(ctx->pipe_wr);
 		ctx->pipe_wr = -1;
 	}
+	free(ctx->prefix);
+	ctx->prefix = NULL;
+	ctx->prefix_len = 0;
+	free(ctx->splice);
+	ctx->splice = NULL;
+
+	/* A new pipeline starts at the top of the governor's ladder */
+	memset(&ctx->gov, 0, sizeof(ctx->gov));
+	ctx->scale_width = 0;
+	ctx->scale_height = 0;
+	ctx->aac_fast = 0;
+	ctx->aac_reopen = 0;
+	ctx->audio_min_pts = 0;
+	dedupe_free(&ctx->dedupe);
+	tsout_report(&ctx->out);
+	tsout_free(&ctx->out);
+	shmring_free(ctx->ring);
+	ctx->ring = NULL;
+	while (ctx->nheld > 0)
+		av_packet_free(&ctx->held[--ctx->nheld]);
+	ctx->video_started = 0;
+	ctx->video_dropped = 0;
 }
 
 /*
@@ -1912,6 +3220,96 @@ media_restart_transcode(media_ctx_t *ctx, int start_sec)
 	return media_open_transcode(ctx);
 }
 
+/*
+ * Input timestamp of stream position 0, in AV_TIME_BASE units: most
+ * MPEG-TS recordings do not start at 0.  Windows are given in input
+ * timestamps, so stream positions are added to this.
+ */
+int64_t
+media_start_us(const media_ctx_t *ctx)
+{
+	if (ctx->ifmt_ctx == NULL || ctx->ifmt_ctx->start_time ==
+	    AV_NOPTS_VALUE)
+		return 0;
+	return ctx->ifmt_ctx->start_time;
+}
+
+/*
+ * Transcode the input window [start_us, end_us) of a probed file (input
+ * timestamps, see media_start_us(); end_us 0 = to EOF) into a malloc'd
+ * MPEG-TS buffer of at most max_bytes.
+ * Output timestamps start at ctx->origin_us.  Clearing *keep_going aborts.
+ * Transcode state is left closed, the input stays open.
+ * Returns 0 on success, -1 on failure, overflow or abort.
+ */
+int
+media_encode_window(media_ctx_t *ctx, int64_t start_us, int64_t end_us,
+    size_t max_bytes, volatile int *keep_going, uint8_t **out,
+    size_t *outlen)
+{
+	uint8_t		*buf = NULL, *nbuf;
+	size_t		 len = 0, cap = 0;
+	ssize_t		 n;
+	int		 failed = 0;
+
+	media_close_transcode_state(ctx);
+	ctx->running = 1;
+	ctx->start_sec = (int)(start_us / AV_TIME_BASE);
+	ctx->trim_us = start_us;
+	ctx->end_us = end_us;
+	if (media_open_transcode(ctx) < 0 ||
+	    pthread_create(&ctx->thread, NULL, media_transcode_thread,
+	    ctx) != 0) {
+		media_close_transcode_state(ctx);
+		return -1;
+	}
+
+	for (;;) {
+		if (len == cap) {
+			cap = cap ? cap * 2 : SEND2TV_BUF_SIZE * 16;
+			if (cap > max_bytes)
+				cap = max_bytes;
+			if (len == cap ||
+			    (nbuf = realloc(buf, cap)) == NULL) {
+				failed = 1;
+				ctx->running = 0;
+				break;
+			}
+			buf = nbuf;
+		}
+		n = read(ctx->pipe_rd, buf + len, cap - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		if (!*keep_going)
+			ctx->running = 0;
+	}
+	/*
+	 * Over max_bytes we stop reading; the thread may be blocked in a
+	 * write to the full pipe, which fails once nobody can read it.
+	 */
+	if (failed) {
+		close(ctx->pipe_rd);
+		ctx->pipe_rd = -1;
+	}
+	pthread_join(ctx->thread, NULL);
+	if (!ctx->completed)
+		failed = 1;
+	media_close_transcode_state(ctx);
+	ctx->trim_us = 0;
+	ctx->end_us = 0;
+
+	if (failed || !running || !*keep_going || len == 0) {
+		free(buf);
+		return -1;
+	}
+	*out = buf;
+	*outlen = len;
+	return 0;
+}
+
 void
 media_close(media_ctx_t *ctx)
 {
@@ -1933,10 +3331,7 @@ media_close(media_ctx_t *ctx)
 		avcodec_free_context(&ctx->sndio_dec);
 	if (ctx->ifmt_ctx != NULL)
 		avformat_close_input(&ctx->ifmt_ctx);
-	if (ctx->avio_in != NULL) {
-		av_free(ctx->avio_in->buffer);
-		avio_context_free(&ctx->avio_in);
-	}
+	media_readahead_close(ctx);
 	if (ctx->sndio_ctx != NULL)
 		avformat_close_input(&ctx->sndio_ctx);
 	if (ctx->ofmt_ctx != NULL) {
@@ -1948,8 +3343,18 @@ media_close(media_ctx_t *ctx)
 	}
 	if (ctx->hw_device_ctx != NULL)
 		av_buffer_unref(&ctx->hw_device_ctx);
+	xshm_close(ctx->xshm);
+	ctx->xshm = NULL;
+	dedupe_free(&ctx->dedupe);
+	tsout_free(&ctx->out);
+	shmring_free(ctx->ring);
+	ctx->ring = NULL;
+	while (ctx->nheld > 0)
+		av_packet_free(&ctx->held[--ctx->nheld]);
 	if (ctx->pipe_rd >= 0)
 		close(ctx->pipe_rd);
 	if (ctx->pipe_wr >= 0)
 		close(ctx->pipe_wr);
+	free(ctx->prefix);
+	free(ctx->splice);
 }
@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "send2tv.h"
+
+/*
+ * Control and data connections between client and server.
+ *
+ * An address is a Unix socket path or host:port for TCP, so that the
+ * transcoding client and the server next to the TV can run on different
+ * machines.  A path is anything starting with '/' or '.' or without a
+ * colon; for listening, the host may be empty (":7390") for all
+ * addresses.
+ *
+ * Over TCP the server greets every connection.  Without a key it sends
+ * "OK".  With a key it sends "AUTH <nonce>" and the client has to answer
+ * with HMAC-SHA256(key, nonce) in hex before the server says "OK".  The
+ * stream itself is not encrypted.  Unix sockets are protected by file
+ * permissions and have no greeting.
+ *
+ * The server runs its side of the handshake a step at a time
+ * (net_auth_begin(), net_auth_poll()), so that a peer that connects
+ * and says nothing holds up no other connection.
+ *
+ * SHA-256 is implemented here rather than taken from libavutil, so that
+ * the tests, which link no FFmpeg library, cover the handshake.
+ */
+
+#define NET_NONCE	16
+#define NET_AUTH_MS	5000		/* handshake timeout */
+
+/* SHA-256, FIPS 180-4 */
+
+typedef struct {
+	uint32_t	 h[8];
+	uint64_t	 len;
+	uint8_t		 buf[64];
+	size_t		 fill;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+static void
+sha256_block(sha256_t *s, const uint8_t *p)
+{
+	uint32_t	 w[64], v[8], t1, t2;
+	int		 i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 |
+		    p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		    (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+		    (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+	memcpy(v, s->h, sizeof(v));
+	for (i = 0; i < 64; i++) {
+		t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) +
+		    ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+		t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) +
+		    ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(v[0]));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		s->h[i] += v[i];
+}
+
+static void
+sha256_init(sha256_t *s)
+{
+	static const uint32_t	 h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+	s->fill = 0;
+}
+
+static void
+sha256_update(sha256_t *s, const uint8_t *p, size_t len)
+{
+	size_t	 n;
+
+	s->len += len;
+	while (len > 0) {
+		n = 64 - s->fill < len ? 64 - s->fill : len;
+		memcpy(s->buf + s->fill, p, n);
+		s->fill += n;
+		p += n;
+		len -= n;
+		if (s->fill == 64) {
+			sha256_block(s, s->buf);
+			s->fill = 0;
+		}
+	}
+}
+
+static void
+sha256_final(sha256_t *s, uint8_t out[32])
+{
+	uint64_t	 bits = s->len * 8;
+	uint8_t		 pad = 0x80, len[8];
+	int		 i;
+
+	sha256_update(s, &pad, 1);
+	pad = 0;
+	while (s->fill != 56)
+		sha256_update(s, &pad, 1);
+	for (i = 0; i < 8; i++)
+		len[i] = bits >> (56 - 8 * i);
+	sha256_update(s, len, 8);
+	for (i = 0; i < 32; i++)
+		out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/*
+ * HMAC-SHA256 (RFC 2104) of msg under key.
+ */
+void
+net_hmac(const char *key, const uint8_t *msg, size_t len, uint8_t out[32])
+{
+	sha256_t	 s;
+	uint8_t		 k[64], pad[64];
+	size_t		 klen = strlen(key);
+	int		 i;
+
+	memset(k, 0, sizeof(k));
+	if (klen > sizeof(k)) {
+		sha256_init(&s);
+		sha256_update(&s, (const uint8_t *)key, klen);
+		sha256_final(&s, k);
+	} else
+		memcpy(k, key, klen);
+
+	for (i = 0; i < 64; i++)
+		pad[i] = k[i] ^ 0x36;
+	sha256_init(&s);
+	sha256_update(&s, pad, sizeof(pad));
+	sha256_update(&s, msg, len);
+	sha256_final(&s, out);
+
+	for (i = 0; i < 64; i++)
+		pad[i] = k[i] ^ 0x5c;
+	sha256_init(&s);
+	sha256_update(&s, pad, sizeof(pad));
+	sha256_update(&s, out, 32);
+	sha256_final(&s, out);
+}
+
+/*
+ * Whether addr is host:port rather than a Unix socket path.
+ */
+int
+net_is_tcp(const char *addr)
+{
+	return addr[0] != '/' && addr[0] != '.' && strrchr(addr, ':') != NULL;
+}
+
+/*
+ * Split host:port; [v6addr]:port is accepted too.  Returns 0 or -1.
+ */
+static int
+net_split(const char *addr, char *host, size_t hostsz, const char **port)
+{
+	const char	*colon = strrchr(addr, ':');
+	size_t		 len = colon - addr;
+
+	*port = colon + 1;
+	if (**port == '\0')
+		return -1;
+	if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+		addr++;
+		len -= 2;
+	}
+	if (len >= hostsz)
+		return -1;
+	memcpy(host, addr, len);
+	host[len] = '\0';
+	return 0;
+}
+
+static int
+unix_listen(const char *path)
+{
+	struct sockaddr_un	 addr;
+	int			 fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, 1) < 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Create a socket listening on addr.  Returns the fd or -1.
+ */
+int
+net_listen(const char *addr)
+{
+	struct addrinfo	 hints, *res, *ai;
+	const char	*port;
+	char		 host[256];
+	int		 fd = -1, on = 1, err;
+
+	if (!net_is_tcp(addr))
+		return unix_listen(addr);
+	if (net_split(addr, host, sizeof(host), &port) < 0) {
+		fprintf(stderr, "%s: expected host:port\n", addr);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((err = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints,
+	    &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", addr, gai_strerror(err));
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, 1) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		fprintf(stderr, "%s: cannot listen: %s\n", addr,
+		    strerror(errno));
+	return fd;
+}
+
+/*
+ * Connect to addr.  Returns the fd or -1.
+ */
+int
+net_connect(const char *addr)
+{
+	struct sockaddr_un	 sun;
+	struct addrinfo		 hints, *res, *ai;
+	const char		*port;
+	char			 host[256];
+	int			 fd = -1, on = 1;
+
+	if (!net_is_tcp(addr)) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strlcpy(sun.sun_path, addr, sizeof(sun.sun_path));
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	if (net_split(addr, host, sizeof(host), &port) < 0 ||
+	    host[0] == '\0')
+		return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	/* Commands are single lines, the stream is written in batches */
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+/*
+ * Read a line of the handshake, waiting at most NET_AUTH_MS in total.
+ * Returns 0 or -1.
+ */
+static int
+net_read_line(int fd, char *buf, size_t bufsz)
+{
+	struct pollfd	 pfd;
+	size_t		 n = 0;
+	ssize_t		 r;
+	int		 left = NET_AUTH_MS;
+	char		 c;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (n < bufsz - 1) {
+		/* Lines are short, 100 ms steps are precise enough */
+		if (poll(&pfd, 1, 100) == 0) {
+			if ((left -= 100) <= 0)
+				return -1;
+			continue;
+		}
+		r = read(fd, &c, 1);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		if (c == '\n') {
+			buf[n] = '\0';
+			return 0;
+		}
+		buf[n++] = c;
+	}
+	return -1;
+}
+
+static int
+net_write_all(int fd, const char *s)
+{
+	size_t	 len = strlen(s);
+	ssize_t	 n;
+
+	while (len > 0) {
+		n = send(fd, s, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		s += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Whether fd is a Unix socket, which only local users can reach.
+ */
+int
+net_is_unix(int fd)
+{
+	struct sockaddr_storage	 ss;
+	socklen_t		 len = sizeof(ss);
+
+	return getsockname(fd, (struct sockaddr *)&ss, &len) == 0 &&
+	    ss.ss_family == AF_UNIX;
+}
+
+static void
+net_hex(const uint8_t *p, size_t len, char *out)
+{
+	size_t	 i;
+
+	for (i = 0; i < len; i++)
+		snprintf(out + 2 * i, 3, "%02x", p[i]);
+}
+
+static int64_t
+net_now_ms(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Start the server side of the handshake on an accepted connection;
+ * key may be NULL.  Returns 1 if the client may go on at once, 0 if
+ * its answer is awaited (see net_auth_poll()), -1 if it is to be
+ * dropped.
+ */
+int
+net_auth_begin(net_auth_t *a, int fd, const char *key)
+{
+	uint8_t		 nonce[NET_NONCE], mac[32];
+	char		 line[128], hex[2 * NET_NONCE + 1];
+
+	memset(a, 0, sizeof(*a));
+	a->fd = fd;
+	if (net_is_unix(fd))
+		return 1;
+	if (key == NULL)
+		return net_write_all(fd, "OK\n") < 0 ? -1 : 1;
+
+	if (getentropy(nonce, sizeof(nonce)) < 0)
+		return -1;
+	net_hex(nonce, sizeof(nonce), hex);
+	snprintf(line, sizeof(line), "AUTH %s\n", hex);
+	if (net_write_all(fd, line) < 0)
+		return -1;
+	net_hmac(key, nonce, sizeof(nonce), mac);
+	net_hex(mac, sizeof(mac), a->want);
+	a->deadline = net_now_ms() + NET_AUTH_MS;
+	return 0;
+}
+
+/*
+ * Take what the client has sent of its answer, without blocking.
+ * Returns 1 if it may go on, 0 if the answer is not complete yet, -1 if
+ * it is to be dropped: a wrong answer, or none by the deadline.
+ */
+int
+net_auth_poll(net_auth_t *a)
+{
+	ssize_t		 r;
+	size_t		 i;
+	int		 diff = 0;
+	char		 c;
+
+	for (;;) {
+		r = recv(a->fd, &c, 1, MSG_DONTWAIT);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return net_now_ms() < a->deadline ? 0 : -1;
+		if (r <= 0)
+			return -1;
+		if (c == '\n')
+			break;
+		if (a->len >= sizeof(a->line) - 1) {
+			a->denied = 1;
+			return -1;
+		}
+		a->line[a->len++] = c;
+	}
+	a->line[a->len] = '\0';
+
+	if (a->len != 64) {
+		a->denied = 1;
+		return -1;
+	}
+	/* Same time for any wrong answer */
+	for (i = 0; i < 64; i++)
+		diff |= a->line[i] ^ a->want[i];
+	if (diff != 0) {
+		a->denied = 1;
+		(void)net_write_all(a->fd, "DENIED\n");
+		return -1;
+	}
+	return net_write_all(a->fd, "OK\n") < 0 ? -1 : 1;
+}
+
+/*
+ * Server side of the handshake on an accepted connection, waiting for
+ * the client's answer; key may be NULL.  Returns 0 if the client may go
+ * on, -1 if it is to be dropped.
+ */
+int
+net_auth_accept(int fd, const char *key)
+{
+	net_auth_t	 a;
+	struct pollfd	 pfd;
+	int		 ret;
+
+	ret = net_auth_begin(&a, fd, key);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (ret == 0) {
+		(void)poll(&pfd, 1, 100);
+		ret = net_auth_poll(&a);
+	}
+	return ret > 0 ? 0 : -1;
+}
+
+/*
+ * Client side of the handshake on a connection to the server; key may
+ * be NULL.  Returns 0 or -1.
+ */
+int
+net_auth_connect(int fd, const char *key)
+{
+	uint8_t		 nonce[NET_NONCE], mac[32];
+	char		 line[128], hex[66];
+	size_t		 i;
+	unsigned int	 b;
+
+	if (net_is_unix(fd))
+		return 0;
+	if (net_read_line(fd, line, sizeof(line)) < 0)
+		return -1;
+	if (strcmp(line, "OK") == 0)
+		return 0;
+	if (strncmp(line, "AUTH ", 5) != 0 ||
+	    strlen(line + 5) != 2 * NET_NONCE) {
+		fprintf(stderr, "Unexpected greeting from server\n");
+		return -1;
+	}
+	if (key == NULL) {
+		fprintf(stderr, "The server wants a key (key= or --key)\n");
+		return -1;
+	}
+	for (i = 0; i < NET_NONCE; i++) {
+		if (sscanf(line + 5 + 2 * i, "%2x", &b) != 1)
+			return -1;
+		nonce[i] = b;
+	}
+	net_hmac(key, nonce, sizeof(nonce), mac);
+	net_hex(mac, sizeof(mac), hex);
+	strlcat(hex, "\n", sizeof(hex));
+	if (net_write_all(fd, hex) < 0 ||
+	    net_read_line(fd, line, sizeof(line)) < 0 ||
+	    strcmp(line, "OK") != 0) {
+		fprintf(stderr, "The server did not accept the key\n");
+		return -1;
+	}
+	return 0;
+}
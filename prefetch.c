@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "send2tv.h"
+
+/*
+ * Read-ahead of a queued segment.
+ *
+ * When the server queues the next segment on the TV with
+ * SetNextAVTransportURI, the client is already producing it into a new
+ * data connection.  A thread reads the first bytes of that connection
+ * into memory, so that the client keeps going and the stream starts
+ * from memory as soon as the TV switches over.  A client that hands
+ * over a shared-memory ring needs no copy: the ring is the buffer, and
+ * the thread only takes it over.
+ */
+
+static void *
+prefetch_thread(void *arg)
+{
+	prefetch_t	*p = arg;
+	struct pollfd	 pfd;
+	struct stat	 st;
+	ssize_t		 n;
+	int		 first = 1;
+
+	if (fstat(p->fd, &st) == 0 && S_ISSOCK(st.st_mode))
+		p->ino = st.st_ino;
+	else
+		first = 0;
+
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+	while (!p->stop && p->len < p->size) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (first) {
+			/* The ring, if any, comes in the first message */
+			first = 0;
+			p->ring = shmring_accept(p->fd, p->buf, p->size, &n);
+			if (p->ring != NULL)
+				break;
+		} else
+			n = read(p->fd, p->buf + p->len, p->size - p->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p->len += n;
+	}
+	DPRINTF("prefetch: %zu bytes%s\n", p->len,
+	    p->ring != NULL ? ", ring" : "");
+	return NULL;
+}
+
+/*
+ * Start reading up to size bytes of fd ahead.  fd stays the caller's.
+ * Returns 0, or -1 on failure.
+ */
+int
+prefetch_start(prefetch_t *p, int fd, size_t size)
+{
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+	p->size = size;
+	if ((p->buf = malloc(size)) == NULL)
+		return -1;
+	if (pthread_create(&p->thread, NULL, prefetch_thread, p) != 0) {
+		free(p->buf);
+		p->buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop reading: the bytes read so far are in p->buf, p->len of them, or
+ * the ring handed over is in p->ring.  The rest is still to be read
+ * from fd.
+ */
+void
+prefetch_stop(prefetch_t *p)
+{
+	if (p->buf == NULL || p->stop)
+		return;
+	p->stop = 1;
+	pthread_join(p->thread, NULL);
+}
+
+/* Free what prefetch_start() allocated, and a ring nobody took */
+void
+prefetch_free(prefetch_t *p)
+{
+	prefetch_stop(p);
+	free(p->buf);
+	p->buf = NULL;
+	shmring_free(p->ring);
+	p->ring = NULL;
+}
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "send2tv.h"
+
+/*
+ * Parallel playlist probing.
+ *
+ * Opening a file and reading its stream info can take seconds on a
+ * network file system, and the playlist loop did it for one file at a
+ * time, when the file came up.  At startup a pool of threads probes
+ * the local files of the playlist after the first one; the loop only
+ * waits for a file still being probed.  What a probe finds out is also
+ * kept on disk, keyed by path, size and mtime, so that a file played
+ * again is not probed at all if it is served as is or from the
+ * transcode cache.  A file that is remuxed or transcoded still has its
+ * input opened when it comes up.
+ */
+
+#define PROBE_MAGIC	"send2tv-probe 1"
+
+/*
+ * Build the key of a local file's probe result: its path, size and
+ * mtime, plus the settings that change the result.  Returns 0, or -1
+ * if the file cannot be identified (URLs, missing files).
+ */
+int
+probe_key(const char *path, const media_ctx_t *tmpl, int force_transcode,
+    char *key, size_t keysz)
+{
+	char		 real[PATH_MAX];
+	char		 desc[PATH_MAX + 128];
+	struct stat	 st;
+
+	if (strstr(path, "://") != NULL || realpath(path, real) == NULL ||
+	    stat(real, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+	snprintf(desc, sizeof(desc), "%s|%lld|%lld|a=%s|t=%d", real,
+	    (long long)st.st_size, (long long)st.st_mtime,
+	    tmpl->audio_selector ? tmpl->audio_selector : "",
+	    force_transcode);
+	snprintf(key, keysz, "%016llx",
+	    (unsigned long long)cache_hash(desc));
+	return 0;
+}
+
+/*
+ * Read the result stored under key in dir.  Returns 0, or -1 if there
+ * is none.
+ */
+int
+probe_load(const char *dir, const char *key, probe_info_t *info)
+{
+	FILE	*f;
+	char	 path[PATH_MAX], line[256];
+	int	 ok;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	memset(info, 0, sizeof(*info));
+	ok = fgets(line, sizeof(line), f) != NULL &&
+	    strncmp(line, PROBE_MAGIC " ", sizeof(PROBE_MAGIC)) == 0 &&
+	    sscanf(line + sizeof(PROBE_MAGIC), "%d %d %d %d %63s %63s",
+	    &info->needs_transcode, &info->video_idx, &info->audio_idx,
+	    &info->duration_sec, info->mime_type,
+	    info->dlna_profile) == 6;
+	fclose(f);
+	if (!ok)
+		return -1;
+	if (strcmp(info->dlna_profile, "-") == 0)
+		info->dlna_profile[0] = '\0';
+	DPRINTF("probe: %s from %s\n", info->mime_type, path);
+	return 0;
+}
+
+/*
+ * Store a result under key in dir, replacing any earlier one at once.
+ * Returns 0, or -1 on failure.
+ */
+int
+probe_store(const char *dir, const char *key, const probe_info_t *info)
+{
+	FILE	*f;
+	char	 tmp[PATH_MAX], path[PATH_MAX];
+	int	 fd, ok;
+
+	snprintf(tmp, sizeof(tmp), "%s/%s.XXXXXX", dir, key);
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	if ((fd = mkstemp(tmp)) < 0)
+		return -1;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	ok = fprintf(f, PROBE_MAGIC " %d %d %d %d %s %s\n",
+	    info->needs_transcode, info->video_idx, info->audio_idx,
+	    info->duration_sec, info->mime_type,
+	    info->dlna_profile[0] != '\0' ? info->dlna_profile : "-") > 0;
+	if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* The result of the probe of ctx */
+void
+probe_save(probe_info_t *info, const media_ctx_t *ctx)
+{
+	memset(info, 0, sizeof(*info));
+	info->needs_transcode = ctx->needs_transcode;
+	info->video_idx = ctx->video_idx;
+	info->audio_idx = ctx->audio_idx;
+	info->duration_sec = ctx->duration_sec;
+	strlcpy(info->mime_type, ctx->mime_type, sizeof(info->mime_type));
+	strlcpy(info->dlna_profile, ctx->dlna_profile,
+	    sizeof(info->dlna_profile));
+}
+
+/* Set up ctx as media_probe() would, without an open input */
+void
+probe_apply(media_ctx_t *ctx, const probe_info_t *info)
+{
+	ctx->needs_transcode = info->needs_transcode;
+	ctx->video_idx = info->video_idx;
+	ctx->audio_idx = info->audio_idx;
+	ctx->duration_sec = info->duration_sec;
+	strlcpy(ctx->mime_type, info->mime_type, sizeof(ctx->mime_type));
+	strlcpy(ctx->dlna_profile, info->dlna_profile,
+	    sizeof(ctx->dlna_profile));
+}
+
+/*
+ * Probe item idx into info: from disk if it was probed before, or else
+ * by opening it in m.  Returns 0, or -1 on failure.
+ */
+static int
+probe_item(probe_pool_t *p, int idx, media_ctx_t *m, probe_info_t *info)
+{
+	const char	*file = p->files[idx];
+	char		 key[32];
+	int		 ret;
+
+	/* URLs are resolved when they come up, and may expire */
+	if (probe_key(file, &p->tmpl, p->force_transcode, key,
+	    sizeof(key)) < 0)
+		return -1;
+	if (p->dir[0] != '\0' && probe_load(p->dir, key, info) == 0)
+		return 0;
+
+	*m = p->tmpl;
+	m->mode = MODE_FILE;
+	m->filepath = file;
+	m->running = 1;
+	m->pipe_rd = -1;
+	m->pipe_wr = -1;
+	m->ctrl_fd = -1;
+	m->cache_fd = -1;
+	m->prefix = NULL;
+	DPRINTF("probe: probing %s\n", file);
+	ret = media_probe(m, file, p->force_transcode);
+	if (ret == 0) {
+		probe_save(info, m);
+		if (p->dir[0] != '\0')
+			probe_store(p->dir, key, info);
+	}
+	media_close(m);
+	return ret;
+}
+
+static void *
+probe_thread(void *arg)
+{
+	probe_pool_t	*p = arg;
+	probe_item_t	*it;
+	media_ctx_t	*m;
+	int		 idx, ret;
+
+	if ((m = malloc(sizeof(*m))) == NULL)
+		return NULL;
+	pthread_mutex_lock(&p->lock);
+	while (running) {
+		/* The next item nobody has taken */
+		while (p->next < p->nfiles &&
+		    p->items[p->next].state != PROBE_PENDING)
+			p->next++;
+		if (p->next >= p->nfiles)
+			break;
+		idx = p->next++;
+		it = &p->items[idx];
+		it->state = PROBE_BUSY;
+		pthread_mutex_unlock(&p->lock);
+
+		ret = probe_item(p, idx, m, &it->info);
+
+		pthread_mutex_lock(&p->lock);
+		it->state = ret == 0 ? PROBE_DONE : PROBE_FAILED;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	free(m);
+	return NULL;
+}
+
+/*
+ * Start probing files[1..nfiles-1]; the first one is due at once and
+ * probed by the caller.  Results are kept in dir, if not NULL.
+ * Returns 0, or -1 on failure.
+ */
+int
+probe_start(probe_pool_t *p, char *const *files, int nfiles,
+    const media_ctx_t *tmpl, int force_transcode, const char *dir)
+{
+	int	 i, n;
+
+	memset(p, 0, sizeof(*p));
+	if ((p->items = calloc(nfiles, sizeof(*p->items))) == NULL)
+		return -1;
+	p->files = files;
+	p->nfiles = nfiles;
+	p->tmpl = *tmpl;
+	p->force_transcode = force_transcode;
+	p->next = 1;
+	if (dir != NULL && cache_mkdir(dir) == 0)
+		strlcpy(p->dir, dir, sizeof(p->dir));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	n = nfiles - 1 < PROBE_THREADS ? nfiles - 1 : PROBE_THREADS;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&p->threads[i], NULL, probe_thread,
+		    p) != 0)
+			break;
+		p->nthreads++;
+	}
+	DPRINTF("probe: %d threads for %d files\n", p->nthreads, nfiles - 1);
+	return 0;
+}
+
+/*
+ * The result for item idx, waiting if it is being probed.  An item no
+ * worker got to is left to the caller, who probes it with the input
+ * kept open; only a result on disk is returned for it.  Returns 0, or
+ * -1 if there is no result.
+ */
+int
+probe_get(probe_pool_t *p, int idx, probe_info_t *info)
+{
+	char	 key[32];
+	int	 state;
+
+	if (p->items == NULL || idx < 0 || idx >= p->nfiles)
+		return -1;
+	pthread_mutex_lock(&p->lock);
+	while (p->items[idx].state == PROBE_BUSY)
+		pthread_cond_wait(&p->cond, &p->lock);
+	state = p->items[idx].state;
+	if (state == PROBE_PENDING)
+		p->items[idx].state = PROBE_TAKEN;
+	else if (state == PROBE_DONE)
+		*info = p->items[idx].info;
+	pthread_mutex_unlock(&p->lock);
+
+	if (state == PROBE_DONE)
+		return 0;
+	if (state == PROBE_PENDING && p->dir[0] != '\0' &&
+	    probe_key(p->files[idx], &p->tmpl, p->force_transcode, key,
+	    sizeof(key)) == 0 && probe_load(p->dir, key, info) == 0)
+		return 0;
+	return -1;
+}
+
+/* Keep the result of the caller's own probe of item idx */
+void
+probe_put(probe_pool_t *p, int idx, const media_ctx_t *ctx)
+{
+	probe_info_t	 info;
+	char		 key[32];
+
+	if (p->items == NULL || idx < 0 || idx >= p->nfiles ||
+	    p->dir[0] == '\0' || probe_key(p->files[idx], &p->tmpl,
+	    p->force_transcode, key, sizeof(key)) < 0)
+		return;
+	probe_save(&info, ctx);
+	probe_store(p->dir, key, &info);
+}
+
+void
+probe_stop(probe_pool_t *p)
+{
+	int	 i;
+
+	if (p->items == NULL)
+		return;
+	for (i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p->items);
+	p->items = NULL;
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "send2tv.h"
+
+/*
+ * Read-ahead of network inputs.
+ *
+ * A remote input read by the demuxer on the transcode or remux thread
+ * holds up the whole pipeline on every slow read, and the TV starves.
+ * Here a thread reads the source into a ring ahead of the demuxer:
+ * once less than the low watermark is buffered ahead, it reads until
+ * the high one, and the rest of the ring keeps what was read last, for
+ * the demuxer's short seeks back.  A seek to bytes the ring holds, or
+ * about to arrive, is served from it; any other seek moves the source,
+ * and what was buffered is dropped.
+ */
+
+#define READAHEAD_CHUNK		(64 * 1024)	/* per source read */
+#define READAHEAD_SKIP		(256 * 1024)	/* read through, not seek */
+#define READAHEAD_MIN		(1024 * 1024)
+#define READAHEAD_POLL_MS	100		/* for the reader's interrupt */
+#define READAHEAD_REPORT_US	5000000
+
+static int64_t
+readahead_now_us(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *
+readahead_thread(void *arg)
+{
+	readahead_t	*ra = arg;
+	int64_t		 ahead, off;
+	size_t		 at, n;
+	int		 gen, r;
+
+	pthread_mutex_lock(&ra->lock);
+	while (ra->run) {
+		if (ra->seek_to >= 0) {
+			off = ra->seek_to;
+			ra->seek_to = -1;
+			gen = ra->gen;
+			pthread_mutex_unlock(&ra->lock);
+			r = ra->src.seek(ra->src.opaque, off);
+			pthread_mutex_lock(&ra->lock);
+			if (gen != ra->gen)
+				continue;	/* sought elsewhere meanwhile */
+			ra->stats.seeks++;
+			if (r < 0) {
+				ra->err = r;
+				pthread_cond_broadcast(&ra->cond);
+			}
+			continue;
+		}
+
+		ahead = ra->head - ra->pos;
+		if (ra->eof || ra->err < 0 ||
+		    ahead >= (int64_t)(ra->filling ? ra->high : ra->low)) {
+			ra->filling = 0;
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		ra->filling = 1;
+
+		at = ra->head % ra->size;
+		n = READAHEAD_CHUNK;
+		if (ahead >= 0 && (int64_t)n > (int64_t)ra->high - ahead)
+			n = ra->high - ahead;
+		if (n > ra->size - at)
+			n = ra->size - at;
+		/* The bytes about to be overwritten are history no more */
+		if (ra->head + (int64_t)n - ra->tail > (int64_t)ra->size)
+			ra->tail = ra->head + n - ra->size;
+		gen = ra->gen;
+		pthread_mutex_unlock(&ra->lock);
+
+		r = ra->src.read(ra->src.opaque, ra->buf + at, n);
+
+		pthread_mutex_lock(&ra->lock);
+		if (gen != ra->gen)
+			continue;
+		if (r > 0) {
+			ra->head += r;
+			ra->stats.bytes += r;
+		} else if (r == 0)
+			ra->eof = 1;
+		else
+			ra->err = r;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/*
+ * A read-ahead ring of size bytes, refilled from below low_pct percent
+ * of it buffered ahead up to high_pct.  The source is given with
+ * readahead_start(); until then, only ra->run means anything, so that
+ * it can interrupt the opening of the source.  Returns NULL on failure.
+ */
+readahead_t *
+readahead_new(size_t size, int low_pct, int high_pct)
+{
+	readahead_t	*ra;
+
+	if ((ra = calloc(1, sizeof(*ra))) == NULL)
+		return NULL;
+	ra->size = size < READAHEAD_MIN ? READAHEAD_MIN : size;
+	if (high_pct <= 0 || high_pct > 100)
+		high_pct = READAHEAD_HIGH;
+	if (low_pct <= 0 || low_pct > high_pct)
+		low_pct = high_pct < READAHEAD_LOW ? high_pct : READAHEAD_LOW;
+	ra->high = ra->size / 100 * high_pct;
+	ra->low = ra->size / 100 * low_pct;
+	ra->seek_to = -1;
+	ra->run = 1;
+	if ((ra->buf = malloc(ra->size)) == NULL) {
+		free(ra);
+		return NULL;
+	}
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	return ra;
+}
+
+/*
+ * Start reading src ahead, from its current position.  Returns 0, or
+ * -1 on failure.
+ */
+int
+readahead_start(readahead_t *ra, const readahead_src_t *src)
+{
+	ra->src = *src;
+	if (pthread_create(&ra->thread, NULL, readahead_thread, ra) != 0)
+		return -1;
+	ra->started = 1;
+	DPRINTF("readahead: %zu MiB ring, refill at %zu%%, up to %zu%%\n",
+	    ra->size >> 20, ra->low * 100 / ra->size,
+	    ra->high * 100 / ra->size);
+	return 0;
+}
+
+/*
+ * Read up to size bytes, waiting for the source if nothing is buffered.
+ * Returns the bytes read, 0 at the end of the stream, or the source's
+ * error (< 0); -1 if interrupted.
+ */
+int
+readahead_read(readahead_t *ra, uint8_t *buf, int size)
+{
+	struct timespec	 ts;
+	int64_t		 t0 = 0;
+	size_t		 at, n, m;
+	int		 ret, intr = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	while (ra->run && ra->head <= ra->pos && !ra->eof && ra->err == 0) {
+		if (t0 == 0) {
+			t0 = readahead_now_us();
+			ra->stats.stalls++;
+		}
+		if (ra->src.interrupt == NULL) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		if ((intr = ra->src.interrupt(ra->src.interrupt_arg)) != 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += READAHEAD_POLL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ra->cond, &ra->lock, &ts);
+	}
+	if (t0 != 0)
+		ra->stats.stall_us += readahead_now_us() - t0;
+
+	if (ra->head > ra->pos && size > 0) {
+		n = ra->head - ra->pos;
+		if (n > (size_t)size)
+			n = size;
+		at = ra->pos % ra->size;
+		m = ra->size - at < n ? ra->size - at : n;
+		memcpy(buf, ra->buf + at, m);
+		memcpy(buf + m, ra->buf, n - m);
+		ra->pos += n;
+		ret = n;
+		if (!ra->filling && ra->head - ra->pos < (int64_t)ra->low)
+			pthread_cond_broadcast(&ra->cond);
+	} else if (ra->err < 0)
+		ret = ra->err;
+	else
+		ret = ra->run && !intr ? 0 : -1;
+	pthread_mutex_unlock(&ra->lock);
+	return ret;
+}
+
+/*
+ * Move the read position to off, relative to whence (SEEK_SET, SEEK_CUR
+ * or SEEK_END).  Returns the new position, or -1 if the source cannot
+ * get there.
+ */
+int64_t
+readahead_seek(readahead_t *ra, int64_t off, int whence)
+{
+	pthread_mutex_lock(&ra->lock);
+	if (whence == SEEK_CUR)
+		off += ra->pos;
+	else if (whence == SEEK_END)
+		off = ra->src.size >= 0 ? ra->src.size + off : -1;
+	else if (whence != SEEK_SET)
+		off = -1;
+	if (off < 0) {
+		pthread_mutex_unlock(&ra->lock);
+		return -1;
+	}
+
+	if (off >= ra->tail && off <= ra->head + READAHEAD_SKIP &&
+	    (off <= ra->head || (!ra->eof && ra->err == 0))) {
+		/* Held, or about to be read anyway */
+		ra->pos = off;
+		ra->stats.hits++;
+		pthread_cond_broadcast(&ra->cond);
+	} else if (ra->src.seek == NULL)
+		off = -1;
+	else {
+		ra->pos = ra->head = ra->tail = off;
+		ra->seek_to = off;
+		ra->gen++;
+		ra->eof = 0;
+		ra->err = 0;
+		ra->filling = 0;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return off;
+}
+
+void
+readahead_stats(readahead_t *ra, readahead_stats_t *st)
+{
+	pthread_mutex_lock(&ra->lock);
+	*st = ra->stats;
+	st->level = ra->head > ra->pos ? ra->head - ra->pos : 0;
+	st->size = ra->size;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/*
+ * Print the buffer level and the stalls since the last report, once
+ * every READAHEAD_REPORT_US; the demuxing loops call it per packet.
+ */
+void
+readahead_report(readahead_t *ra)
+{
+	readahead_stats_t	 st;
+	int64_t			 now = readahead_now_us();
+
+	if (ra->report_us == 0)
+		ra->report_us = now;
+	if (now - ra->report_us < READAHEAD_REPORT_US)
+		return;
+	readahead_stats(ra, &st);
+	DPRINTF("readahead: %zu KiB buffered (%zu%%), %lld stalls for "
+	    "%lld ms, %lld KiB read\n", st.level >> 10,
+	    st.level * 100 / st.size,
+	    (long long)(st.stalls - ra->reported.stalls),
+	    (long long)((st.stall_us - ra->reported.stall_us) / 1000),
+	    (long long)((st.bytes - ra->reported.bytes) >> 10));
+	ra->reported = st;
+	ra->report_us = now;
+}
+
+/*
+ * Stop the thread and free ra.  A source read in progress must return
+ * on its own: its interrupt callback checks ra->run.
+ */
+void
+readahead_close(readahead_t *ra)
+{
+	readahead_stats_t	 st;
+
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->lock);
+	ra->run = 0;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	if (ra->started) {
+		pthread_join(ra->thread, NULL);
+		readahead_stats(ra, &st);
+		DPRINTF("readahead: %lld bytes read, %lld stalls for %lld ms, "
+		    "%lld seeks, %lld in the ring\n", (long long)st.bytes,
+		    (long long)st.stalls, (long long)(st.stall_us / 1000),
+		    (long long)st.seeks, (long long)st.hits);
+	}
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra->buf);
+	free(ra);
+}
@@ -9,6 +9,7 @@
 #include <poll.h>
 #include <time.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -25,6 +26,28 @@ static char conf_host[256];
 static char conf_audiodev[64];
 static char conf_codec[32];
 static char conf_mac[18];
+static char conf_key[128];
+static int speculate = 0;
+static int use_cache = 0;
+static int use_probecache = 1;
+static int use_fastprobe = 1;
+static int use_abr = 0;
+static int use_governor = 0;
+static int use_lowlatency = 0;
+static const profile_t *use_profile = NULL;
+static int use_shm = 1;
+static int lookahead = 0;
+static int continuous = 0;
+static int use_gapless = 1;
+static int max_height = 0;
+static char conf_cachedir[1024];
+static long long cache_mb = CACHE_DEFAULT_MB;
+static long long tshift_mb = TSHIFT_DEFAULT_MB;
+static char conf_tshiftdir[1024];
+static int readahead_mb = READAHEAD_DEFAULT_MB;
+static int readahead_low = READAHEAD_LOW;
+static int readahead_high = READAHEAD_HIGH;
+static cache_ctx_t cache;
 
 /* Audio channel remapping presets.
  * map[output_slot] = input_channel_index, matching the ffmpeg channelmap
@@ -83,9 +106,11 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: send2tv --server [-h host] [-v] [--ctrl path] [--data path]\n"
-	    "       send2tv [-tv] [-b kbps] [-c codec] [-h host] [--ctrl path] [--data path] file ...\n"
+	    "usage: send2tv --server [-h host[,host...]] [-v] [--ctrl path] [--data path]\n"
+	    "       send2tv [-tv] [-b kbps] [-c codec] [-h host] [--ctrl path] [--data path] [--tv n] file ...\n"
 	    "       send2tv [-av] [-b kbps] [-c codec] [-h host] [--ctrl path] [--data path] -s\n"
+	    "       send2tv [-tv] [-b kbps] [-c codec] [-j jobs] [--remote host[:port][/jobs]] --prepare file ...\n"
+	    "       send2tv [-v] --key k --worker [port]\n"
 	    "       send2tv [-v] -d\n"
 	    "       send2tv [-v] -q -h host\n"
 	    "       send2tv [-v] -w\n"
@@ -101,16 +126,44 @@ usage(void)
 	    "  -c codec     transcode video codec: h264, hevc (default: auto)\n"
 	    "  -p port      HTTP server port (default: auto)\n"
 	    "  -b kbps      video bitrate in kbps (default: 2000)\n"
+	    "  --maxres h   cap transcoded output at h lines (default: auto,\n"
+	    "               by bitrate)\n"
 	    "  -w           send Wake-on-LAN packet to configured MAC\n"
 	    "  --server     run as server (manages TV connection and HTTP server)\n"
-	    "  --ctrl path  control socket path (default: /tmp/send2tv.ctrl)\n"
-	    "  --data path  data socket path (default: /tmp/send2tv.data)\n"
+	    "  --ctrl path  control socket path or host:port for TCP\n"
+	    "               (default: /tmp/send2tv.ctrl)\n"
+	    "  --data path  data socket path or host:port for TCP\n"
+	    "               (default: /tmp/send2tv.data)\n"
+	    "  --key k      shared key for TCP control and data connections,\n"
+	    "               and for chunk workers\n"
+	    "  --tv n       use the server session of the n-th TV given to\n"
+	    "               --server -h (default: 0)\n"
 	    "  --app        list installed apps on the TV\n"
 	    "  --app <n>    launch app whose name contains <n> (case-insensitive)\n"
 	    "  --channelmap list 5.1 channel remapping presets\n"
 	    "  --channelmap <preset>  remap audio channels (forces transcode)\n"
 	    "  --lang       list audio streams in file\n"
 	    "  --lang <id>  select audio stream by index or language tag\n"
+	    "  --speculate  pre-encode likely seek targets on idle cores\n"
+	    "  --cache      keep finished transcodes on disk and replay them\n"
+	    "  --lookahead  prepare the next files while one is playing\n"
+	    "  --continuous splice files and seeks into one stream to the TV\n"
+	    "  --no-gapless stop and restart the TV between files instead of\n"
+	    "               queueing the next one where the TV can\n"
+	    "  --timeshift mb  server: keep the last mb MB of live streams so\n"
+	    "               the TV can pause and seek back (0: off)\n"
+	    "  --readahead mb  read network inputs up to mb MB ahead (0: off)\n"
+	    "  --abr        lower the bitrate while the network falls behind\n"
+	    "  --governor   lower resolution/frame rate while the CPU falls behind\n"
+	    "  --lowlatency screen: intra refresh instead of keyframes, small VBV\n"
+	    "  --profile p  pipeline buffering: interactive, balanced (default)\n"
+	    "               or throughput\n"
+	    "  --no-shm     send to the server over the data socket, not a\n"
+	    "               shared-memory ring\n"
+	    "  --prepare    transcode files into the cache in parallel chunks\n"
+	    "  -j jobs      local chunk workers (default: number of CPUs)\n"
+	    "  --remote w   also use the chunk worker w (host[:port][/jobs])\n"
+	    "  --worker     serve chunks to --prepare on port (default: 7389)\n"
 	    "  -v           verbose/debug output\n"
 	    "\n"
 	    "During playback:\n"
@@ -137,22 +190,19 @@ sighandler(int sig)
 }
 
 /*
- * Connect to a Unix domain socket at path.
+ * Connect to the server's control or data socket, a path or host:port,
+ * and authenticate with the shared key if the server asks for it.
  * Returns the connected fd on success, -1 on failure.
  */
 static int
-unix_connect(const char *path)
+server_connect(const char *addr)
 {
-	struct sockaddr_un	 addr;
-	int			 fd;
+	int	 fd;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = net_connect(addr);
 	if (fd < 0)
 		return -1;
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
-	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	if (net_auth_connect(fd, conf_key[0] != '\0' ? conf_key : NULL) < 0) {
 		close(fd);
 		return -1;
 	}
@@ -169,6 +219,245 @@ ctrl_send(int ctrl_fd, const char *cmd)
 	write(ctrl_fd, cmd, len);
 }
 
+/*
+ * Restart the file pipeline at target_sec on a fresh data connection and
+ * tell the server to start a new segment.  The running pipeline thread
+ * is stopped first.  If the speculative cache holds a snippet near the
+ * target, it is sent ahead and the pipeline continues right after it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+seek_restart(media_ctx_t *media, int ctrl_fd, const char *data_path,
+    int target, spec_ctx_t *spec)
+{
+	char	 play_cmd[256];
+	uint8_t	*snip;
+	size_t	 snip_len;
+	int	 snip_start, data_fd;
+
+	DPRINTF("seek: restart at %ds\n", target);
+	media->running = 0;
+	pthread_join(media->thread, NULL);
+
+	/* Only uninterrupted transcodes from the start are cached */
+	if (media->cache_fd >= 0) {
+		media->cache_fd = -1;
+		cache_abort(&cache);
+	}
+
+	data_fd = server_connect(data_path);
+	if (data_fd < 0) {
+		fprintf(stderr, "Seek: data connect failed\n");
+		return -1;
+	}
+	media_close_transcode_state(media);
+	media->pipe_wr = data_fd;
+	media->ctrl_fd = ctrl_fd;
+	media->running = 1;
+	media->start_sec = target;
+	media->trim_us = 0;
+	media->origin_us = 0;
+
+	if (media->needs_transcode && spec != NULL &&
+	    spec_take(spec, target, &snip, &snip_len, &snip_start) == 0 &&
+	    media_set_prefix(media, snip, snip_len) == 0) {
+		/* Stream position 0 is now the snippet's first frame */
+		media->start_sec = snip_start;
+		media->trim_us = media_start_us(media) +
+		    (int64_t)(snip_start + SPEC_SNIPPET_SEC) * AV_TIME_BASE;
+		media->origin_us = (int64_t)SPEC_SNIPPET_SEC * AV_TIME_BASE;
+	}
+
+	av_seek_frame(media->ifmt_ctx, -1,
+	    (int64_t)target * AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
+	if (media->needs_transcode) {
+		if (media_open_transcode(media) < 0 ||
+		    pthread_create(&media->thread, NULL,
+		    media_transcode_thread, media) != 0) {
+			fprintf(stderr, "Seek failed\n");
+			close(data_fd);
+			media->pipe_wr = -1;
+			return -1;
+		}
+	} else {
+		if (media_open_remux(media) < 0 ||
+		    pthread_create(&media->thread, NULL,
+		    media_remux_thread, media) != 0) {
+			fprintf(stderr, "Seek failed\n");
+			close(data_fd);
+			media->pipe_wr = -1;
+			return -1;
+		}
+	}
+
+	/* A continuous stream drops what is left of the old position */
+	if (media->continuous)
+		snprintf(play_cmd, sizeof(play_cmd), "SPLICE cut %s %s\n",
+		    media->mime_type, media->dlna_profile);
+	else
+		snprintf(play_cmd, sizeof(play_cmd), "PLAY %s %s\n",
+		    media->mime_type, media->dlna_profile);
+	ctrl_send(ctrl_fd, play_cmd);
+	return 0;
+}
+
+/*
+ * The cache directory: cachedir= if configured, otherwise
+ * $XDG_CACHE_HOME/send2tv or ~/.cache/send2tv.
+ * Returns 0 on success, -1 if there is none.
+ */
+static int
+cache_dir(char *dir, size_t dirsz)
+{
+	const char	*xdg = getenv("XDG_CACHE_HOME");
+	const char	*home = getenv("HOME");
+
+	if (conf_cachedir[0] != '\0')
+		strlcpy(dir, conf_cachedir, dirsz);
+	else if (xdg != NULL && xdg[0] == '/')
+		snprintf(dir, dirsz, "%s/send2tv", xdg);
+	else if (home != NULL)
+		snprintf(dir, dirsz, "%s/.cache/send2tv", home);
+	else
+		return -1;
+	return 0;
+}
+
+/*
+ * Open the transcode cache in the cache directory.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+open_cache(void)
+{
+	char	 dir[1024];
+
+	if (cache_dir(dir, sizeof(dir)) < 0)
+		return -1;
+	return cache_init(&cache, dir, cache_mb * 1024 * 1024);
+}
+
+/*
+ * Have the server serve a local file as is and wait until it has played
+ * or the user moves on.  The TV seeks on its own through byte ranges;
+ * keys are forwarded as UPnP seeks when the TV is reachable.  The end is
+ * estimated from the duration and re-synced with the TV's position.
+ */
+static void
+play_served_file(int ctrl_fd, upnp_ctx_t *upnp, const char *path,
+    const char *mime, const char *dlna, int duration_sec)
+{
+	char		 cmd[1280];
+	struct pollfd	 pfd;
+	unsigned char	 buf[8];
+	struct timespec	 base_ts, sync_ts, now;
+	ssize_t		 n;
+	int		 base_pos = 0, pos, tvpos, target, delta;
+	int		 end_mode = 0, saved_pos = 0;
+	int		 can_seek = upnp->control_url[0] != '\0';
+
+	snprintf(cmd, sizeof(cmd), "PLAY_FILE %s %s %s\n", mime,
+	    dlna[0] != '\0' ? dlna : "-", path);
+	ctrl_send(ctrl_fd, cmd);
+
+	if (term_raw_mode() == 0)
+		printf("Playing. Keys: %sq=next, Q=quit\n", can_seek ?
+		    "arrows=seek, e=end/back, " : "");
+	else
+		printf("Playing. Press Ctrl+C to stop.\n");
+
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &base_ts);
+	sync_ts = base_ts;
+
+	while (running) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pos = base_pos + (int)(now.tv_sec - base_ts.tv_sec);
+
+		/* Follow pauses and seeks done with the TV remote */
+		if (can_seek && now.tv_sec - sync_ts.tv_sec >= 5) {
+			sync_ts = now;
+			if (upnp_get_position(upnp, &tvpos) == 0) {
+				/* A stopped TV reports position 0 */
+				if (tvpos == 0 && duration_sec > 0 &&
+				    pos >= duration_sec - 10)
+					break;
+				base_pos = pos = tvpos;
+				base_ts = now;
+			}
+		}
+		if (duration_sec > 0 && pos > duration_sec + 3)
+			break;
+
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		n = read(STDIN_FILENO, buf, sizeof(buf));
+		if (n <= 0)
+			continue;
+
+		if (buf[0] == 'q')
+			break;
+		if (buf[0] == 'Q' || buf[0] == 0x03) {
+			running = 0;
+			break;
+		}
+		if (!can_seek)
+			continue;
+
+		target = -1;
+		if (buf[0] == 'e' && duration_sec > 0) {
+			if (!end_mode) {
+				saved_pos = pos;
+				target = duration_sec > 60 ?
+				    duration_sec - 60 : 0;
+			} else
+				target = saved_pos;
+			end_mode = !end_mode;
+		} else if (n >= 3 && buf[0] == 0x1b && buf[1] == '[') {
+			delta = 0;
+			switch (buf[2]) {
+			case 'C': delta =  10; break;
+			case 'D': delta = -10; break;
+			case 'A': delta =  30; break;
+			case 'B': delta = -30; break;
+			}
+			if (delta == 0)
+				continue;
+			target = pos + delta;
+			if (target < 0)
+				target = 0;
+		}
+		if (target < 0)
+			continue;
+
+		if (upnp_seek(upnp, target) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &base_ts);
+			base_pos = target;
+		}
+	}
+
+	ctrl_send(ctrl_fd, "STOP\n");
+	term_restore();
+}
+
+/*
+ * Parse an output size cap: "auto" or a height in lines.
+ * Returns the height (0 for auto), or -1 if invalid.
+ */
+static int
+parse_maxres(const char *s)
+{
+	int	 h;
+
+	if (strcmp(s, "auto") == 0)
+		return 0;
+	h = atoi(s);
+	if (h < 144 || h > 4320)
+		return -1;
+	return h;
+}
+
 static void
 load_config(const char **host, const char **audiodev, int *port,
     int *bitrate, int *transcode, const char **codec, const char **mac)
@@ -270,6 +559,176 @@ load_config(const char **host, const char **audiodev, int *port,
 				    "%s:%d: verbose: "
 				    "expected yes or no\n",
 				    path, lineno);
+		} else if (strcmp(key, "speculate") == 0) {
+			if (strcmp(val, "yes") == 0)
+				speculate = 1;
+			else if (strcmp(val, "no") == 0)
+				speculate = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: speculate: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "cache") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_cache = 1;
+			else if (strcmp(val, "no") == 0)
+				use_cache = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: cache: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "abr") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_abr = 1;
+			else if (strcmp(val, "no") == 0)
+				use_abr = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: abr: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "governor") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_governor = 1;
+			else if (strcmp(val, "no") == 0)
+				use_governor = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: governor: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "lowlatency") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_lowlatency = 1;
+			else if (strcmp(val, "no") == 0)
+				use_lowlatency = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: lowlatency: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "shm") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_shm = 1;
+			else if (strcmp(val, "no") == 0)
+				use_shm = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: shm: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "profile") == 0) {
+			if ((use_profile = profile_find(val)) == NULL)
+				fprintf(stderr,
+				    "%s:%d: profile: expected interactive, "
+				    "balanced or throughput\n",
+				    path, lineno);
+		} else if (strcmp(key, "lookahead") == 0) {
+			if (strcmp(val, "yes") == 0)
+				lookahead = 1;
+			else if (strcmp(val, "no") == 0)
+				lookahead = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: lookahead: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "continuous") == 0) {
+			if (strcmp(val, "yes") == 0)
+				continuous = 1;
+			else if (strcmp(val, "no") == 0)
+				continuous = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: continuous: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "gapless") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_gapless = 1;
+			else if (strcmp(val, "no") == 0)
+				use_gapless = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: gapless: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "timeshift") == 0) {
+			tshift_mb = atoll(val);
+			if (tshift_mb < 0) {
+				fprintf(stderr,
+				    "%s:%d: invalid timeshift\n",
+				    path, lineno);
+				tshift_mb = TSHIFT_DEFAULT_MB;
+			}
+		} else if (strcmp(key, "timeshiftdir") == 0) {
+			strlcpy(conf_tshiftdir, val, sizeof(conf_tshiftdir));
+		} else if (strcmp(key, "readahead") == 0) {
+			readahead_mb = atoi(val);
+			if (readahead_mb < 0) {
+				fprintf(stderr,
+				    "%s:%d: invalid readahead\n",
+				    path, lineno);
+				readahead_mb = READAHEAD_DEFAULT_MB;
+			}
+		} else if (strcmp(key, "readaheadlow") == 0) {
+			readahead_low = atoi(val);
+			if (readahead_low <= 0 || readahead_low > 100) {
+				fprintf(stderr,
+				    "%s:%d: invalid readaheadlow\n",
+				    path, lineno);
+				readahead_low = READAHEAD_LOW;
+			}
+		} else if (strcmp(key, "readaheadhigh") == 0) {
+			readahead_high = atoi(val);
+			if (readahead_high <= 0 || readahead_high > 100) {
+				fprintf(stderr,
+				    "%s:%d: invalid readaheadhigh\n",
+				    path, lineno);
+				readahead_high = READAHEAD_HIGH;
+			}
+		} else if (strcmp(key, "fastprobe") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_fastprobe = 1;
+			else if (strcmp(val, "no") == 0)
+				use_fastprobe = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: fastprobe: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "probecache") == 0) {
+			if (strcmp(val, "yes") == 0)
+				use_probecache = 1;
+			else if (strcmp(val, "no") == 0)
+				use_probecache = 0;
+			else
+				fprintf(stderr,
+				    "%s:%d: probecache: "
+				    "expected yes or no\n",
+				    path, lineno);
+		} else if (strcmp(key, "cachedir") == 0) {
+			strlcpy(conf_cachedir, val, sizeof(conf_cachedir));
+		} else if (strcmp(key, "cachesize") == 0) {
+			cache_mb = atoll(val);
+			if (cache_mb <= 0) {
+				fprintf(stderr,
+				    "%s:%d: invalid cachesize\n",
+				    path, lineno);
+				cache_mb = CACHE_DEFAULT_MB;
+			}
+		} else if (strcmp(key, "maxres") == 0) {
+			int h = parse_maxres(val);
+
+			if (h < 0)
+				fprintf(stderr,
+				    "%s:%d: maxres: "
+				    "expected auto or a height\n",
+				    path, lineno);
+			else
+				max_height = h;
 		} else if (strcmp(key, "codec") == 0) {
 			if (strcmp(val, "h264") == 0 ||
 			    strcmp(val, "hevc") == 0 ||
@@ -282,6 +741,8 @@ load_config(const char **host, const char **audiodev, int *port,
 				    "%s:%d: codec: "
 				    "expected h264, hevc, or auto\n",
 				    path, lineno);
+		} else if (strcmp(key, "key") == 0) {
+			strlcpy(conf_key, val, sizeof(conf_key));
 		} else if (strcmp(key, "mac") == 0) {
 			strlcpy(conf_mac, val, sizeof(conf_mac));
 			*mac = conf_mac;
@@ -424,19 +885,42 @@ discover_and_select(char *out_host, size_t out_sz)
 	return 0;
 }
 
+/*
+ * Fill tvs[] from a comma separated list of TV hosts.
+ * Returns the number of TVs, or -1 if there are more than max.
+ */
+static int
+parse_tvs(const char *hosts, upnp_ctx_t *tvs, int max)
+{
+	char	 buf[1024], *h, *next;
+	int	 n = 0;
+
+	strlcpy(buf, hosts, sizeof(buf));
+	for (next = buf; (h = strsep(&next, ",")) != NULL; ) {
+		if (*h == '\0')
+			continue;
+		if (n == max)
+			return -1;
+		strlcpy(tvs[n].tv_ip, h, sizeof(tvs[n].tv_ip));
+		n++;
+	}
+	return n;
+}
+
 /*
  * Connect to the TV's AVTransport service.
  * If the initial attempt fails and a MAC address is configured,
  * send a Wake-on-LAN packet and retry for up to 60 seconds.
+ * With save_mac, a MAC learned from the TV goes into the config file.
  * Returns 0 on success, -1 on failure.
  */
 static int
-connect_to_tv(upnp_ctx_t *upnp)
+connect_to_tv(upnp_ctx_t *upnp, int save_mac)
 {
 	int	 t;
 
 	if (upnp_find_transport(upnp) == 0) {
-		if (upnp->tv_mac[0] == '\0' &&
+		if (save_mac && upnp->tv_mac[0] == '\0' &&
 		    upnp_get_mac(upnp) == 0)
 			save_mac_to_config(upnp->tv_mac);
 		return 0;
@@ -595,6 +1079,24 @@ main(int argc, char *argv[])
 		{ "ctrl",       required_argument, NULL, 'C' },
 		{ "data",       required_argument, NULL, 'D' },
 		{ "direct",     no_argument,       NULL,  1  },
+		{ "speculate",  no_argument,       NULL,  2  },
+		{ "cache",      no_argument,       NULL,  3  },
+		{ "lookahead",  no_argument,       NULL,  4  },
+		{ "prepare",    no_argument,       NULL,  5  },
+		{ "worker",     optional_argument, NULL,  6  },
+		{ "remote",     required_argument, NULL,  7  },
+		{ "abr",        no_argument,       NULL,  8  },
+		{ "governor",   no_argument,       NULL,  9  },
+		{ "maxres",     required_argument, NULL, 10  },
+		{ "lowlatency", no_argument,       NULL, 11  },
+		{ "profile",    required_argument, NULL, 12  },
+		{ "no-shm",     no_argument,       NULL, 13  },
+		{ "key",        required_argument, NULL, 14  },
+		{ "tv",         required_argument, NULL, 15  },
+		{ "continuous", no_argument,       NULL, 16  },
+		{ "no-gapless", no_argument,       NULL, 17  },
+		{ "timeshift",  required_argument, NULL, 18  },
+		{ "readahead",  required_argument, NULL, 19  },
 		{ NULL,         0,                 NULL,  0  }
 	};
 	const char	*host = NULL;
@@ -614,6 +1116,14 @@ main(int argc, char *argv[])
 	int		 app_mode = 0;
 	int		 server_mode = 0;
 	int		 prefer_direct = 0;
+	int		 prepare_mode = 0;
+	int		 worker_port = 0;
+	int		 jobs = 0;
+	chunk_remote_t	 remotes[CHUNK_MAX_REMOTES];
+	int		 nremotes = 0;
+	int		 tv = -1, ntv, i;
+	int		 skipped = 0, queued = 0;
+	static char	 tv_ctrl[256], tv_data[256];
 	const char	*ctrl_path = "/tmp/send2tv.ctrl";
 	const char	*data_path = "/tmp/send2tv.data";
 	int		 port = 0;
@@ -621,15 +1131,20 @@ main(int argc, char *argv[])
 	int		 vcodec = VCODEC_H264;
 	int		 ch;
 	int		 fileidx;
-	upnp_ctx_t	 upnp;
+	upnp_ctx_t	 upnp, tvs[HTTPD_MAX_SRC];
 	httpd_ctx_t	 httpd;
-	media_ctx_t	 media;
+	media_ctx_t	 media, tmpl;
+	spec_ctx_t	 spec;
+	lookahead_ctx_t	 la;
+	probe_pool_t	 probes;
+	probe_info_t	 pinfo;
+	char		 pdir[1024];
 	int		 ctrl_fd = -1;
 	int		 data_fd = -1;
 
 	load_config(&host, &audiodev, &port, &bitrate, &transcode, &codec, &mac);
 
-	while ((ch = getopt_long(argc, argv, "a:b:c:h:sp:dqvtw",
+	while ((ch = getopt_long(argc, argv, "a:b:c:h:j:sp:dqvtw",
 	    longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'a':
@@ -656,6 +1171,14 @@ main(int argc, char *argv[])
 		case 'h':
 			host = optarg;
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs <= 0) {
+				fprintf(stderr, "Invalid jobs: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
 		case 's':
 			screen = 1;
 			break;
@@ -712,6 +1235,98 @@ main(int argc, char *argv[])
 		case 1:
 			prefer_direct = 1;
 			break;
+		case 2:
+			speculate = 1;
+			break;
+		case 3:
+			use_cache = 1;
+			break;
+		case 4:
+			lookahead = 1;
+			break;
+		case 5:
+			prepare_mode = 1;
+			break;
+		case 6:
+			worker_port = CHUNK_DEFAULT_PORT;
+			if (optarg != NULL)
+				worker_port = atoi(optarg);
+			else if (optind < argc && argv[optind][0] != '-')
+				worker_port = atoi(argv[optind++]);
+			if (worker_port <= 0 || worker_port > 65535) {
+				fprintf(stderr, "Invalid worker port\n");
+				usage();
+			}
+			break;
+		case 7:
+			if (nremotes == CHUNK_MAX_REMOTES ||
+			    chunk_parse_remote(optarg,
+			    &remotes[nremotes]) < 0) {
+				fprintf(stderr, "Invalid worker: %s\n",
+				    optarg);
+				usage();
+			}
+			nremotes++;
+			break;
+		case 8:
+			use_abr = 1;
+			break;
+		case 9:
+			use_governor = 1;
+			break;
+		case 10:
+			if ((max_height = parse_maxres(optarg)) < 0) {
+				fprintf(stderr, "Invalid maxres: %s "
+				    "(use auto or a height)\n", optarg);
+				usage();
+			}
+			break;
+		case 11:
+			use_lowlatency = 1;
+			break;
+		case 12:
+			if ((use_profile = profile_find(optarg)) == NULL) {
+				fprintf(stderr, "Invalid profile: %s (use "
+				    "interactive, balanced or throughput)\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 13:
+			use_shm = 0;
+			break;
+		case 14:
+			strlcpy(conf_key, optarg, sizeof(conf_key));
+			break;
+		case 15:
+			tv = atoi(optarg);
+			if (tv < 0 || tv >= HTTPD_MAX_SRC) {
+				fprintf(stderr, "Invalid TV: %s\n", optarg);
+				usage();
+			}
+			break;
+		case 16:
+			continuous = 1;
+			break;
+		case 17:
+			use_gapless = 0;
+			break;
+		case 18:
+			tshift_mb = atoll(optarg);
+			if (tshift_mb < 0) {
+				fprintf(stderr, "Invalid time-shift size: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 19:
+			readahead_mb = atoi(optarg);
+			if (readahead_mb < 0) {
+				fprintf(stderr, "Invalid read-ahead size: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
 		default:
 			usage();
 		}
@@ -870,33 +1485,47 @@ main(int argc, char *argv[])
 		signal(SIGTERM, sighandler);
 		signal(SIGPIPE, SIG_IGN);
 
-		memset(&upnp, 0, sizeof(upnp));
 		memset(&httpd, 0, sizeof(httpd));
-		strlcpy(upnp.tv_ip, host, sizeof(upnp.tv_ip));
-		if (mac != NULL)
-			strlcpy(upnp.tv_mac, mac, sizeof(upnp.tv_mac));
-
-		if (upnp_get_local_ip(&upnp) < 0) {
-			fprintf(stderr, "Cannot determine local IP\n");
+		httpd.tshift_size = (size_t)tshift_mb << 20;
+		httpd.tshift_dir = conf_tshiftdir[0] != '\0' ?
+		    conf_tshiftdir : NULL;
+		memset(tvs, 0, sizeof(tvs));
+		ntv = parse_tvs(host, tvs, HTTPD_MAX_SRC);
+		if (ntv < 0) {
+			fprintf(stderr, "At most %d TVs, comma separated\n",
+			    HTTPD_MAX_SRC);
 			return 1;
 		}
-		printf("Local IP: %s\n", upnp.local_ip);
+		/* The configured MAC is that of the one TV */
+		if (mac != NULL && ntv == 1)
+			strlcpy(tvs[0].tv_mac, mac, sizeof(tvs[0].tv_mac));
 
-		printf("Connecting to TV at %s...\n", upnp.tv_ip);
-		if (connect_to_tv(&upnp) < 0)
-			return 1;
-		printf("AVTransport: %s:%d%s\n", upnp.tv_ip,
-		    upnp.tv_port, upnp.control_url);
+		for (i = 0; i < ntv; i++) {
+			if (upnp_get_local_ip(&tvs[i]) < 0) {
+				fprintf(stderr, "Cannot determine local IP\n");
+				return 1;
+			}
+			printf("Local IP: %s\n", tvs[i].local_ip);
+
+			printf("Connecting to TV at %s...\n", tvs[i].tv_ip);
+			if (connect_to_tv(&tvs[i], ntv == 1) < 0)
+				return 1;
+			printf("AVTransport: %s:%d%s\n", tvs[i].tv_ip,
+			    tvs[i].tv_port, tvs[i].control_url);
+		}
 
-		server_run(&upnp, &httpd, ctrl_path, data_path);
+		server_run(tvs, ntv, &httpd, ctrl_path, data_path,
+		    conf_key[0] != '\0' ? conf_key : NULL);
 		return 0;
 	}
 
 	/* Validate arguments */
-	if (argc == 0 && !screen)
+	if (argc == 0 && !screen && worker_port == 0)
 		usage();
 	if (argc > 0 && screen)
 		usage();
+	if (prepare_mode && (screen || worker_port != 0))
+		usage();
 
 	/* Resolve transcode video codec */
 	if (strcmp(codec, "hevc") == 0)
@@ -914,8 +1543,71 @@ main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 	atexit(term_restore);
 
+	/* Per-file settings, copied into each file's media context */
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.mode = MODE_FILE;
+	tmpl.running = 1;
+	tmpl.pipe_rd = -1;
+	tmpl.pipe_wr = -1;
+	tmpl.ctrl_fd = -1;
+	tmpl.cache_fd = -1;
+	tmpl.bitrate = bitrate;
+	tmpl.vcodec = vcodec;
+	tmpl.max_height = max_height;
+	tmpl.profile = use_profile;
+	tmpl.use_shm = use_shm;
+	tmpl.continuous = continuous;
+	tmpl.full_probe = !use_fastprobe;
+	tmpl.readahead_mb = readahead_mb;
+	tmpl.readahead_low = readahead_low;
+	tmpl.readahead_high = readahead_high;
+	if (lang_mode && lang_arg != NULL)
+		tmpl.audio_selector = lang_arg;
+	if (channelmap_mode && channelmap_arg != NULL) {
+		const channelmap_preset_t *p;
+
+		for (p = channelmap_presets; p->name != NULL; p++) {
+			if (strcmp(p->name, channelmap_arg) == 0) {
+				memcpy(tmpl.channelmap, p->map,
+				    sizeof(tmpl.channelmap));
+				tmpl.has_channelmap = 1;
+				break;
+			}
+		}
+	}
+
+	/* Chunk worker for --prepare on other machines */
+	if (worker_port != 0)
+		return chunk_serve(worker_port,
+		    conf_key[0] != '\0' ? conf_key : NULL) < 0 ? 1 : 0;
+
+	/* Batch mode: fill the transcode cache, no TV involved */
+	if (prepare_mode) {
+		for (i = 0; i < nremotes; i++)
+			remotes[i].key = conf_key[0] != '\0' ? conf_key : NULL;
+		if (open_cache() < 0)
+			return 1;
+		if (jobs == 0)
+			jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+		return chunk_prepare(&tmpl, argv, argc, transcode, jobs,
+		    remotes, nremotes, &cache);
+	}
+
+	/* Sockets of the server session for TV n */
+	if (tv >= 0) {
+		if (server_addr(ctrl_path, tv, tv_ctrl, sizeof(tv_ctrl)) < 0 ||
+		    server_addr(data_path, tv, tv_data, sizeof(tv_data)) < 0) {
+			fprintf(stderr, "Invalid TV: %d\n", tv);
+			return 1;
+		}
+		ctrl_path = tv_ctrl;
+		data_path = tv_data;
+	}
+
 	/* Connect to server */
-	ctrl_fd = unix_connect(ctrl_path);
+	ctrl_fd = server_connect(ctrl_path);
 	if (ctrl_fd < 0) {
 		fprintf(stderr,
 		    "Cannot connect to server ctrl socket %s\n"
@@ -935,8 +1627,12 @@ main(int argc, char *argv[])
 	media.pipe_rd = -1;
 	media.pipe_wr = -1;
 	media.ctrl_fd = -1;
+	media.cache_fd = -1;
 	media.bitrate = bitrate;
 	media.vcodec = vcodec;
+	media.max_height = max_height;
+	media.profile = use_profile;
+	media.use_shm = use_shm;
 	media.sndio_device = audiodev;
 
 	/*
@@ -952,7 +1648,7 @@ main(int argc, char *argv[])
 		}
 
 		/* Connect data socket and set as pipe_wr before open */
-		data_fd = unix_connect(data_path);
+		data_fd = server_connect(data_path);
 		if (data_fd < 0) {
 			fprintf(stderr, "Cannot connect to server data "
 			    "socket %s\n", data_path);
@@ -961,6 +1657,9 @@ main(int argc, char *argv[])
 		}
 		media.pipe_wr = data_fd;
 		media.ctrl_fd = ctrl_fd;
+		media.adaptive = use_abr;
+		media.governed = use_governor;
+		media.low_latency = use_lowlatency;
 
 		printf("Setting up screen capture...\n");
 		if (media_open_screen(&media) < 0) {
@@ -990,8 +1689,9 @@ main(int argc, char *argv[])
 
 		{
 			char play_cmd[256];
+			/* The server can keep a live capture for pausing */
 			snprintf(play_cmd, sizeof(play_cmd),
-			    "PLAY %s %s\n",
+			    "PLAY %s %s live\n",
 			    media.mime_type, media.dlna_profile);
 			ctrl_send(ctrl_fd, play_cmd);
 		}
@@ -1057,15 +1757,43 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (use_cache && open_cache() < 0) {
+		fprintf(stderr, "Transcode cache disabled\n");
+		use_cache = 0;
+	}
+
+	memset(&la, 0, sizeof(la));
+	if (lookahead && argc > 1 &&
+	    lookahead_start(&la, argv, argc, &tmpl, transcode,
+	    use_cache ? &cache : NULL) < 0)
+		fprintf(stderr, "Look-ahead unavailable\n");
+
+	/* Probe the rest of the playlist meanwhile; results kept on disk */
+	if (use_probecache && cache_dir(pdir, sizeof(pdir)) == 0)
+		strlcat(pdir, "/probe", sizeof(pdir));
+	else
+		pdir[0] = '\0';
+	if (probe_start(&probes, argv, argc, &tmpl, transcode,
+	    pdir[0] != '\0' ? pdir : NULL) < 0)
+		fprintf(stderr, "Parallel probing unavailable\n");
+
 	/* Per-file loop */
 	for (fileidx = 0; fileidx < argc && running; fileidx++) {
 		const char *file = argv[fileidx];
 		const char *title;
 		char ytdlp_url[2048];
 		char ytdlp_title[256];
+		char ckey[32], cpath[1024];
+		char real[PATH_MAX];
+		uint8_t *pre;
+		size_t pre_len;
+		int pre_sec;
 		int ytdlp_duration = 0;
 		int force_tc = transcode;
 
+		memset(&spec, 0, sizeof(spec));
+		lookahead_advance(&la, fileidx);
+
 		/* Resolve web URLs via yt-dlp */
 		ytdlp_title[0] = '\0';
 		if (strncmp(file, "http://", 7) == 0 ||
@@ -1146,43 +1874,93 @@ main(int argc, char *argv[])
 			printf("\n[%d/%d] %s\n", fileidx + 1, argc, file);
 		}
 
-		/* Re-initialize media context for this file */
-		memset(&media, 0, sizeof(media));
-		media.mode = MODE_FILE;
-		media.filepath = file;
-		media.running = 1;
-		media.pipe_rd = -1;
-		media.pipe_wr = -1;
-		media.ctrl_fd = -1;
-		media.bitrate = bitrate;
-		media.vcodec = vcodec;
-		if (lang_mode && lang_arg != NULL)
-			media.audio_selector = lang_arg;
-		/* channelmap is cleared by memset; restore for each file */
-		if (channelmap_mode && channelmap_arg != NULL) {
-			const channelmap_preset_t *p;
-
-			for (p = channelmap_presets; p->name != NULL; p++) {
-				if (strcmp(p->name, channelmap_arg) == 0) {
-					memcpy(media.channelmap, p->map,
-					    sizeof(media.channelmap));
-					media.has_channelmap = 1;
-					break;
-				}
+		/* Prepared by the look-ahead worker, or probe it now */
+		if (lookahead_take(&la, fileidx, &media, &pre, &pre_len,
+		    &pre_sec) == 0) {
+			/* The opening goes out first, we continue behind it */
+			if (pre != NULL &&
+			    media_set_prefix(&media, pre, pre_len) == 0) {
+				media.origin_us = (int64_t)pre_sec *
+				    AV_TIME_BASE;
+				media.trim_us = media_start_us(&media) +
+				    media.origin_us;
 			}
+		} else {
+			/* Re-initialize media context for this file */
+			media = tmpl;
+			media.filepath = file;
+
+			/*
+			 * Probed by the pool or on an earlier play: the
+			 * input is opened below, if it is needed at all.
+			 */
+			if (probe_get(&probes, fileidx, &pinfo) == 0)
+				probe_apply(&media, &pinfo);
+			else if (media_probe(&media, file, force_tc) < 0) {
+				if (running)
+					fprintf(stderr,
+					    "Failed to probe %s, skipping\n",
+					    file);
+				continue;
+			} else
+				probe_put(&probes, fileidx, &media);
+		}
+
+		/* If this one plays to the end, the TV gets the next queued */
+		media.queue_next = use_gapless && !media.continuous &&
+		    fileidx < argc - 1;
+
+		/*
+		 * A finished transcode of this file is on disk: serve it.
+		 * Paths mean nothing to a server on another machine.
+		 */
+		ckey[0] = '\0';
+		if (use_cache && media.needs_transcode &&
+		    strstr(file, "://") == NULL &&
+		    cache_key(&media, ckey, sizeof(ckey)) < 0)
+			ckey[0] = '\0';
+		if (ckey[0] != '\0' && !net_is_tcp(ctrl_path) &&
+		    cache_lookup(&cache, ckey, cpath, sizeof(cpath)) == 0) {
+			printf("Playing cached transcode\n");
+			play_served_file(ctrl_fd, &upnp, cpath,
+			    media.mime_type, media.dlna_profile,
+			    media.duration_sec);
+			printf("\nStopping...\n");
+			media_close(&media);
+			continue;
 		}
 
-		/* Probe */
-		if (media_probe(&media, file, force_tc) < 0) {
+		/*
+		 * A local file the TV plays natively is served as is, in its
+		 * own container: the TV seeks through byte ranges and we do
+		 * no work per byte.  A chosen audio stream still needs the
+		 * remux, the TV would play the default one.
+		 */
+		if (!media.needs_transcode && media.audio_selector == NULL &&
+		    strstr(file, "://") == NULL && !net_is_tcp(ctrl_path) &&
+		    realpath(file, real) != NULL &&
+		    strlcpy(cpath, real, sizeof(cpath)) < sizeof(cpath)) {
+			printf("Format supported, serving the file as is\n");
+			play_served_file(ctrl_fd, &upnp, cpath,
+			    media.mime_type, media.dlna_profile,
+			    media.duration_sec);
+			printf("\nStopping...\n");
+			media_close(&media);
+			continue;
+		}
+
+		/* Only the probe result is at hand: open the input now */
+		if (media.ifmt_ctx == NULL &&
+		    media_probe(&media, file, force_tc) < 0) {
 			if (running)
-				fprintf(stderr,
-				    "Failed to probe %s, skipping\n",
+				fprintf(stderr, "Failed to open %s, skipping\n",
 				    file);
+			media_close(&media);
 			continue;
 		}
 
 		/* Connect data socket; set as pipe_wr before opening pipeline */
-		data_fd = unix_connect(data_path);
+		data_fd = server_connect(data_path);
 		if (data_fd < 0) {
 			fprintf(stderr, "Cannot connect to server data "
 			    "socket %s, skipping\n", data_path);
@@ -1191,6 +1969,8 @@ main(int argc, char *argv[])
 		}
 		media.pipe_wr = data_fd;
 		media.ctrl_fd = ctrl_fd;
+		media.adaptive = use_abr && media.needs_transcode;
+		media.governed = use_governor && media.needs_transcode;
 
 		if (media.needs_transcode) {
 			printf("Transcoding %s\n", transcode ?
@@ -1205,10 +1985,16 @@ main(int argc, char *argv[])
 				media_close(&media);
 				continue;
 			}
+			if (ckey[0] != '\0')
+				media.cache_fd = cache_begin(&cache, ckey);
 			if (pthread_create(&media.thread, NULL,
 			    media_transcode_thread, &media) != 0) {
 				fprintf(stderr, "Failed to start "
 				    "transcoding, skipping\n");
+				if (media.cache_fd >= 0) {
+					media.cache_fd = -1;
+					cache_abort(&cache);
+				}
 				media.pipe_wr = -1;
 				close(data_fd);
 				data_fd = -1;
@@ -1254,12 +2040,30 @@ main(int argc, char *argv[])
 		}
 		(void)title; /* title used for display only in client mode */
 
-		/* Tell server to start playback */
+		/*
+		 * Tell server to start playback.  In continuous mode the
+		 * file follows the previous one on the same stream, or cuts
+		 * it short if it was skipped.  After one that played to
+		 * the end, the TV can have it queued.
+		 */
 		{
 			char play_cmd[256];
-			snprintf(play_cmd, sizeof(play_cmd),
-			    "PLAY %s %s\n",
-			    media.mime_type, media.dlna_profile);
+
+			if (media.continuous)
+				snprintf(play_cmd, sizeof(play_cmd),
+				    "SPLICE %s %s %s\n",
+				    skipped ? "cut" : "append",
+				    media.mime_type, media.dlna_profile);
+			else if (queued)
+				snprintf(play_cmd, sizeof(play_cmd),
+				    "NEXT %s %s\n",
+				    media.mime_type, media.dlna_profile);
+			else
+				snprintf(play_cmd, sizeof(play_cmd),
+				    "PLAY %s %s%s\n",
+				    media.mime_type, media.dlna_profile,
+				    strstr(file, "://") != NULL &&
+				    media.duration_sec <= 0 ? " live" : "");
 			printf("Sending PLAY to server...\n");
 			ctrl_send(ctrl_fd, play_cmd);
 		}
@@ -1267,6 +2071,12 @@ main(int argc, char *argv[])
 		if (!running)
 			goto next_file;
 
+		/* Speculative seek cache: local transcoded files only */
+		if (speculate && media.needs_transcode &&
+		    strstr(file, "://") == NULL &&
+		    spec_start(&spec, &tmpl, file) < 0)
+			fprintf(stderr, "Speculative encoding unavailable\n");
+
 		/* Enter raw terminal mode for key input */
 		if (term_raw_mode() == 0)
 			printf("Playing. Keys: arrows=seek, "
@@ -1284,14 +2094,25 @@ main(int argc, char *argv[])
 			int		 saved_pos = 0;
 			int		 seek_delta = 0;
 			int		 seek_pending = 0;
-			struct timespec	 seek_ts;
+			struct timespec	 seek_ts, play_ts;
 
 			pfd.fd = STDIN_FILENO;
 			pfd.events = POLLIN;
+			clock_gettime(CLOCK_MONOTONIC, &play_ts);
 
 			while (running && media.running) {
 				int timeout = 500;
 
+				/* Keep predictions near the (estimated)
+				 * playback position without asking the TV */
+				if (spec.started) {
+					struct timespec	 now;
+
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					spec_predict(&spec, media.start_sec +
+					    (int)(now.tv_sec - play_ts.tv_sec));
+				}
+
 				/* Fire debounced seek if 500ms have elapsed */
 				if (seek_pending) {
 					struct timespec	 now;
@@ -1321,80 +2142,14 @@ main(int argc, char *argv[])
 							    media.duration_sec
 							    - 5;
 
-						DPRINTF("seek: restart at "
-						    "%ds\n", target);
-						media.running = 0;
-						pthread_join(media.thread,
-						    NULL);
-
-						data_fd = unix_connect(
-						    data_path);
-						if (data_fd < 0) {
-							fprintf(stderr,
-							    "Seek: data connect"
-							    " failed\n");
+						if (seek_restart(&media,
+						    ctrl_fd, data_path, target,
+						    &spec) < 0) {
 							running = 0;
 							break;
 						}
-						media_close_transcode_state(
-						    &media);
-						media.pipe_wr = data_fd;
-						media.ctrl_fd = ctrl_fd;
-						media.running = 1;
-						media.start_sec = target;
-						av_seek_frame(media.ifmt_ctx,
-						    -1,
-						    (int64_t)target *
-						    AV_TIME_BASE,
-						    AVSEEK_FLAG_BACKWARD);
-						if (media.video_dec)
-							avcodec_flush_buffers(
-							    media.video_dec);
-						if (media.audio_dec)
-							avcodec_flush_buffers(
-							    media.audio_dec);
-						if (media.needs_transcode) {
-							if (media_open_transcode(
-							    &media) < 0 ||
-							    pthread_create(
-							    &media.thread, NULL,
-							    media_transcode_thread,
-							    &media) != 0) {
-								fprintf(stderr,
-								    "Seek "
-								    "failed\n");
-								close(data_fd);
-								data_fd = -1;
-								running = 0;
-								break;
-							}
-						} else {
-							if (media_open_remux(
-							    &media) < 0 ||
-							    pthread_create(
-							    &media.thread, NULL,
-							    media_remux_thread,
-							    &media) != 0) {
-								fprintf(stderr,
-								    "Seek "
-								    "failed\n");
-								close(data_fd);
-								data_fd = -1;
-								running = 0;
-								break;
-							}
-						}
-						data_fd = -1;
-						{
-							char play_cmd[256];
-							snprintf(play_cmd,
-							    sizeof(play_cmd),
-							    "PLAY %s %s\n",
-							    media.mime_type,
-							    media.dlna_profile);
-							ctrl_send(ctrl_fd,
-							    play_cmd);
-						}
+						clock_gettime(CLOCK_MONOTONIC,
+						    &play_ts);
 						continue;
 					} else {
 						timeout = (int)(500 -
@@ -1443,72 +2198,13 @@ main(int argc, char *argv[])
 						end_mode = 0;
 					}
 
-					DPRINTF("seek: restart at %ds\n",
-					    etarget);
-					media.running = 0;
-					pthread_join(media.thread, NULL);
-
-					data_fd = unix_connect(data_path);
-					if (data_fd < 0) {
-						fprintf(stderr,
-						    "Seek: data connect "
-						    "failed\n");
+					if (seek_restart(&media, ctrl_fd,
+					    data_path, etarget, &spec) < 0) {
 						running = 0;
 						break;
 					}
-					media_close_transcode_state(&media);
-					media.pipe_wr = data_fd;
-					media.ctrl_fd = ctrl_fd;
-					media.running = 1;
-					media.start_sec = etarget;
-					av_seek_frame(media.ifmt_ctx, -1,
-					    (int64_t)etarget * AV_TIME_BASE,
-					    AVSEEK_FLAG_BACKWARD);
-					if (media.video_dec)
-						avcodec_flush_buffers(
-						    media.video_dec);
-					if (media.audio_dec)
-						avcodec_flush_buffers(
-						    media.audio_dec);
-					if (media.needs_transcode) {
-						if (media_open_transcode(
-						    &media) < 0 ||
-						    pthread_create(
-						    &media.thread, NULL,
-						    media_transcode_thread,
-						    &media) != 0) {
-							fprintf(stderr,
-							    "Seek failed\n");
-							close(data_fd);
-							data_fd = -1;
-							running = 0;
-							break;
-						}
-					} else {
-						if (media_open_remux(
-						    &media) < 0 ||
-						    pthread_create(
-						    &media.thread, NULL,
-						    media_remux_thread,
-						    &media) != 0) {
-							fprintf(stderr,
-							    "Seek failed\n");
-							close(data_fd);
-							data_fd = -1;
-							running = 0;
-							break;
-						}
-					}
-					data_fd = -1;
-					{
-						char play_cmd[256];
-						snprintf(play_cmd,
-						    sizeof(play_cmd),
-						    "PLAY %s %s\n",
-						    media.mime_type,
-						    media.dlna_profile);
-						ctrl_send(ctrl_fd, play_cmd);
-					}
+					clock_gettime(CLOCK_MONOTONIC,
+					    &play_ts);
 					continue;
 				}
 
@@ -1537,14 +2233,33 @@ main(int argc, char *argv[])
 
 	next_file:
 		printf("\nStopping...\n");
-		ctrl_send(ctrl_fd, "STOP\n");
-
+		/*
+		 * A continuous stream goes on with the next file; after one
+		 * that played to the end, the TV is given the next queued.
+		 */
+		skipped = media.running;
+		queued = media.queue_next && !skipped && running;
+		if (!queued &&
+		    (!media.continuous || !running || fileidx == argc - 1))
+			ctrl_send(ctrl_fd, "STOP\n");
+
+		spec_stop(&spec);
 		media.running = 0;
 		pthread_join(media.thread, NULL);
 
+		if (use_cache) {
+			if (media.completed && media.cache_fd >= 0)
+				cache_commit(&cache);
+			else
+				cache_abort(&cache);
+			media.cache_fd = -1;
+		}
+
 		media_close(&media);
 	}
 
+	lookahead_stop(&la);
+	probe_stop(&probes);
 	close(ctrl_fd);
 
 	printf("Done.\n");
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -19,6 +21,7 @@
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 #include <libavutil/audio_fifo.h>
+#include <libavutil/time.h>
 
 #define SEND2TV_BUF_SIZE	65536
 #define SEND2TV_AVIO_SIZE	4096
@@ -43,6 +46,328 @@ enum {
 	VCODEC_HEVC
 };
 
+/* Low-latency screen encoding (media.c) */
+#define LOWLAT_VBV_MS		250	/* VBV buffer, vs. 1 s otherwise */
+#define LOWLAT_SLICES		4	/* slices per frame */
+
+/* Audio held back until the first video packet is out (media.c) */
+#define AUDIO_HOLD		64
+
+/* Remuxed video dropped while waiting for a keyframe, at most (media.c) */
+#define VIDEO_HOLD_PKTS		300
+#define VIDEO_HOLD_US		5000000
+
+/* Adaptive bitrate (abr.c) */
+#define ABR_WINDOW_US		2000000		/* evaluation window */
+#define ABR_MIN_DIV		4	/* floor: configured rate / 4 ... */
+#define ABR_MIN_KBPS		500	/* ... but not below this */
+#define ABR_PACE_LOW		90	/* % of real time: falling behind */
+#define ABR_PACE_OK		98	/* % of real time: keeping up */
+#define ABR_STALL_HIGH		20	/* % of the window blocked in write */
+#define ABR_QUEUE_HIGH		75	/* % of the send buffer in use */
+#define ABR_UP_WINDOWS		5	/* clear windows before stepping up */
+#define ABR_HOLD_US		20000000	/* no step up after a drop */
+
+typedef struct {
+	int		 max_kbps;	/* configured rate, the ceiling */
+	int		 min_kbps;
+	int		 cur_kbps;
+	int		 pending;	/* rate not applied to the encoder yet */
+	int64_t		 win_start;	/* current window, -1 before first */
+	int64_t		 last_down;
+	int64_t		 bytes;		/* written in this window */
+	int64_t		 stall_us;	/* blocked in write in this window */
+	int		 queue_pct;	/* peak send buffer use */
+	int64_t		 pts_start;	/* output time covered, -1 = none */
+	int64_t		 pts_last;
+	int		 clear;		/* windows in a row keeping up */
+} abr_ctx_t;
+
+/* CPU governor for software encoding (gov.c) */
+#define GOV_RUNGS		7
+#define GOV_HIGH		95	/* % of the frame deadline: too slow */
+#define GOV_TARGET		80	/* % a rung must be estimated to fit */
+#define GOV_DOWN_GOPS		2	/* slow GOPs before stepping down */
+#define GOV_UP_GOPS		10	/* GOPs with headroom before stepping up */
+
+typedef struct {
+	int		 width;		/* output size */
+	int		 height;
+	int		 fps_div;	/* keep every fps_div-th frame */
+	int		 aac_fast;	/* AAC fast coder */
+	int64_t		 cost;		/* estimated, pixels per second */
+} gov_rung_t;
+
+typedef struct {
+	gov_rung_t	 rungs[GOV_RUNGS];
+	int		 nrungs;	/* 0 = governor inactive */
+	int		 rung;
+	int		 fps_num;	/* source frame rate */
+	int		 fps_den;
+	int64_t		 busy_us;	/* work in the current GOP */
+	int		 frames;	/* frames encoded in the current GOP */
+	int		 over;		/* slow GOPs in a row */
+	int		 under;		/* GOPs in a row the rung above fits */
+	int64_t		 gop_pts;	/* last GOP boundary evaluated */
+	int		 drop;		/* frame counter for fps_div */
+} gov_ctx_t;
+
+/* Static-content frame dedupe for screen capture (dedupe.c) */
+#define DEDUPE_TILE_W		64	/* tile size in pixels */
+#define DEDUPE_TILE_H		32
+#define DEDUPE_KEEP		6	/* encode at least every n-th frame */
+#define DEDUPE_REPORT		300	/* frames between debug reports */
+
+typedef struct {
+	uint8_t		*prev;		/* reference frame, rows packed */
+	int		 width;
+	int		 height;
+	int		 bpp;		/* bytes per pixel */
+	int		 tiles;		/* tiles per frame */
+	int64_t		 frames;	/* compared */
+	int64_t		 skipped;	/* not encoded, counted by caller */
+	int64_t		 dirty_tiles;	/* summed over all frames */
+	int		 last_dirty;	/* dirty tiles in the last frame */
+	int		 x0, y0;	/* dirty rectangle of the last change */
+	int		 x1, y1;
+} dedupe_ctx_t;
+
+/* A/V clock for screen capture (avsync.c) */
+#define AVSYNC_WINDOW_US	10000000	/* report interval */
+#define AUDIO_QUEUE		64	/* sndio packets read ahead */
+#define AUDIO_ASYNC		1000	/* max resampler stretch, samples/s */
+
+typedef struct {
+	int64_t		 t0;		/* capture clock origin */
+	int64_t		 win_start;
+	int		 have_video;
+	int64_t		 vpos_us;	/* last video position error */
+	int		 av_n;		/* A/V offset in this window */
+	int64_t		 av_sum;
+	int64_t		 av_min;
+	int64_t		 av_max;
+	int		 vlat_n;	/* capture to muxer, video */
+	int64_t		 vlat_sum;
+	int64_t		 vlat_max;
+	int		 alat_n;	/* capture to muxer, audio */
+	int64_t		 alat_sum;
+	int64_t		 alat_max;
+	int		 dropped;	/* audio packets, queue full */
+	int64_t		 av_us;		/* last window averages */
+	int64_t		 vlat_us;
+	int64_t		 alat_us;
+} avsync_ctx_t;
+
+/* sndio packets from the audio capture thread, stamped on capture */
+typedef struct {
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	volatile int	 running;
+	AVPacket	*pkt[AUDIO_QUEUE];
+	int64_t		 cap_us[AUDIO_QUEUE];
+	int		 head;
+	int		 len;
+	int		 dropped;
+} audio_queue_t;
+
+/* MPEG-TS lock-on check (tslock.c) */
+typedef struct {
+	int		 pmt_pid;	/* from the PAT, -1 before */
+	int		 video_pid;	/* from the PMT, -1 before */
+	int		 video_type;	/* PMT stream_type */
+	int		 have_pat;
+	int		 have_pmt;
+	int64_t		 off;		/* bytes scanned */
+	int64_t		 pes_off;	/* start of the current video PES */
+	int		 pes_rai;	/* it has the random access flag */
+	int		 ps;		/* parameter sets seen, bit mask */
+	int		 idr;		/* IDR/IRAP picture seen */
+	int		 zeros;		/* start code scanner state */
+	int		 nal_next;
+	int		 locked;
+	int64_t		 lock_off;	/* PES that locked, -1 before */
+	uint8_t		 carry[188];	/* partial TS packet */
+	int		 carry_len;
+} tslock_t;
+
+/* Coalesced MPEG-TS output (tsout.c) */
+typedef struct {
+	uint8_t		*buf;		/* staged output, NULL = pass through */
+	size_t		 cap;
+	size_t		 len;
+	int		 pkts;		/* write at this many TS packets */
+	int64_t		 budget_us;	/* or once the oldest is this old */
+	int64_t		 first_us;	/* oldest staged byte arrived */
+	int		(*sink)(void *, const struct iovec *, int);
+	void		*opaque;
+	int64_t		 calls;		/* chunks from the muxer */
+	int64_t		 writes;	/* sink calls */
+	int64_t		 bytes;
+} tsout_t;
+
+/* Splicing of items into one continuous MPEG-TS (splice.c) */
+#define SPLICE_CHUNK		(64 * 188)	/* bytes rewritten per call */
+
+typedef struct {
+	int		 item;		/* items started */
+	int		 timed;		/* offset of this item is set */
+	int		 mark;		/* next PCR gets the discontinuity flag */
+	int64_t		 offset;	/* added to PCR/PTS/DTS, 90 kHz */
+	int64_t		 last_pcr;	/* highest PCR base sent, -1 = none */
+	int64_t		 last_pts;	/* highest PTS sent, -1 = none */
+	int		 pmt_pid;
+	uint32_t	 psi_sum[2];	/* PAT, PMT content sent last */
+	int		 psi_ver[2];	/* and its version, -1 = none yet */
+	uint8_t		 pid[8192];	/* last CC sent, SPLICE_CC */
+	uint8_t		 carry[188];	/* partial TS packet */
+	int		 carry_len;
+	int64_t		 packets;
+} splice_t;
+
+/* Shared-memory ring from client to server (shmring.c) */
+#define SHMRING_SIZE		(256 * 1024)	/* unless the profile sizes it */
+
+typedef struct shmring shmring_t;
+
+/*
+ * Read-ahead of the data connection of a segment queued on the TV
+ * (prefetch.c), so that its first bytes are there when the TV asks.
+ */
+#define PREFETCH_MAX		(4 * 1024 * 1024)
+
+typedef struct {
+	int		 fd;
+	uint8_t		*buf;
+	size_t		 size;
+	size_t		 len;
+	shmring_t	*ring;		/* handed over instead of bytes */
+	ino_t		 ino;		/* of fd, for httpd_src_t ring_ino */
+	volatile int	 stop;
+	pthread_t	 thread;
+} prefetch_t;
+
+/*
+ * Time-shift window of a live segment (tshift.c): its data connection
+ * is drained as fast as it comes into the last size bytes, and the TV
+ * reads from them at any offset they still hold.
+ */
+#define TSHIFT_DEFAULT_MB	64
+#define TSHIFT_KEYS		4096	/* keyframes indexed in the window */
+
+typedef struct {
+	int64_t		 off;		/* stream offset of its packet */
+	int64_t		 pts;
+} tshift_key_t;
+
+typedef struct {
+	int		 fd;		/* data connection, drained */
+	uint8_t		*mem;		/* the window in memory, or */
+	int		 file;		/* in an unlinked file */
+	size_t		 size;
+	int64_t		 head;		/* stream bytes received */
+	int64_t		 tail;		/* oldest byte still held */
+	tshift_key_t	 keys[TSHIFT_KEYS];
+	int		 key0;		/* oldest in keys[] */
+	int		 nkeys;
+	int64_t		 pts0;		/* of the first keyframe, npt 0 */
+	uint8_t		 pkt[188];	/* packet being indexed */
+	int		 pkt_len;
+	int64_t		 pkt_off;
+	int		 eof;		/* the data connection ended */
+	int		 closed;
+	int		 readers;
+	volatile int	 run;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+} tshift_t;
+
+/*
+ * Read-ahead of a network input (readahead.c): a thread reads the
+ * source into a ring ahead of the demuxer, which reads from memory.
+ */
+#define READAHEAD_DEFAULT_MB	16
+#define READAHEAD_LOW		50	/* % of the ring: refill below */
+#define READAHEAD_HIGH		75	/* up to; the rest keeps history */
+
+typedef struct {
+	/* Bytes read, 0 at the end, < 0 on error */
+	int		(*read)(void *opaque, uint8_t *buf, int size);
+	/* Move to absolute offset off: 0, or < 0; NULL if unseekable */
+	int		(*seek)(void *opaque, int64_t off);
+	void		*opaque;
+	int64_t		 size;		/* of the stream, -1 if unknown */
+	/* Reader gives up waiting when non-zero; may be NULL */
+	int		(*interrupt)(void *arg);
+	void		*interrupt_arg;
+} readahead_src_t;
+
+typedef struct {
+	size_t		 level;		/* bytes buffered ahead */
+	size_t		 size;
+	int64_t		 bytes;		/* read from the source */
+	int64_t		 stalls;	/* reads that found nothing buffered */
+	int64_t		 stall_us;	/* waiting for the source, total */
+	int64_t		 seeks;		/* source seeks */
+	int64_t		 hits;		/* seeks served from the ring */
+} readahead_stats_t;
+
+typedef struct {
+	readahead_src_t	 src;
+	uint8_t		*buf;
+	size_t		 size;
+	size_t		 low;		/* refill below this much ahead */
+	size_t		 high;		/* up to this much */
+	int64_t		 head;		/* stream offset of the next byte in */
+	int64_t		 pos;		/* of the next byte out */
+	int64_t		 tail;		/* oldest byte still held */
+	int64_t		 seek_to;	/* for the thread, -1 if none */
+	int		 gen;		/* bumped by every source seek */
+	int		 filling;
+	int		 eof;
+	int		 err;
+	volatile int	 run;
+	int		 started;
+	readahead_stats_t stats;
+	readahead_stats_t reported;	/* at the last readahead_report() */
+	int64_t		 report_us;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;		/* data in, or room */
+} readahead_t;
+
+/* Server side of a connection handshake in progress (net.c) */
+typedef struct {
+	int		 fd;
+	int		 tag;		/* the caller's */
+	int64_t		 deadline;	/* ms, monotonic */
+	char		 want[65];	/* the expected answer, hex */
+	char		 line[128];	/* the answer so far */
+	size_t		 len;
+	int		 denied;	/* the answer was wrong */
+} net_auth_t;
+
+/* Native X11 screen capture (xshm.c) */
+typedef struct xshm_ctx xshm_ctx_t;
+
+/*
+ * Pipeline profile (media.c): how much the output path buffers, traded
+ * against latency.  A media context without one uses "balanced".
+ */
+typedef struct {
+	const char	*name;
+	const char	*desc;
+	int		 flush_packets;	/* flush the muxer after each packet */
+	int64_t		 interleave_us;	/* muxer max_interleave_delta */
+	int		 avio_size;	/* output AVIO buffer */
+	int		 pipe_size;	/* output pipe/socket buffer, 0 = system */
+	int		 async_depth;	/* VAAPI encoder pipeline depth */
+	int		 zerolatency;	/* x264/x265 tune=zerolatency */
+	int		 thread_type;	/* FF_THREAD_*, 0 = FFmpeg default */
+	int		 coalesce_pkts;	/* tsout.c: write at this many packets */
+	int64_t		 coalesce_us;	/* or after this long */
+} profile_t;
+
 /* Media context */
 typedef struct {
 	int		 mode;		/* MODE_FILE or MODE_SCREEN */
@@ -50,6 +375,7 @@ typedef struct {
 	int		 needs_transcode;
 	int		 bitrate;	/* video bitrate in kbps */
 	int		 vcodec;	/* VCODEC_H264 or VCODEC_HEVC */
+	int		 max_height;	/* output height cap, 0 = auto */
 	char		 mime_type[64];
 	char		 dlna_profile[64]; /* DLNA.ORG_PN value */
 
@@ -61,6 +387,13 @@ typedef struct {
 	AVFormatContext	*ifmt_ctx;
 	int		 video_idx;
 	int		 audio_idx;
+	int		 full_probe;	/* FFmpeg's probe sizes from the start */
+	int64_t		 probe_bytes;	/* read by media_probe() */
+	int		 probe_tries;
+	readahead_t	*ra;		/* network input read ahead, or NULL */
+	int		 readahead_mb;	/* its ring, 0 = none */
+	int		 readahead_low;	/* watermarks, % of the ring */
+	int		 readahead_high;
 	AVCodecContext	*video_dec;
 	AVCodecContext	*audio_dec;
 
@@ -92,7 +425,7 @@ typedef struct {
 	int		 start_sec;	/* transcode start position */
 	int		 duration_sec;	/* total duration (0 if unknown) */
 
-	AVIOContext	*avio_in;	/* custom AVIO for sink socket input, freed by media_close */
+	AVIOContext	*avio_in;	/* read-ahead input, or NULL */
 
 	/* audio channel remapping (map[out] = in_index, -1 = silence) */
 	int		 channelmap[6];
@@ -103,8 +436,226 @@ typedef struct {
 
 	/* control socket fd for sending STOP when stream ends naturally */
 	int		 ctrl_fd;
+	int		 continuous;	/* items are spliced into one stream */
+	int		 queue_next;	/* the next item is queued on the TV */
+
+	/*
+	 * Partial transcode window, used to pre-encode snippets and to
+	 * continue a snippet seamlessly.  Positions are input timestamps
+	 * in AV_TIME_BASE units; all zero means the whole file.
+	 */
+	int64_t		 trim_us;	/* drop decoded input before this */
+	int64_t		 end_us;	/* stop at this position (0 = EOF) */
+	int64_t		 origin_us;	/* output timestamp of first frame */
+	int		 past_end;	/* set once end_us was reached */
+
+	/* pre-encoded MPEG-TS written before the header (owned, free()d) */
+	uint8_t		*prefix;
+	size_t		 prefix_len;
+	splice_t	*splice;	/* rewrites what follows the prefix */
+
+	/* tee of the MPEG-TS output into the transcode cache (-1 = none) */
+	int		 cache_fd;
+	int		 completed;	/* ran to EOF or end_us, all sent */
+
+	int		 threads;	/* codec threads, 0 = FFmpeg default */
+	int		 low_latency;	/* intra refresh, slices, small VBV */
+	const profile_t	*profile;	/* NULL = balanced */
+	tsout_t		 out;		/* coalesces writes to pipe_wr */
+	int		 use_shm;	/* offer a ring on a data socket */
+	shmring_t	*ring;		/* output goes here, pipe_wr idles */
+
+	/* the output starts with a video keyframe, audio waits for it */
+	int		 video_started;
+	AVPacket	*held[AUDIO_HOLD];
+	int		 nheld;
+	int		 video_dropped;	/* remux: packets before the keyframe */
+	int64_t		 video_drop_ts;	/* and the first one's timestamp */
+
+	/* adapt the video bitrate to the link (live output only) */
+	int		 adaptive;
+	abr_ctx_t	 abr;
+
+	/* step quality down while software encoding falls behind */
+	int		 governed;
+	gov_ctx_t	 gov;
+	int64_t		 write_us;	/* blocked writing output, total */
+	int		 scale_width;	/* software filter scales, 0 = no */
+	int		 scale_height;
+	int		 aac_fast;	/* AAC fast coder */
+	int		 aac_reopen;	/* audio encoder to be reopened */
+	int64_t		 audio_min_pts;	/* drop audio before (enc tb) */
+
+	/* screen capture source, and skipping of unchanged frames */
+	xshm_ctx_t	*xshm;		/* native grabber, NULL = x11grab */
+	int		 screen_clean;	/* grabber saw no damage */
+	dedupe_ctx_t	 dedupe;
+	audio_queue_t	 audio_q;
+	avsync_ctx_t	 sync;
 } media_ctx_t;
 
+/* On-disk transcode cache (cache.c) */
+#define CACHE_DEFAULT_MB	4096
+
+typedef struct {
+	char		 dir[1024];
+	long long	 max_bytes;
+	int		 wfd;		/* entry being written, -1 if none */
+	char		 wkey[32];
+} cache_ctx_t;
+
+/* Speculative seek cache (spec.c) */
+#define SPEC_MAX_ENTRIES	8
+#define SPEC_MAX_TARGETS	8
+#define SPEC_SNIPPET_SEC	4	/* whole GOPs: the GOP is one second */
+#define SPEC_TOLERANCE_SEC	3	/* max distance for a cache hit */
+#define SPEC_MAX_BYTES		(64 * 1024 * 1024)
+
+typedef struct {
+	int		 start_sec;
+	int		 last_used;	/* prediction tick, for LRU eviction */
+	uint8_t		*data;		/* MPEG-TS, NULL if slot is free */
+	size_t		 len;
+} spec_entry_t;
+
+typedef struct {
+	media_ctx_t	 media;		/* worker's own input and pipeline */
+	int		 duration_sec;
+	int		 started;
+	volatile int	 running;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	int		 center_sec;	/* position the targets were made for */
+	int		 stale;		/* targets need re-centring */
+	int		 targets[SPEC_MAX_TARGETS];
+	int		 ntargets;
+	int		 tick;
+	spec_entry_t	 entries[SPEC_MAX_ENTRIES];
+	size_t		 bytes;
+} spec_ctx_t;
+
+/* Playlist look-ahead (lookahead.c) */
+#define LOOKAHEAD_ITEMS		2
+#define LOOKAHEAD_SEC		60	/* opening to pre-encode */
+#define LOOKAHEAD_MAX_BYTES	(128 * 1024 * 1024)
+
+enum {
+	LA_EMPTY,
+	LA_BUSY,	/* worker is preparing it */
+	LA_READY,
+	LA_FAILED,
+	LA_TAKEN	/* handed to the main loop */
+};
+
+typedef struct {
+	int		 idx;		/* file index, -1 if unused */
+	int		 state;
+	volatile int	 wanted;	/* cleared to abort preparation */
+	media_ctx_t	 media;		/* probed input */
+	uint8_t		*data;		/* pre-encoded opening or NULL */
+	size_t		 len;
+	int		 sec;
+} lookahead_item_t;
+
+typedef struct {
+	char *const	*files;
+	int		 nfiles;
+	media_ctx_t	 tmpl;		/* per-file settings */
+	int		 force_transcode;
+	cache_ctx_t	*cache;		/* skip cached files, may be NULL */
+	int		 started;
+	volatile int	 running;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	int		 current;	/* index of the playing item */
+	lookahead_item_t items[LOOKAHEAD_ITEMS]; /* by idx % LOOKAHEAD_ITEMS */
+} lookahead_ctx_t;
+
+/* Parallel playlist probing (probe.c) */
+#define PROBE_THREADS		8
+
+enum {
+	PROBE_PENDING,
+	PROBE_BUSY,	/* a worker is probing it */
+	PROBE_DONE,
+	PROBE_FAILED,
+	PROBE_TAKEN	/* left to the main loop */
+};
+
+/* What a probe finds out, enough to serve a file without opening it */
+typedef struct {
+	int		 needs_transcode;
+	int		 video_idx;
+	int		 audio_idx;
+	int		 duration_sec;
+	char		 mime_type[64];
+	char		 dlna_profile[64];
+} probe_info_t;
+
+typedef struct {
+	int		 state;
+	probe_info_t	 info;
+} probe_item_t;
+
+typedef struct {
+	char *const	*files;
+	int		 nfiles;
+	media_ctx_t	 tmpl;		/* per-file settings */
+	int		 force_transcode;
+	char		 dir[1024];	/* results on disk, "" = none */
+	probe_item_t	*items;
+	int		 next;		/* next item for a worker */
+	int		 nthreads;
+	pthread_t	 threads[PROBE_THREADS];
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+} probe_pool_t;
+
+/* Chunked batch transcoding (chunk.c) */
+#define CHUNK_SEC		30	/* target chunk length */
+#define CHUNK_MAX_BYTES		(256 * 1024 * 1024)
+#define CHUNK_MAX_STREAMS	16
+#define CHUNK_MAX_REMOTES	16
+#define CHUNK_DEFAULT_PORT	7389
+
+enum {
+	CHUNK_PENDING,
+	CHUNK_RUNNING,
+	CHUNK_DONE
+};
+
+typedef struct {
+	int64_t		 start_us;	/* input position (demuxer time) */
+	int64_t		 end_us;	/* 0 = to EOF */
+	int64_t		 origin_us;	/* output position */
+	int		 state;
+	uint8_t		*data;		/* encoded MPEG-TS */
+	size_t		 len;
+} chunk_t;
+
+typedef struct {
+	char		 host[256];
+	int		 port;
+	int		 jobs;		/* connections (chunks in flight) */
+	const char	*key;		/* the worker's, or NULL */
+} chunk_remote_t;
+
+typedef struct {
+	const media_ctx_t *tmpl;	/* per-file settings */
+	const char	*filepath;
+	int		 force_transcode;
+	int		 threads;	/* codec threads per local worker */
+	chunk_t		*chunks;
+	int		 nchunks;
+	int		 ndone;
+	int		 nworkers;	/* workers still running */
+	volatile int	 active;	/* cleared on failure */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+} chunk_job_t;
+
 /* UPnP context */
 typedef struct {
 	char		 tv_ip[64];
@@ -113,15 +664,56 @@ typedef struct {
 	char		 control_url[256];
 	char		 local_ip[64];
 	int		 local_http_port;
+	int		 can_queue;	/* has SetNextAVTransportURI */
 } upnp_ctx_t;
 
 /* HTTP server context */
+#define HTTPD_MAX_SRC		8	/* TVs served by one server */
+#define HTTPD_WORKERS_PER_SRC	2	/* a stream and a probe or reconnect */
+#define HTTPD_QUEUE		16	/* accepted connections not yet taken */
+#define HTTPD_LINGER_MS		3000	/* an ended segment waits for a next */
+
+/* What is served under /media/<n>/ */
+typedef struct {
+	media_ctx_t	*media;
+	shmring_t	*ring;		/* of the data connection ring_ino */
+	ino_t		 ring_ino;
+	pthread_mutex_t	 pipe_lock;	/* one reader of the pipe at a time */
+
+	/* continuous stream: media->pipe_rd is the item being sent */
+	int		 live;		/* a TV is receiving it */
+	int		 next_fd;	/* data connection of the next item */
+	volatile int	 cut;		/* drop the rest of the current one */
+	volatile int	 gen;		/* bumped when the stream is dropped */
+	pthread_mutex_t	 splice_lock;	/* the above and pipe_rd */
+	pthread_cond_t	 splice_cond;
+
+	/* gapless: the segment queued with SetNextAVTransportURI */
+	int		 next_seg;	/* its number, 0 if none */
+	char		 next_mime[64];
+	char		 next_dlna[64];
+	prefetch_t	*prefetch;	/* its data connection, read ahead */
+
+	tshift_t	*tshift;	/* live segment: its time-shift window */
+} httpd_src_t;
+
 typedef struct {
 	int		 listen_fd;
 	int		 port;
-	media_ctx_t	*media;
+	httpd_src_t	 src[HTTPD_MAX_SRC];
+	int		 nsrc;
 	volatile int	 running;
-	pthread_t	 thread;
+	pthread_t	 thread;	/* accepts and queues connections */
+	pthread_t	 workers[HTTPD_MAX_SRC * HTTPD_WORKERS_PER_SRC + 1];
+	int		 nworkers;
+	int		 queue[HTTPD_QUEUE];
+	int		 qhead;
+	int		 qlen;
+	int		 idle;		/* workers waiting for a connection */
+	pthread_mutex_t	 lock;		/* queue, idle, running */
+	pthread_cond_t	 cond;
+	size_t		 tshift_size;	/* per live segment, 0 = none */
+	const char	*tshift_dir;	/* window on disk there, or in memory */
 } httpd_ctx_t;
 
 /* Samsung app entry */
@@ -138,7 +730,9 @@ typedef struct {
 	char	 name[192];	/* friendlyName (modelName) */
 } upnp_device_t;
 
-/* dlna.c */
+/* dlna.c; is_streaming DLNA_TIMESHIFT: live, time seeks in a window */
+#define DLNA_TIMESHIFT		2
+
 void	 build_dlna_features(char *buf, size_t buflen,
 	    const char *dlna_profile, int is_streaming);
 
@@ -149,6 +743,9 @@ int	 upnp_wake(upnp_ctx_t *ctx);
 int	 upnp_find_transport(upnp_ctx_t *ctx);
 int	 upnp_set_uri(upnp_ctx_t *ctx, const char *uri, const char *mime,
 	    const char *title, int is_streaming, const char *dlna_profile);
+int	 upnp_set_next_uri(upnp_ctx_t *ctx, const char *uri,
+	    const char *mime, const char *title, int is_streaming,
+	    const char *dlna_profile);
 int	 upnp_play(upnp_ctx_t *ctx);
 int	 upnp_stop(upnp_ctx_t *ctx);
 int	 upnp_get_local_ip(upnp_ctx_t *ctx);
@@ -161,16 +758,32 @@ int	 upnp_list_apps(upnp_ctx_t *ctx, app_entry_t *apps, int max_apps);
 int	 upnp_launch_app(upnp_ctx_t *ctx, const char *app_id);
 
 /* httpd.c */
-int	 httpd_start(httpd_ctx_t *ctx, media_ctx_t *media, int port);
+int	 httpd_start(httpd_ctx_t *ctx, media_ctx_t **media, int nmedia,
+	    int port);
 void	 httpd_stop(httpd_ctx_t *ctx);
+int	 httpd_splice(httpd_ctx_t *ctx, int src, int fd, int cut);
+void	 httpd_drop_pipe(httpd_ctx_t *ctx, int src);
+int	 httpd_live(httpd_ctx_t *ctx, int src);
+int	 httpd_queue(httpd_ctx_t *ctx, int src, int fd, int seg,
+	    const char *mime, const char *dlna);
+int	 httpd_timeshift(httpd_ctx_t *ctx, int src);
 
 /* media.c */
+extern const profile_t profiles[];
+const profile_t *profile_find(const char *name);
 int	 ffmpeg_interrupt_cb(void *opaque);
 void	 media_list_audio_streams(const char *filepath);
 int	 media_probe(media_ctx_t *ctx, const char *filepath, int force_transcode);
 int	 media_open_transcode(media_ctx_t *ctx);
 int	 media_restart_transcode(media_ctx_t *ctx, int start_sec);
 void	 media_close_transcode_state(media_ctx_t *ctx);
+void	 media_from_template(media_ctx_t *m, const media_ctx_t *tmpl,
+	    const char *filepath);
+int	 media_set_prefix(media_ctx_t *ctx, uint8_t *data, size_t len);
+int64_t	 media_start_us(const media_ctx_t *ctx);
+int	 media_encode_window(media_ctx_t *ctx, int64_t start_us,
+	    int64_t end_us, size_t max_bytes, volatile int *keep_going,
+	    uint8_t **out, size_t *outlen);
 int	 media_open_screen(media_ctx_t *ctx);
 void	*media_transcode_thread(void *arg);
 void	*media_capture_thread(void *arg);
@@ -181,8 +794,166 @@ int	 media_probe_avfmt(media_ctx_t *ctx, AVFormatContext *fmt, int force_transco
 int	 media_open_remux(media_ctx_t *ctx);
 void	*media_remux_thread(void *arg);
 
+/* spec.c */
+int	 spec_start(spec_ctx_t *sc, const media_ctx_t *tmpl,
+	    const char *filepath);
+void	 spec_predict(spec_ctx_t *sc, int pos_sec);
+int	 spec_take(spec_ctx_t *sc, int target_sec, uint8_t **data,
+	    size_t *len, int *start_sec);
+void	 spec_stop(spec_ctx_t *sc);
+
+/* cache.c */
+uint64_t cache_hash(const char *s);
+int	 cache_mkdir(const char *dir);
+int	 cache_init(cache_ctx_t *c, const char *dir, long long max_bytes);
+int	 cache_key(const media_ctx_t *ctx, char *key, size_t keysz);
+int	 cache_lookup(cache_ctx_t *c, const char *key, char *path,
+	    size_t pathsz);
+int	 cache_begin(cache_ctx_t *c, const char *key);
+void	 cache_commit(cache_ctx_t *c);
+void	 cache_abort(cache_ctx_t *c);
+void	 cache_trim(cache_ctx_t *c);
+
+/* lookahead.c */
+int	 lookahead_start(lookahead_ctx_t *la, char *const *files, int nfiles,
+	    const media_ctx_t *tmpl, int force_transcode, cache_ctx_t *cache);
+void	 lookahead_advance(lookahead_ctx_t *la, int idx);
+int	 lookahead_take(lookahead_ctx_t *la, int idx, media_ctx_t *media,
+	    uint8_t **data, size_t *len, int *sec);
+void	 lookahead_stop(lookahead_ctx_t *la);
+
+/* probe.c */
+int	 probe_key(const char *path, const media_ctx_t *tmpl,
+	    int force_transcode, char *key, size_t keysz);
+int	 probe_load(const char *dir, const char *key, probe_info_t *info);
+int	 probe_store(const char *dir, const char *key,
+	    const probe_info_t *info);
+void	 probe_save(probe_info_t *info, const media_ctx_t *ctx);
+void	 probe_apply(media_ctx_t *ctx, const probe_info_t *info);
+int	 probe_start(probe_pool_t *p, char *const *files, int nfiles,
+	    const media_ctx_t *tmpl, int force_transcode, const char *dir);
+int	 probe_get(probe_pool_t *p, int idx, probe_info_t *info);
+void	 probe_put(probe_pool_t *p, int idx, const media_ctx_t *ctx);
+void	 probe_stop(probe_pool_t *p);
+
+/* abr.c */
+void	 abr_init(abr_ctx_t *a, int kbps);
+void	 abr_note_write(abr_ctx_t *a, size_t len, int64_t stall_us,
+	    int queue_pct);
+void	 abr_note_pts(abr_ctx_t *a, int64_t pts_us);
+int	 abr_update(abr_ctx_t *a, int64_t now_us);
+int	 abr_queue_pct(int fd);
+
+/* gov.c */
+void	 gov_init(gov_ctx_t *g, int width, int height, int fps_num,
+	    int fps_den);
+void	 gov_note_busy(gov_ctx_t *g, int64_t us);
+void	 gov_note_frame(gov_ctx_t *g);
+int	 gov_update(gov_ctx_t *g);
+
+/* dedupe.c */
+int	 dedupe_frame(dedupe_ctx_t *d, const uint8_t *data, int linesize,
+	    int width, int height, int bpp);
+void	 dedupe_report(const dedupe_ctx_t *d);
+void	 dedupe_free(dedupe_ctx_t *d);
+
+/* avsync.c */
+void	 avsync_init(avsync_ctx_t *s, int64_t t0);
+void	 avsync_note_video(avsync_ctx_t *s, int64_t pos_us, int64_t cap_us,
+	    int64_t now_us);
+void	 avsync_note_audio(avsync_ctx_t *s, int64_t pos_us, int64_t cap_us,
+	    int64_t now_us);
+int	 avsync_update(avsync_ctx_t *s, int64_t now_us);
+
+/* tslock.c */
+void	 tslock_init(tslock_t *t);
+int	 tslock_feed(tslock_t *t, const uint8_t *buf, size_t len);
+
+/* tsout.c */
+int	 tsout_init(tsout_t *o, int pkts, int64_t budget_us,
+	    int (*sink)(void *, const struct iovec *, int), void *opaque);
+int	 tsout_write(tsout_t *o, const uint8_t *data, size_t len,
+	    int64_t now_us);
+int	 tsout_tick(tsout_t *o, int64_t now_us);
+int	 tsout_push(tsout_t *o, int64_t now_us);
+int	 tsout_flush(tsout_t *o);
+void	 tsout_report(const tsout_t *o);
+void	 tsout_free(tsout_t *o);
+
+/* splice.c */
+void	 splice_init(splice_t *s);
+void	 splice_next(splice_t *s);
+size_t	 splice_feed(splice_t *s, const uint8_t *in, size_t len,
+	    uint8_t *out);
+
+/* tshift.c */
+tshift_t	*tshift_open(int fd, size_t size, const char *dir);
+void	 tshift_close(tshift_t *t);
+void	 tshift_hold(tshift_t *t);
+void	 tshift_release(tshift_t *t);
+int64_t	 tshift_live(tshift_t *t);
+int64_t	 tshift_seek(tshift_t *t, double npt, double *at);
+int	 tshift_holds(tshift_t *t, int64_t off);
+ssize_t	 tshift_read(tshift_t *t, int64_t *off, void *buf, size_t len);
+
+/* readahead.c */
+readahead_t	*readahead_new(size_t size, int low_pct, int high_pct);
+int	 readahead_start(readahead_t *ra, const readahead_src_t *src);
+int	 readahead_read(readahead_t *ra, uint8_t *buf, int size);
+int64_t	 readahead_seek(readahead_t *ra, int64_t off, int whence);
+void	 readahead_stats(readahead_t *ra, readahead_stats_t *st);
+void	 readahead_report(readahead_t *ra);
+void	 readahead_close(readahead_t *ra);
+
+/* prefetch.c */
+int	 prefetch_start(prefetch_t *p, int fd, size_t size);
+void	 prefetch_stop(prefetch_t *p);
+void	 prefetch_free(prefetch_t *p);
+
+/* shmring.c */
+shmring_t	*shmring_create(size_t size);
+int	 shmring_send(shmring_t *r, int sock);
+shmring_t	*shmring_accept(int sock, void *buf, size_t len, ssize_t *n);
+int	 shmring_write(shmring_t *r, const struct iovec *iov, int n,
+	    volatile int *running, int sock);
+const uint8_t	*shmring_peek(shmring_t *r, size_t max, size_t *len,
+	    volatile int *running, int sock);
+void	 shmring_consume(shmring_t *r, size_t len);
+int	 shmring_fill_pct(const shmring_t *r);
+void	 shmring_free(shmring_t *r);
+
+/* xshm.c */
+xshm_ctx_t	*xshm_open(const char *display, int fps, int draw_mouse);
+void	 xshm_size(const xshm_ctx_t *x, int *width, int *height);
+int	 xshm_grab(xshm_ctx_t *x, AVFrame *frame);
+void	 xshm_close(xshm_ctx_t *x);
+
+/* chunk.c */
+int	 chunk_stitch(const chunk_t *chunks, int nchunks, int out_fd);
+int	 chunk_transcode(const media_ctx_t *tmpl, const char *filepath,
+	    int force_transcode, int jobs, const chunk_remote_t *remotes,
+	    int nremotes, int out_fd);
+int	 chunk_serve(int port, const char *key);
+int	 chunk_parse_remote(const char *spec, chunk_remote_t *r);
+int	 chunk_prepare(const media_ctx_t *tmpl, char *const *files,
+	    int nfiles, int force_transcode, int jobs,
+	    const chunk_remote_t *remotes, int nremotes, cache_ctx_t *cache);
+
+/* net.c */
+int	 net_is_tcp(const char *addr);
+int	 net_listen(const char *addr);
+int	 net_connect(const char *addr);
+int	 net_is_unix(int fd);
+int	 net_auth_begin(net_auth_t *a, int fd, const char *key);
+int	 net_auth_poll(net_auth_t *a);
+int	 net_auth_accept(int fd, const char *key);
+int	 net_auth_connect(int fd, const char *key);
+void	 net_hmac(const char *key, const uint8_t *msg, size_t len,
+	    uint8_t out[32]);
+
 /* server.c */
-int	 server_run(upnp_ctx_t *upnp, httpd_ctx_t *httpd,
-	    const char *ctrl_path, const char *data_path);
+int	 server_addr(const char *base, int tv, char *buf, size_t bufsz);
+int	 server_run(upnp_ctx_t *tvs, int ntv, httpd_ctx_t *httpd,
+	    const char *ctrl_path, const char *data_path, const char *key);
 
 #endif /* SEND2TV_H */
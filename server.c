@@ -1,10 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
 #include <sys/socket.h>
-#include <sys/un.h>
 
 #include "send2tv.h"
 
@@ -37,146 +37,266 @@ read_line(int fd, char *buf, size_t bufsz)
 	return (int)n;
 }
 
+#define SESSION_PENDING	4	/* handshakes in progress, per TV */
+
+enum { SESSION_CTRL, SESSION_DATA };
+
+/* One TV of the server: its sockets, renderer and stream */
+typedef struct {
+	int		 id;		/* served as /media/<id>/<segment> */
+	upnp_ctx_t	*upnp;
+	httpd_ctx_t	*httpd;
+	const char	*key;
+	char		 ctrl_addr[256];
+	char		 data_addr[256];
+	int		 ctrl_listen;
+	int		 data_listen;
+	media_ctx_t	 media;
+	int		 seg_id;
+	pthread_t	 thread;
+} session_t;
+
 /*
- * Create and bind a Unix domain socket at path, ready to accept.
- * Returns the listening fd on success, -1 on failure.
+ * Address of TV tv's control or data socket: base for the first TV,
+ * then base.1, base.2 ... for paths and port+1, port+2 ... for TCP.
+ * Returns 0, or -1 if it does not fit or the port is out of range.
  */
-static int
-unix_listen(const char *path)
+int
+server_addr(const char *base, int tv, char *buf, size_t bufsz)
 {
-	struct sockaddr_un	 addr;
-	int			 fd;
+	const char	*colon;
+	int		 port;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fd < 0) {
-		perror("socket");
-		return -1;
-	}
-	unlink(path);
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
-	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		close(fd);
-		return -1;
-	}
-	if (listen(fd, 1) < 0) {
-		perror("listen");
-		close(fd);
+	if (tv == 0)
+		return strlcpy(buf, base, bufsz) < bufsz ? 0 : -1;
+	if (!net_is_tcp(base))
+		return snprintf(buf, bufsz, "%s.%d", base, tv) <
+		    (int)bufsz ? 0 : -1;
+	colon = strrchr(base, ':');
+	port = atoi(colon + 1) + tv;
+	if (port > 65535)
 		return -1;
-	}
-	return fd;
+	return snprintf(buf, bufsz, "%.*s:%d", (int)(colon - base), base,
+	    port) < (int)bufsz ? 0 : -1;
 }
 
 /*
- * Server main loop.
- * upnp must already be connected (upnp_find_transport done by caller).
- * httpd must already be started (httpd_start done by caller).
+ * Start a new segment from the data connection *data_fd and have the TV
+ * play it.  A continuous one takes the items spliced in later; a live
+ * one is kept in a time-shift window, so that the TV can pause it.
  */
-int
-server_run(upnp_ctx_t *upnp, httpd_ctx_t *httpd,
-    const char *ctrl_path, const char *data_path)
+static void
+session_play(session_t *s, int *data_fd, const char *mime,
+    const char *dlna, int continuous, int live)
 {
-	media_ctx_t	 media;
-	int		 ctrl_listen = -1, data_listen = -1;
-	int		 ctrl_fd = -1, data_fd = -1;
-	int		 seg_id = 0;
-	int		 ret = -1;
+	media_ctx_t	*media = &s->media;
+	upnp_ctx_t	*upnp = s->upnp;
 	char		 url[256];
+	int		 ts;
 
-	memset(&media, 0, sizeof(media));
-	media.pipe_rd = -1;
-	media.pipe_wr = -1;
-	media.ctrl_fd = -1;
-	media.mode    = MODE_SINK;
+	/* Switch to new segment */
+	media->running = 0;
+	httpd_drop_pipe(s->httpd, s->id);
 
-	ctrl_listen = unix_listen(ctrl_path);
-	if (ctrl_listen < 0) {
-		fprintf(stderr, "server: cannot create control socket %s\n",
-		    ctrl_path);
-		goto done;
+	if (*data_fd < 0) {
+		fprintf(stderr, "server: PLAY with no data connection\n");
+		return;
 	}
-	data_listen = unix_listen(data_path);
-	if (data_listen < 0) {
-		fprintf(stderr, "server: cannot create data socket %s\n",
-		    data_path);
-		goto done;
+	media->pipe_rd = *data_fd;
+	*data_fd = -1;
+	media->running = 1;
+	media->mode = MODE_SINK;
+	media->continuous = continuous;
+	media->queue_next = upnp->can_queue && !continuous;
+	strlcpy(media->mime_type, mime, sizeof(media->mime_type));
+	strlcpy(media->dlna_profile, dlna, sizeof(media->dlna_profile));
+
+	s->seg_id++;
+	snprintf(url, sizeof(url), "http://%s:%d/media/%d/%d",
+	    upnp->local_ip, s->httpd->port, s->id, s->seg_id);
+	printf("Server: segment %d — %s\n", s->seg_id, url);
+
+	ts = live && httpd_timeshift(s->httpd, s->id) == 0;
+	if (ts)
+		printf("Server: TV %d: time-shift window of %zu MB\n", s->id,
+		    s->httpd->tshift_size >> 20);
+	if (upnp_set_uri(upnp, url, mime, "Client",
+	    ts ? DLNA_TIMESHIFT : 1, dlna) < 0 ||
+	    upnp_play(upnp) < 0)
+		fprintf(stderr, "server: TV playback failed\n");
+}
+
+/*
+ * Queue the data connection *data_fd as the segment the TV plays when
+ * the current one ends, so that it switches without a gap.  Returns 0,
+ * or -1 if the TV cannot queue or has finished already.
+ */
+static int
+session_queue(session_t *s, int *data_fd, const char *mime,
+    const char *dlna)
+{
+	upnp_ctx_t	*upnp = s->upnp;
+	char		 url[256];
+
+	if (*data_fd < 0 || !upnp->can_queue || s->media.continuous ||
+	    !httpd_live(s->httpd, s->id))
+		return -1;
+	snprintf(url, sizeof(url), "http://%s:%d/media/%d/%d",
+	    upnp->local_ip, s->httpd->port, s->id, s->seg_id + 1);
+	if (upnp_set_next_uri(upnp, url, mime, "Client", 1, dlna) < 0 ||
+	    httpd_queue(s->httpd, s->id, *data_fd, s->seg_id + 1, mime,
+	    dlna) < 0)
+		return -1;
+	*data_fd = -1;
+	s->seg_id++;
+	printf("Server: TV %d: segment %d queued — %s\n", s->id, s->seg_id,
+	    url);
+	return 0;
+}
+
+/*
+ * Take a connection whose handshake is done as the control or data
+ * connection of s, in place of any earlier one.
+ */
+static void
+session_admit(session_t *s, const net_auth_t *a, int *ctrl_fd,
+    int *ctrl_unix, int *data_fd)
+{
+	if (a->tag == SESSION_CTRL) {
+		if (*ctrl_fd >= 0) {
+			upnp_stop(s->upnp);
+			close(*ctrl_fd);
+		}
+		*ctrl_fd = a->fd;
+		*ctrl_unix = net_is_unix(a->fd);
+		printf("Server: TV %d: client connected\n", s->id);
+	} else {
+		if (*data_fd >= 0)
+			close(*data_fd);
+		*data_fd = a->fd;
+		DPRINTF("server: data connection accepted\n");
 	}
+}
 
-	/* Start HTTP server, pointing it at our local media context */
-	if (httpd_start(httpd, &media, 0) < 0) {
-		fprintf(stderr, "server: cannot start HTTP server\n");
-		goto done;
+/*
+ * Drop a connection whose handshake failed, or that made room for a
+ * newer one (evicted).
+ */
+static void
+session_refuse(const net_auth_t *a, int evicted)
+{
+	fprintf(stderr, "server: %s connection refused, %s\n",
+	    a->tag == SESSION_CTRL ? "control" : "data",
+	    evicted ? "too many pending handshakes" :
+	    a->denied ? "bad key" : "handshake failed");
+	close(a->fd);
+}
+
+/*
+ * Accept a connection on listening socket lfd and start its handshake,
+ * which goes on in pend[] while it waits for the client.  The oldest
+ * one waiting makes room if there are too many.
+ */
+static void
+session_accept(session_t *s, int lfd, int tag, net_auth_t *pend,
+    int *npend, int *ctrl_fd, int *ctrl_unix, int *data_fd)
+{
+	net_auth_t	*a;
+	int		 fd, r;
+
+	if ((fd = accept(lfd, NULL, NULL)) < 0)
+		return;
+	if (*npend == SESSION_PENDING) {
+		session_refuse(&pend[0], 1);
+		memmove(pend, pend + 1, --*npend * sizeof(*pend));
 	}
-	printf("Server: HTTP server on port %d\n", httpd->port);
+	a = &pend[*npend];
+	r = net_auth_begin(a, fd, s->key);
+	a->tag = tag;
+	if (r > 0)
+		session_admit(s, a, ctrl_fd, ctrl_unix, data_fd);
+	else if (r < 0)
+		session_refuse(a, 0);
+	else
+		(*npend)++;
+}
 
-	printf("Server: control socket %s\n", ctrl_path);
-	printf("Server: data socket    %s\n", data_path);
+/*
+ * Session thread: the control channel of one TV and its SOAP calls, so
+ * that a slow TV holds up nobody else.
+ */
+static void *
+session_thread(void *arg)
+{
+	session_t	*s = arg;
+	upnp_ctx_t	*upnp = s->upnp;
+	media_ctx_t	*media = &s->media;
+	net_auth_t	 pend[SESSION_PENDING], a;
+	int		 ctrl_fd = -1, data_fd = -1, ctrl_unix = 0;
+	int		 npend = 0, i, r;
+	char		 url[256];
+	char		 file_path[1024];
 
 	upnp_stop(upnp);
-	ret = 0;
 
 	while (running) {
-		struct pollfd	 pfds[3];
-		int		 nfds = 2;
+		struct pollfd	 pfds[3 + SESSION_PENDING];
+		int		 nfds = 3;
 
-		pfds[0].fd     = ctrl_listen;
+		pfds[0].fd     = s->ctrl_listen;
 		pfds[0].events = POLLIN;
-		pfds[1].fd     = data_listen;
+		pfds[1].fd     = s->data_listen;
 		pfds[1].events = POLLIN;
-		if (ctrl_fd >= 0) {
-			pfds[2].fd     = ctrl_fd;
-			pfds[2].events = POLLIN;
-			nfds = 3;
+		pfds[2].fd     = ctrl_fd;	/* ignored while < 0 */
+		pfds[2].events = POLLIN;
+		for (i = 0; i < npend; i++) {
+			pfds[nfds].fd = pend[i].fd;
+			pfds[nfds++].events = POLLIN;
 		}
 
-		if (poll(pfds, nfds, 500) <= 0)
+		if (poll(pfds, nfds, 500) < 0)
 			continue;
 
-		/* New control connection */
-		if (pfds[0].revents & POLLIN) {
-			int newfd = accept(ctrl_listen, NULL, NULL);
-			if (newfd >= 0) {
-				if (ctrl_fd >= 0) {
-					upnp_stop(upnp);
-					close(ctrl_fd);
-				}
-				ctrl_fd = newfd;
-				printf("Server: client connected\n");
+		/* Handshakes going on: answered, wrong or out of time */
+		for (i = 0; i < npend; ) {
+			if ((r = net_auth_poll(&pend[i])) == 0) {
+				i++;
+				continue;
 			}
+			a = pend[i];
+			memmove(pend + i, pend + i + 1,
+			    (--npend - i) * sizeof(*pend));
+			if (r > 0)
+				session_admit(s, &a, &ctrl_fd, &ctrl_unix,
+				    &data_fd);
+			else
+				session_refuse(&a, 0);
 		}
 
-		/* New data connection */
-		if (pfds[1].revents & POLLIN) {
-			int newfd = accept(data_listen, NULL, NULL);
-			if (newfd >= 0) {
-				if (data_fd >= 0)
-					close(data_fd);
-				data_fd = newfd;
-				DPRINTF("server: data connection accepted\n");
-			}
-		}
+		/* New control or data connection */
+		if (pfds[0].revents & POLLIN)
+			session_accept(s, s->ctrl_listen, SESSION_CTRL, pend,
+			    &npend, &ctrl_fd, &ctrl_unix, &data_fd);
+		if (pfds[1].revents & POLLIN)
+			session_accept(s, s->data_listen, SESSION_DATA, pend,
+			    &npend, &ctrl_fd, &ctrl_unix, &data_fd);
 
 		/* Control command from connected client */
-		if (ctrl_fd >= 0 && nfds == 3 &&
+		if (ctrl_fd >= 0 && pfds[2].fd == ctrl_fd &&
 		    (pfds[2].revents & (POLLIN | POLLHUP))) {
 			char	 line[1024];
-			char	 mime[64], dlna[64];
+			char	 mime[64], dlna[64], how[8];
 			int	 n;
 
 			n = read_line(ctrl_fd, line, sizeof(line));
 
 			if (n == 0 || n < 0) {
 				/* Client disconnected */
-				printf("Server: client disconnected, "
-				    "going idle\n");
+				printf("Server: TV %d: client disconnected, "
+				    "going idle\n", s->id);
 				upnp_stop(upnp);
-				media.running = 0;
-				if (media.pipe_rd >= 0) {
-					close(media.pipe_rd);
-					media.pipe_rd = -1;
-				}
+				media->running = 0;
+				httpd_drop_pipe(s->httpd, s->id);
 				if (data_fd >= 0) {
 					close(data_fd);
 					data_fd = -1;
@@ -185,45 +305,97 @@ server_run(upnp_ctx_t *upnp, httpd_ctx_t *httpd,
 				ctrl_fd = -1;
 
 			} else if (strncmp(line, "PLAY ", 5) == 0 &&
-			    sscanf(line + 5, "%63s %63s", mime, dlna) == 2) {
+			    (n = sscanf(line + 5, "%63s %63s %7s", mime, dlna,
+			    how)) >= 2) {
+				/* Syntax: PLAY mime dlna [live] */
+				session_play(s, &data_fd, mime, dlna, 0,
+				    n == 3 && strcmp(how, "live") == 0);
 
-				/* Switch to new segment */
-				media.running = 0;
-				if (media.pipe_rd >= 0 &&
-				    media.pipe_rd != data_fd) {
-					close(media.pipe_rd);
-					media.pipe_rd = -1;
+			} else if (strncmp(line, "NEXT ", 5) == 0 &&
+			    sscanf(line + 5, "%63s %63s", mime, dlna) == 2) {
+				/*
+				 * The file after one that ended: queued on
+				 * the TV while the last one still plays,
+				 * or else Stop, SetAVTransportURI and Play.
+				 * Syntax: NEXT mime dlna
+				 */
+				if (session_queue(s, &data_fd, mime,
+				    dlna) < 0) {
+					upnp_stop(upnp);
+					session_play(s, &data_fd, mime, dlna,
+					    0, 0);
 				}
 
-				if (data_fd < 0) {
-					fprintf(stderr,
-					    "server: PLAY with no data "
-					    "connection\n");
-				} else {
-					media.pipe_rd = data_fd;
+			} else if (strncmp(line, "SPLICE ", 7) == 0 &&
+			    sscanf(line + 7, "%7s %63s %63s", how, mime,
+			    dlna) == 3) {
+				/*
+				 * Continuous mode: the item goes on the
+				 * stream the TV is receiving, without SOAP
+				 * calls; if there is none, it starts one.
+				 * Syntax: SPLICE append|cut mime dlna
+				 */
+				if (data_fd >= 0 && media->continuous &&
+				    strcmp(mime, media->mime_type) == 0 &&
+				    httpd_splice(s->httpd, s->id, data_fd,
+				    strcmp(how, "cut") == 0) == 0) {
+					printf("Server: TV %d: next item "
+					    "spliced in (%s)\n", s->id, how);
 					data_fd = -1;
-					media.running = 1;
-					media.mode = MODE_SINK;
-					strlcpy(media.mime_type, mime,
-					    sizeof(media.mime_type));
-					strlcpy(media.dlna_profile, dlna,
-					    sizeof(media.dlna_profile));
-
-					seg_id++;
-					snprintf(url, sizeof(url),
-					    "http://%s:%d/media?id=%d",
-					    upnp->local_ip, httpd->port,
-					    seg_id);
-					printf("Server: segment %d — %s\n",
-					    seg_id, url);
-
-					if (upnp_set_uri(upnp, url, mime,
-					    "Client", 1, dlna) < 0 ||
-					    upnp_play(upnp) < 0)
-						fprintf(stderr,
-						    "server: TV playback "
-						    "failed\n");
+				} else
+					session_play(s, &data_fd, mime, dlna,
+					    1, 0);
+
+			} else if (strncmp(line, "PLAY_FILE ", 10) == 0) {
+				int	 off = 0;
+
+				/*
+				 * Serve a local file as is (e.g. from the
+				 * transcode cache): the TV gets byte ranges,
+				 * so it can seek on its own.
+				 * Syntax: PLAY_FILE mime dlna|- path
+				 * Only a local client may name a file: over
+				 * TCP, anyone with the key, or anyone at all
+				 * without one, could read what the server
+				 * can.
+				 */
+				if (!ctrl_unix) {
+					fprintf(stderr, "server: PLAY_FILE "
+					    "refused over TCP\n");
+					continue;
 				}
+				if (sscanf(line + 10, "%63s %63s %n", mime,
+				    dlna, &off) != 2 || off == 0 ||
+				    line[10 + off] == '\0')
+					continue;
+
+				media->running = 0;
+				httpd_drop_pipe(s->httpd, s->id);
+				strlcpy(file_path, line + 10 + off,
+				    sizeof(file_path));
+				media->mode = MODE_FILE;
+				media->filepath = file_path;
+				media->needs_transcode = 0;
+				media->continuous = 0;
+				media->queue_next = 0;
+				strlcpy(media->mime_type, mime,
+				    sizeof(media->mime_type));
+				if (strcmp(dlna, "-") == 0)
+					dlna[0] = '\0';
+				strlcpy(media->dlna_profile, dlna,
+				    sizeof(media->dlna_profile));
+
+				s->seg_id++;
+				snprintf(url, sizeof(url),
+				    "http://%s:%d/media/%d/%d",
+				    upnp->local_ip, s->httpd->port, s->id,
+				    s->seg_id);
+				printf("Server: file %s — %s\n", file_path, url);
+
+				if (upnp_set_uri(upnp, url, mime, "Client", 0,
+				    dlna) < 0 || upnp_play(upnp) < 0)
+					fprintf(stderr,
+					    "server: TV playback failed\n");
 
 			} else if (strncmp(line, "PLAY_DIRECT ", 12) == 0) {
 				char durl[768];
@@ -244,27 +416,133 @@ server_run(upnp_ctx_t *upnp, httpd_ctx_t *httpd,
 				}
 
 			} else if (strcmp(line, "STOP") == 0) {
-				printf("Server: stop\n");
+				printf("Server: TV %d: stop\n", s->id);
 				upnp_stop(upnp);
 			}
 		}
 	}
 
-done:
-	if (ctrl_listen >= 0) {
-		close(ctrl_listen);
-		unlink(ctrl_path);
-	}
-	if (data_listen >= 0) {
-		close(data_listen);
-		unlink(data_path);
-	}
+	for (i = 0; i < npend; i++)
+		close(pend[i].fd);
 	if (ctrl_fd >= 0)
 		close(ctrl_fd);
 	if (data_fd >= 0)
 		close(data_fd);
-	if (media.pipe_rd >= 0)
-		close(media.pipe_rd);
+	return NULL;
+}
+
+/*
+ * Server main loop for ntv TVs, tvs[i] served under /media/<i>/ and
+ * controlled through server_addr(ctrl_path, i) and
+ * server_addr(data_path, i).
+ * tvs must already be connected (upnp_find_transport done by caller).
+ * ctrl_path and data_path are socket paths or host:port (net.c); key,
+ * if not NULL, is required of TCP clients.
+ */
+int
+server_run(upnp_ctx_t *tvs, int ntv, httpd_ctx_t *httpd,
+    const char *ctrl_path, const char *data_path, const char *key)
+{
+	session_t	*sess;
+	media_ctx_t	*media[HTTPD_MAX_SRC];
+	int		 i, nstarted = 0, ret = -1;
+
+	if (ntv < 1 || ntv > HTTPD_MAX_SRC) {
+		fprintf(stderr, "server: 1 to %d TVs\n", HTTPD_MAX_SRC);
+		return -1;
+	}
+	if ((sess = calloc(ntv, sizeof(*sess))) == NULL)
+		return -1;
+
+	for (i = 0; i < ntv; i++) {
+		session_t	*s = &sess[i];
+
+		s->id = i;
+		s->upnp = &tvs[i];
+		s->httpd = httpd;
+		s->key = key;
+		s->ctrl_listen = -1;
+		s->data_listen = -1;
+		s->media.pipe_rd = -1;
+		s->media.pipe_wr = -1;
+		s->media.ctrl_fd = -1;
+		s->media.cache_fd = -1;
+		s->media.mode    = MODE_SINK;
+		media[i] = &s->media;
+	}
+	for (i = 0; i < ntv; i++) {
+		session_t	*s = &sess[i];
+
+		if (server_addr(ctrl_path, i, s->ctrl_addr,
+		    sizeof(s->ctrl_addr)) < 0 ||
+		    (s->ctrl_listen = net_listen(s->ctrl_addr)) < 0) {
+			fprintf(stderr, "server: cannot create control "
+			    "socket %s\n", s->ctrl_addr);
+			goto done;
+		}
+		if (server_addr(data_path, i, s->data_addr,
+		    sizeof(s->data_addr)) < 0 ||
+		    (s->data_listen = net_listen(s->data_addr)) < 0) {
+			fprintf(stderr, "server: cannot create data "
+			    "socket %s\n", s->data_addr);
+			goto done;
+		}
+	}
+
+	/* Start HTTP server, pointing it at our local media contexts */
+	if (httpd_start(httpd, media, ntv, 0) < 0) {
+		fprintf(stderr, "server: cannot start HTTP server\n");
+		goto done;
+	}
+	printf("Server: HTTP server on port %d\n", httpd->port);
+
+	for (i = 0; i < ntv; i++) {
+		printf("Server: TV %d at %s\n", i, tvs[i].tv_ip);
+		printf("Server:   control socket %s\n", sess[i].ctrl_addr);
+		printf("Server:   data socket    %s\n", sess[i].data_addr);
+	}
+	if (key == NULL &&
+	    (net_is_tcp(ctrl_path) || net_is_tcp(data_path)))
+		printf("Server: no key set, anyone who can reach the "
+		    "sockets can play on the TV\n");
+
+	ret = 0;
+	for (nstarted = 0; nstarted < ntv; nstarted++)
+		if (pthread_create(&sess[nstarted].thread, NULL,
+		    session_thread, &sess[nstarted]) != 0) {
+			fprintf(stderr, "server: cannot start session\n");
+			running = 0;
+			ret = -1;
+			break;
+		}
+	for (i = 0; i < nstarted; i++)
+		pthread_join(sess[i].thread, NULL);
+
+	/* End the streams still being served */
+	for (i = 0; i < ntv; i++) {
+		sess[i].media.running = 0;
+		if (sess[i].media.pipe_rd >= 0)
+			shutdown(sess[i].media.pipe_rd, SHUT_RD);
+	}
 	httpd_stop(httpd);
+
+done:
+	for (i = 0; i < ntv; i++) {
+		session_t	*s = &sess[i];
+
+		if (s->ctrl_listen >= 0) {
+			close(s->ctrl_listen);
+			if (!net_is_tcp(s->ctrl_addr))
+				unlink(s->ctrl_addr);
+		}
+		if (s->data_listen >= 0) {
+			close(s->data_listen);
+			if (!net_is_tcp(s->data_addr))
+				unlink(s->data_addr);
+		}
+		if (s->media.pipe_rd >= 0)
+			close(s->media.pipe_rd);
+	}
+	free(sess);
 	return ret;
 }
@@ -0,0 +1,459 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* memfd_create, MSG_CMSG_CLOEXEC */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "send2tv.h"
+
+/*
+ * Shared-memory transport from the client to the server.
+ *
+ * Over the Unix data socket every TS byte is copied into the socket by
+ * the client, out of it by the server and once more into the TV's TCP
+ * connection.  With a ring the client copies the output into pages it
+ * shares with the server, and the server sends straight from them.
+ *
+ * The client creates the ring on a memfd, with one eventfd for each
+ * direction, and passes the three descriptors with SCM_RIGHTS as the
+ * first message on the data connection.  The connection stays open for
+ * the lifetime of the stream and carries nothing else: its EOF tells the
+ * server that the client is done, and the server closing it tells the
+ * client that nobody reads any more.
+ *
+ * It is a single-producer, single-consumer ring of free-running byte
+ * counters.  A side that has to wait sets its waiting flag, checks the
+ * counters once more and sleeps on its eventfd; the other side only
+ * writes to the eventfd when it sees the flag, so a flowing stream costs
+ * no system calls for the ring itself.
+ *
+ * Only built on Linux (memfd_create, eventfd); elsewhere
+ * shmring_create() fails and the data socket is used as before.
+ */
+
+#define SHMRING_MAGIC	"S2TVRING"
+#define SHMRING_HDR	4096		/* header page, data follows */
+
+struct shmring_hdr {
+	uint64_t	 head;		/* bytes written, producer */
+	char		 pad1[56];
+	uint64_t	 tail;		/* bytes consumed, consumer */
+	char		 pad2[56];
+	uint64_t	 size;		/* data bytes, a power of two */
+	int		 rd_waiting;
+	int		 wr_waiting;
+};
+
+struct shmring {
+	struct shmring_hdr	*hdr;
+	uint8_t			*data;
+	size_t			 size;
+	int			 memfd;
+	int			 ev_data;	/* producer wakes consumer */
+	int			 ev_space;	/* consumer wakes producer */
+	int64_t			 waits;		/* sleeps on the eventfd */
+	int64_t			 wakes;		/* eventfd writes */
+};
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+static shmring_t *
+shmring_map(int memfd, int ev_data, int ev_space, size_t size)
+{
+	shmring_t	*r;
+	void		*p;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	p = mmap(NULL, SHMRING_HDR + size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, memfd, 0);
+	if (p == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+	r->hdr = p;
+	r->data = (uint8_t *)p + SHMRING_HDR;
+	r->size = size;
+	r->memfd = memfd;
+	r->ev_data = ev_data;
+	r->ev_space = ev_space;
+	return r;
+}
+
+/*
+ * Create a ring of at least size bytes.  Returns NULL on failure.
+ */
+shmring_t *
+shmring_create(size_t size)
+{
+	shmring_t	*r;
+	size_t		 sz = 4096;
+	int		 memfd, ev_data = -1, ev_space = -1;
+
+	while (sz < size)
+		sz <<= 1;
+	memfd = memfd_create("send2tv-ring", MFD_CLOEXEC);
+	if (memfd < 0)
+		return NULL;
+	if (ftruncate(memfd, SHMRING_HDR + sz) < 0 ||
+	    (ev_data = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+	    (ev_space = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+	    (r = shmring_map(memfd, ev_data, ev_space, sz)) == NULL) {
+		if (ev_data >= 0)
+			close(ev_data);
+		if (ev_space >= 0)
+			close(ev_space);
+		close(memfd);
+		return NULL;
+	}
+	r->hdr->size = sz;
+	return r;
+}
+
+/*
+ * Hand the ring to the reader of the stream socket sock.  Returns 0, or
+ * -1 if it could not be sent.
+ */
+int
+shmring_send(shmring_t *r, int sock)
+{
+	struct msghdr	 msg;
+	struct iovec	 iov;
+	struct cmsghdr	*cm;
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(3 * sizeof(int))];
+	} cbuf;
+	int		 fds[3];
+
+	fds[0] = r->memfd;
+	fds[1] = r->ev_data;
+	fds[2] = r->ev_space;
+	iov.iov_base = (void *)SHMRING_MAGIC;
+	iov.iov_len = sizeof(SHMRING_MAGIC) - 1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len ?
+	    0 : -1;
+}
+
+/*
+ * Read the first message of stream socket sock.  If it hands over a
+ * ring, the ring is returned and *n is 0; otherwise NULL is returned and
+ * the bytes read (*n, -1 on error) are stream data.
+ */
+shmring_t *
+shmring_accept(int sock, void *buf, size_t len, ssize_t *n)
+{
+	struct msghdr	 msg;
+	struct iovec	 iov;
+	struct cmsghdr	*cm;
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(3 * sizeof(int))];
+	} cbuf;
+	shmring_t	*r = NULL;
+	int		 fds[3], nfds = 0, i;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	do
+		*n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	while (*n < 0 && errno == EINTR);
+	if (*n < 0)
+		return NULL;
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+	    cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds > 3)
+			nfds = 3;
+		memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+	}
+	if (nfds == 3 && *n == sizeof(SHMRING_MAGIC) - 1 &&
+	    memcmp(buf, SHMRING_MAGIC, *n) == 0) {
+		struct shmring_hdr	 hdr;
+
+		/* The size comes from the creator, check it fits */
+		if (pread(fds[0], &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		    hdr.size >= 4096 && (hdr.size & (hdr.size - 1)) == 0 &&
+		    (r = shmring_map(fds[0], fds[1], fds[2],
+		    hdr.size)) != NULL) {
+			*n = 0;
+			DPRINTF("shmring: attached %zu KiB ring\n",
+			    r->size / 1024);
+			return r;
+		}
+		*n = -1;
+	}
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	return NULL;
+}
+
+/*
+ * Sleep until evfd is signalled, sock hangs up or 100 ms pass.  Returns
+ * -1 if sock hung up, 0 otherwise.
+ */
+static int
+shmring_sleep(shmring_t *r, int evfd, int sock)
+{
+	struct pollfd	 pfd[2];
+	uint64_t	 v;
+	char		 c;
+
+	r->waits++;
+	pfd[0].fd = evfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sock;
+	pfd[1].events = POLLIN;
+	if (poll(pfd, 2, 100) <= 0)
+		return 0;
+	if (pfd[0].revents & POLLIN)
+		(void)read(evfd, &v, sizeof(v));
+	/* Nothing but EOF is sent on the socket after the ring */
+	if (pfd[1].revents & (POLLHUP | POLLERR))
+		return -1;
+	if ((pfd[1].revents & POLLIN) &&
+	    recv(sock, &c, 1, MSG_DONTWAIT) <= 0)
+		return -1;
+	return 0;
+}
+
+static void
+shmring_wake(shmring_t *r, int evfd, int *waiting)
+{
+	uint64_t	 one = 1;
+
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		r->wakes++;
+		(void)write(evfd, &one, sizeof(one));
+	}
+}
+
+/*
+ * Copy iov into the ring, waiting for space.  sock is the data
+ * connection; the wait ends when it hangs up or *running is cleared.
+ * Returns 0 or a negative errno.
+ */
+int
+shmring_write(shmring_t *r, const struct iovec *iov, int n,
+    volatile int *running, int sock)
+{
+	struct shmring_hdr	*h = r->hdr;
+	const uint8_t		*src;
+	uint64_t		 head, tail;
+	size_t			 left, len, off, part;
+	int			 i;
+
+	head = h->head;
+	for (i = 0; i < n; i++) {
+		src = iov[i].iov_base;
+		left = iov[i].iov_len;
+		while (left > 0) {
+			tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+			if (head - tail == r->size) {
+				__atomic_store_n(&h->wr_waiting, 1,
+				    __ATOMIC_SEQ_CST);
+				tail = __atomic_load_n(&h->tail,
+				    __ATOMIC_SEQ_CST);
+				if (head - tail == r->size &&
+				    shmring_sleep(r, r->ev_space, sock) < 0) {
+					h->wr_waiting = 0;
+					return -EPIPE;
+				}
+				__atomic_store_n(&h->wr_waiting, 0,
+				    __ATOMIC_SEQ_CST);
+				if (!*running)
+					return -EINTR;
+				continue;
+			}
+			len = r->size - (head - tail);
+			if (len > left)
+				len = left;
+			off = head & (r->size - 1);
+			part = r->size - off < len ? r->size - off : len;
+			memcpy(r->data + off, src, part);
+			memcpy(r->data, src + part, len - part);
+			head += len;
+			src += len;
+			left -= len;
+			__atomic_store_n(&h->head, head, __ATOMIC_SEQ_CST);
+			shmring_wake(r, r->ev_data, &h->rd_waiting);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Wait for data and return the longest contiguous run of it, at most
+ * max bytes, in *len.  Returns NULL at the end of the stream (sock
+ * hung up and the ring is empty) or once *running is cleared.
+ */
+const uint8_t *
+shmring_peek(shmring_t *r, size_t max, size_t *len, volatile int *running,
+    int sock)
+{
+	struct shmring_hdr	*h = r->hdr;
+	uint64_t		 head, tail = h->tail;
+	size_t			 off;
+	int			 eof = 0;
+
+	for (;;) {
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if (head != tail)
+			break;
+		if (eof || !*running)
+			return NULL;
+		__atomic_store_n(&h->rd_waiting, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&h->head, __ATOMIC_SEQ_CST);
+		if (head == tail && shmring_sleep(r, r->ev_data, sock) < 0)
+			eof = 1;	/* drain what is left */
+		__atomic_store_n(&h->rd_waiting, 0, __ATOMIC_SEQ_CST);
+	}
+	off = tail & (r->size - 1);
+	*len = head - tail;
+	if (*len > r->size - off)
+		*len = r->size - off;
+	if (*len > max)
+		*len = max;
+	return r->data + off;
+}
+
+/*
+ * Release len bytes returned by shmring_peek().
+ */
+void
+shmring_consume(shmring_t *r, size_t len)
+{
+	struct shmring_hdr	*h = r->hdr;
+
+	__atomic_store_n(&h->tail, h->tail + len, __ATOMIC_SEQ_CST);
+	shmring_wake(r, r->ev_space, &h->wr_waiting);
+}
+
+/*
+ * How full the ring is, in percent.
+ */
+int
+shmring_fill_pct(const shmring_t *r)
+{
+	uint64_t	 used;
+
+	used = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	return (int)(used * 100 / r->size);
+}
+
+void
+shmring_free(shmring_t *r)
+{
+	if (r == NULL)
+		return;
+	DPRINTF("shmring: %lld sleeps, %lld wakeups\n", (long long)r->waits,
+	    (long long)r->wakes);
+	munmap(r->hdr, SHMRING_HDR + r->size);
+	close(r->memfd);
+	close(r->ev_data);
+	close(r->ev_space);
+	free(r);
+}
+
+#else /* !__linux__ */
+
+shmring_t *
+shmring_create(size_t size)
+{
+	(void)size;
+	return NULL;
+}
+
+int
+shmring_send(shmring_t *r, int sock)
+{
+	(void)r;
+	(void)sock;
+	return -1;
+}
+
+shmring_t *
+shmring_accept(int sock, void *buf, size_t len, ssize_t *n)
+{
+	do
+		*n = read(sock, buf, len);
+	while (*n < 0 && errno == EINTR);
+	return NULL;
+}
+
+int
+shmring_write(shmring_t *r, const struct iovec *iov, int n,
+    volatile int *running, int sock)
+{
+	(void)r;
+	(void)iov;
+	(void)n;
+	(void)running;
+	(void)sock;
+	return -EPIPE;
+}
+
+const uint8_t *
+shmring_peek(shmring_t *r, size_t max, size_t *len, volatile int *running,
+    int sock)
+{
+	(void)r;
+	(void)max;
+	(void)len;
+	(void)running;
+	(void)sock;
+	return NULL;
+}
+
+void
+shmring_consume(shmring_t *r, size_t len)
+{
+	(void)r;
+	(void)len;
+}
+
+int
+shmring_fill_pct(const shmring_t *r)
+{
+	(void)r;
+	return -1;
+}
+
+void
+shmring_free(shmring_t *r)
+{
+	(void)r;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "send2tv.h"
+
+/*
+ * Speculative seek cache.
+ *
+ * While a transcoded file plays, a worker thread pre-encodes short
+ * MPEG-TS snippets at the positions the user is most likely to seek to
+ * next: the current position plus/minus the arrow-key steps, and the
+ * 'e' end-jump target.  Each snippet starts on an IDR frame and covers
+ * SPEC_SNIPPET_SEC seconds (whole GOPs, since the encoder uses a
+ * one-second GOP).  A seek that lands near a cached snippet sends it to
+ * the TV straight away while the main pipeline is restarted behind it.
+ */
+
+/* Seek steps offered by the client loop (see usage()) */
+static const int spec_steps[] = { 10, -10, 30, -30 };
+
+/*
+ * Index of the cached snippet closest to target_sec, or -1 if none lies
+ * within SPEC_TOLERANCE_SEC.  Caller holds sc->lock.
+ */
+static int
+spec_find(spec_ctx_t *sc, int target_sec)
+{
+	int	 i, best = -1, best_d = SPEC_TOLERANCE_SEC + 1, d;
+
+	for (i = 0; i < SPEC_MAX_ENTRIES; i++) {
+		if (sc->entries[i].data == NULL)
+			continue;
+		d = abs(sc->entries[i].start_sec - target_sec);
+		if (d < best_d) {
+			best_d = d;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static void
+spec_drop(spec_ctx_t *sc, int i)
+{
+	sc->bytes -= sc->entries[i].len;
+	free(sc->entries[i].data);
+	sc->entries[i].data = NULL;
+	sc->entries[i].len = 0;
+}
+
+/*
+ * Store a finished snippet, evicting least recently predicted entries
+ * until it fits the slot and byte budget.  Caller holds sc->lock.
+ */
+static void
+spec_store(spec_ctx_t *sc, int start_sec, uint8_t *data, size_t len)
+{
+	int	 i, victim;
+
+	for (;;) {
+		victim = -1;
+		for (i = 0; i < SPEC_MAX_ENTRIES; i++) {
+			if (sc->entries[i].data == NULL) {
+				if (sc->bytes + len <= SPEC_MAX_BYTES)
+					goto store;
+				continue;
+			}
+			if (victim < 0 || sc->entries[i].last_used <
+			    sc->entries[victim].last_used)
+				victim = i;
+		}
+		if (victim < 0) {
+			free(data);
+			return;
+		}
+		DPRINTF("spec: evicting snippet at %ds\n",
+		    sc->entries[victim].start_sec);
+		spec_drop(sc, victim);
+	}
+
+store:
+	sc->entries[i].start_sec = start_sec;
+	sc->entries[i].last_used = sc->tick;
+	sc->entries[i].data = data;
+	sc->entries[i].len = len;
+	sc->bytes += len;
+}
+
+/*
+ * Pick the next predicted target that has no snippet yet.
+ * Returns -1 if every target is cached.  Caller holds sc->lock.
+ */
+static int
+spec_next_target(spec_ctx_t *sc)
+{
+	int	 i;
+
+	for (i = 0; i < sc->ntargets; i++) {
+		if (spec_find(sc, sc->targets[i]) < 0)
+			return sc->targets[i];
+	}
+	return -1;
+}
+
+/*
+ * Remove a target that could not be encoded so the worker does not spin
+ * on it.  Caller holds sc->lock.
+ */
+static void
+spec_forget(spec_ctx_t *sc, int target_sec)
+{
+	int	 i, n = 0;
+
+	for (i = 0; i < sc->ntargets; i++)
+		if (sc->targets[i] != target_sec)
+			sc->targets[n++] = sc->targets[i];
+	sc->ntargets = n;
+}
+
+static void *
+spec_thread(void *arg)
+{
+	spec_ctx_t	*sc = arg;
+	uint8_t		*data;
+	size_t		 len;
+	int64_t		 t0;
+	int		 target;
+
+#ifdef __linux__
+	/* Linux applies nice values per thread: stay out of the way of
+	 * the main pipeline, encoder threads inherit this */
+	setpriority(PRIO_PROCESS, 0, 10);
+#endif
+
+	pthread_mutex_lock(&sc->lock);
+	while (sc->running) {
+		target = spec_next_target(sc);
+		if (target < 0) {
+			pthread_cond_wait(&sc->cond, &sc->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sc->lock);
+
+		DPRINTF("spec: pre-encoding %ds..%ds\n", target,
+		    target + SPEC_SNIPPET_SEC);
+		t0 = media_start_us(&sc->media);
+		if (media_encode_window(&sc->media,
+		    t0 + (int64_t)target * AV_TIME_BASE,
+		    t0 + (int64_t)(target + SPEC_SNIPPET_SEC) * AV_TIME_BASE,
+		    SPEC_MAX_BYTES / 2, &sc->running, &data, &len) < 0) {
+			pthread_mutex_lock(&sc->lock);
+			if (!sc->running)
+				break;
+			spec_forget(sc, target);
+			continue;
+		}
+
+		pthread_mutex_lock(&sc->lock);
+		if (!sc->running) {
+			free(data);
+			break;
+		}
+		DPRINTF("spec: cached %zu bytes at %ds\n", len, target);
+		spec_store(sc, target, data, len);
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	return NULL;
+}
+
+/*
+ * Start speculative encoding for filepath (probed and needing a
+ * transcode).  The snippets are spliced into the playing stream, so
+ * they are encoded with all settings of the playback template tmpl.
+ * The worker opens its own input so it never touches the playing
+ * pipeline.  Returns 0 on success, -1 on failure.
+ */
+int
+spec_start(spec_ctx_t *sc, const media_ctx_t *tmpl, const char *filepath)
+{
+	int	 i;
+
+	memset(sc, 0, sizeof(*sc));
+	for (i = 0; i < SPEC_MAX_ENTRIES; i++)
+		sc->entries[i].start_sec = -1;
+	sc->stale = 1;
+
+	media_from_template(&sc->media, tmpl, filepath);
+
+	if (media_probe(&sc->media, filepath, 1) < 0)
+		return -1;
+	sc->duration_sec = sc->media.duration_sec;
+
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->cond, NULL);
+	sc->running = 1;
+	if (pthread_create(&sc->thread, NULL, spec_thread, sc) != 0) {
+		sc->running = 0;
+		pthread_mutex_destroy(&sc->lock);
+		pthread_cond_destroy(&sc->cond);
+		media_close(&sc->media);
+		return -1;
+	}
+	sc->started = 1;
+	DPRINTF("spec: worker started\n");
+	return 0;
+}
+
+/*
+ * Re-centre the predictions on the current playback position.
+ * Cheap enough to call from every iteration of the key loop: the
+ * target list only changes once the position drifts by more than the
+ * hit tolerance.
+ */
+void
+spec_predict(spec_ctx_t *sc, int pos_sec)
+{
+	int	 i, t, n = 0;
+
+	if (!sc->started)
+		return;
+
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->stale &&
+	    abs(pos_sec - sc->center_sec) <= SPEC_TOLERANCE_SEC) {
+		pthread_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	sc->center_sec = pos_sec;
+	sc->stale = 0;
+	sc->tick++;
+	for (i = 0; i < (int)(sizeof(spec_steps) / sizeof(spec_steps[0]));
+	    i++) {
+		t = pos_sec + spec_steps[i];
+		if (t < 0)
+			t = 0;
+		if (sc->duration_sec > 0 && t > sc->duration_sec - 5)
+			continue;
+		sc->targets[n++] = t;
+	}
+	if (sc->duration_sec > 60)
+		sc->targets[n++] = sc->duration_sec - 60;
+	sc->ntargets = n;
+
+	/* Snippets that are still predicted count as recently used */
+	for (i = 0; i < n; i++) {
+		t = spec_find(sc, sc->targets[i]);
+		if (t >= 0)
+			sc->entries[t].last_used = sc->tick;
+	}
+
+	pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+}
+
+/*
+ * Take the snippet nearest to target_sec out of the cache.
+ * On a hit, ownership of *data passes to the caller and *start_sec is
+ * the position the snippet starts at.  Returns 0 on hit, -1 on miss.
+ */
+int
+spec_take(spec_ctx_t *sc, int target_sec, uint8_t **data, size_t *len,
+    int *start_sec)
+{
+	int	 i;
+
+	if (!sc->started)
+		return -1;
+
+	pthread_mutex_lock(&sc->lock);
+	i = spec_find(sc, target_sec);
+	if (i < 0) {
+		pthread_mutex_unlock(&sc->lock);
+		return -1;
+	}
+	*data = sc->entries[i].data;
+	*len = sc->entries[i].len;
+	*start_sec = sc->entries[i].start_sec;
+	sc->bytes -= sc->entries[i].len;
+	sc->entries[i].data = NULL;
+	sc->entries[i].len = 0;
+	/* Everything predicted from the old position is stale now */
+	sc->ntargets = 0;
+	sc->stale = 1;
+	pthread_mutex_unlock(&sc->lock);
+
+	DPRINTF("spec: hit for %ds (snippet at %ds, %zu bytes)\n",
+	    target_sec, *start_sec, *len);
+	return 0;
+}
+
+void
+spec_stop(spec_ctx_t *sc)
+{
+	int	 i;
+
+	if (!sc->started)
+		return;
+
+	pthread_mutex_lock(&sc->lock);
+	sc->running = 0;
+	sc->media.running = 0;
+	pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+	pthread_join(sc->thread, NULL);
+
+	for (i = 0; i < SPEC_MAX_ENTRIES; i++)
+		if (sc->entries[i].data != NULL)
+			spec_drop(sc, i);
+	media_close(&sc->media);
+	pthread_mutex_destroy(&sc->lock);
+	pthread_cond_destroy(&sc->cond);
+	sc->started = 0;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send2tv.h"
+
+/*
+ * Splicing of successive MPEG-TS streams into one continuous stream.
+ *
+ * In continuous mode the TV keeps one HTTP connection, and each new
+ * file or seek restart is appended to it instead of being started as a
+ * new segment with SetAVTransportURI and Play.  Every item comes from a
+ * muxer of its own: its clock starts over, its continuity counters
+ * start at 0 and its PAT and PMT are version 0.  The items are
+ * rewritten into one stream:
+ *
+ * - PCR, PTS and DTS of an item are moved by one offset, chosen at its
+ *   first timestamps so that the PCR goes on from the previous item and
+ *   nothing is stamped before a frame already sent.
+ * - The first PCR of every later item carries the discontinuity
+ *   indicator, as the clock may still jump forward there.
+ * - Continuity counters are renumbered per PID across the items.
+ * - A PAT or PMT that differs from the previous one gets the next
+ *   version number, with its CRC recomputed.
+ *
+ * Only whole packets are rewritten; the first item goes out unchanged.
+ */
+
+#define TS_PACKET	188
+#define TS_SYNC		0x47
+#define TS_MASK		((1LL << 33) - 1)
+
+#define SPLICE_CC	0x10		/* pid[]: a packet was sent */
+
+/* Gaps at the splice, 90 kHz: the PCR interval, a frame at 24 fps */
+#define SPLICE_PCR_GAP	1800
+#define SPLICE_PTS_GAP	3750
+
+enum {
+	SPLICE_PAT,
+	SPLICE_PMT
+};
+
+void
+splice_init(splice_t *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->last_pcr = -1;
+	s->last_pts = -1;
+	s->pmt_pid = -1;
+	s->psi_ver[SPLICE_PAT] = -1;
+	s->psi_ver[SPLICE_PMT] = -1;
+}
+
+/*
+ * The next bytes fed start a new item.  A partial packet of the
+ * previous one is dropped.
+ */
+void
+splice_next(splice_t *s)
+{
+	s->carry_len = 0;
+	s->item++;
+	s->timed = 0;
+	s->mark = s->item > 1;
+}
+
+/* CRC-32/MPEG-2 of PSI sections */
+static uint32_t
+splice_crc(const uint8_t *p, int len, uint32_t crc)
+{
+	int	 i;
+
+	while (len-- > 0) {
+		crc ^= (uint32_t)*p++ << 24;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? crc << 1 ^ 0x04c11db7 :
+			    crc << 1;
+	}
+	return crc;
+}
+
+static int64_t
+splice_ts_get(const uint8_t *p)
+{
+	return (int64_t)(p[0] & 0x0e) << 29 | (int64_t)p[1] << 22 |
+	    (int64_t)(p[2] & 0xfe) << 14 | (int64_t)p[3] << 7 | p[4] >> 1;
+}
+
+static void
+splice_ts_put(uint8_t *p, int64_t ts)
+{
+	ts &= TS_MASK;
+	p[0] = (p[0] & 0xf1) | (ts >> 29 & 0x0e);
+	p[1] = ts >> 22;
+	p[2] = (ts >> 14 & 0xfe) | 1;
+	p[3] = ts >> 7;
+	p[4] = (ts << 1 & 0xfe) | 1;
+}
+
+static int64_t
+splice_pcr_get(const uint8_t *p)
+{
+	return (int64_t)p[0] << 25 | (int64_t)p[1] << 17 |
+	    (int64_t)p[2] << 9 | (int64_t)p[3] << 1 | p[4] >> 7;
+}
+
+/* The base only; the 27 MHz extension stays */
+static void
+splice_pcr_put(uint8_t *p, int64_t base)
+{
+	base &= TS_MASK;
+	p[0] = base >> 25;
+	p[1] = base >> 17;
+	p[2] = base >> 9;
+	p[3] = base >> 1;
+	p[4] = (p[4] & 0x7f) | (base << 7 & 0x80);
+}
+
+/*
+ * Version a PAT or PMT section for the output: the first one seen keeps
+ * its version, a section that differs from the last one sent gets the
+ * next.
+ */
+static void
+splice_psi(splice_t *s, int table, uint8_t *p, int len)
+{
+	uint8_t		 sec[TS_PACKET];
+	uint32_t	 sum, crc;
+	int		 slen, ver, i;
+
+	if (len < 1 || 1 + p[0] >= len)
+		return;
+	len -= 1 + p[0];
+	p += 1 + p[0];
+	if (len < 3)
+		return;
+	slen = ((p[1] & 0x0f) << 8 | p[2]) + 3;
+	if (slen < 12 || slen > len)
+		return;		/* sections spanning packets pass as is */
+
+	/* Programs after the 8 byte header, 4 byte CRC at the end */
+	for (i = 8; table == SPLICE_PAT && i + 4 <= slen - 4; i += 4)
+		if ((p[i] << 8 | p[i + 1]) != 0) {
+			s->pmt_pid = (p[i + 2] & 0x1f) << 8 | p[i + 3];
+			break;
+		}
+
+	/* The content, version aside */
+	memcpy(sec, p, slen - 4);
+	sec[5] &= 0xc1;
+	sum = splice_crc(sec, slen - 4, 0xffffffff);
+	ver = (p[5] >> 1) & 0x1f;
+	if (s->psi_ver[table] < 0) {
+		s->psi_ver[table] = ver;
+		s->psi_sum[table] = sum;
+		return;
+	}
+	if (sum != s->psi_sum[table]) {
+		s->psi_ver[table] = (s->psi_ver[table] + 1) & 0x1f;
+		s->psi_sum[table] = sum;
+		DPRINTF("splice: %s version %d\n",
+		    table == SPLICE_PAT ? "PAT" : "PMT", s->psi_ver[table]);
+	}
+	if (ver == s->psi_ver[table])
+		return;
+	p[5] = (p[5] & 0xc1) | s->psi_ver[table] << 1;
+	crc = splice_crc(p, slen - 4, 0xffffffff);
+	p[slen - 4] = crc >> 24;
+	p[slen - 3] = crc >> 16;
+	p[slen - 2] = crc >> 8;
+	p[slen - 1] = crc;
+}
+
+/*
+ * Offset for the item whose first timestamps are pcr and pts (-1 if the
+ * packet has none): the later of the one that continues the PCR and the
+ * one that stamps the first frame after the last one sent.
+ */
+static int64_t
+splice_offset(const splice_t *s, int64_t pcr, int64_t pts)
+{
+	int64_t	 off = INT64_MIN, o;
+
+	if (pcr >= 0 && s->last_pcr >= 0)
+		off = s->last_pcr + SPLICE_PCR_GAP - pcr;
+	if (pts >= 0 && s->last_pts >= 0) {
+		o = s->last_pts + SPLICE_PTS_GAP - pts;
+		if (o > off)
+			off = o;
+	}
+	if (off == INT64_MIN) {
+		/* Only the other kind was sent before */
+		o = s->last_pcr > s->last_pts ? s->last_pcr : s->last_pts;
+		if (o < 0)
+			return 0;
+		off = o + SPLICE_PTS_GAP - (pcr >= 0 ? pcr : pts);
+	}
+	return off;
+}
+
+/*
+ * Rewrite one packet of the current item in place.  Returns 0, or -1
+ * if it is not a TS packet.
+ */
+static int
+splice_packet(splice_t *s, uint8_t *pkt)
+{
+	uint8_t		*p, *pes_ts = NULL;
+	int64_t		 pcr = -1, pts = -1, t;
+	int		 pid, pusi, afc, len, flags = 0, cc;
+
+	if (pkt[0] != TS_SYNC)
+		return -1;
+	s->packets++;
+	pusi = pkt[1] & 0x40;
+	pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+	afc = (pkt[3] >> 4) & 3;
+	p = pkt + 4;
+	len = TS_PACKET - 4;
+	if (afc & 2) {
+		if (p[0] >= 7 && (p[1] & 0x10))
+			pcr = splice_pcr_get(p + 2);
+		len -= 1 + p[0];
+		p += 1 + p[0];
+	}
+	if (!(afc & 1) || len <= 0)
+		len = 0;
+
+	/* PES header with a PTS, and maybe a DTS */
+	if (pusi && len >= 19 && pid != 0 && pid != s->pmt_pid &&
+	    p[0] == 0 && p[1] == 0 && p[2] == 1 && (p[6] & 0xc0) == 0x80) {
+		flags = p[7] & 0xc0;
+		if (flags & 0x80) {
+			pes_ts = p + 9;
+			pts = splice_ts_get(pes_ts);
+		}
+	}
+
+	if (!s->timed && (pcr >= 0 || pts >= 0)) {
+		s->offset = s->item > 1 ? splice_offset(s, pcr, pts) : 0;
+		s->timed = 1;
+		if (s->item > 1)
+			DPRINTF("splice: item %d, offset %lld\n", s->item,
+			    (long long)s->offset);
+	}
+	if (pcr >= 0) {
+		t = pcr + s->offset;
+		splice_pcr_put(pkt + 6, t);
+		if (t > s->last_pcr)
+			s->last_pcr = t;
+		if (s->mark) {
+			pkt[5] |= 0x80;		/* discontinuity_indicator */
+			s->mark = 0;
+		}
+	}
+	if (pes_ts != NULL) {
+		t = pts + s->offset;
+		splice_ts_put(pes_ts, t);
+		if (t > s->last_pts)
+			s->last_pts = t;
+		if (flags == 0xc0)
+			splice_ts_put(pes_ts + 5,
+			    splice_ts_get(pes_ts + 5) + s->offset);
+	}
+
+	if (pusi && len > 0 && pid == 0)
+		splice_psi(s, SPLICE_PAT, p, len);
+	else if (pusi && len > 0 && pid == s->pmt_pid)
+		splice_psi(s, SPLICE_PMT, p, len);
+
+	/* Counters go on across items; null packets have none */
+	if (pid != 0x1fff) {
+		cc = pkt[3] & 0x0f;
+		if (s->pid[pid] & SPLICE_CC)
+			cc = (s->pid[pid] + ((afc & 1) ? 1 : 0)) & 0x0f;
+		pkt[3] = (pkt[3] & 0xf0) | cc;
+		s->pid[pid] = SPLICE_CC | cc;
+	}
+	return 0;
+}
+
+/*
+ * Rewrite len bytes of the current item into out, which has room for
+ * len + 188 bytes.  A partial packet at the end is kept for the next
+ * call, bytes out of sync are skipped.  Returns the bytes in out.
+ */
+size_t
+splice_feed(splice_t *s, const uint8_t *in, size_t len, uint8_t *out)
+{
+	size_t	 n = 0, take;
+
+	while (len > 0) {
+		if (s->carry_len == 0 && len >= TS_PACKET) {
+			if (in[0] != TS_SYNC) {
+				in++;
+				len--;
+				continue;
+			}
+			memcpy(out + n, in, TS_PACKET);
+			in += TS_PACKET;
+			len -= TS_PACKET;
+		} else {
+			if (s->carry_len == 0 && in[0] != TS_SYNC) {
+				in++;
+				len--;
+				continue;
+			}
+			take = TS_PACKET - s->carry_len;
+			if (take > len)
+				take = len;
+			memcpy(s->carry + s->carry_len, in, take);
+			s->carry_len += take;
+			in += take;
+			len -= take;
+			if (s->carry_len < TS_PACKET)
+				break;
+			s->carry_len = 0;
+			memcpy(out + n, s->carry, TS_PACKET);
+		}
+		if (splice_packet(s, out + n) == 0)
+			n += TS_PACKET;
+	}
+	return n;
+}
@@ -6,6 +6,9 @@
  * Run:    ./tests
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* before any header, as in media.c */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,10 +16,33 @@
 /* Provide verbose flag needed by DPRINTF macro */
 int verbose = 0;
 
+/* Cleared to stop the server loops, as by the signal handler */
+volatile int running = 1;
+
 /* Include source files to access static functions */
 #include "dlna.c"
 #include "media.c"
 #include "upnp.c"
+#include "spec.c"
+#include "cache.c"
+#include "lookahead.c"
+#include "chunk.c"
+#include "abr.c"
+#include "gov.c"
+#include "dedupe.c"
+#include "xshm.c"
+#include "avsync.c"
+#include "tslock.c"
+#include "tsout.c"
+#include "shmring.c"
+#include "net.c"
+#include "httpd.c"
+#include "server.c"
+#include "splice.c"
+#include "prefetch.c"
+#include "tshift.c"
+#include "probe.c"
+#include "readahead.c"
 
 /* ------------------------------------------------------------------ */
 /* Minimal test framework                                             */
@@ -597,6 +623,126 @@ TEST(dlna_h264_unknown_fmt_empty)
 	ASSERT_STR_EQ(m.dlna_profile, "");
 }
 
+/* ------------------------------------------------------------------ */
+/* Tests: output_size                                                 */
+/* ------------------------------------------------------------------ */
+
+static void
+output_test(int bitrate, int vcodec, int max_height, int w, int h,
+    int *ow, int *oh)
+{
+	media_ctx_t	 m;
+
+	memset(&m, 0, sizeof(m));
+	m.bitrate = bitrate;
+	m.vcodec = vcodec;
+	m.max_height = max_height;
+	output_size(&m, w, h, ow, oh);
+}
+
+TEST(output_auto_by_bitrate)
+{
+	int	 w, h;
+
+	output_test(2000, VCODEC_H264, 0, 3840, 2160, &w, &h);
+	ASSERT_INT_EQ(w, 1280);
+	ASSERT_INT_EQ(h, 720);
+	output_test(800, VCODEC_H264, 0, 1920, 1080, &w, &h);
+	ASSERT_INT_EQ(h, 480);
+	output_test(4000, VCODEC_H264, 0, 3840, 2160, &w, &h);
+	ASSERT_INT_EQ(w, 1920);
+	ASSERT_INT_EQ(h, 1080);
+}
+
+TEST(output_capped_by_profile)
+{
+	int	 w, h;
+
+	/* AVC HD: 1080p at most, whatever the bitrate */
+	output_test(40000, VCODEC_H264, 0, 3840, 2160, &w, &h);
+	ASSERT_INT_EQ(h, 1080);
+	output_test(40000, VCODEC_H264, 2160, 3840, 2160, &w, &h);
+	ASSERT_INT_EQ(h, 1080);
+	output_test(40000, VCODEC_HEVC, 0, 3840, 2160, &w, &h);
+	ASSERT_INT_EQ(w, 3840);
+	ASSERT_INT_EQ(h, 2160);
+}
+
+TEST(output_explicit_cap)
+{
+	int	 w, h;
+
+	output_test(2000, VCODEC_H264, 1080, 2880, 1800, &w, &h);
+	ASSERT_INT_EQ(w, 1728);
+	ASSERT_INT_EQ(h, 1080);
+	/* Wide sources are limited by width too */
+	output_test(2000, VCODEC_H264, 0, 2560, 1080, &w, &h);
+	ASSERT_INT_EQ(w, 1280);
+	ASSERT_INT_EQ(h, 540);
+}
+
+TEST(output_never_upscales)
+{
+	int	 w, h;
+
+	output_test(20000, VCODEC_H264, 0, 720, 576, &w, &h);
+	ASSERT_INT_EQ(w, 720);
+	ASSERT_INT_EQ(h, 576);
+	output_test(20000, VCODEC_H264, 0, 1365, 767, &w, &h);
+	ASSERT_INT_EQ(w, 1364);
+	ASSERT_INT_EQ(h, 766);
+}
+
+/* ------------------------------------------------------------------ */
+/* Tests: pipeline profiles                                           */
+/* ------------------------------------------------------------------ */
+
+TEST(profile_lookup)
+{
+	ASSERT(profile_find("interactive") != NULL);
+	ASSERT(profile_find("throughput") != NULL);
+	ASSERT(profile_find("fast") == NULL);
+	ASSERT(profile_find("") == NULL);
+}
+
+/* No profile keeps the settings send2tv always used */
+TEST(profile_default_balanced)
+{
+	media_ctx_t		 m;
+	const profile_t		*p;
+
+	memset(&m, 0, sizeof(m));
+	p = media_profile(&m);
+	ASSERT_STR_EQ(p->name, "balanced");
+	ASSERT(p == profile_find("balanced"));
+	ASSERT_INT_EQ(p->flush_packets, 1);
+	ASSERT_INT_EQ(p->interleave_us, 0);
+	ASSERT_INT_EQ(p->avio_size, SEND2TV_AVIO_SIZE);
+	ASSERT_INT_EQ(p->pipe_size, 0);
+	ASSERT_INT_EQ(p->async_depth, 1);
+	ASSERT_INT_EQ(p->zerolatency, 1);
+	ASSERT_INT_EQ(p->thread_type, 0);
+
+	m.profile = profile_find("throughput");
+	ASSERT_STR_EQ(media_profile(&m)->name, "throughput");
+}
+
+/* interactive never buffers more than balanced */
+TEST(profile_interactive_smaller)
+{
+	const profile_t	*i = profile_find("interactive");
+	const profile_t	*b = profile_find("balanced");
+	const profile_t	*t = profile_find("throughput");
+
+	ASSERT(i->avio_size <= b->avio_size);
+	ASSERT(i->pipe_size > 0);
+	ASSERT(i->flush_packets);
+	ASSERT(i->zerolatency);
+	ASSERT(!t->flush_packets);
+	ASSERT(t->avio_size > b->avio_size);
+	ASSERT(t->async_depth > b->async_depth);
+}
+
 /* ------------------------------------------------------------------ */
 /* Tests: build_dlna_features (DLNA spec compliance)                  */
 /* ------------------------------------------------------------------ */
@@ -1088,150 +1234,3694 @@ TEST(xml_encode_all_special)
 }
 
 /* ------------------------------------------------------------------ */
-/* Main: run all tests                                                */
+/* Tests: speculative seek cache                                      */
 /* ------------------------------------------------------------------ */
 
-int
-main(void)
+static void
+spec_test_init(spec_ctx_t *sc, int duration_sec)
 {
-	printf("send2tv unit tests\n\n");
+	int i;
 
-	printf("video_container_ok:\n");
-	RUN_TEST(video_h264_mp4);
-	RUN_TEST(video_h264_matroska);
-	RUN_TEST(video_h264_avi);
-	RUN_TEST(video_h264_asf);
-	RUN_TEST(video_h264_flv);
-	RUN_TEST(video_h264_mpegts);
-	RUN_TEST(video_h264_mov);
-	RUN_TEST(video_h264_webm_rejected);
-	RUN_TEST(video_h264_null);
-	RUN_TEST(video_hevc_mp4);
-	RUN_TEST(video_hevc_matroska);
-	RUN_TEST(video_hevc_mpegts);
-	RUN_TEST(video_hevc_avi_rejected);
-	RUN_TEST(video_vp8_webm);
-	RUN_TEST(video_vp8_matroska);
-	RUN_TEST(video_vp8_mp4_rejected);
-	RUN_TEST(video_vp9_webm);
-	RUN_TEST(video_av1_matroska);
-	RUN_TEST(video_mpeg4_avi);
-	RUN_TEST(video_mpeg4_mp4);
-	RUN_TEST(video_mpeg4_mpeg_rejected);
-	RUN_TEST(video_mpeg2_mpeg);
-	RUN_TEST(video_mpeg1_mpeg);
-	RUN_TEST(video_vc1_avi);
-	RUN_TEST(video_wmv3_asf);
-	RUN_TEST(video_mjpeg_avi);
-	RUN_TEST(video_unknown_codec);
+	memset(sc, 0, sizeof(*sc));
+	for (i = 0; i < SPEC_MAX_ENTRIES; i++)
+		sc->entries[i].start_sec = -1;
+	sc->duration_sec = duration_sec;
+	sc->started = 1;
+	sc->stale = 1;
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->cond, NULL);
+}
 
-	printf("\naudio_codec_ok:\n");
-	RUN_TEST(audio_aac);
-	RUN_TEST(audio_mp3);
-	RUN_TEST(audio_mp2);
-	RUN_TEST(audio_flac);
-	RUN_TEST(audio_ac3);
-	RUN_TEST(audio_eac3);
-	RUN_TEST(audio_vorbis);
-	RUN_TEST(audio_opus);
-	RUN_TEST(audio_wmav1);
-	RUN_TEST(audio_wmav2);
-	RUN_TEST(audio_pcm_s16le);
-	RUN_TEST(audio_pcm_alaw);
-	RUN_TEST(audio_pcm_mulaw);
-	RUN_TEST(audio_adpcm_ima_wav);
-	RUN_TEST(audio_adpcm_ms);
-	RUN_TEST(audio_dts_rejected);
-	RUN_TEST(audio_unknown);
+static uint8_t *
+spec_test_blob(size_t len)
+{
+	uint8_t *p = malloc(len);
 
-	printf("\ncontainer_ok:\n");
-	RUN_TEST(container_mp4);
-	RUN_TEST(container_matroska);
-	RUN_TEST(container_mpegts);
-	RUN_TEST(container_avi);
-	RUN_TEST(container_asf);
-	RUN_TEST(container_flv);
-	RUN_TEST(container_mp3);
-	RUN_TEST(container_flac);
-	RUN_TEST(container_ogg);
-	RUN_TEST(container_wav);
-	RUN_TEST(container_null);
-	RUN_TEST(container_unknown);
+	memset(p, 0x47, len);
+	return p;
+}
 
-	printf("\nset_mime_type:\n");
-	RUN_TEST(mime_mp4);
-	RUN_TEST(mime_mov);
-	RUN_TEST(mime_mkv_h264);
-	RUN_TEST(mime_mkv_vp8);
-	RUN_TEST(mime_mkv_vp9);
-	RUN_TEST(mime_mkv_av1);
-	RUN_TEST(mime_mpegts);
-	RUN_TEST(mime_mpeg);
-	RUN_TEST(mime_avi);
-	RUN_TEST(mime_asf);
-	RUN_TEST(mime_flv);
-	RUN_TEST(mime_audio_mp3);
-	RUN_TEST(mime_audio_flac);
-	RUN_TEST(mime_audio_ogg);
-	RUN_TEST(mime_audio_wav);
-	RUN_TEST(mime_unknown_defaults_to_mp2t);
+TEST(spec_predict_targets)
+{
+	spec_ctx_t sc;
+
+	spec_test_init(&sc, 600);
+	spec_predict(&sc, 100);
+	ASSERT_INT_EQ(sc.ntargets, 5);
+	ASSERT_INT_EQ(sc.targets[0], 110);
+	ASSERT_INT_EQ(sc.targets[1], 90);
+	ASSERT_INT_EQ(sc.targets[2], 130);
+	ASSERT_INT_EQ(sc.targets[3], 70);
+	ASSERT_INT_EQ(sc.targets[4], 540);	/* 'e' end jump */
+}
 
-	printf("\nset_dlna_profile:\n");
-	RUN_TEST(dlna_h264_mp4);
-	RUN_TEST(dlna_h264_mov);
-	RUN_TEST(dlna_h264_3gp);
-	RUN_TEST(dlna_h264_matroska);
-	RUN_TEST(dlna_h264_mpegts);
-	RUN_TEST(dlna_h264_avi);
-	RUN_TEST(dlna_hevc_mp4);
-	RUN_TEST(dlna_hevc_matroska_empty);
-	RUN_TEST(dlna_mpeg4);
-	RUN_TEST(dlna_vp8_empty);
-	RUN_TEST(dlna_h264_unknown_fmt_empty);
+TEST(spec_predict_clamps_start)
+{
+	spec_ctx_t sc;
 
-	printf("\nbuild_dlna_features:\n");
-	RUN_TEST(dlna_features_file_with_profile);
-	RUN_TEST(dlna_features_streaming_with_profile);
-	RUN_TEST(dlna_features_null_profile);
-	RUN_TEST(dlna_features_empty_profile);
-	RUN_TEST(dlna_features_op_format_file);
-	RUN_TEST(dlna_features_op_format_streaming);
-	RUN_TEST(dlna_features_ci_original);
-	RUN_TEST(dlna_features_ci_transcoded);
-	RUN_TEST(dlna_features_flags_length);
-	RUN_TEST(dlna_features_flags_value);
-	RUN_TEST(dlna_features_consistency);
-	RUN_TEST(dlna_features_field_order);
-	RUN_TEST(dlna_features_field_order_no_profile);
-	RUN_TEST(dlna_transcode_profile_matches_encoder);
-	RUN_TEST(dlna_transcode_profile_hevc);
-	RUN_TEST(dlna_transcode_mime_type);
-	RUN_TEST(dlna_screen_capture_profile);
-	RUN_TEST(dlna_features_no_colons);
-	RUN_TEST(dlna_features_no_colons_no_profile);
-	RUN_TEST(dlna_features_hevc_streaming);
-	RUN_TEST(dlna_mpegts_direct_vs_transcode);
+	spec_test_init(&sc, 0);
+	spec_predict(&sc, 5);
+	ASSERT_INT_EQ(sc.ntargets, 4);
+	ASSERT_INT_EQ(sc.targets[1], 0);
+	ASSERT_INT_EQ(sc.targets[3], 0);
+}
 
-	printf("\nvcodec:\n");
-	RUN_TEST(vcodec_default_is_h264);
-	RUN_TEST(vcodec_hevc_value);
+TEST(spec_predict_skips_past_end)
+{
+	spec_ctx_t sc;
+
+	spec_test_init(&sc, 120);
+	spec_predict(&sc, 100);
+	/* +30 lands past the last 5 seconds */
+	ASSERT_INT_EQ(sc.ntargets, 4);
+	ASSERT_INT_EQ(sc.targets[0], 110);
+	ASSERT_INT_EQ(sc.targets[1], 90);
+	ASSERT_INT_EQ(sc.targets[2], 70);
+	ASSERT_INT_EQ(sc.targets[3], 60);
+}
 
-	printf("\nxml_extract:\n");
-	RUN_TEST(xml_extract_basic);
-	RUN_TEST(xml_extract_nested);
-	RUN_TEST(xml_extract_open_not_found);
-	RUN_TEST(xml_extract_close_not_found);
-	RUN_TEST(xml_extract_empty_content);
-	RUN_TEST(xml_extract_truncation);
-	RUN_TEST(xml_extract_first_match);
+TEST(spec_predict_hysteresis)
+{
+	spec_ctx_t sc;
+
+	spec_test_init(&sc, 600);
+	spec_predict(&sc, 100);
+	spec_predict(&sc, 100 + SPEC_TOLERANCE_SEC);
+	ASSERT_INT_EQ(sc.center_sec, 100);
+	spec_predict(&sc, 101 + SPEC_TOLERANCE_SEC);
+	ASSERT_INT_EQ(sc.center_sec, 101 + SPEC_TOLERANCE_SEC);
+}
 
-	printf("\nxml_encode:\n");
-	RUN_TEST(xml_encode_plain);
-	RUN_TEST(xml_encode_lt_gt);
-	RUN_TEST(xml_encode_amp);
-	RUN_TEST(xml_encode_quotes);
-	RUN_TEST(xml_encode_empty);
-	RUN_TEST(xml_encode_all_special);
+TEST(spec_take_within_tolerance)
+{
+	spec_ctx_t	 sc;
+	uint8_t		*data;
+	size_t		 len;
+	int		 start;
+
+	spec_test_init(&sc, 600);
+	spec_store(&sc, 110, spec_test_blob(1000), 1000);
+	ASSERT_INT_EQ(spec_take(&sc, 110 + SPEC_TOLERANCE_SEC + 1, &data,
+	    &len, &start), -1);
+	ASSERT_INT_EQ(spec_take(&sc, 112, &data, &len, &start), 0);
+	ASSERT_INT_EQ(start, 110);
+	ASSERT_INT_EQ((int)len, 1000);
+	ASSERT_INT_EQ((int)sc.bytes, 0);
+	free(data);
+	/* Taken snippets leave the cache */
+	ASSERT_INT_EQ(spec_take(&sc, 110, &data, &len, &start), -1);
+}
+
+TEST(spec_take_nearest)
+{
+	spec_ctx_t	 sc;
+	uint8_t		*data;
+	size_t		 len;
+	int		 start;
+
+	spec_test_init(&sc, 600);
+	spec_store(&sc, 100, spec_test_blob(10), 10);
+	spec_store(&sc, 103, spec_test_blob(10), 10);
+	ASSERT_INT_EQ(spec_take(&sc, 102, &data, &len, &start), 0);
+	ASSERT_INT_EQ(start, 103);
+	free(data);
+}
+
+TEST(spec_store_evicts_lru_slot)
+{
+	spec_ctx_t	sc;
+	int		i;
+
+	spec_test_init(&sc, 6000);
+	for (i = 0; i < SPEC_MAX_ENTRIES; i++) {
+		sc.tick = i;
+		spec_store(&sc, i * 100, spec_test_blob(10), 10);
+	}
+	sc.tick = 100;
+	spec_store(&sc, 5000, spec_test_blob(10), 10);
+	ASSERT_INT_EQ(spec_find(&sc, 0), -1);
+	ASSERT(spec_find(&sc, 100) >= 0);
+	ASSERT(spec_find(&sc, 5000) >= 0);
+	ASSERT_INT_EQ((int)sc.bytes, SPEC_MAX_ENTRIES * 10);
+}
+
+TEST(spec_store_respects_byte_budget)
+{
+	spec_ctx_t	sc;
+
+	spec_test_init(&sc, 600);
+	sc.tick = 1;
+	spec_store(&sc, 10, spec_test_blob(SPEC_MAX_BYTES / 2),
+	    SPEC_MAX_BYTES / 2);
+	sc.tick = 2;
+	spec_store(&sc, 20, spec_test_blob(SPEC_MAX_BYTES / 2),
+	    SPEC_MAX_BYTES / 2);
+	sc.tick = 3;
+	spec_store(&sc, 30, spec_test_blob(1000), 1000);
+	ASSERT_INT_EQ(spec_find(&sc, 10), -1);
+	ASSERT(spec_find(&sc, 20) >= 0);
+	ASSERT(spec_find(&sc, 30) >= 0);
+	ASSERT(sc.bytes <= SPEC_MAX_BYTES);
+}
+
+/* Windows are input timestamps: stream positions go on from start_time */
+TEST(spec_window_from_start_time)
+{
+	AVFormatContext	 fmt;
+	media_ctx_t	 m;
+
+	memset(&m, 0, sizeof(m));
+	ASSERT(media_start_us(&m) == 0);
+	memset(&fmt, 0, sizeof(fmt));
+	m.ifmt_ctx = &fmt;
+	fmt.start_time = AV_NOPTS_VALUE;
+	ASSERT(media_start_us(&m) == 0);
+	fmt.start_time = 1400000;
+	ASSERT(media_start_us(&m) == 1400000);
+}
+
+/* ------------------------------------------------------------------ */
+/* Tests: transcode cache                                             */
+/* ------------------------------------------------------------------ */
+
+static void
+cache_test_dir(cache_ctx_t *c, char *dir, size_t dirsz, long long max)
+{
+	strlcpy(dir, "/tmp/send2tv-test.XXXXXX", dirsz);
+	if (mkdtemp(dir) == NULL)
+		dir[0] = '\0';
+	cache_init(c, dir, max);
+}
+
+static void
+cache_test_file(const char *dir, const char *name, size_t len, time_t mtime)
+{
+	char		 path[1024], buf[512];
+	struct timeval	 tv[2];
+	int		 fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	memset(buf, 0x47, sizeof(buf));
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	write(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+	close(fd);
+	tv[0].tv_sec = tv[1].tv_sec = mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	utimes(path, tv);
+}
+
+static int
+cache_test_exists(const char *dir, const char *name)
+{
+	char		 path[1024];
+	struct stat	 st;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return stat(path, &st) == 0;
+}
+
+static void
+cache_test_cleanup(const char *dir)
+{
+	DIR		*d;
+	struct dirent	*de;
+	char		 path[1024];
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+TEST(cache_key_depends_on_settings)
+{
+	media_ctx_t	 m;
+	char		 dir[64], src[128], k1[32], k2[32];
+	cache_ctx_t	 c;
+
+	cache_test_dir(&c, dir, sizeof(dir), 1 << 20);
+	cache_test_file(dir, "in.mkv", 100, 1000000);
+	memset(&m, 0, sizeof(m));
+	snprintf(src, sizeof(src), "%s/in.mkv", dir);
+	m.filepath = src;
+	m.bitrate = 2000;
+
+	ASSERT_INT_EQ(cache_key(&m, k1, sizeof(k1)), 0);
+	ASSERT_INT_EQ((int)strlen(k1), 16);
+	ASSERT_INT_EQ(cache_key(&m, k2, sizeof(k2)), 0);
+	ASSERT_STR_EQ(k1, k2);
+
+	m.bitrate = 4000;
+	cache_key(&m, k2, sizeof(k2));
+	ASSERT(strcmp(k1, k2) != 0);
+	m.bitrate = 2000;
+
+	m.vcodec = VCODEC_HEVC;
+	cache_key(&m, k2, sizeof(k2));
+	ASSERT(strcmp(k1, k2) != 0);
+	m.vcodec = VCODEC_H264;
+
+	m.audio_selector = "eng";
+	cache_key(&m, k2, sizeof(k2));
+	ASSERT(strcmp(k1, k2) != 0);
+	m.audio_selector = NULL;
+
+	m.max_height = 720;
+	cache_key(&m, k2, sizeof(k2));
+	ASSERT(strcmp(k1, k2) != 0);
+	m.max_height = 0;
+
+	/* Touching the source invalidates the entry */
+	cache_test_file(dir, "in.mkv", 100, 2000000);
+	cache_key(&m, k2, sizeof(k2));
+	ASSERT(strcmp(k1, k2) != 0);
+
+	cache_test_cleanup(dir);
+}
+
+TEST(cache_key_missing_file)
+{
+	media_ctx_t	 m;
+	char		 key[32];
+
+	memset(&m, 0, sizeof(m));
+	m.filepath = "/nonexistent/send2tv/file.mkv";
+	ASSERT_INT_EQ(cache_key(&m, key, sizeof(key)), -1);
+}
+
+TEST(cache_commit_then_lookup)
+{
+	cache_ctx_t	 c;
+	char		 dir[64], path[1024];
+	int		 fd;
+
+	cache_test_dir(&c, dir, sizeof(dir), 1 << 20);
+	ASSERT_INT_EQ(cache_lookup(&c, "0123456789abcdef", path,
+	    sizeof(path)), -1);
+
+	fd = cache_begin(&c, "0123456789abcdef");
+	ASSERT(fd >= 0);
+	write(fd, "\x47\x40\x00\x10", 4);
+	/* An entry being written is not a hit */
+	ASSERT_INT_EQ(cache_lookup(&c, "0123456789abcdef", path,
+	    sizeof(path)), -1);
+
+	cache_commit(&c);
+	ASSERT_INT_EQ(c.wfd, -1);
+	ASSERT_INT_EQ(cache_lookup(&c, "0123456789abcdef", path,
+	    sizeof(path)), 0);
+	ASSERT(strstr(path, "0123456789abcdef.ts") != NULL);
+	ASSERT(!cache_test_exists(dir, "0123456789abcdef.ts.part"));
+
+	cache_test_cleanup(dir);
+}
+
+TEST(cache_abort_removes_part)
+{
+	cache_ctx_t	 c;
+	char		 dir[64], path[1024];
+	int		 fd;
+
+	cache_test_dir(&c, dir, sizeof(dir), 1 << 20);
+	fd = cache_begin(&c, "feedfacefeedface");
+	ASSERT(fd >= 0);
+	write(fd, "\x47", 1);
+	ASSERT(cache_test_exists(dir, "feedfacefeedface.ts.part"));
+
+	cache_abort(&c);
+	ASSERT_INT_EQ(c.wfd, -1);
+	ASSERT(!cache_test_exists(dir, "feedfacefeedface.ts.part"));
+	ASSERT_INT_EQ(cache_lookup(&c, "feedfacefeedface", path,
+	    sizeof(path)), -1);
+
+	cache_test_cleanup(dir);
+}
+
+TEST(cache_trim_evicts_least_recently_used)
+{
+	cache_ctx_t	 c;
+	char		 dir[64];
+
+	cache_test_dir(&c, dir, sizeof(dir), 250);
+	cache_test_file(dir, "a.ts", 100, 1000);
+	cache_test_file(dir, "b.ts", 100, 3000);
+	cache_test_file(dir, "c.ts", 100, 2000);
+	cache_test_file(dir, "d.ts.part", 100, 500);
+
+	cache_trim(&c);
+	ASSERT(!cache_test_exists(dir, "a.ts"));
+	ASSERT(cache_test_exists(dir, "b.ts"));
+	ASSERT(cache_test_exists(dir, "c.ts"));
+	/* Partial entries are not counted or evicted */
+	ASSERT(cache_test_exists(dir, "d.ts.part"));
+
+	c.max_bytes = 100;
+	cache_trim(&c);
+	ASSERT(!cache_test_exists(dir, "c.ts"));
+	ASSERT(cache_test_exists(dir, "b.ts"));
+
+	cache_test_cleanup(dir);
+}
+
+/* ------------------------------------------------------------------ */
+/* Tests: playlist look-ahead                                         */
+/* ------------------------------------------------------------------ */
+
+static char *la_test_files[] = {
+	"a.mkv", "b.mkv", "https://example.com/c", "d.mkv", "e.mkv"
+};
+
+static void
+la_test_init(lookahead_ctx_t *la)
+{
+	int i;
+
+	memset(la, 0, sizeof(*la));
+	la->files = la_test_files;
+	la->nfiles = 5;
+	la->current = -1;
+	la->started = 1;
+	for (i = 0; i < LOOKAHEAD_ITEMS; i++) {
+		la->items[i].idx = -1;
+		la->items[i].media.pipe_rd = -1;
+		la->items[i].media.pipe_wr = -1;
+	}
+	pthread_mutex_init(&la->lock, NULL);
+	pthread_cond_init(&la->cond, NULL);
+}
+
+static void
+la_test_fill(lookahead_ctx_t *la, int idx, int state, size_t len)
+{
+	lookahead_item_t *it = &la->items[idx % LOOKAHEAD_ITEMS];
+
+	it->idx = idx;
+	it->state = state;
+	it->wanted = 1;
+	it->media.filepath = la_test_files[idx];
+	it->media.pipe_rd = -1;
+	it->media.pipe_wr = -1;
+	if (len > 0) {
+		it->data = malloc(len);
+		it->len = len;
+		it->sec = 60;
+	}
+}
+
+TEST(lookahead_window_sec_scales_with_bitrate)
+{
+	ASSERT_INT_EQ(lookahead_window_sec(2000), LOOKAHEAD_SEC);
+	ASSERT_INT_EQ(lookahead_window_sec(20000), 26);
+	ASSERT_INT_EQ(lookahead_window_sec(1000000), SPEC_SNIPPET_SEC);
+}
+
+TEST(lookahead_next_index_window)
+{
+	lookahead_ctx_t la;
+
+	la_test_init(&la);
+	ASSERT_INT_EQ(lookahead_next_index(&la), 0);
+
+	la.current = 0;
+	ASSERT_INT_EQ(lookahead_next_index(&la), 1);
+	la.items[1].idx = 1;
+	/* files[2] is a URL, files[3] is outside the window */
+	ASSERT_INT_EQ(lookahead_next_index(&la), -1);
+
+	la.current = 1;
+	ASSERT_INT_EQ(lookahead_next_index(&la), 3);
+
+	la.current = 4;
+	ASSERT_INT_EQ(lookahead_next_index(&la), -1);
+}
+
+TEST(lookahead_take_ready_only)
+{
+	lookahead_ctx_t	 la;
+	media_ctx_t	 m;
+	uint8_t		*data;
+	size_t		 len;
+	int		 sec;
+
+	la_test_init(&la);
+	la_test_fill(&la, 1, LA_BUSY, 0);
+	ASSERT_INT_EQ(lookahead_take(&la, 1, &m, &data, &len, &sec), -1);
+	/* Slot holds a different file */
+	ASSERT_INT_EQ(lookahead_take(&la, 3, &m, &data, &len, &sec), -1);
+
+	la.items[1].state = LA_READY;
+	la.items[1].data = malloc(1000);
+	la.items[1].len = 1000;
+	la.items[1].sec = 60;
+	ASSERT_INT_EQ(lookahead_take(&la, 1, &m, &data, &len, &sec), 0);
+	ASSERT_STR_EQ(m.filepath, "b.mkv");
+	ASSERT(data != NULL);
+	ASSERT_INT_EQ((int)len, 1000);
+	ASSERT_INT_EQ(sec, 60);
+	ASSERT_INT_EQ(la.items[1].state, LA_TAKEN);
+	ASSERT(la.items[1].data == NULL);
+	/* Taken once only */
+	ASSERT_INT_EQ(lookahead_take(&la, 1, &m, &data, &len, &sec), -1);
+	free(data);
+}
+
+/*
+ * Look-ahead items, seek snippets and chunks are encoded with every
+ * setting of the template.
+ */
+TEST(media_from_template_keeps_settings)
+{
+	media_ctx_t	 tmpl, m;
+	uint8_t		 junk[4];
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.continuous = 1;
+	tmpl.use_shm = 1;
+	tmpl.profile = &profiles[0];
+	tmpl.readahead_mb = 16;
+	tmpl.bitrate = 8000;
+	tmpl.threads = 3;
+	tmpl.full_probe = 1;
+	tmpl.cache_fd = 7;
+	tmpl.prefix = junk;
+	tmpl.prefix_len = sizeof(junk);
+	media_from_template(&m, &tmpl, "b.mkv");
+	ASSERT_STR_EQ(m.filepath, "b.mkv");
+	ASSERT_INT_EQ(m.continuous, 1);
+	ASSERT_INT_EQ(m.use_shm, 1);
+	ASSERT(m.profile == &profiles[0]);
+	ASSERT_INT_EQ(m.readahead_mb, 16);
+	ASSERT_INT_EQ(m.bitrate, 8000);
+	ASSERT_INT_EQ(m.threads, 3);
+	ASSERT_INT_EQ(m.full_probe, 1);
+	/* Per stream */
+	ASSERT_INT_EQ(m.cache_fd, -1);
+	ASSERT_INT_EQ(m.pipe_wr, -1);
+	ASSERT_INT_EQ(m.running, 1);
+	ASSERT(m.prefix == NULL && m.splice == NULL);
+}
+
+TEST(lookahead_advance_drops_passed_items)
+{
+	lookahead_ctx_t la;
+
+	la_test_init(&la);
+	la_test_fill(&la, 1, LA_READY, 100);
+	la_test_fill(&la, 2, LA_BUSY, 0);
+
+	lookahead_advance(&la, 2);
+	ASSERT_INT_EQ(la.current, 2);
+	ASSERT_INT_EQ(la.items[1].idx, -1);
+	ASSERT_INT_EQ(la.items[1].state, LA_EMPTY);
+	ASSERT(la.items[1].data == NULL);
+	/* The worker owns a busy slot: only told to stop */
+	ASSERT_INT_EQ(la.items[0].idx, 2);
+	ASSERT_INT_EQ(la.items[0].state, LA_BUSY);
+	ASSERT_INT_EQ(la.items[0].wanted, 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* chunk.c tests                                                      */
+/* ------------------------------------------------------------------ */
+
+TEST(chunk_plan_on_keyframes)
+{
+	/* Keyframes every 2s from t0 = 1s, 100s long */
+	int64_t	 kf[50];
+	chunk_t	*c;
+	int	 i, n;
+
+	for (i = 0; i < 50; i++)
+		kf[i] = (1 + 2 * (int64_t)i) * AV_TIME_BASE;
+	n = chunk_plan(kf, 50, AV_TIME_BASE, 100LL * AV_TIME_BASE,
+	    30LL * AV_TIME_BASE, &c);
+	ASSERT_INT_EQ(n, 4);
+	ASSERT_INT_EQ(c[0].start_us, 1LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[0].origin_us, 0);
+	ASSERT_INT_EQ(c[0].end_us, 31LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[1].start_us, 31LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[1].origin_us, 30LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[2].end_us, 91LL * AV_TIME_BASE);
+	/* The last chunk runs to EOF */
+	ASSERT_INT_EQ(c[3].start_us, 91LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[3].end_us, 0);
+	for (i = 0; i < n; i++)
+		ASSERT_INT_EQ(c[i].state, CHUNK_PENDING);
+	free(c);
+}
+
+TEST(chunk_plan_without_index)
+{
+	chunk_t	*c;
+	int	 n;
+
+	n = chunk_plan(NULL, 0, 0, 70LL * AV_TIME_BASE,
+	    30LL * AV_TIME_BASE, &c);
+	ASSERT_INT_EQ(n, 3);
+	ASSERT_INT_EQ(c[1].start_us, 30LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[1].end_us, 60LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[2].end_us, 0);
+	free(c);
+}
+
+TEST(chunk_plan_merges_short_tail)
+{
+	chunk_t	*c;
+	int	 n;
+
+	/* 5s would be left for a third chunk: under a quarter, merged */
+	n = chunk_plan(NULL, 0, 0, 65LL * AV_TIME_BASE,
+	    30LL * AV_TIME_BASE, &c);
+	ASSERT_INT_EQ(n, 2);
+	ASSERT_INT_EQ(c[1].start_us, 30LL * AV_TIME_BASE);
+	ASSERT_INT_EQ(c[1].end_us, 0);
+	free(c);
+}
+
+TEST(chunk_plan_unknown_duration)
+{
+	chunk_t	*c;
+	int	 n;
+
+	n = chunk_plan(NULL, 0, 0, 0, 30LL * AV_TIME_BASE, &c);
+	ASSERT_INT_EQ(n, 1);
+	ASSERT_INT_EQ(c[0].start_us, 0);
+	ASSERT_INT_EQ(c[0].end_us, 0);
+	free(c);
+}
+
+TEST(chunk_parse_remote_spec)
+{
+	chunk_remote_t	 r;
+
+	ASSERT_INT_EQ(chunk_parse_remote("box", &r), 0);
+	ASSERT_STR_EQ(r.host, "box");
+	ASSERT_INT_EQ(r.port, CHUNK_DEFAULT_PORT);
+	ASSERT_INT_EQ(r.jobs, 1);
+
+	ASSERT_INT_EQ(chunk_parse_remote("10.0.0.2:9000/8", &r), 0);
+	ASSERT_STR_EQ(r.host, "10.0.0.2");
+	ASSERT_INT_EQ(r.port, 9000);
+	ASSERT_INT_EQ(r.jobs, 8);
+
+	ASSERT_INT_EQ(chunk_parse_remote("box/0", &r), -1);
+	ASSERT_INT_EQ(chunk_parse_remote("box:70000", &r), -1);
+	ASSERT_INT_EQ(chunk_parse_remote(":9000", &r), -1);
+}
+
+TEST(chunk_request_round_trip)
+{
+	media_ctx_t	 t, m;
+	chunk_job_t	 job;
+	chunk_t		 c, p;
+	char		 line[2048], sel[64], path[1024];
+	int		 force;
+
+	memset(&t, 0, sizeof(t));
+	t.bitrate = 8000;
+	t.vcodec = 1;
+	t.max_height = 720;
+	t.audio_selector = "ger";
+	t.has_channelmap = 1;
+	t.channelmap[0] = 1;
+	t.channelmap[5] = 4;
+	memset(&job, 0, sizeof(job));
+	job.tmpl = &t;
+	job.filepath = "/media/a film.mkv";
+	job.force_transcode = 1;
+	memset(&c, 0, sizeof(c));
+	c.start_us = 31LL * AV_TIME_BASE;
+	c.end_us = 61LL * AV_TIME_BASE;
+	c.origin_us = 30LL * AV_TIME_BASE;
+
+	chunk_format_request(line, sizeof(line), &job, &c, 4);
+	line[strcspn(line, "\n")] = '\0';
+	memset(&m, 0, sizeof(m));
+	ASSERT_INT_EQ(chunk_parse_request(line, &p, &m, &force, sel,
+	    sizeof(sel), path, sizeof(path)), 0);
+	ASSERT_INT_EQ(p.start_us, c.start_us);
+	ASSERT_INT_EQ(p.end_us, c.end_us);
+	ASSERT_INT_EQ(p.origin_us, c.origin_us);
+	ASSERT_INT_EQ(m.bitrate, 8000);
+	ASSERT_INT_EQ(m.vcodec, 1);
+	ASSERT_INT_EQ(m.max_height, 720);
+	ASSERT_INT_EQ(m.threads, 4);
+	ASSERT_INT_EQ(force, 1);
+	ASSERT_INT_EQ(m.has_channelmap, 1);
+	ASSERT_INT_EQ(m.channelmap[5], 4);
+	ASSERT_STR_EQ(sel, "ger");
+	ASSERT_STR_EQ(path, "/media/a film.mkv");
+
+	ASSERT_INT_EQ(chunk_parse_request("CHUNK 0 0 0 8000", &p, &m,
+	    &force, sel, sizeof(sel), path, sizeof(path)), -1);
+}
+
+/* A worker opens regular files only, not URLs or devices for anyone */
+TEST(chunk_worker_paths)
+{
+	char	 dir[64], path[128];
+	int	 fd;
+
+	snprintf(dir, sizeof(dir), "/tmp/send2tv-test.%d", (int)getpid());
+	ASSERT_INT_EQ(mkdir(dir, 0700), 0);
+	snprintf(path, sizeof(path), "%s/film.mkv", dir);
+	ASSERT((fd = open(path, O_CREAT | O_WRONLY, 0600)) >= 0);
+	close(fd);
+	ASSERT_INT_EQ(chunk_path_ok(path), 1);
+	ASSERT_INT_EQ(chunk_path_ok(dir), 0);
+	ASSERT_INT_EQ(chunk_path_ok("/dev/zero"), 0);
+	ASSERT_INT_EQ(chunk_path_ok("http://127.0.0.1/film.mkv"), 0);
+	ASSERT_INT_EQ(chunk_path_ok("file:///etc/passwd"), 0);
+	ASSERT_INT_EQ(chunk_path_ok("/nonexistent/film.mkv"), 0);
+	unlink(path);
+	rmdir(dir);
+}
+
+/* ------------------------------------------------------------------ */
+/* abr.c tests                                                        */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Feed one ABR window: output advanced pace_pct of real time, writes
+ * blocked stall_pct of it and sent kbps went out.
+ */
+static int
+abr_test_window(abr_ctx_t *a, int64_t *now, int pace_pct, int stall_pct,
+    int queue_pct, int kbps)
+{
+	int64_t	 pts = a->pts_last < 0 ? 0 : a->pts_last;
+
+	abr_note_pts(a, pts);
+	abr_note_pts(a, pts + (int64_t)ABR_WINDOW_US * pace_pct / 100);
+	abr_note_write(a, (size_t)kbps * 1000 / 8 * ABR_WINDOW_US /
+	    1000000, (int64_t)ABR_WINDOW_US * stall_pct / 100, queue_pct);
+	*now += ABR_WINDOW_US;
+	return abr_update(a, *now);
+}
+
+TEST(abr_init_floor)
+{
+	abr_ctx_t	 a;
+
+	abr_init(&a, 8000);
+	ASSERT_INT_EQ(a.cur_kbps, 8000);
+	ASSERT_INT_EQ(a.min_kbps, 2000);
+	abr_init(&a, 1000);
+	ASSERT_INT_EQ(a.min_kbps, ABR_MIN_KBPS);
+	abr_init(&a, 300);
+	ASSERT_INT_EQ(a.min_kbps, 300);
+}
+
+TEST(abr_throttled_reader_is_not_congestion)
+{
+	abr_ctx_t	 a;
+	int64_t		 now = 0;
+	int		 i;
+
+	/* A TV reading at playback speed blocks most writes */
+	abr_init(&a, 8000);
+	ASSERT_INT_EQ(abr_update(&a, now), 0);
+	for (i = 0; i < 10; i++)
+		ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 90, 100, 8300),
+		    0);
+	ASSERT_INT_EQ(a.cur_kbps, 8000);
+}
+
+TEST(abr_steps_down_when_behind)
+{
+	abr_ctx_t	 a;
+	int64_t		 now = 0;
+
+	abr_init(&a, 8000);
+	abr_update(&a, now);
+	/* Behind, but writes do not block: not the network */
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 70, 5, 10, 8000), 0);
+	/* Behind and blocked: a quarter down */
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 80, 50, -1, 8000), 6000);
+	/* The link carried far less: follow it */
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 50, 60, -1, 3000), 2400);
+	/* Never below the floor */
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 10, 90, 100, 500), 2000);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 10, 90, 100, 500), 0);
+	ASSERT_INT_EQ(a.cur_kbps, 2000);
+}
+
+TEST(abr_full_queue_counts_as_blocked)
+{
+	abr_ctx_t	 a;
+	int64_t		 now = 0;
+
+	abr_init(&a, 4000);
+	abr_update(&a, now);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 85, 0, 90, 4000), 3000);
+}
+
+TEST(abr_steps_up_with_hysteresis)
+{
+	abr_ctx_t	 a;
+	int64_t		 now = 0;
+	int		 i;
+
+	abr_init(&a, 8000);
+	abr_update(&a, now);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 50, 80, -1, 8000), 6000);
+
+	/* Clear windows, but within the hold time after the drop */
+	for (i = 0; i < ABR_HOLD_US / ABR_WINDOW_US - 1; i++)
+		ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 6000),
+		    0);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 6000), 6800);
+
+	/* A window falling behind restarts the count */
+	for (i = 0; i < ABR_UP_WINDOWS - 1; i++)
+		ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 6800),
+		    0);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 95, 10, 0, 6800), 0);
+	for (i = 0; i < ABR_UP_WINDOWS - 1; i++)
+		ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 6800),
+		    0);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 6800), 7600);
+
+	/* Capped at the configured rate */
+	for (i = 0; i < ABR_UP_WINDOWS - 1; i++)
+		abr_test_window(&a, &now, 100, 10, 0, 7600);
+	ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 7600), 8000);
+	for (i = 0; i < 2 * ABR_UP_WINDOWS; i++)
+		ASSERT_INT_EQ(abr_test_window(&a, &now, 100, 10, 0, 8000),
+		    0);
+}
+
+TEST(abr_waits_for_full_window)
+{
+	abr_ctx_t	 a;
+
+	abr_init(&a, 8000);
+	abr_update(&a, 0);
+	abr_note_pts(&a, 0);
+	abr_note_write(&a, 1000, ABR_WINDOW_US / 2, 100);
+	ASSERT_INT_EQ(abr_update(&a, ABR_WINDOW_US / 2), 0);
+	ASSERT_INT_EQ(abr_update(&a, ABR_WINDOW_US), 2000);
+}
+
+/* ------------------------------------------------------------------ */
+/* gov.c tests                                                        */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Feed one GOP of fps frames that took load_pct of real time.
+ */
+static int
+gov_test_gop(gov_ctx_t *g, int load_pct)
+{
+	int	 fps = g->fps_num / g->fps_den / g->rungs[g->rung].fps_div;
+	int	 i;
+
+	for (i = 0; i < fps; i++)
+		gov_note_frame(g);
+	gov_note_busy(g, 1000000LL * load_pct / 100);
+	return gov_update(g);
+}
+
+TEST(gov_ladder_4k60)
+{
+	gov_ctx_t	 g;
+
+	gov_init(&g, 3840, 2160, 60, 1);
+	ASSERT_INT_EQ(g.nrungs, 7);
+	ASSERT_INT_EQ(g.rungs[0].height, 2160);
+	ASSERT_INT_EQ(g.rungs[1].aac_fast, 1);
+	ASSERT_INT_EQ(g.rungs[2].width, 2560);
+	ASSERT_INT_EQ(g.rungs[2].height, 1440);
+	ASSERT_INT_EQ(g.rungs[3].height, 1080);
+	ASSERT_INT_EQ(g.rungs[3].fps_div, 1);
+	ASSERT_INT_EQ(g.rungs[4].fps_div, 2);
+	ASSERT_INT_EQ(g.rungs[6].width, 960);
+	ASSERT_INT_EQ(g.rungs[6].height, 540);
+}
+
+TEST(gov_ladder_skips_noop_rungs)
+{
+	gov_ctx_t	 g;
+
+	/* 1080p30: nothing to do for 1440, 1080 or half frame rate */
+	gov_init(&g, 1920, 1080, 30000, 1001);
+	ASSERT_INT_EQ(g.nrungs, 4);
+	ASSERT_INT_EQ(g.rungs[1].height, 1080);
+	ASSERT_INT_EQ(g.rungs[1].aac_fast, 1);
+	ASSERT_INT_EQ(g.rungs[2].height, 720);
+	ASSERT_INT_EQ(g.rungs[2].fps_div, 1);
+	ASSERT_INT_EQ(g.rungs[3].height, 540);
+
+	/* Odd widths stay even */
+	gov_init(&g, 2880, 1800, 30, 1);
+	ASSERT_INT_EQ(g.rungs[2].width, 2304);
+	ASSERT_INT_EQ(g.rungs[3].width, 1728);
+}
+
+TEST(gov_steps_down_to_fitting_rung)
+{
+	gov_ctx_t	 g;
+
+	gov_init(&g, 3840, 2160, 60, 1);
+	/* One slow GOP is not enough */
+	ASSERT_INT_EQ(gov_test_gop(&g, 150), -1);
+	ASSERT_INT_EQ(gov_test_gop(&g, 50), -1);
+	ASSERT_INT_EQ(gov_test_gop(&g, 150), -1);
+	/* 150% needs half the pixels: 1440p60 at 44% of 4K */
+	ASSERT_INT_EQ(gov_test_gop(&g, 150), 2);
+	ASSERT_INT_EQ(g.rung, 2);
+
+	/* Far too slow: straight to the bottom */
+	gov_test_gop(&g, 900);
+	ASSERT_INT_EQ(gov_test_gop(&g, 900), 6);
+	gov_test_gop(&g, 900);
+	ASSERT_INT_EQ(gov_test_gop(&g, 900), -1);
+}
+
+TEST(gov_steps_up_with_headroom)
+{
+	gov_ctx_t	 g;
+	int		 i;
+
+	gov_init(&g, 1920, 1080, 30, 1);
+	gov_test_gop(&g, 200);
+	ASSERT_INT_EQ(gov_test_gop(&g, 200), 3);
+
+	/* 540p at 40%: 720p would be ~71%, fits after GOV_UP_GOPS */
+	for (i = 0; i < GOV_UP_GOPS - 1; i++)
+		ASSERT_INT_EQ(gov_test_gop(&g, 40), -1);
+	ASSERT_INT_EQ(gov_test_gop(&g, 40), 2);
+
+	/* 720p at 60%: 1080p would be ~128%, stay */
+	for (i = 0; i < 3 * GOV_UP_GOPS; i++)
+		ASSERT_INT_EQ(gov_test_gop(&g, 60), -1);
+
+	/* One busy GOP restarts the count */
+	for (i = 0; i < GOV_UP_GOPS - 1; i++)
+		ASSERT_INT_EQ(gov_test_gop(&g, 30), -1);
+	ASSERT_INT_EQ(gov_test_gop(&g, 90), -1);
+	for (i = 0; i < GOV_UP_GOPS - 1; i++)
+		ASSERT_INT_EQ(gov_test_gop(&g, 30), -1);
+	ASSERT_INT_EQ(gov_test_gop(&g, 30), 1);
+}
+
+TEST(gov_no_frames_no_decision)
+{
+	gov_ctx_t	 g;
+
+	gov_init(&g, 1920, 1080, 30, 1);
+	gov_note_busy(&g, 5000000);
+	ASSERT_INT_EQ(gov_update(&g), -1);
+	ASSERT_INT_EQ(g.over, 0);
+	ASSERT_INT_EQ(g.busy_us, 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* dedupe.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+#define DD_W	200	/* 4 x 3 tiles, the last column and row partial */
+#define DD_H	70
+#define DD_LS	(DD_W * 4 + 32)	/* padded like x11grab rows may be */
+
+static uint8_t	 dd_frame[DD_LS * DD_H];
+
+TEST(dedupe_first_frame_all_dirty)
+{
+	dedupe_ctx_t	 d;
+
+	memset(&d, 0, sizeof(d));
+	memset(dd_frame, 0x40, sizeof(dd_frame));
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 12);
+	ASSERT_INT_EQ(d.tiles, 12);
+	ASSERT_INT_EQ(d.x1, DD_W);
+	ASSERT_INT_EQ(d.y1, DD_H);
+	dedupe_free(&d);
+}
+
+TEST(dedupe_static_frame_clean)
+{
+	dedupe_ctx_t	 d;
+
+	memset(&d, 0, sizeof(d));
+	memset(dd_frame, 0x40, sizeof(dd_frame));
+	dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4);
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 0);
+
+	/* Row padding is not part of the picture */
+	dd_frame[DD_W * 4 + 5] = 0x99;
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 0);
+	ASSERT_INT_EQ(d.frames, 3);
+	ASSERT_INT_EQ(d.dirty_tiles, 12);
+	dedupe_free(&d);
+}
+
+TEST(dedupe_one_pixel_one_tile)
+{
+	dedupe_ctx_t	 d;
+
+	memset(&d, 0, sizeof(d));
+	memset(dd_frame, 0x40, sizeof(dd_frame));
+	dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4);
+
+	/* Pixel (130, 40): tile column 2, tile row 1 */
+	dd_frame[40 * DD_LS + 130 * 4 + 1] = 0x41;
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 1);
+	ASSERT_INT_EQ(d.x0, 128);
+	ASSERT_INT_EQ(d.y0, 32);
+	ASSERT_INT_EQ(d.x1, 192);
+	ASSERT_INT_EQ(d.y1, 64);
+
+	/* The change became the reference */
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 0);
+	dedupe_free(&d);
+}
+
+TEST(dedupe_partial_tiles_and_bbox)
+{
+	dedupe_ctx_t	 d;
+
+	memset(&d, 0, sizeof(d));
+	memset(dd_frame, 0x40, sizeof(dd_frame));
+	dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4);
+
+	/* Last pixel and the pixel at the origin */
+	dd_frame[(DD_H - 1) * DD_LS + (DD_W - 1) * 4] = 0;
+	dd_frame[0] = 0;
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4), 2);
+	ASSERT_INT_EQ(d.x0, 0);
+	ASSERT_INT_EQ(d.y0, 0);
+	ASSERT_INT_EQ(d.x1, DD_W);
+	ASSERT_INT_EQ(d.y1, DD_H);
+	dedupe_free(&d);
+}
+
+TEST(dedupe_resize_starts_over)
+{
+	dedupe_ctx_t	 d;
+
+	memset(&d, 0, sizeof(d));
+	memset(dd_frame, 0x40, sizeof(dd_frame));
+	dedupe_frame(&d, dd_frame, DD_LS, DD_W, DD_H, 4);
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, 64, 32, 4), 1);
+	ASSERT_INT_EQ(dedupe_frame(&d, dd_frame, DD_LS, 64, 32, 4), 0);
+	dedupe_free(&d);
+	ASSERT(d.prev == NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* avsync.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+TEST(avsync_offset_from_position_errors)
+{
+	avsync_ctx_t	 s;
+
+	avsync_init(&s, 1000000);
+
+	/* Video frame captured at +1 s, written at 1 s: on the clock */
+	avsync_note_video(&s, 1000000, 2000000, 2030000);
+	ASSERT_INT_EQ(s.vpos_us, 0);
+
+	/* Audio captured at +1 s but written at 1.04 s: 40 ms late */
+	avsync_note_audio(&s, 1040000, 2000000, 2010000);
+	/* And 20 ms early */
+	avsync_note_audio(&s, 980000, 2000000, 2050000);
+	ASSERT_INT_EQ(s.av_n, 2);
+	ASSERT_INT_EQ(s.av_min, -20000);
+	ASSERT_INT_EQ(s.av_max, 40000);
+
+	ASSERT_INT_EQ(avsync_update(&s, 1000000 + AVSYNC_WINDOW_US), 1);
+	ASSERT_INT_EQ(s.av_us, 10000);
+	ASSERT_INT_EQ(s.vlat_us, 30000);
+	ASSERT_INT_EQ(s.alat_us, 30000);
+}
+
+TEST(avsync_offset_relative_to_video)
+{
+	avsync_ctx_t	 s;
+
+	avsync_init(&s, 0);
+
+	/* Video output runs 100 ms ahead of its capture time */
+	avsync_note_video(&s, 600000, 500000, 520000);
+	avsync_note_audio(&s, 600000, 500000, 510000);
+	ASSERT_INT_EQ(s.av_sum, 0);
+	avsync_note_audio(&s, 500000, 500000, 510000);
+	ASSERT_INT_EQ(s.av_min, -100000);
+}
+
+TEST(avsync_audio_before_video_no_offset)
+{
+	avsync_ctx_t	 s;
+
+	avsync_init(&s, 0);
+	avsync_note_audio(&s, 0, 0, 15000);
+	ASSERT_INT_EQ(s.av_n, 0);
+	ASSERT_INT_EQ(s.alat_n, 1);
+	ASSERT_INT_EQ(s.alat_max, 15000);
+}
+
+TEST(avsync_window)
+{
+	avsync_ctx_t	 s;
+
+	avsync_init(&s, 0);
+	avsync_note_video(&s, 0, 0, 40000);
+	ASSERT_INT_EQ(avsync_update(&s, AVSYNC_WINDOW_US - 1), 0);
+	ASSERT_INT_EQ(avsync_update(&s, AVSYNC_WINDOW_US), 1);
+	ASSERT_INT_EQ(s.vlat_us, 40000);
+	ASSERT_INT_EQ(s.vlat_n, 0);
+	ASSERT_INT_EQ(s.vlat_max, 0);
+
+	/* The next window starts where the last one closed */
+	ASSERT_INT_EQ(avsync_update(&s, 2 * AVSYNC_WINDOW_US - 1), 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* tslock.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+#define TSL_PMT		0x1000
+#define TSL_VIDEO	0x0100
+
+/* One TS packet carrying data, padded with adaptation field stuffing */
+static void
+tsl_packet(uint8_t *pkt, int pid, int pusi, int rai, const uint8_t *data,
+    int len)
+{
+	int	 af = TS_PACKET - 4 - len;
+
+	memset(pkt, 0xff, TS_PACKET);
+	pkt[0] = TS_SYNC;
+	pkt[1] = (pusi ? 0x40 : 0) | pid >> 8;
+	pkt[2] = pid & 0xff;
+	pkt[3] = 0x30;
+	pkt[4] = af - 1;
+	pkt[5] = rai ? 0x40 : 0;
+	memcpy(pkt + 4 + af, data, len);
+}
+
+static void
+tsl_psi(uint8_t *pkt, int type)
+{
+	static const uint8_t pat[] = {
+		0x00, 0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+		0x00, 0x01, 0xe0 | TSL_PMT >> 8, TSL_PMT & 0xff,
+		0, 0, 0, 0
+	};
+	uint8_t	 pmt[] = {
+		0x00, 0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00,
+		0xe0 | TSL_VIDEO >> 8, TSL_VIDEO & 0xff, 0xf0, 0x00,
+		0x1b, 0xe0 | TSL_VIDEO >> 8, TSL_VIDEO & 0xff, 0xf0, 0x00,
+		0, 0, 0, 0
+	};
+
+	if (type < 0) {
+		tsl_packet(pkt, 0, 1, 0, pat, sizeof(pat));
+		return;
+	}
+	pmt[13] = type;
+	tsl_packet(pkt, TSL_PMT, 1, 0, pmt, sizeof(pmt));
+}
+
+/* A video PES with the given NAL unit headers (after the start code) */
+static void
+tsl_pes(uint8_t *pkt, int rai, const uint8_t *nals, int n, int nal_len)
+{
+	uint8_t	 buf[160];
+	int	 len, i;
+
+	static const uint8_t hdr[] = {
+		0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05,
+		0x21, 0x00, 0x01, 0x00, 0x01
+	};
+
+	memcpy(buf, hdr, sizeof(hdr));
+	len = sizeof(hdr);
+	for (i = 0; i < n; i++) {
+		buf[len++] = 0;
+		buf[len++] = 0;
+		buf[len++] = 1;
+		memcpy(buf + len, nals + i * nal_len, nal_len);
+		len += nal_len;
+		buf[len++] = 0x88;	/* some payload */
+	}
+	tsl_packet(pkt, TSL_VIDEO, 1, rai, buf, len);
+}
+
+static const uint8_t tsl_h264_key[] = { 0x67, 0x68, 0x65 };
+static const uint8_t tsl_h264_delta[] = { 0x41 };
+
+TEST(tslock_h264_keyframe)
+{
+	uint8_t		 ts[4 * TS_PACKET];
+	tslock_t	 t;
+
+	tsl_psi(ts, -1);
+	tsl_psi(ts + TS_PACKET, 0x1b);
+	tsl_pes(ts + 2 * TS_PACKET, 1, tsl_h264_key, 3, 1);
+	tsl_pes(ts + 3 * TS_PACKET, 0, tsl_h264_delta, 1, 1);
+
+	tslock_init(&t);
+	ASSERT_INT_EQ(tslock_feed(&t, ts, sizeof(ts)), 1);
+	ASSERT_INT_EQ(t.video_pid, TSL_VIDEO);
+	ASSERT_INT_EQ(t.lock_off, 2 * TS_PACKET);
+}
+
+TEST(tslock_needs_psi_first)
+{
+	uint8_t		 ts[4 * TS_PACKET];
+	tslock_t	 t;
+
+	/* A keyframe before PAT/PMT cannot be decoded */
+	tsl_pes(ts, 1, tsl_h264_key, 3, 1);
+	tsl_psi(ts + TS_PACKET, -1);
+	tsl_psi(ts + 2 * TS_PACKET, 0x1b);
+
+	tslock_init(&t);
+	ASSERT_INT_EQ(tslock_feed(&t, ts, 3 * TS_PACKET), 0);
+	tsl_pes(ts + 3 * TS_PACKET, 1, tsl_h264_key, 3, 1);
+	ASSERT_INT_EQ(tslock_feed(&t, ts + 3 * TS_PACKET, TS_PACKET), 1);
+	ASSERT_INT_EQ(t.lock_off, 3 * TS_PACKET);
+}
+
+TEST(tslock_waits_for_idr)
+{
+	uint8_t		 ts[5 * TS_PACKET];
+	static const uint8_t ps_only[] = { 0x67, 0x68, 0x41 };
+	tslock_t	 t;
+
+	tsl_psi(ts, -1);
+	tsl_psi(ts + TS_PACKET, 0x1b);
+	/* Mid-GOP start: parameter sets but no IDR, then no RAI */
+	tsl_pes(ts + 2 * TS_PACKET, 1, ps_only, 3, 1);
+	tsl_pes(ts + 3 * TS_PACKET, 0, tsl_h264_key, 3, 1);
+	tsl_pes(ts + 4 * TS_PACKET, 1, tsl_h264_key, 3, 1);
+
+	tslock_init(&t);
+	ASSERT_INT_EQ(tslock_feed(&t, ts, 4 * TS_PACKET), 0);
+	ASSERT_INT_EQ(tslock_feed(&t, ts + 4 * TS_PACKET, TS_PACKET), 1);
+	ASSERT_INT_EQ(t.lock_off, 4 * TS_PACKET);
+}
+
+TEST(tslock_split_feed)
+{
+	uint8_t		 ts[3 * TS_PACKET];
+	tslock_t	 t;
+	size_t		 i;
+	int		 locked = 0;
+
+	tsl_psi(ts, -1);
+	tsl_psi(ts + TS_PACKET, 0x1b);
+	tsl_pes(ts + 2 * TS_PACKET, 1, tsl_h264_key, 3, 1);
+
+	tslock_init(&t);
+	for (i = 0; i < sizeof(ts) && !locked; i += 7)
+		locked = tslock_feed(&t, ts + i,
+		    sizeof(ts) - i < 7 ? sizeof(ts) - i : 7);
+	ASSERT_INT_EQ(locked, 1);
+	ASSERT_INT_EQ(t.lock_off, 2 * TS_PACKET);
+}
+
+TEST(tslock_hevc_irap)
+{
+	uint8_t		 ts[4 * TS_PACKET];
+	tslock_t	 t;
+	/* VPS, SPS, PPS, IDR_W_RADL */
+	static const uint8_t key[] = {
+		0x40, 0x01, 0x42, 0x01, 0x44, 0x01, 0x26, 0x01
+	};
+
+	tsl_psi(ts, -1);
+	tsl_psi(ts + TS_PACKET, 0x24);
+	/* SPS and PPS without a VPS are not enough */
+	tsl_pes(ts + 2 * TS_PACKET, 1, key + 2, 3, 2);
+	tsl_pes(ts + 3 * TS_PACKET, 1, key, 4, 2);
+
+	tslock_init(&t);
+	ASSERT_INT_EQ(tslock_feed(&t, ts, sizeof(ts)), 1);
+	ASSERT_INT_EQ(t.video_type, 0x24);
+	ASSERT_INT_EQ(t.lock_off, 3 * TS_PACKET);
+}
+
+/* ------------------------------------------------------------------ */
+/* tsout.c tests                                                      */
+/* ------------------------------------------------------------------ */
+
+/* Records what the sink was given */
+static uint8_t	 tso_out[8192];
+static size_t	 tso_len;
+static int	 tso_writes;
+static size_t	 tso_last;
+
+static int
+tso_sink(void *opaque, const struct iovec *iov, int n)
+{
+	int	 i;
+
+	(void)opaque;
+	tso_writes++;
+	tso_last = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(tso_out + tso_len, iov[i].iov_base, iov[i].iov_len);
+		tso_len += iov[i].iov_len;
+		tso_last += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static void
+tso_reset(void)
+{
+	tso_len = 0;
+	tso_writes = 0;
+	tso_last = 0;
+}
+
+/* Bytes 0, 1, 2 ... from off, to check order across staging */
+static void
+tso_fill(uint8_t *buf, size_t len, size_t off)
+{
+	size_t	 i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (off + i) & 0xff;
+}
+
+static int
+tso_in_order(void)
+{
+	size_t	 i;
+
+	for (i = 0; i < tso_len; i++)
+		if (tso_out[i] != (i & 0xff))
+			return 0;
+	return 1;
+}
+
+TEST(tsout_passthrough)
+{
+	tsout_t	 o;
+	uint8_t	 buf[100];
+
+	tso_reset();
+	ASSERT_INT_EQ(tsout_init(&o, 0, 0, tso_sink, NULL), 0);
+	tso_fill(buf, sizeof(buf), 0);
+	ASSERT_INT_EQ(tsout_write(&o, buf, sizeof(buf), 0), 0);
+	ASSERT_INT_EQ(tso_writes, 1);
+	ASSERT_INT_EQ(tso_len, 100);
+	tsout_free(&o);
+}
+
+TEST(tsout_batches_whole_packets)
+{
+	tsout_t	 o;
+	uint8_t	 buf[4096];
+	size_t	 off = 0;
+	int	 i;
+
+	tso_reset();
+	ASSERT_INT_EQ(tsout_init(&o, 7, 1000000, tso_sink, NULL), 0);
+	/* Audio-sized chunks: staged until 7 packets are there */
+	for (i = 0; i < 6; i++) {
+		tso_fill(buf, 188, off);
+		ASSERT_INT_EQ(tsout_write(&o, buf, 188, 0), 0);
+		off += 188;
+	}
+	ASSERT_INT_EQ(tso_writes, 0);
+	/* An unaligned AVIO chunk: whole packets out, the tail staged */
+	tso_fill(buf, 1100, off);
+	ASSERT_INT_EQ(tsout_write(&o, buf, 1100, 0), 0);
+	off += 1100;
+	ASSERT_INT_EQ(tso_writes, 1);
+	ASSERT_INT_EQ(tso_len, 11 * 188);
+	ASSERT_INT_EQ(o.len, 160);
+	ASSERT(tso_in_order());
+
+	ASSERT_INT_EQ(tsout_flush(&o), 0);
+	ASSERT_INT_EQ(tso_len, off);
+	ASSERT(tso_in_order());
+	ASSERT_INT_EQ(o.calls, 7);
+	ASSERT_INT_EQ(o.writes, 2);
+	tsout_free(&o);
+}
+
+TEST(tsout_latency_budget)
+{
+	tsout_t	 o;
+	uint8_t	 buf[400];
+
+	tso_reset();
+	ASSERT_INT_EQ(tsout_init(&o, 21, 10000, tso_sink, NULL), 0);
+	tso_fill(buf, sizeof(buf), 0);
+	ASSERT_INT_EQ(tsout_write(&o, buf, 188, 1000), 0);
+	ASSERT_INT_EQ(tsout_tick(&o, 10999), 0);
+	ASSERT_INT_EQ(tso_writes, 0);
+	/* 10 ms after the first byte: written on the tick */
+	ASSERT_INT_EQ(tsout_tick(&o, 11000), 0);
+	ASSERT_INT_EQ(tso_writes, 1);
+	ASSERT_INT_EQ(tso_len, 188);
+
+	/* Or by the next write past the budget, still whole packets */
+	ASSERT_INT_EQ(tsout_write(&o, buf + 188, 100, 12000), 0);
+	ASSERT_INT_EQ(tsout_write(&o, buf + 288, 100, 22000), 0);
+	ASSERT_INT_EQ(tso_writes, 2);
+	ASSERT_INT_EQ(tso_len, 376);
+	ASSERT_INT_EQ(o.len, 12);
+	ASSERT(tso_in_order());
+	tsout_free(&o);
+}
+
+/* At the end of a frame, whole packets go out before their deadline */
+TEST(tsout_push_frame)
+{
+	tsout_t	 o;
+	uint8_t	 buf[500];
+
+	tso_reset();
+	ASSERT_INT_EQ(tsout_init(&o, 21, 10000, tso_sink, NULL), 0);
+	tso_fill(buf, sizeof(buf), 0);
+	ASSERT_INT_EQ(tsout_write(&o, buf, 100, 1000), 0);
+	ASSERT_INT_EQ(tsout_push(&o, 1001), 0);
+	ASSERT_INT_EQ(tso_writes, 0);	/* not a whole packet yet */
+	ASSERT_INT_EQ(tsout_write(&o, buf + 100, 400, 1002), 0);
+	ASSERT_INT_EQ(tso_writes, 0);
+	ASSERT_INT_EQ(tsout_push(&o, 1003), 0);
+	ASSERT_INT_EQ(tso_writes, 1);
+	ASSERT_INT_EQ(tso_len, 2 * 188);
+	ASSERT_INT_EQ(o.len, 500 - 2 * 188);
+	ASSERT(tso_in_order());
+	tsout_free(&o);
+}
+
+TEST(tsout_partial_packet_waits)
+{
+	tsout_t	 o;
+	uint8_t	 buf[188];
+
+	tso_reset();
+	ASSERT_INT_EQ(tsout_init(&o, 7, 0, tso_sink, NULL), 0);
+	tso_fill(buf, sizeof(buf), 0);
+	/* Due at once, but less than a packet: nothing to write yet */
+	ASSERT_INT_EQ(tsout_write(&o, buf, 100, 0), 0);
+	ASSERT_INT_EQ(tso_writes, 0);
+	ASSERT_INT_EQ(tsout_write(&o, buf + 100, 88, 0), 0);
+	ASSERT_INT_EQ(tso_writes, 1);
+	ASSERT_INT_EQ(tso_last, 188);
+	ASSERT_INT_EQ(o.len, 0);
+	tsout_free(&o);
+}
+
+/* ------------------------------------------------------------------ */
+/* shmring.c tests                                                    */
+/* ------------------------------------------------------------------ */
+
+#ifdef __linux__
+
+/* A ring handed from sv[0] to sv[1], both ends mapped */
+static int
+shr_pair(int sv[2], size_t size, shmring_t **wr, shmring_t **rd)
+{
+	char		 buf[16];
+	ssize_t		 n;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+	if ((*wr = shmring_create(size)) == NULL ||
+	    shmring_send(*wr, sv[0]) < 0)
+		return -1;
+	*rd = shmring_accept(sv[1], buf, sizeof(buf), &n);
+	return *rd != NULL && n == 0 ? 0 : -1;
+}
+
+static void
+shr_close(int sv[2], shmring_t *wr, shmring_t *rd)
+{
+	shmring_free(wr);
+	shmring_free(rd);
+	if (sv[0] >= 0)
+		close(sv[0]);
+	if (sv[1] >= 0)
+		close(sv[1]);
+}
+
+TEST(shmring_handover)
+{
+	shmring_t	*wr, *rd;
+	struct iovec	 iov[2];
+	const uint8_t	*p;
+	size_t		 len;
+	volatile int	 run = 1;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(shr_pair(sv, 1000, &wr, &rd), 0);
+	iov[0].iov_base = "abc";
+	iov[0].iov_len = 3;
+	iov[1].iov_base = "defg";
+	iov[1].iov_len = 4;
+	ASSERT_INT_EQ(shmring_write(wr, iov, 2, &run, sv[0]), 0);
+	ASSERT_INT_EQ(shmring_fill_pct(wr), 0);	/* 7 of 4096 */
+	p = shmring_peek(rd, 100, &len, &run, sv[1]);
+	ASSERT(p != NULL);
+	ASSERT_INT_EQ(len, 7);
+	ASSERT(memcmp(p, "abcdefg", 7) == 0);
+	shmring_consume(rd, len);
+	shr_close(sv, wr, rd);
+}
+
+TEST(shmring_wraps)
+{
+	shmring_t	*wr, *rd;
+	struct iovec	 iov;
+	uint8_t		 buf[3000];
+	const uint8_t	*p;
+	size_t		 len, i;
+	volatile int	 run = 1;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(shr_pair(sv, 4096, &wr, &rd), 0);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i & 0xff;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), 0);
+	p = shmring_peek(rd, sizeof(buf), &len, &run, sv[1]);
+	ASSERT_INT_EQ(len, 3000);
+	shmring_consume(rd, len);
+
+	/* 2000 more: 1096 up to the end of the ring, 904 from the start */
+	iov.iov_len = 2000;
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), 0);
+	p = shmring_peek(rd, sizeof(buf), &len, &run, sv[1]);
+	ASSERT_INT_EQ(len, 1096);
+	ASSERT(memcmp(p, buf, 1096) == 0);
+	shmring_consume(rd, len);
+	p = shmring_peek(rd, sizeof(buf), &len, &run, sv[1]);
+	ASSERT_INT_EQ(len, 904);
+	ASSERT(memcmp(p, buf + 1096, 904) == 0);
+	shmring_consume(rd, len);
+	shr_close(sv, wr, rd);
+}
+
+TEST(shmring_eof_drains)
+{
+	shmring_t	*wr, *rd;
+	struct iovec	 iov;
+	const uint8_t	*p;
+	size_t		 len;
+	volatile int	 run = 1;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(shr_pair(sv, 4096, &wr, &rd), 0);
+	iov.iov_base = "0123456789";
+	iov.iov_len = 10;
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), 0);
+	/* The client is done: what it wrote is still read */
+	close(sv[0]);
+	sv[0] = -1;
+	p = shmring_peek(rd, 100, &len, &run, sv[1]);
+	ASSERT(p != NULL);
+	ASSERT_INT_EQ(len, 10);
+	shmring_consume(rd, len);
+	ASSERT(shmring_peek(rd, 100, &len, &run, sv[1]) == NULL);
+	shr_close(sv, wr, rd);
+}
+
+TEST(shmring_reader_gone)
+{
+	shmring_t	*wr, *rd;
+	struct iovec	 iov;
+	uint8_t		 buf[4096];
+	volatile int	 run = 1;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(shr_pair(sv, 4096, &wr, &rd), 0);
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), 0);
+	ASSERT_INT_EQ(shmring_fill_pct(wr), 100);
+	/* Full and the server hung up: the writer must not wait forever */
+	close(sv[1]);
+	sv[1] = -1;
+	iov.iov_len = 1;
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), -EPIPE);
+	shr_close(sv, wr, rd);
+}
+
+TEST(shmring_plain_stream)
+{
+	char		 buf[16];
+	ssize_t		 n;
+	int		 sv[2];
+
+	/* An old client sends TS data straight away */
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT_INT_EQ(write(sv[0], "G\x40\x00\x10", 4), 4);
+	ASSERT(shmring_accept(sv[1], buf, sizeof(buf), &n) == NULL);
+	ASSERT_INT_EQ(n, 4);
+	ASSERT(memcmp(buf, "G\x40\x00\x10", 4) == 0);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+#endif /* __linux__ */
+
+/* ------------------------------------------------------------------ */
+/* net.c tests                                                        */
+/* ------------------------------------------------------------------ */
+
+TEST(net_hmac_rfc4231)
+{
+	static const char	*data = "what do ya want for nothing?";
+	uint8_t			 mac[32];
+	char			 hex[65];
+	int			 i;
+
+	/* RFC 4231 test case 2 */
+	net_hmac("Jefe", (const uint8_t *)data, strlen(data), mac);
+	for (i = 0; i < 32; i++)
+		snprintf(hex + 2 * i, 3, "%02x", mac[i]);
+	ASSERT_STR_EQ(hex, "5bdcc146bf60754e6a042426089575c7"
+	    "5a003f089d2739839dec58b964ec3843");
+}
+
+TEST(net_addr_kinds)
+{
+	ASSERT_INT_EQ(net_is_tcp("/tmp/send2tv.ctrl"), 0);
+	ASSERT_INT_EQ(net_is_tcp("./a:b"), 0);
+	ASSERT_INT_EQ(net_is_tcp("send2tv.data"), 0);
+	ASSERT_INT_EQ(net_is_tcp("tv-box:7390"), 1);
+	ASSERT_INT_EQ(net_is_tcp(":7390"), 1);
+	ASSERT_INT_EQ(net_is_tcp("[::1]:7390"), 1);
+}
+
+/* The server end of a loopback connection, run on its own thread */
+struct net_peer {
+	int		 lfd;
+	const char	*key;
+	int		 fd;
+	int		 ret;
+};
+
+static void *
+net_peer_accept(void *arg)
+{
+	struct net_peer	*p = arg;
+
+	p->fd = accept(p->lfd, NULL, NULL);
+	p->ret = p->fd < 0 ? -1 : net_auth_accept(p->fd, p->key);
+	return NULL;
+}
+
+/* Listen on a free loopback port, address in addr */
+static int
+net_listen_any(char *addr, size_t addrsz)
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 len = sizeof(sin);
+	int			 fd;
+
+	if ((fd = net_listen("127.0.0.1:0")) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+		return -1;
+	snprintf(addr, addrsz, "127.0.0.1:%d", ntohs(sin.sin_port));
+	return fd;
+}
+
+/* Connect a client with ckey to a server with skey */
+static int
+net_pair(const char *skey, const char *ckey, int *sfd, int *cfd, int *sret)
+{
+	struct net_peer	 p;
+	pthread_t	 t;
+	char		 addr[64];
+	int		 ret;
+
+	memset(&p, 0, sizeof(p));
+	p.key = skey;
+	if ((p.lfd = net_listen_any(addr, sizeof(addr))) < 0 ||
+	    pthread_create(&t, NULL, net_peer_accept, &p) != 0)
+		return -2;
+	if ((*cfd = net_connect(addr)) < 0)
+		ret = -2;
+	else
+		ret = net_auth_connect(*cfd, ckey);
+	/* As server_connect() closes it, the server is not kept waiting */
+	if (ret == -1)
+		shutdown(*cfd, SHUT_RDWR);
+	pthread_join(t, NULL);
+	close(p.lfd);
+	*sfd = p.fd;
+	*sret = p.ret;
+	return ret;
+}
+
+TEST(net_tcp_key)
+{
+	char	 line[64];
+	int	 sfd, cfd, sret;
+
+	/* Transcoding box to the server next to the TV */
+	ASSERT_INT_EQ(net_pair("s3cret", "s3cret", &sfd, &cfd, &sret), 0);
+	ASSERT_INT_EQ(sret, 0);
+	ASSERT_INT_EQ(write(cfd, "PLAY video/mp2t -\n", 18), 18);
+	/* Nothing of the handshake is left over for the command reader */
+	ASSERT_INT_EQ(read(sfd, line, sizeof(line)), 18);
+	ASSERT(memcmp(line, "PLAY video/mp2t -\n", 18) == 0);
+	close(sfd);
+	close(cfd);
+}
+
+TEST(net_tcp_wrong_key)
+{
+	int	 sfd, cfd, sret;
+
+	ASSERT_INT_EQ(net_pair("s3cret", "guess", &sfd, &cfd, &sret), -1);
+	ASSERT_INT_EQ(sret, -1);
+	close(sfd);
+	close(cfd);
+
+	/* No key at all where one is wanted */
+	ASSERT_INT_EQ(net_pair("s3cret", NULL, &sfd, &cfd, &sret), -1);
+	close(sfd);
+	close(cfd);
+}
+
+TEST(net_tcp_open)
+{
+	int	 sfd, cfd, sret;
+
+	/* A server without a key lets anyone in */
+	ASSERT_INT_EQ(net_pair(NULL, NULL, &sfd, &cfd, &sret), 0);
+	ASSERT_INT_EQ(sret, 0);
+	close(sfd);
+	close(cfd);
+	ASSERT_INT_EQ(net_pair(NULL, "s3cret", &sfd, &cfd, &sret), 0);
+	ASSERT_INT_EQ(sret, 0);
+	close(sfd);
+	close(cfd);
+}
+
+struct net_client {
+	int		 fd;
+	const char	*key;
+	int		 ret;
+};
+
+static void *
+net_client_auth(void *arg)
+{
+	struct net_client	*c = arg;
+
+	c->ret = net_auth_connect(c->fd, c->key);
+	return NULL;
+}
+
+/* A peer that connects and says nothing holds up no other handshake */
+TEST(net_auth_stepwise)
+{
+	struct net_client	 c;
+	net_auth_t		 idle, a;
+	pthread_t		 t;
+	char			 addr[64];
+	int			 lfd, ifd, r, i;
+
+	ASSERT((lfd = net_listen_any(addr, sizeof(addr))) >= 0);
+	ASSERT((ifd = net_connect(addr)) >= 0);
+	ASSERT_INT_EQ(net_auth_begin(&idle, accept(lfd, NULL, NULL),
+	    "s3cret"), 0);
+	ASSERT_INT_EQ(net_auth_poll(&idle), 0);
+
+	ASSERT((c.fd = net_connect(addr)) >= 0);
+	c.key = "s3cret";
+	ASSERT_INT_EQ(net_auth_begin(&a, accept(lfd, NULL, NULL), "s3cret"),
+	    0);
+	ASSERT_INT_EQ(pthread_create(&t, NULL, net_client_auth, &c), 0);
+	for (i = 0, r = 0; i < 300 && r == 0; i++) {
+		usleep(10000);
+		r = net_auth_poll(&a);
+	}
+	pthread_join(t, NULL);
+	ASSERT_INT_EQ(r, 1);
+	ASSERT_INT_EQ(c.ret, 0);
+	ASSERT(!a.denied);
+	close(a.fd);
+	close(c.fd);
+
+	/* A wrong key is told apart from no answer */
+	ASSERT((c.fd = net_connect(addr)) >= 0);
+	c.key = "wrong";
+	ASSERT_INT_EQ(net_auth_begin(&a, accept(lfd, NULL, NULL), "s3cret"),
+	    0);
+	ASSERT_INT_EQ(pthread_create(&t, NULL, net_client_auth, &c), 0);
+	for (i = 0, r = 0; i < 300 && r == 0; i++) {
+		usleep(10000);
+		r = net_auth_poll(&a);
+	}
+	pthread_join(t, NULL);
+	ASSERT_INT_EQ(r, -1);
+	ASSERT(a.denied);
+
+	/* Still waiting, until its time is up */
+	ASSERT_INT_EQ(net_auth_poll(&idle), 0);
+	idle.deadline = 0;
+	ASSERT_INT_EQ(net_auth_poll(&idle), -1);
+	ASSERT(!idle.denied);
+	close(idle.fd);
+	close(ifd);
+	close(a.fd);
+	close(c.fd);
+	close(lfd);
+}
+
+TEST(net_unix_local)
+{
+	char	 path[64];
+	int	 lfd, cfd, sfd;
+
+	/* Both on one host: no greeting, the ring can be offered */
+	snprintf(path, sizeof(path), "/tmp/send2tv-test.%d", (int)getpid());
+	ASSERT((lfd = net_listen(path)) >= 0);
+	ASSERT((cfd = net_connect(path)) >= 0);
+	ASSERT((sfd = accept(lfd, NULL, NULL)) >= 0);
+	ASSERT_INT_EQ(net_auth_accept(sfd, "s3cret"), 0);
+	ASSERT_INT_EQ(net_auth_connect(cfd, NULL), 0);
+	close(sfd);
+	close(cfd);
+	close(lfd);
+	unlink(path);
+}
+
+/* ------------------------------------------------------------------ */
+/* server.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+TEST(server_addr_per_tv)
+{
+	char	 buf[64];
+
+	ASSERT_INT_EQ(server_addr("/tmp/s.ctrl", 0, buf, sizeof(buf)), 0);
+	ASSERT_STR_EQ(buf, "/tmp/s.ctrl");
+	ASSERT_INT_EQ(server_addr("/tmp/s.ctrl", 2, buf, sizeof(buf)), 0);
+	ASSERT_STR_EQ(buf, "/tmp/s.ctrl.2");
+	ASSERT_INT_EQ(server_addr("tv-box:7390", 0, buf, sizeof(buf)), 0);
+	ASSERT_STR_EQ(buf, "tv-box:7390");
+	ASSERT_INT_EQ(server_addr("[::1]:7390", 3, buf, sizeof(buf)), 0);
+	ASSERT_STR_EQ(buf, "[::1]:7393");
+	ASSERT_INT_EQ(server_addr("tv-box:65535", 1, buf, sizeof(buf)), -1);
+	ASSERT_INT_EQ(server_addr("/tmp/s.ctrl", 1, buf, 12), -1);
+}
+
+TEST(httpd_request_src)
+{
+	httpd_ctx_t	 ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.nsrc = 3;
+	ASSERT(request_src(&ctx, " HTTP/1.1") == &ctx.src[0]);
+	ASSERT(request_src(&ctx, "?x=1 HTTP/1.1") == &ctx.src[0]);
+	ASSERT(request_src(&ctx, "/0/1 HTTP/1.1") == &ctx.src[0]);
+	ASSERT(request_src(&ctx, "/2/7 HTTP/1.1") == &ctx.src[2]);
+	ASSERT(request_src(&ctx, "/1 HTTP/1.1") == &ctx.src[1]);
+	ASSERT(request_src(&ctx, "/3/1 HTTP/1.1") == NULL);
+	ASSERT(request_src(&ctx, "/-1/1 HTTP/1.1") == NULL);
+	ASSERT(request_src(&ctx, "/x/1 HTTP/1.1") == NULL);
+	ASSERT(request_src(&ctx, "/1x HTTP/1.1") == NULL);
+	ASSERT_INT_EQ(request_seg("/2/7 HTTP/1.1"), 7);
+	ASSERT_INT_EQ(request_seg("/1 HTTP/1.1"), 0);
+	ASSERT_INT_EQ(request_seg(" HTTP/1.1"), 0);
+}
+
+/* A renderer that takes every SOAP call and keeps the last URIs */
+struct fake_dmr {
+	int		 lfd;
+	int		 port;
+	volatile int	 stop;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	char		 uri[256];
+	char		 next[256];	/* SetNextAVTransportURI */
+	int		 plays;
+};
+
+static void
+fake_dmr_call(struct fake_dmr *d, int fd)
+{
+	static const char	*ok = "HTTP/1.1 200 OK\r\n"
+	    "Content-Length: 0\r\n\r\n";
+	char			 req[16384], *body, *cl, *u, *e;
+	size_t			 len = 0;
+	ssize_t			 n;
+
+	while (len < sizeof(req) - 1 &&
+	    (n = read(fd, req + len, sizeof(req) - 1 - len)) > 0) {
+		len += n;
+		req[len] = '\0';
+		if ((body = strstr(req, "\r\n\r\n")) == NULL ||
+		    (cl = strcasestr(req, "Content-Length:")) == NULL)
+			continue;
+		if (req + len - (body + 4) >= atoi(cl + 15))
+			break;
+	}
+	req[len] = '\0';
+
+	pthread_mutex_lock(&d->lock);
+	if ((u = strstr(req, "<CurrentURI>")) != NULL &&
+	    (e = strstr(u, "</CurrentURI>")) != NULL)
+		snprintf(d->uri, sizeof(d->uri), "%.*s",
+		    (int)(e - u - 12), u + 12);
+	if ((u = strstr(req, "<NextURI>")) != NULL &&
+	    (e = strstr(u, "</NextURI>")) != NULL)
+		snprintf(d->next, sizeof(d->next), "%.*s",
+		    (int)(e - u - 9), u + 9);
+	if (strstr(req, "#Play\"") != NULL)
+		d->plays++;
+	pthread_mutex_unlock(&d->lock);
+	write(fd, ok, strlen(ok));
+}
+
+static void *
+fake_dmr_thread(void *arg)
+{
+	struct fake_dmr	*d = arg;
+	struct pollfd	 pfd;
+	int		 fd;
+
+	pfd.fd = d->lfd;
+	pfd.events = POLLIN;
+	while (!d->stop) {
+		if (poll(&pfd, 1, 100) <= 0 ||
+		    (fd = accept(d->lfd, NULL, NULL)) < 0)
+			continue;
+		fake_dmr_call(d, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+static int
+fake_dmr_start(struct fake_dmr *d, upnp_ctx_t *upnp)
+{
+	char	 addr[64];
+
+	memset(d, 0, sizeof(*d));
+	if ((d->lfd = net_listen_any(addr, sizeof(addr))) < 0)
+		return -1;
+	d->port = atoi(strchr(addr, ':') + 1);
+	pthread_mutex_init(&d->lock, NULL);
+	memset(upnp, 0, sizeof(*upnp));
+	strlcpy(upnp->tv_ip, "127.0.0.1", sizeof(upnp->tv_ip));
+	strlcpy(upnp->local_ip, "127.0.0.1", sizeof(upnp->local_ip));
+	strlcpy(upnp->control_url, "/ctl", sizeof(upnp->control_url));
+	upnp->tv_port = d->port;
+	return pthread_create(&d->thread, NULL, fake_dmr_thread, d);
+}
+
+static void
+fake_dmr_stop(struct fake_dmr *d)
+{
+	d->stop = 1;
+	pthread_join(d->thread, NULL);
+	close(d->lfd);
+	pthread_mutex_destroy(&d->lock);
+}
+
+#define TEST_TVS	3
+
+struct server_fixture {
+	upnp_ctx_t	 tvs[TEST_TVS];
+	struct fake_dmr	 dmr[TEST_TVS];
+	httpd_ctx_t	 httpd;
+	char		 ctrl[64], data[64];
+	pthread_t	 thread;
+	int		 ctrl_fd[TEST_TVS], data_fd[TEST_TVS];
+	int		 http_fd[TEST_TVS];
+	char		 payload[TEST_TVS][4096];
+};
+
+static void *
+server_fixture_run(void *arg)
+{
+	struct server_fixture	*f = arg;
+
+	server_run(f->tvs, TEST_TVS, &f->httpd, f->ctrl, f->data, NULL);
+	return NULL;
+}
+
+/* Wait for TV i to be told to play n times, the last URI in uri */
+static int
+server_wait_uri(struct server_fixture *f, int i, int n, char *uri,
+    size_t urisz)
+{
+	int	 t, plays;
+
+	for (t = 0; t < 300; t++) {
+		pthread_mutex_lock(&f->dmr[i].lock);
+		strlcpy(uri, f->dmr[i].uri, urisz);
+		plays = f->dmr[i].plays;
+		pthread_mutex_unlock(&f->dmr[i].lock);
+		if (plays >= n)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+/* Connect as client for TV i and start a stream of its payload */
+static int
+server_play(struct server_fixture *f, int i)
+{
+	static const char	*play =
+	    "PLAY video/mp2t AVC_TS_HP_HD_AAC_MULT5\n";
+	char			 ctrl[64], data[64];
+	int			 t;
+
+	server_addr(f->ctrl, i, ctrl, sizeof(ctrl));
+	server_addr(f->data, i, data, sizeof(data));
+	for (t = 0; t < 200 && (f->ctrl_fd[i] = net_connect(ctrl)) < 0; t++)
+		usleep(10000);
+	if (f->ctrl_fd[i] < 0 || (f->data_fd[i] = net_connect(data)) < 0)
+		return -1;
+	memset(f->payload[i], 'a' + i, sizeof(f->payload[i]));
+	if (write(f->data_fd[i], f->payload[i], sizeof(f->payload[i])) !=
+	    sizeof(f->payload[i]) ||
+	    write(f->ctrl_fd[i], play, strlen(play)) != (ssize_t)strlen(play))
+		return -1;
+	return 0;
+}
+
+/* GET TV i's segment seg and check its payload arrives; left open */
+static int
+server_fetch(struct server_fixture *f, int i, int seg)
+{
+	struct timeval	 tv = { 3, 0 };
+	char		 addr[64], req[128], buf[8192], *body;
+	size_t		 len = 0, want = sizeof(f->payload[i]);
+	ssize_t		 n;
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", f->httpd.port);
+	snprintf(req, sizeof(req), "GET /media/%d/%d HTTP/1.1\r\n"
+	    "Host: %s\r\n\r\n", i, seg, addr);
+	if ((f->http_fd[i] = net_connect(addr)) < 0 ||
+	    write(f->http_fd[i], req, strlen(req)) != (ssize_t)strlen(req))
+		return -1;
+	setsockopt(f->http_fd[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (len < sizeof(buf) - 1 &&
+	    (n = read(f->http_fd[i], buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += n;
+		buf[len] = '\0';
+		if ((body = strstr(buf, "\r\n\r\n")) != NULL &&
+		    buf + len - (body + 4) >= (ssize_t)want)
+			break;
+	}
+	buf[len] = '\0';
+	if (strncmp(buf, "HTTP/1.1 200", 12) != 0 ||
+	    (body = strstr(buf, "\r\n\r\n")) == NULL ||
+	    buf + len - (body + 4) != (ssize_t)want)
+		return -1;
+	return memcmp(body + 4, f->payload[i], want) == 0 ? 0 : -1;
+}
+
+/* Play on every TV; each one's stream must go to its own renderer */
+static int
+server_sessions(struct server_fixture *f, char *why, size_t whysz)
+{
+	char	 uri[256], want[256];
+	int	 i;
+
+	for (i = 0; i < TEST_TVS; i++) {
+		if (server_play(f, i) < 0) {
+			snprintf(why, whysz, "TV %d: cannot connect", i);
+			return -1;
+		}
+		if (server_wait_uri(f, i, 1, uri, sizeof(uri)) < 0) {
+			snprintf(why, whysz, "TV %d: no Play", i);
+			return -1;
+		}
+		snprintf(want, sizeof(want), "http://127.0.0.1:%d/media/%d/1",
+		    f->httpd.port, i);
+		if (strcmp(uri, want) != 0) {
+			snprintf(why, whysz, "TV %d: URI %s", i, uri);
+			return -1;
+		}
+		/* The earlier streams are still being served */
+		if (server_fetch(f, i, 1) < 0) {
+			snprintf(why, whysz, "TV %d: bad stream", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Run check against a server for TEST_TVS fake renderers */
+static int
+server_fixture_check(int (*check)(struct server_fixture *, char *, size_t),
+    char *why, size_t whysz)
+{
+	struct server_fixture	*f;
+	int			 i, n, ret = -1, out, null;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		return -1;
+	snprintf(f->ctrl, sizeof(f->ctrl), "/tmp/send2tv-test.%d.ctrl",
+	    (int)getpid());
+	snprintf(f->data, sizeof(f->data), "/tmp/send2tv-test.%d.data",
+	    (int)getpid());
+	for (n = 0; n < TEST_TVS; n++) {
+		f->ctrl_fd[n] = f->data_fd[n] = f->http_fd[n] = -1;
+		if (fake_dmr_start(&f->dmr[n], &f->tvs[n]) != 0) {
+			snprintf(why, whysz, "cannot start renderer");
+			goto done;
+		}
+	}
+
+	/* The server reports on stdout */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	if (pthread_create(&f->thread, NULL, server_fixture_run, f) == 0) {
+		ret = check(f, why, whysz);
+		for (i = 0; i < TEST_TVS; i++) {
+			if (f->data_fd[i] >= 0)
+				close(f->data_fd[i]);
+			if (f->ctrl_fd[i] >= 0)
+				close(f->ctrl_fd[i]);
+			if (f->http_fd[i] >= 0)
+				close(f->http_fd[i]);
+		}
+		running = 0;
+		pthread_join(f->thread, NULL);
+		running = 1;
+	}
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	close(null);
+
+done:
+	for (i = 0; i < n; i++)
+		fake_dmr_stop(&f->dmr[i]);
+	free(f);
+	return ret;
+}
+
+TEST(server_multi_tv)
+{
+	char	 why[128] = "";
+
+	if (server_fixture_check(server_sessions, why, sizeof(why)) < 0) {
+		printf("FAIL\n    %s\n", why);
+		current_failed = 1;
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* splice.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+/* A video PES start with PTS and DTS, and a PCR if pcr >= 0 */
+static void
+splice_pes(uint8_t *pkt, int cc, int64_t pcr, int64_t pts, int64_t dts)
+{
+	uint8_t	 pes[19] = {
+		0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0xc0, 0x0a,
+		0x31, 0, 0, 0, 0, 0x11, 0, 0, 0, 0
+	};
+
+	splice_ts_put(pes + 9, pts);
+	splice_ts_put(pes + 14, dts);
+	tsl_packet(pkt, TSL_VIDEO, 1, 1, pes, sizeof(pes));
+	pkt[3] |= cc;
+	if (pcr >= 0) {
+		pkt[5] |= 0x10;
+		splice_pcr_put(pkt + 6, pcr);
+	}
+}
+
+/* An item as a muxer starts it: PAT, PMT, video with PCR, more video */
+static void
+splice_item(uint8_t *buf, int type, int64_t pcr, int64_t pts)
+{
+	static const uint8_t	 data[20];
+
+	tsl_psi(buf, -1);
+	tsl_psi(buf + TS_PACKET, type);
+	splice_pes(buf + 2 * TS_PACKET, 0, pcr, pts, pts - 3600);
+	tsl_packet(buf + 3 * TS_PACKET, TSL_VIDEO, 0, 0, data, sizeof(data));
+	buf[3 * TS_PACKET + 3] |= 1;
+}
+
+static const uint8_t *
+splice_pes_ts(const uint8_t *pkt)
+{
+	return pkt + 5 + pkt[4] + 9;
+}
+
+TEST(splice_first_item_unchanged)
+{
+	splice_t	*s = malloc(sizeof(*s));
+	uint8_t		 in[4 * TS_PACKET], out[5 * TS_PACKET];
+
+	ASSERT(s != NULL);
+	splice_init(s);
+	splice_next(s);
+	splice_item(in, 0x1b, 900000, 963000);
+	ASSERT_INT_EQ((int)splice_feed(s, in, sizeof(in), out), sizeof(in));
+	ASSERT(memcmp(in, out, sizeof(in)) == 0);
+	free(s);
+}
+
+TEST(splice_timestamps_continue)
+{
+	splice_t	*s = malloc(sizeof(*s));
+	uint8_t		 in[4 * TS_PACKET], out[5 * TS_PACKET];
+	const uint8_t	*pkt = out + 2 * TS_PACKET;
+	int64_t		 pcr, pts;
+
+	ASSERT(s != NULL);
+	splice_init(s);
+	splice_next(s);
+	splice_item(in, 0x1b, 900000, 963000);
+	splice_feed(s, in, sizeof(in), out);
+	ASSERT_INT_EQ(pkt[5] & 0x80, 0);
+
+	/* The next muxer starts its clock over */
+	splice_next(s);
+	splice_item(in, 0x1b, 126000, 189000);
+	ASSERT_INT_EQ((int)splice_feed(s, in, sizeof(in), out), sizeof(in));
+	pcr = splice_pcr_get(pkt + 6);
+	pts = splice_ts_get(splice_pes_ts(pkt));
+	ASSERT(pcr > 900000);
+	ASSERT(pts > 963000 && pts <= 963000 + 3750);
+	ASSERT(pts - pcr == 63000);
+	ASSERT(splice_ts_get(splice_pes_ts(pkt) + 5) == pts - 3600);
+	ASSERT_INT_EQ(pkt[5] & 0x80, 0x80);	/* discontinuity */
+	free(s);
+}
+
+TEST(splice_cc_continues)
+{
+	splice_t	*s = malloc(sizeof(*s));
+	uint8_t		 in[4 * TS_PACKET], out[5 * TS_PACKET];
+
+	ASSERT(s != NULL);
+	splice_init(s);
+	splice_next(s);
+	splice_item(in, 0x1b, 900000, 963000);
+	splice_feed(s, in, sizeof(in), out);
+	ASSERT_INT_EQ(out[3 * TS_PACKET + 3] & 0x0f, 1);
+
+	splice_next(s);
+	splice_item(in, 0x1b, 126000, 189000);
+	splice_feed(s, in, sizeof(in), out);
+	ASSERT_INT_EQ(out[3] & 0x0f, 1);		/* PAT */
+	ASSERT_INT_EQ(out[TS_PACKET + 3] & 0x0f, 1);	/* PMT */
+	ASSERT_INT_EQ(out[2 * TS_PACKET + 3] & 0x0f, 2);
+	ASSERT_INT_EQ(out[3 * TS_PACKET + 3] & 0x0f, 3);
+	free(s);
+}
+
+TEST(splice_psi_versions)
+{
+	splice_t	*s = malloc(sizeof(*s));
+	uint8_t		 in[4 * TS_PACKET], out[5 * TS_PACKET];
+	const uint8_t	*pmt;
+
+	ASSERT(s != NULL);
+	splice_init(s);
+	splice_next(s);
+	splice_item(in, 0x1b, 900000, 963000);
+	splice_feed(s, in, sizeof(in), out);
+
+	/* Same programme: PAT and PMT go out as they are */
+	splice_next(s);
+	splice_item(in, 0x1b, 126000, 189000);
+	splice_feed(s, in, sizeof(in), out);
+	ASSERT(memcmp(in + TS_PACKET + 4, out + TS_PACKET + 4,
+	    TS_PACKET - 4) == 0);
+
+	/* HEVC now: a new PMT version, the PAT stays */
+	splice_next(s);
+	splice_item(in, 0x24, 126000, 189000);
+	splice_feed(s, in, sizeof(in), out);
+	pmt = out + TS_PACKET + 5 + out[TS_PACKET + 4] + 1;
+	ASSERT(memcmp(in + 4, out + 4, TS_PACKET - 4) == 0);
+	ASSERT_INT_EQ((pmt[5] >> 1) & 0x1f, 1);
+	ASSERT_INT_EQ(pmt[12], 0x24);
+	ASSERT(splice_crc(pmt, ((pmt[1] & 0x0f) << 8 | pmt[2]) + 3,
+	    0xffffffff) == 0);
+	free(s);
+}
+
+TEST(splice_feed_pieces)
+{
+	splice_t	*s = malloc(sizeof(*s));
+	uint8_t		 in[3 + 4 * TS_PACKET], out[5 * TS_PACKET];
+	uint8_t		 whole[5 * TS_PACKET];
+	size_t		 off, n = 0, step;
+
+	ASSERT(s != NULL);
+	splice_init(s);
+	splice_next(s);
+	splice_item(in + 3, 0x1b, 900000, 963000);
+	in[0] = in[1] = in[2] = 0x00;		/* out of sync */
+	splice_feed(s, in, sizeof(in), whole);
+
+	splice_init(s);
+	splice_next(s);
+	for (off = 0; off < sizeof(in); off += step) {
+		step = off % 2 ? 100 : 1;
+		if (step > sizeof(in) - off)
+			step = sizeof(in) - off;
+		n += splice_feed(s, in + off, step, out + n);
+	}
+	ASSERT_INT_EQ((int)n, 4 * TS_PACKET);
+	ASSERT(memcmp(out, whole, n) == 0);
+
+	/* A partial packet does not survive the splice */
+	splice_feed(s, in + 3, 100, out);
+	splice_next(s);
+	ASSERT_INT_EQ((int)splice_feed(s, in + 3, 4 * TS_PACKET, out),
+	    4 * TS_PACKET);
+	free(s);
+}
+
+/* Announce a new data connection for TV 0 that carries buf */
+static int
+splice_server_item(struct server_fixture *f, const uint8_t *buf,
+    size_t len)
+{
+	static const char	*cmd =
+	    "SPLICE append video/mp2t AVC_TS_HP_HD_AAC_MULT5\n";
+	char			 data[64];
+
+	/* The previous item ends */
+	if (f->data_fd[0] >= 0)
+		close(f->data_fd[0]);
+	server_addr(f->data, 0, data, sizeof(data));
+	if ((f->data_fd[0] = net_connect(data)) < 0 ||
+	    write(f->data_fd[0], buf, len) != (ssize_t)len ||
+	    write(f->ctrl_fd[0], cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+		return -1;
+	return 0;
+}
+
+static int
+splice_read(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t	 n;
+
+	for (; len > 0; buf += n, len -= n)
+		if ((n = read(fd, buf, len)) <= 0)
+			return -1;
+	return 0;
+}
+
+/* Two items for TV 0 arrive on the one stream it was told to play */
+static int
+splice_server_check(struct server_fixture *f, char *why, size_t whysz)
+{
+	struct timeval	 tv = { 3, 0 };
+	uint8_t		 item[4 * TS_PACKET], got[4 * TS_PACKET];
+	char		 addr[64], uri[256], req[128], c;
+	int		 t, nl = 0;
+
+	server_addr(f->ctrl, 0, addr, sizeof(addr));
+	for (t = 0; t < 200 && (f->ctrl_fd[0] = net_connect(addr)) < 0; t++)
+		usleep(10000);
+	splice_item(item, 0x1b, 900000, 963000);
+	if (f->ctrl_fd[0] < 0 ||
+	    splice_server_item(f, item, sizeof(item)) < 0 ||
+	    server_wait_uri(f, 0, 1, uri, sizeof(uri)) < 0) {
+		snprintf(why, whysz, "first item not played");
+		return -1;
+	}
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", f->httpd.port);
+	snprintf(req, sizeof(req), "GET /media/0/1 HTTP/1.1\r\n"
+	    "Host: %s\r\n\r\n", addr);
+	if ((f->http_fd[0] = net_connect(addr)) < 0 ||
+	    write(f->http_fd[0], req, strlen(req)) != (ssize_t)strlen(req))
+		return -1;
+	setsockopt(f->http_fd[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (nl < 2 && read(f->http_fd[0], &c, 1) == 1)
+		nl = c == '\n' ? nl + 1 : c == '\r' ? nl : 0;
+	if (splice_read(f->http_fd[0], got, sizeof(got)) < 0 ||
+	    memcmp(got, item, sizeof(item)) != 0) {
+		snprintf(why, whysz, "first item not sent as is");
+		return -1;
+	}
+
+	/* The next muxer starts over, the TV sees the stream go on */
+	splice_item(item, 0x1b, 126000, 189000);
+	if (splice_server_item(f, item, sizeof(item)) < 0 ||
+	    splice_read(f->http_fd[0], got, sizeof(got)) < 0) {
+		snprintf(why, whysz, "second item not sent");
+		return -1;
+	}
+	if (splice_pcr_get(got + 2 * TS_PACKET + 6) <= 900000 ||
+	    (got[2 * TS_PACKET + 5] & 0x80) == 0) {
+		snprintf(why, whysz, "second item not spliced");
+		return -1;
+	}
+	pthread_mutex_lock(&f->dmr[0].lock);
+	t = f->dmr[0].plays;
+	pthread_mutex_unlock(&f->dmr[0].lock);
+	if (t != 1) {
+		snprintf(why, whysz, "%d Play calls", t);
+		return -1;
+	}
+	return 0;
+}
+
+TEST(splice_server_continuous)
+{
+	char	 why[128] = "";
+
+	if (server_fixture_check(splice_server_check, why,
+	    sizeof(why)) < 0) {
+		printf("FAIL\n    %s\n", why);
+		current_failed = 1;
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* prefetch.c tests                                                   */
+/* ------------------------------------------------------------------ */
+
+/* Wait for p to have read want bytes */
+static int
+prefetch_wait(prefetch_t *p, size_t want)
+{
+	int	 t;
+
+	for (t = 0; t < 300 && p->len < want; t++)
+		usleep(10000);
+	return p->len >= want ? 0 : -1;
+}
+
+TEST(prefetch_reads_ahead)
+{
+	prefetch_t	 p;
+	uint8_t		 buf[10000], rest[10000];
+	size_t		 i;
+	int		 sv[2];
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7;
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT_INT_EQ(write(sv[0], buf, sizeof(buf)), sizeof(buf));
+	ASSERT_INT_EQ(prefetch_start(&p, sv[1], 4096), 0);
+	ASSERT_INT_EQ(prefetch_wait(&p, 4096), 0);
+	prefetch_stop(&p);
+
+	/* Up to the size, the rest left on the connection */
+	ASSERT_INT_EQ(p.len, 4096);
+	ASSERT(p.ring == NULL);
+	ASSERT(memcmp(p.buf, buf, 4096) == 0);
+	ASSERT_INT_EQ(read(sv[1], rest, sizeof(rest)), sizeof(buf) - 4096);
+	ASSERT(memcmp(rest, buf + 4096, sizeof(buf) - 4096) == 0);
+	prefetch_free(&p);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+TEST(prefetch_short_stream)
+{
+	prefetch_t	 p;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT_INT_EQ(write(sv[0], "abc", 3), 3);
+	close(sv[0]);
+	ASSERT_INT_EQ(prefetch_start(&p, sv[1], 4096), 0);
+	ASSERT_INT_EQ(prefetch_wait(&p, 3), 0);
+	usleep(50000);
+	prefetch_stop(&p);
+	ASSERT_INT_EQ(p.len, 3);
+	ASSERT(memcmp(p.buf, "abc", 3) == 0);
+	prefetch_free(&p);
+	close(sv[1]);
+}
+
+TEST(prefetch_takes_ring)
+{
+	prefetch_t	 p;
+	shmring_t	*wr;
+	struct iovec	 iov;
+	const uint8_t	*q;
+	size_t		 len;
+	volatile int	 run = 1;
+	int		 sv[2], t;
+
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT((wr = shmring_create(4096)) != NULL);
+	ASSERT_INT_EQ(shmring_send(wr, sv[0]), 0);
+	iov.iov_base = "abcdefg";
+	iov.iov_len = 7;
+	ASSERT_INT_EQ(shmring_write(wr, &iov, 1, &run, sv[0]), 0);
+	ASSERT_INT_EQ(prefetch_start(&p, sv[1], 4096), 0);
+	for (t = 0; t < 300 && p.ring == NULL; t++)
+		usleep(10000);
+	prefetch_stop(&p);
+
+	/* The ring is the buffer: nothing copied, the data waits in it */
+	ASSERT(p.ring != NULL);
+	ASSERT_INT_EQ(p.len, 0);
+	q = shmring_peek(p.ring, 100, &len, &run, sv[1]);
+	ASSERT(q != NULL);
+	ASSERT_INT_EQ(len, 7);
+	ASSERT(memcmp(q, "abcdefg", 7) == 0);
+	prefetch_free(&p);
+	shmring_free(wr);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* Wait for TV i to be given next as the URI after the current one */
+static int
+gapless_wait_next(struct server_fixture *f, int i, const char *next)
+{
+	int	 t, ok;
+
+	for (t = 0; t < 300; t++) {
+		pthread_mutex_lock(&f->dmr[i].lock);
+		ok = strcmp(f->dmr[i].next, next) == 0;
+		pthread_mutex_unlock(&f->dmr[i].lock);
+		if (ok)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+/*
+ * The file after one that ended: TV 0 can queue it and switches from
+ * the first stream to the second without Play, TV 1 cannot and is
+ * restarted on it.
+ */
+static int
+gapless_check(struct server_fixture *f, char *why, size_t whysz)
+{
+	static const char	*next =
+	    "NEXT video/mp2t AVC_TS_HP_HD_AAC_MULT5\n";
+	char			 uri[256], want[256], data[64], c;
+	int			 i, fd[2], plays;
+
+	f->tvs[0].can_queue = 1;
+	for (i = 0; i < 2; i++)
+		if (server_play(f, i) < 0 ||
+		    server_wait_uri(f, i, 1, uri, sizeof(uri)) < 0 ||
+		    server_fetch(f, i, 1) < 0) {
+			snprintf(why, whysz, "TV %d: first segment", i);
+			return -1;
+		}
+
+	/* Sent while the first streams are still being served */
+	for (i = 0; i < 2; i++) {
+		server_addr(f->data, i, data, sizeof(data));
+		memset(f->payload[i], 'x' + i, sizeof(f->payload[i]));
+		if ((fd[i] = net_connect(data)) < 0 ||
+		    write(fd[i], f->payload[i], sizeof(f->payload[i])) !=
+		    sizeof(f->payload[i]) ||
+		    write(f->ctrl_fd[i], next, strlen(next)) !=
+		    (ssize_t)strlen(next)) {
+			snprintf(why, whysz, "TV %d: cannot send next", i);
+			return -1;
+		}
+	}
+
+	snprintf(want, sizeof(want), "http://127.0.0.1:%d/media/0/2",
+	    f->httpd.port);
+	if (gapless_wait_next(f, 0, want) < 0) {
+		snprintf(why, whysz, "TV 0: next segment not queued");
+		return -1;
+	}
+	/* The first one ends; the TV goes on to the second by itself */
+	close(f->data_fd[0]);
+	f->data_fd[0] = fd[0];
+	if (read(f->http_fd[0], &c, 1) != 0) {
+		snprintf(why, whysz, "TV 0: first segment goes on");
+		return -1;
+	}
+	close(f->http_fd[0]);
+	if (server_fetch(f, 0, 2) < 0) {
+		snprintf(why, whysz, "TV 0: bad queued segment");
+		return -1;
+	}
+	pthread_mutex_lock(&f->dmr[0].lock);
+	plays = f->dmr[0].plays;
+	pthread_mutex_unlock(&f->dmr[0].lock);
+	if (plays != 1) {
+		snprintf(why, whysz, "TV 0: %d Play calls", plays);
+		return -1;
+	}
+
+	/* Stop, SetAVTransportURI and Play */
+	snprintf(want, sizeof(want), "http://127.0.0.1:%d/media/1/2",
+	    f->httpd.port);
+	close(f->data_fd[1]);
+	f->data_fd[1] = fd[1];
+	if (server_wait_uri(f, 1, 2, uri, sizeof(uri)) < 0 ||
+	    strcmp(uri, want) != 0) {
+		snprintf(why, whysz, "TV 1: not restarted");
+		return -1;
+	}
+	close(f->http_fd[1]);
+	if (server_fetch(f, 1, 2) < 0) {
+		snprintf(why, whysz, "TV 1: bad second segment");
+		return -1;
+	}
+	return 0;
+}
+
+TEST(server_gapless)
+{
+	char	 why[128] = "";
+
+	if (server_fixture_check(gapless_check, why, sizeof(why)) < 0) {
+		printf("FAIL\n    %s\n", why);
+		current_failed = 1;
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* tshift.c tests                                                     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * A video packet of PID 0x100: with key set, the start of a keyframe
+ * (random_access_indicator, PES with PTS pts), otherwise filler.
+ */
+static void
+tshift_test_pkt(uint8_t *pkt, int key, int64_t pts, int n)
+{
+	memset(pkt, n & 0xff, TS_PACKET);
+	pkt[0] = TS_SYNC;
+	pkt[1] = 0x01;
+	pkt[2] = 0x00;
+	pkt[3] = 0x10 | (n & 0x0f);
+	if (!key)
+		return;
+	pkt[1] |= 0x40;
+	pkt[3] |= 0x20;
+	pkt[4] = 1;
+	pkt[5] = 0x40;
+	memcpy(pkt + 6, "\x00\x00\x01\xe0\x00\x00\x80\x80\x05", 9);
+	pkt[15] = 0x21 | (pts >> 29 & 0x0e);
+	pkt[16] = pts >> 22;
+	pkt[17] = (pts >> 14 & 0xfe) | 1;
+	pkt[18] = pts >> 7;
+	pkt[19] = (pts << 1 & 0xfe) | 1;
+}
+
+/* Write groups of per packets, one keyframe a second, into fd */
+static int
+tshift_test_feed(int fd, int groups, int per)
+{
+	uint8_t	 pkt[TS_PACKET];
+	int	 g, i;
+
+	for (g = 0; g < groups; g++)
+		for (i = 0; i < per; i++) {
+			tshift_test_pkt(pkt, i == 0, 1000 + g * 90000LL,
+			    g * per + i);
+			if (write(fd, pkt, sizeof(pkt)) != sizeof(pkt))
+				return -1;
+		}
+	return 0;
+}
+
+/* Wait for t to have received len bytes */
+static int
+tshift_test_wait(tshift_t *t, int64_t len)
+{
+	int	 i;
+
+	for (i = 0; i < 300 && !tshift_holds(t, len); i++)
+		usleep(10000);
+	return tshift_holds(t, len) ? 0 : -1;
+}
+
+TEST(tshift_keyframe_index)
+{
+	tshift_t	*t;
+	uint8_t		 pkt[TS_PACKET], buf[TS_PACKET * 11];
+	int64_t		 off, n = 0;
+	double		 at;
+	ssize_t		 r;
+	int		 sv[2];
+
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT((t = tshift_open(sv[1], 0, NULL)) != NULL);
+	ASSERT_INT_EQ(tshift_test_feed(sv[0], 10, 11), 0);
+	ASSERT_INT_EQ(tshift_test_wait(t, 110 * TS_PACKET), 0);
+
+	/* A time seek starts at the keyframe before it */
+	ASSERT_INT_EQ(tshift_seek(t, 3.5, &at), 3 * 11 * TS_PACKET);
+	ASSERT(at == 3.0);
+	ASSERT_INT_EQ(tshift_seek(t, 0, &at), 0);
+	ASSERT_INT_EQ(tshift_seek(t, 99, &at), 9 * 11 * TS_PACKET);
+	ASSERT(at == 9.0);
+
+	/* A new reader starts at the newest one, and reads to the end */
+	off = tshift_live(t);
+	ASSERT_INT_EQ(off, 9 * 11 * TS_PACKET);
+	close(sv[0]);
+	while ((r = tshift_read(t, &off, buf + n, sizeof(buf) - n)) > 0)
+		n += r;
+	ASSERT_INT_EQ(r, 0);
+	ASSERT_INT_EQ(n, sizeof(buf));
+	tshift_test_pkt(pkt, 1, 1000 + 9 * 90000LL, 99);
+	ASSERT(memcmp(buf, pkt, TS_PACKET) == 0);
+	tshift_close(t);
+	close(sv[1]);
+}
+
+TEST(tshift_reader_overtaken)
+{
+	tshift_t	*t;
+	uint8_t		 buf[TS_PACKET];
+	int64_t		 off = 0;
+	double		 at;
+	int		 sv[2];
+
+	/* 2.6 MB through a 1 MB window on disk */
+	ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ASSERT((t = tshift_open(sv[1], 1024 * 1024, "/tmp")) != NULL);
+	ASSERT_INT_EQ(tshift_test_feed(sv[0], 140, 100), 0);
+	ASSERT_INT_EQ(tshift_test_wait(t, 14000 * TS_PACKET), 0);
+	ASSERT(!tshift_holds(t, 0));
+
+	/* The reader left behind goes on at the oldest keyframe */
+	ASSERT_INT_EQ(tshift_read(t, &off, buf, sizeof(buf)), TS_PACKET);
+	ASSERT(off > 14000 * TS_PACKET - 1024 * 1024);
+	ASSERT_INT_EQ((off - TS_PACKET) % (100 * TS_PACKET), 0);
+	ASSERT(buf[1] & 0x40);
+	ASSERT(buf[5] & 0x40);
+	ASSERT_INT_EQ(tshift_seek(t, 0, &at), off - TS_PACKET);
+	ASSERT(at == (off - TS_PACKET) / (100 * TS_PACKET));
+
+	/* Closed under a reader: -1, and the reader frees it */
+	tshift_hold(t);
+	shutdown(sv[1], SHUT_RDWR);
+	tshift_close(t);
+	ASSERT_INT_EQ(tshift_read(t, &off, buf, sizeof(buf)), -1);
+	tshift_release(t);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+TEST(tshift_parse_npt)
+{
+	ASSERT(parse_npt("12.5") == 12.5);
+	ASSERT(parse_npt("1:02:03.5") == 3723.5);
+	ASSERT(parse_npt("0:10") == 10);
+	ASSERT(parse_npt("abc") < 0);
+	ASSERT(parse_npt("-3") < 0);
+	ASSERT(parse_npt("1:2:3:4") < 0);
+}
+
+/*
+ * A time-shifted stream seeks by time only, in a window that moves on
+ * at both ends: s0-increasing and sN-increasing set.
+ */
+TEST(dlna_features_timeshift)
+{
+	char buf[256];
+
+	build_dlna_features(buf, sizeof(buf), "MPEG_TS_HD_NA", DLNA_TIMESHIFT);
+	ASSERT(strstr(buf, "DLNA.ORG_OP=10") != NULL);
+	ASSERT(strstr(buf, "DLNA.ORG_CI=1") != NULL);
+	ASSERT(strstr(buf, "DLNA.ORG_FLAGS=0D700000") != NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* probe.c tests                                                      */
+/* ------------------------------------------------------------------ */
+
+static void
+probe_test_info(probe_info_t *info, int duration)
+{
+	memset(info, 0, sizeof(*info));
+	info->needs_transcode = 0;
+	info->video_idx = 0;
+	info->audio_idx = 1;
+	info->duration_sec = duration;
+	strlcpy(info->mime_type, "video/mp4", sizeof(info->mime_type));
+	strlcpy(info->dlna_profile, "AVC_MP4_MP_SD_AAC",
+	    sizeof(info->dlna_profile));
+}
+
+TEST(probe_key_identity)
+{
+	media_ctx_t	 tmpl;
+	cache_ctx_t	 c;
+	char		 dir[64], path[128], k1[32], k2[32], k3[32];
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	cache_test_dir(&c, dir, sizeof(dir), 0);
+	cache_test_file(dir, "a.mkv", 100, 1000000);
+	snprintf(path, sizeof(path), "%s/a.mkv", dir);
+
+	ASSERT_INT_EQ(probe_key(path, &tmpl, 0, k1, sizeof(k1)), 0);
+	ASSERT_INT_EQ(probe_key(path, &tmpl, 1, k2, sizeof(k2)), 0);
+	ASSERT(strcmp(k1, k2) != 0);
+	tmpl.audio_selector = "eng";
+	ASSERT_INT_EQ(probe_key(path, &tmpl, 0, k3, sizeof(k3)), 0);
+	ASSERT(strcmp(k1, k3) != 0);
+
+	/* A rewritten file is another file */
+	tmpl.audio_selector = NULL;
+	cache_test_file(dir, "a.mkv", 100, 2000000);
+	ASSERT_INT_EQ(probe_key(path, &tmpl, 0, k2, sizeof(k2)), 0);
+	ASSERT(strcmp(k1, k2) != 0);
+
+	ASSERT_INT_EQ(probe_key("http://host/a.mkv", &tmpl, 0, k1,
+	    sizeof(k1)), -1);
+	ASSERT_INT_EQ(probe_key(dir, &tmpl, 0, k1, sizeof(k1)), -1);
+	cache_test_cleanup(dir);
+}
+
+TEST(probe_store_load)
+{
+	probe_info_t	 in, out;
+	cache_ctx_t	 c;
+	char		 dir[64];
+
+	cache_test_dir(&c, dir, sizeof(dir), 0);
+	probe_test_info(&in, 5400);
+	ASSERT_INT_EQ(probe_load(dir, "0123456789abcdef", &out), -1);
+	ASSERT_INT_EQ(probe_store(dir, "0123456789abcdef", &in), 0);
+	ASSERT_INT_EQ(probe_load(dir, "0123456789abcdef", &out), 0);
+	ASSERT(memcmp(&in, &out, sizeof(in)) == 0);
+
+	/* No DLNA profile */
+	in.dlna_profile[0] = '\0';
+	in.needs_transcode = 1;
+	ASSERT_INT_EQ(probe_store(dir, "0123456789abcdef", &in), 0);
+	ASSERT_INT_EQ(probe_load(dir, "0123456789abcdef", &out), 0);
+	ASSERT_INT_EQ(out.needs_transcode, 1);
+	ASSERT_STR_EQ(out.mime_type, "video/mp4");
+	ASSERT_STR_EQ(out.dlna_profile, "");
+
+	/* Anything else is no result */
+	cache_test_file(dir, "fedcba9876543210", 100, 1000000);
+	ASSERT_INT_EQ(probe_load(dir, "fedcba9876543210", &out), -1);
+	cache_test_cleanup(dir);
+}
+
+/* Whether the workers are through with items 1 and up */
+static int
+probe_test_done(probe_pool_t *p)
+{
+	int	 i, done = 1;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 1; i < p->nfiles; i++)
+		if (p->items[i].state == PROBE_PENDING ||
+		    p->items[i].state == PROBE_BUSY)
+			done = 0;
+	pthread_mutex_unlock(&p->lock);
+	return done;
+}
+
+TEST(probe_pool_from_disk)
+{
+	probe_pool_t	 p;
+	probe_info_t	 info;
+	media_ctx_t	 tmpl;
+	cache_ctx_t	 c;
+	char		 dir[64], path[5][128], key[32];
+	char		*files[6];
+	int		 i;
+
+	/* Files probed on an earlier play: no FFmpeg involved */
+	memset(&tmpl, 0, sizeof(tmpl));
+	cache_test_dir(&c, dir, sizeof(dir), 0);
+	for (i = 0; i < 5; i++) {
+		snprintf(path[i], sizeof(path[i]), "%s/f%d.mp4", dir, i);
+		cache_test_file(dir, path[i] + strlen(dir) + 1, 10, 1000000);
+		ASSERT_INT_EQ(probe_key(path[i], &tmpl, 0, key,
+		    sizeof(key)), 0);
+		probe_test_info(&info, 60 * (i + 1));
+		ASSERT_INT_EQ(probe_store(dir, key, &info), 0);
+		files[i] = path[i];
+	}
+	files[5] = "https://example.com/watch?v=x";
+
+	ASSERT_INT_EQ(probe_start(&p, files, 6, &tmpl, 0, dir), 0);
+	ASSERT_INT_EQ(p.nthreads, 5);
+	for (i = 0; i < 300 && !probe_test_done(&p); i++)
+		usleep(10000);
+
+	/* All but the first, which is the caller's */
+	ASSERT_INT_EQ(p.items[0].state, PROBE_PENDING);
+	ASSERT_INT_EQ(p.items[3].state, PROBE_DONE);
+	ASSERT_INT_EQ(p.items[5].state, PROBE_FAILED);
+	for (i = 0; i < 5; i++) {
+		memset(&info, 0, sizeof(info));
+		ASSERT_INT_EQ(probe_get(&p, i, &info), 0);
+		ASSERT_INT_EQ(info.duration_sec, 60 * (i + 1));
+		ASSERT_STR_EQ(info.mime_type, "video/mp4");
+	}
+	ASSERT_INT_EQ(probe_get(&p, 5, &info), -1);
+	ASSERT_INT_EQ(probe_get(&p, 6, &info), -1);
+	ASSERT_INT_EQ(p.items[0].state, PROBE_TAKEN);
+	probe_stop(&p);
+	cache_test_cleanup(dir);
+}
+
+TEST(probe_pool_put)
+{
+	probe_pool_t	 p;
+	probe_info_t	 info;
+	media_ctx_t	 tmpl, m;
+	cache_ctx_t	 c;
+	char		 dir[64], path[128];
+	char		*files[1];
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	cache_test_dir(&c, dir, sizeof(dir), 0);
+	cache_test_file(dir, "one.mkv", 10, 1000000);
+	snprintf(path, sizeof(path), "%s/one.mkv", dir);
+	files[0] = path;
+
+	/* Nothing yet: the caller probes it, then keeps the result */
+	ASSERT_INT_EQ(probe_start(&p, files, 1, &tmpl, 0, dir), 0);
+	ASSERT_INT_EQ(p.nthreads, 0);
+	ASSERT_INT_EQ(probe_get(&p, 0, &info), -1);
+	memset(&m, 0, sizeof(m));
+	probe_test_info(&info, 42);
+	probe_apply(&m, &info);
+	ASSERT(m.ifmt_ctx == NULL);
+	probe_put(&p, 0, &m);
+	probe_stop(&p);
+
+	ASSERT_INT_EQ(probe_start(&p, files, 1, &tmpl, 0, dir), 0);
+	memset(&info, 0, sizeof(info));
+	ASSERT_INT_EQ(probe_get(&p, 0, &info), 0);
+	ASSERT_INT_EQ(info.duration_sec, 42);
+	ASSERT_INT_EQ(info.audio_idx, 1);
+	probe_stop(&p);
+	cache_test_cleanup(dir);
+}
+
+/* An audio-only TS is complete once its PMT was read */
+TEST(probe_complete_audio_ts)
+{
+	AVFormatContext		 fmt;
+	AVStream		 st, *streams[1];
+	AVCodecParameters	 par;
+	AVProgram		 prog, *progs[1];
+	unsigned int		 idx[1] = { 0 };
+	media_ctx_t		 m;
+
+	memset(&fmt, 0, sizeof(fmt));
+	memset(&st, 0, sizeof(st));
+	memset(&par, 0, sizeof(par));
+	memset(&prog, 0, sizeof(prog));
+	memset(&m, 0, sizeof(m));
+	par.codec_type = AVMEDIA_TYPE_AUDIO;
+	par.codec_id = AV_CODEC_ID_AAC;
+	par.sample_rate = 48000;
+	par.ch_layout.nb_channels = 2;
+	par.format = 8;
+	st.codecpar = &par;
+	streams[0] = &st;
+	fmt.streams = streams;
+	fmt.nb_streams = 1;
+	fmt.ctx_flags = AVFMTCTX_NOHEADER;
+	m.video_idx = -1;
+	m.audio_idx = 0;
+
+	/* No PMT yet, and more input may still add a stream */
+	ASSERT_INT_EQ(media_probe_complete(&m, &fmt, -1), 0);
+	ASSERT_INT_EQ(media_probe_complete(&m, &fmt, 0), 0);
+	/* Reading more found nothing new */
+	ASSERT_INT_EQ(media_probe_complete(&m, &fmt, 1), 1);
+	/* The PMT lists the stream */
+	prog.stream_index = idx;
+	prog.nb_stream_indexes = 1;
+	progs[0] = &prog;
+	fmt.programs = progs;
+	fmt.nb_programs = 1;
+	ASSERT_INT_EQ(media_probe_complete(&m, &fmt, -1), 1);
+	/* Its parameters still count */
+	par.sample_rate = 0;
+	ASSERT_INT_EQ(media_probe_complete(&m, &fmt, -1), 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* readahead.c tests                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+ * A throttled HTTP server on loopback: chunk bytes at a time, delay_us
+ * apart, from the offset of a "Range: bytes=N-" header.  Connections
+ * are served one after the other, as a client that seeks reconnects.
+ */
+struct ra_httpd {
+	int		 lfd;
+	char		 addr[64];
+	const uint8_t	*data;
+	size_t		 len;
+	size_t		 chunk;
+	int		 delay_us;
+	volatile int	 hold;		/* send nothing while set */
+	volatile int	 stop;
+	int		 requests;
+	pthread_t	 thread;
+};
+
+static void *
+ra_httpd_thread(void *arg)
+{
+	struct ra_httpd	*h = arg;
+	char		 req[1024], hdr[128], *p;
+	size_t		 off, n;
+	ssize_t		 r;
+	int		 fd, len;
+
+	while (!h->stop && (fd = accept(h->lfd, NULL, NULL)) >= 0) {
+		len = 0;
+		while (len < (int)sizeof(req) - 1 &&
+		    (r = read(fd, req + len, sizeof(req) - 1 - len)) > 0) {
+			len += r;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n") != NULL)
+				break;
+		}
+		req[len] = '\0';
+		h->requests++;
+		off = 0;
+		if ((p = strstr(req, "Range: bytes=")) != NULL)
+			off = strtoull(p + 13, NULL, 10);
+		if (off > h->len)
+			off = h->len;
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n"
+		    "Content-Length: %zu\r\n\r\n",
+		    off > 0 ? "206 Partial Content" : "200 OK", h->len - off);
+		send(fd, hdr, strlen(hdr), MSG_NOSIGNAL);
+		while (off < h->len && !h->stop) {
+			if (h->hold) {
+				usleep(1000);
+				continue;
+			}
+			n = h->len - off < h->chunk ? h->len - off : h->chunk;
+			if (send(fd, h->data + off, n, MSG_NOSIGNAL) !=
+			    (ssize_t)n)
+				break;	/* the client went elsewhere */
+			off += n;
+			if (h->delay_us > 0)
+				usleep(h->delay_us);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int
+ra_httpd_start(struct ra_httpd *h, const uint8_t *data, size_t len,
+    size_t chunk, int delay_us)
+{
+	memset(h, 0, sizeof(*h));
+	h->data = data;
+	h->len = len;
+	h->chunk = chunk;
+	h->delay_us = delay_us;
+	if ((h->lfd = net_listen_any(h->addr, sizeof(h->addr))) < 0)
+		return -1;
+	return pthread_create(&h->thread, NULL, ra_httpd_thread, h);
+}
+
+static void
+ra_httpd_stop(struct ra_httpd *h)
+{
+	h->stop = 1;
+	shutdown(h->lfd, SHUT_RDWR);
+	pthread_join(h->thread, NULL);
+	close(h->lfd);
+}
+
+/* The source: an HTTP client that reconnects with a Range to seek */
+struct ra_client {
+	const char	*addr;
+	int		 fd;
+	volatile int	*run;		/* gives up reading once cleared */
+};
+
+static int
+ra_client_open(struct ra_client *c, int64_t off)
+{
+	char	 req[128];
+	int	 len, got = 0;
+	char	 ch;
+
+	if (c->fd >= 0)
+		close(c->fd);
+	if ((c->fd = net_connect(c->addr)) < 0)
+		return -1;
+	len = snprintf(req, sizeof(req), "GET /x HTTP/1.1\r\n"
+	    "Range: bytes=%lld-\r\n\r\n", (long long)off);
+	if (write(c->fd, req, len) != len)
+		return -1;
+	/* Up to the blank line after the headers */
+	while (got < 4 && read(c->fd, &ch, 1) == 1)
+		got = ch == (got % 2 == 0 ? '\r' : '\n') ? got + 1 :
+		    ch == '\r';
+	return got == 4 ? 0 : -1;
+}
+
+static int
+ra_client_read(void *opaque, uint8_t *buf, int size)
+{
+	struct ra_client	*c = opaque;
+	struct pollfd		 pfd;
+
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+	while (c->run == NULL || *c->run) {
+		if (poll(&pfd, 1, 50) > 0)
+			return read(c->fd, buf, size);
+	}
+	return -1;
+}
+
+static int
+ra_client_seek(void *opaque, int64_t off)
+{
+	return ra_client_open(opaque, off);
+}
+
+static uint8_t *
+ra_test_data(size_t len)
+{
+	uint8_t	*data;
+	size_t	 i;
+
+	if ((data = malloc(len)) != NULL)
+		for (i = 0; i < len; i++)
+			data[i] = (i * 7 + i / 251) & 0xff;
+	return data;
+}
+
+/* Read exactly len bytes of ra, checking them against data at off */
+static int
+ra_test_read(readahead_t *ra, const uint8_t *data, int64_t off, size_t len)
+{
+	uint8_t	 buf[10000];
+	size_t	 got = 0;
+	int	 n;
+
+	while (got < len) {
+		n = len - got < sizeof(buf) ? len - got : sizeof(buf);
+		if ((n = readahead_read(ra, buf, n)) <= 0 ||
+		    memcmp(buf, data + off + got, n) != 0)
+			return -1;
+		got += n;
+	}
+	return 0;
+}
+
+static readahead_t *
+ra_test_open(struct ra_client *c, struct ra_httpd *h, int low, int high,
+    int seekable)
+{
+	readahead_src_t	 src;
+	readahead_t	*ra;
+
+	memset(&src, 0, sizeof(src));
+	c->addr = h->addr;
+	c->fd = -1;
+	c->run = NULL;
+	if ((ra = readahead_new(1 << 20, low, high)) == NULL)
+		return NULL;
+	src.read = ra_client_read;
+	src.seek = seekable ? ra_client_seek : NULL;
+	src.opaque = c;
+	src.size = h->len;
+	c->run = &ra->run;
+	if (ra_client_open(c, 0) < 0 || readahead_start(ra, &src) < 0) {
+		readahead_close(ra);
+		return NULL;
+	}
+	return ra;
+}
+
+static void
+ra_test_close(readahead_t *ra, struct ra_client *c)
+{
+	readahead_close(ra);
+	if (c->fd >= 0)
+		close(c->fd);
+}
+
+/*
+ * Level of ra once it has reached want and the thread has stopped
+ * reading, or the last one seen if it does not within 2 s.
+ */
+static size_t
+ra_test_settle(readahead_t *ra, size_t want)
+{
+	readahead_stats_t	 st;
+	int			 i;
+
+	for (i = 0; i < 200; i++) {
+		readahead_stats(ra, &st);
+		if (st.level == want && !ra->filling)
+			break;
+		usleep(10000);
+	}
+	/* And stays there */
+	usleep(30000);
+	readahead_stats(ra, &st);
+	return st.level;
+}
+
+/* A slow server: every byte arrives, and the waits are accounted for */
+TEST(readahead_throttled)
+{
+	struct ra_httpd		 h;
+	struct ra_client	 c;
+	readahead_stats_t	 st;
+	readahead_t		*ra;
+	uint8_t			*data, buf[16];
+	size_t			 len = 512 * 1024;
+
+	ASSERT((data = ra_test_data(len)) != NULL);
+	ASSERT_INT_EQ(ra_httpd_start(&h, data, len, 16 * 1024, 2000), 0);
+	ASSERT((ra = ra_test_open(&c, &h, 0, 0, 1)) != NULL);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 0, len), 0);
+	ASSERT_INT_EQ(readahead_read(ra, buf, sizeof(buf)), 0);
+	readahead_stats(ra, &st);
+	ASSERT(st.bytes == (int64_t)len);
+	ASSERT(st.stalls > 0);
+	ASSERT(st.stall_us > 0);
+	ASSERT(st.level == 0);
+	ASSERT(st.seeks == 0);
+	ASSERT_INT_EQ(h.requests, 1);
+	/* Reported while playing, once the period is over */
+	readahead_report(ra);
+	ASSERT(ra->reported.bytes == 0);
+	ra->report_us -= 5000000;
+	readahead_report(ra);
+	ASSERT(ra->reported.bytes == (int64_t)len);
+	ASSERT(ra->reported.stalls == st.stalls);
+	ra_test_close(ra, &c);
+	ra_httpd_stop(&h);
+	free(data);
+}
+
+/* Refilled from below the low watermark, up to the high one only */
+TEST(readahead_watermarks)
+{
+	struct ra_httpd		 h;
+	struct ra_client	 c;
+	readahead_t		*ra;
+	uint8_t			*data;
+	size_t			 len = 4 << 20, high, low;
+
+	ASSERT((data = ra_test_data(len)) != NULL);
+	ASSERT_INT_EQ(ra_httpd_start(&h, data, len, 64 * 1024, 0), 0);
+	ASSERT((ra = ra_test_open(&c, &h, 25, 50, 1)) != NULL);
+	high = ra->high;
+	low = ra->low;
+	ASSERT(high == ra->size / 100 * 50 && low == ra->size / 100 * 25);
+	ASSERT(ra_test_settle(ra, high) == high);
+
+	/* Still above low: left alone */
+	ASSERT_INT_EQ(ra_test_read(ra, data, 0, 100000), 0);
+	ASSERT(ra_test_settle(ra, high - 100000) == high - 100000);
+
+	/* Below it: back up to high */
+	ASSERT_INT_EQ(ra_test_read(ra, data, 100000, high - low), 0);
+	ASSERT(ra_test_settle(ra, high) == high);
+	ra_test_close(ra, &c);
+	ra_httpd_stop(&h);
+	free(data);
+}
+
+/* Seeks into the ring are served from it; others go to the server */
+TEST(readahead_seek)
+{
+	struct ra_httpd		 h;
+	struct ra_client	 c;
+	readahead_stats_t	 st;
+	readahead_t		*ra;
+	uint8_t			*data, buf[16];
+	size_t			 len = 4 << 20;
+
+	ASSERT((data = ra_test_data(len)) != NULL);
+	ASSERT_INT_EQ(ra_httpd_start(&h, data, len, 64 * 1024, 0), 0);
+	ASSERT((ra = ra_test_open(&c, &h, 0, 0, 1)) != NULL);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 0, 600000), 0);
+
+	/* Back, as a demuxer does after a probe */
+	ASSERT(readahead_seek(ra, 500000, SEEK_SET) == 500000);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 500000, 200000), 0);
+	/* Forward a little: read through */
+	ASSERT(readahead_seek(ra, 50000, SEEK_CUR) == 750000);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 750000, 10000), 0);
+	readahead_stats(ra, &st);
+	ASSERT(st.hits == 2 && st.seeks == 0);
+	ASSERT_INT_EQ(h.requests, 1);
+
+	/* Far: from the server, with a range */
+	ASSERT(readahead_seek(ra, 2 << 20, SEEK_SET) == 2 << 20);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 2 << 20, 100000), 0);
+	ASSERT(readahead_seek(ra, -1000, SEEK_END) == (int64_t)len - 1000);
+	ASSERT_INT_EQ(ra_test_read(ra, data, len - 1000, 1000), 0);
+	ASSERT_INT_EQ(readahead_read(ra, buf, sizeof(buf)), 0);
+	readahead_stats(ra, &st);
+	ASSERT(st.seeks == 2);
+	ASSERT_INT_EQ(h.requests, 3);
+	ra_test_close(ra, &c);
+	ra_httpd_stop(&h);
+	free(data);
+}
+
+/* Without a seekable source, only the ring can be sought in */
+TEST(readahead_unseekable)
+{
+	struct ra_httpd		 h;
+	struct ra_client	 c;
+	readahead_t		*ra;
+	uint8_t			*data;
+	size_t			 len = 4 << 20;
+
+	ASSERT((data = ra_test_data(len)) != NULL);
+	ASSERT_INT_EQ(ra_httpd_start(&h, data, len, 64 * 1024, 0), 0);
+	ASSERT((ra = ra_test_open(&c, &h, 0, 0, 0)) != NULL);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 0, 300000), 0);
+	ASSERT(readahead_seek(ra, 3 << 20, SEEK_SET) == -1);
+	/* What is above the high watermark is kept behind */
+	ASSERT(readahead_seek(ra, 100000, SEEK_SET) == 100000);
+	ASSERT_INT_EQ(ra_test_read(ra, data, 100000, 400000), 0);
+	ASSERT_INT_EQ(h.requests, 1);
+	ra_test_close(ra, &c);
+	ra_httpd_stop(&h);
+	free(data);
+}
+
+static volatile int ra_test_stop;
+
+static int
+ra_test_interrupt(void *arg)
+{
+	(void)arg;
+	return ra_test_stop;
+}
+
+static void *
+ra_test_stopper(void *arg)
+{
+	(void)arg;
+	usleep(100000);
+	ra_test_stop = 1;
+	return NULL;
+}
+
+/* A reader waiting on a stalled server can be stopped, and closed */
+TEST(readahead_interrupt)
+{
+	struct ra_httpd		 h;
+	struct ra_client	 c;
+	readahead_stats_t	 st;
+	readahead_t		*ra;
+	pthread_t		 t;
+	uint8_t			*data, buf[16];
+	size_t			 len = 1 << 20;
+
+	ASSERT((data = ra_test_data(len)) != NULL);
+	ASSERT_INT_EQ(ra_httpd_start(&h, data, len, 64 * 1024, 0), 0);
+	h.hold = 1;
+	ASSERT((ra = ra_test_open(&c, &h, 0, 0, 1)) != NULL);
+	ra_test_stop = 0;
+	ra->src.interrupt = ra_test_interrupt;
+	ASSERT_INT_EQ(pthread_create(&t, NULL, ra_test_stopper, NULL), 0);
+	ASSERT_INT_EQ(readahead_read(ra, buf, sizeof(buf)), -1);
+	pthread_join(t, NULL);
+	readahead_stats(ra, &st);
+	ASSERT(st.stalls == 1 && st.stall_us >= 50000);
+	ra_test_close(ra, &c);
+	ra_httpd_stop(&h);
+	free(data);
+}
+
+/*
+ * Native capture against a real display ($DISPLAY, e.g. under Xvfb).
+ * Skipped when there is none: xshm_grab() itself needs FFmpeg, so the
+ * rows are fetched through its helpers and timed like bench grab.
+ */
+TEST(xshm_capture_display)
+{
+#ifdef HAVE_XSHM
+	struct timespec	 t0, t1;
+	xshm_ctx_t	*x;
+	clock_t		 c;
+	int		 w, h, y0, y1, i, frames = 30;
+
+	if (getenv("DISPLAY") == NULL) {
+		printf("skipped (no DISPLAY), ");
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	x = xshm_open(NULL, 30, 1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (x == NULL) {
+		printf("skipped (no MIT-SHM), ");
+		return;
+	}
+	xshm_size(x, &w, &h);
+	ASSERT(w > 0 && h > 0);
+
+	/* The first frame is always grabbed whole */
+	damaged_rows(x, &y0, &y1);
+	ASSERT_INT_EQ(y0, 0);
+	ASSERT_INT_EQ(y1, h);
+	ASSERT_INT_EQ(grab_rows(x, y0, y1), 0);
+	ASSERT(draw_cursor(x, y0, y1) >= 0);
+
+	c = clock();
+	for (i = 0; i < frames; i++) {
+		x->full = 1;
+		damaged_rows(x, &y0, &y1);
+		ASSERT_INT_EQ(grab_rows(x, y0, y1), 0);
+	}
+	printf("%dx%d open %.1f ms, %.3f ms cpu/frame, ", w, h,
+	    (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+	    (double)(clock() - c) * 1e3 / CLOCKS_PER_SEC / frames);
+	xshm_close(x);
+#else
+	/* The stub must fail so that capture falls back to x11grab */
+	ASSERT(xshm_open(NULL, 30, 1) == NULL);
+	printf("skipped (no HAVE_XSHM), ");
+#endif
+}
+
+/* ------------------------------------------------------------------ */
+/* Main: run all tests                                                */
+/* ------------------------------------------------------------------ */
+
+int
+main(void)
+{
+	printf("send2tv unit tests\n\n");
+
+	printf("video_container_ok:\n");
+	RUN_TEST(video_h264_mp4);
+	RUN_TEST(video_h264_matroska);
+	RUN_TEST(video_h264_avi);
+	RUN_TEST(video_h264_asf);
+	RUN_TEST(video_h264_flv);
+	RUN_TEST(video_h264_mpegts);
+	RUN_TEST(video_h264_mov);
+	RUN_TEST(video_h264_webm_rejected);
+	RUN_TEST(video_h264_null);
+	RUN_TEST(video_hevc_mp4);
+	RUN_TEST(video_hevc_matroska);
+	RUN_TEST(video_hevc_mpegts);
+	RUN_TEST(video_hevc_avi_rejected);
+	RUN_TEST(video_vp8_webm);
+	RUN_TEST(video_vp8_matroska);
+	RUN_TEST(video_vp8_mp4_rejected);
+	RUN_TEST(video_vp9_webm);
+	RUN_TEST(video_av1_matroska);
+	RUN_TEST(video_mpeg4_avi);
+	RUN_TEST(video_mpeg4_mp4);
+	RUN_TEST(video_mpeg4_mpeg_rejected);
+	RUN_TEST(video_mpeg2_mpeg);
+	RUN_TEST(video_mpeg1_mpeg);
+	RUN_TEST(video_vc1_avi);
+	RUN_TEST(video_wmv3_asf);
+	RUN_TEST(video_mjpeg_avi);
+	RUN_TEST(video_unknown_codec);
+
+	printf("\naudio_codec_ok:\n");
+	RUN_TEST(audio_aac);
+	RUN_TEST(audio_mp3);
+	RUN_TEST(audio_mp2);
+	RUN_TEST(audio_flac);
+	RUN_TEST(audio_ac3);
+	RUN_TEST(audio_eac3);
+	RUN_TEST(audio_vorbis);
+	RUN_TEST(audio_opus);
+	RUN_TEST(audio_wmav1);
+	RUN_TEST(audio_wmav2);
+	RUN_TEST(audio_pcm_s16le);
+	RUN_TEST(audio_pcm_alaw);
+	RUN_TEST(audio_pcm_mulaw);
+	RUN_TEST(audio_adpcm_ima_wav);
+	RUN_TEST(audio_adpcm_ms);
+	RUN_TEST(audio_dts_rejected);
+	RUN_TEST(audio_unknown);
+
+	printf("\ncontainer_ok:\n");
+	RUN_TEST(container_mp4);
+	RUN_TEST(container_matroska);
+	RUN_TEST(container_mpegts);
+	RUN_TEST(container_avi);
+	RUN_TEST(container_asf);
+	RUN_TEST(container_flv);
+	RUN_TEST(container_mp3);
+	RUN_TEST(container_flac);
+	RUN_TEST(container_ogg);
+	RUN_TEST(container_wav);
+	RUN_TEST(container_null);
+	RUN_TEST(container_unknown);
+
+	printf("\nset_mime_type:\n");
+	RUN_TEST(mime_mp4);
+	RUN_TEST(mime_mov);
+	RUN_TEST(mime_mkv_h264);
+	RUN_TEST(mime_mkv_vp8);
+	RUN_TEST(mime_mkv_vp9);
+	RUN_TEST(mime_mkv_av1);
+	RUN_TEST(mime_mpegts);
+	RUN_TEST(mime_mpeg);
+	RUN_TEST(mime_avi);
+	RUN_TEST(mime_asf);
+	RUN_TEST(mime_flv);
+	RUN_TEST(mime_audio_mp3);
+	RUN_TEST(mime_audio_flac);
+	RUN_TEST(mime_audio_ogg);
+	RUN_TEST(mime_audio_wav);
+	RUN_TEST(mime_unknown_defaults_to_mp2t);
+
+	printf("\nset_dlna_profile:\n");
+	RUN_TEST(dlna_h264_mp4);
+	RUN_TEST(dlna_h264_mov);
+	RUN_TEST(dlna_h264_3gp);
+	RUN_TEST(dlna_h264_matroska);
+	RUN_TEST(dlna_h264_mpegts);
+	RUN_TEST(dlna_h264_avi);
+	RUN_TEST(dlna_hevc_mp4);
+	RUN_TEST(dlna_hevc_matroska_empty);
+	RUN_TEST(dlna_mpeg4);
+	RUN_TEST(dlna_vp8_empty);
+	RUN_TEST(dlna_h264_unknown_fmt_empty);
+
+	printf("\noutput_size:\n");
+	RUN_TEST(output_auto_by_bitrate);
+	RUN_TEST(output_capped_by_profile);
+	RUN_TEST(output_explicit_cap);
+	RUN_TEST(output_never_upscales);
+
+	printf("\nprofile:\n");
+	RUN_TEST(profile_lookup);
+	RUN_TEST(profile_default_balanced);
+	RUN_TEST(profile_interactive_smaller);
+
+	printf("\nbuild_dlna_features:\n");
+	RUN_TEST(dlna_features_file_with_profile);
+	RUN_TEST(dlna_features_streaming_with_profile);
+	RUN_TEST(dlna_features_null_profile);
+	RUN_TEST(dlna_features_empty_profile);
+	RUN_TEST(dlna_features_op_format_file);
+	RUN_TEST(dlna_features_op_format_streaming);
+	RUN_TEST(dlna_features_ci_original);
+	RUN_TEST(dlna_features_ci_transcoded);
+	RUN_TEST(dlna_features_flags_length);
+	RUN_TEST(dlna_features_flags_value);
+	RUN_TEST(dlna_features_consistency);
+	RUN_TEST(dlna_features_field_order);
+	RUN_TEST(dlna_features_field_order_no_profile);
+	RUN_TEST(dlna_transcode_profile_matches_encoder);
+	RUN_TEST(dlna_transcode_profile_hevc);
+	RUN_TEST(dlna_transcode_mime_type);
+	RUN_TEST(dlna_screen_capture_profile);
+	RUN_TEST(dlna_features_no_colons);
+	RUN_TEST(dlna_features_no_colons_no_profile);
+	RUN_TEST(dlna_features_hevc_streaming);
+	RUN_TEST(dlna_mpegts_direct_vs_transcode);
+
+	printf("\nvcodec:\n");
+	RUN_TEST(vcodec_default_is_h264);
+	RUN_TEST(vcodec_hevc_value);
+
+	printf("\nxml_extract:\n");
+	RUN_TEST(xml_extract_basic);
+	RUN_TEST(xml_extract_nested);
+	RUN_TEST(xml_extract_open_not_found);
+	RUN_TEST(xml_extract_close_not_found);
+	RUN_TEST(xml_extract_empty_content);
+	RUN_TEST(xml_extract_truncation);
+	RUN_TEST(xml_extract_first_match);
+
+	printf("\nxml_encode:\n");
+	RUN_TEST(xml_encode_plain);
+	RUN_TEST(xml_encode_lt_gt);
+	RUN_TEST(xml_encode_amp);
+	RUN_TEST(xml_encode_quotes);
+	RUN_TEST(xml_encode_empty);
+	RUN_TEST(xml_encode_all_special);
+
+	printf("\nspec:\n");
+	RUN_TEST(spec_predict_targets);
+	RUN_TEST(spec_predict_clamps_start);
+	RUN_TEST(spec_predict_skips_past_end);
+	RUN_TEST(spec_predict_hysteresis);
+	RUN_TEST(spec_take_within_tolerance);
+	RUN_TEST(spec_take_nearest);
+	RUN_TEST(spec_store_evicts_lru_slot);
+	RUN_TEST(spec_store_respects_byte_budget);
+	RUN_TEST(spec_window_from_start_time);
+
+	printf("\ncache:\n");
+	RUN_TEST(cache_key_depends_on_settings);
+	RUN_TEST(cache_key_missing_file);
+	RUN_TEST(cache_commit_then_lookup);
+	RUN_TEST(cache_abort_removes_part);
+	RUN_TEST(cache_trim_evicts_least_recently_used);
+
+	printf("\nlookahead:\n");
+	RUN_TEST(lookahead_window_sec_scales_with_bitrate);
+	RUN_TEST(lookahead_next_index_window);
+	RUN_TEST(lookahead_take_ready_only);
+	RUN_TEST(media_from_template_keeps_settings);
+	RUN_TEST(lookahead_advance_drops_passed_items);
+
+	printf("\nchunk:\n");
+	RUN_TEST(chunk_plan_on_keyframes);
+	RUN_TEST(chunk_plan_without_index);
+	RUN_TEST(chunk_plan_merges_short_tail);
+	RUN_TEST(chunk_plan_unknown_duration);
+	RUN_TEST(chunk_parse_remote_spec);
+	RUN_TEST(chunk_request_round_trip);
+	RUN_TEST(chunk_worker_paths);
+
+	printf("\nabr:\n");
+	RUN_TEST(abr_init_floor);
+	RUN_TEST(abr_throttled_reader_is_not_congestion);
+	RUN_TEST(abr_steps_down_when_behind);
+	RUN_TEST(abr_full_queue_counts_as_blocked);
+	RUN_TEST(abr_steps_up_with_hysteresis);
+	RUN_TEST(abr_waits_for_full_window);
+
+	printf("\ngov:\n");
+	RUN_TEST(gov_ladder_4k60);
+	RUN_TEST(gov_ladder_skips_noop_rungs);
+	RUN_TEST(gov_steps_down_to_fitting_rung);
+	RUN_TEST(gov_steps_up_with_headroom);
+	RUN_TEST(gov_no_frames_no_decision);
+
+	printf("\ndedupe:\n");
+	RUN_TEST(dedupe_first_frame_all_dirty);
+	RUN_TEST(dedupe_static_frame_clean);
+	RUN_TEST(dedupe_one_pixel_one_tile);
+	RUN_TEST(dedupe_partial_tiles_and_bbox);
+	RUN_TEST(dedupe_resize_starts_over);
+
+	printf("\navsync:\n");
+	RUN_TEST(avsync_offset_from_position_errors);
+	RUN_TEST(avsync_offset_relative_to_video);
+	RUN_TEST(avsync_audio_before_video_no_offset);
+	RUN_TEST(avsync_window);
+
+	printf("\ntslock:\n");
+	RUN_TEST(tslock_h264_keyframe);
+	RUN_TEST(tslock_needs_psi_first);
+	RUN_TEST(tslock_waits_for_idr);
+	RUN_TEST(tslock_split_feed);
+	RUN_TEST(tslock_hevc_irap);
+
+	printf("\ntsout:\n");
+	RUN_TEST(tsout_passthrough);
+	RUN_TEST(tsout_batches_whole_packets);
+	RUN_TEST(tsout_latency_budget);
+	RUN_TEST(tsout_partial_packet_waits);
+	RUN_TEST(tsout_push_frame);
+
+#ifdef __linux__
+	printf("\nshmring:\n");
+	RUN_TEST(shmring_handover);
+	RUN_TEST(shmring_wraps);
+	RUN_TEST(shmring_eof_drains);
+	RUN_TEST(shmring_reader_gone);
+	RUN_TEST(shmring_plain_stream);
+#endif
+
+	printf("\nnet:\n");
+	RUN_TEST(net_hmac_rfc4231);
+	RUN_TEST(net_addr_kinds);
+	RUN_TEST(net_tcp_key);
+	RUN_TEST(net_tcp_wrong_key);
+	RUN_TEST(net_tcp_open);
+	RUN_TEST(net_auth_stepwise);
+	RUN_TEST(net_unix_local);
+
+	printf("\nserver:\n");
+	RUN_TEST(server_addr_per_tv);
+	RUN_TEST(httpd_request_src);
+	RUN_TEST(server_multi_tv);
+
+	printf("\nsplice:\n");
+	RUN_TEST(splice_first_item_unchanged);
+	RUN_TEST(splice_timestamps_continue);
+	RUN_TEST(splice_cc_continues);
+	RUN_TEST(splice_psi_versions);
+	RUN_TEST(splice_feed_pieces);
+
+	RUN_TEST(splice_server_continuous);
+
+	printf("\nprefetch:\n");
+	RUN_TEST(prefetch_reads_ahead);
+	RUN_TEST(prefetch_short_stream);
+	RUN_TEST(prefetch_takes_ring);
+	RUN_TEST(server_gapless);
+
+	printf("\ntshift:\n");
+	RUN_TEST(tshift_keyframe_index);
+	RUN_TEST(tshift_reader_overtaken);
+	RUN_TEST(tshift_parse_npt);
+	RUN_TEST(dlna_features_timeshift);
+
+	printf("\nprobe:\n");
+	RUN_TEST(probe_key_identity);
+	RUN_TEST(probe_store_load);
+	RUN_TEST(probe_pool_from_disk);
+	RUN_TEST(probe_pool_put);
+	RUN_TEST(probe_complete_audio_ts);
+
+	printf("\nreadahead:\n");
+	RUN_TEST(readahead_throttled);
+	RUN_TEST(readahead_watermarks);
+	RUN_TEST(readahead_seek);
+	RUN_TEST(readahead_unseekable);
+	RUN_TEST(readahead_interrupt);
+
+	printf("\nxshm:\n");
+	RUN_TEST(xshm_capture_display);
 
 	printf("\n%d/%d passed", tests_passed, tests_run);
 	if (tests_failed > 0)
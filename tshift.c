@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "send2tv.h"
+
+/*
+ * Time-shift window for live segments.
+ *
+ * A screen capture or live URL is one forward-only stream: if the TV
+ * pauses, the data connection fills up and the client's muxer blocks,
+ * which drops real time, and there is nothing to go back to.  Here a
+ * thread drains the connection at the rate it arrives into a window of
+ * the last size bytes, in memory or in an unlinked file, and indexes
+ * the video keyframes in it.  The TV reads from the window: a paused
+ * TV resumes where it was for as long as the window still holds it,
+ * and a time seek starts at the keyframe before the requested time.
+ * A reader the window has overtaken skips to its oldest keyframe.
+ */
+
+#define TS_PACKET	188
+#define TS_SYNC		0x47
+#define TS_MASK		((1LL << 33) - 1)
+
+#define TSHIFT_MIN	(1024 * 1024)
+
+/* Copy n bytes at stream offset off into the window, or out of it */
+static int
+tshift_io(tshift_t *t, int64_t off, uint8_t *p, size_t n, int store)
+{
+	size_t	 pos, m;
+	ssize_t	 r;
+
+	while (n > 0) {
+		pos = (size_t)(off % (int64_t)t->size);
+		m = t->size - pos < n ? t->size - pos : n;
+		if (t->mem != NULL) {
+			if (store)
+				memcpy(t->mem + pos, p, m);
+			else
+				memcpy(p, t->mem + pos, m);
+		} else {
+			r = store ? pwrite(t->file, p, m, pos) :
+			    pread(t->file, p, m, pos);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return -1;
+			m = r;
+		}
+		off += m;
+		p += m;
+		n -= m;
+	}
+	return 0;
+}
+
+/* A packet that starts a video keyframe goes into the index */
+static void
+tshift_packet(tshift_t *t)
+{
+	const uint8_t	*p;
+	int64_t		 pts;
+	int		 afc, len;
+
+	afc = (t->pkt[3] >> 4) & 3;
+	if (!(t->pkt[1] & 0x40) || afc != 3 || t->pkt[4] == 0 ||
+	    !(t->pkt[5] & 0x40))		/* random_access_indicator */
+		return;
+	p = t->pkt + 5 + t->pkt[4];
+	len = TS_PACKET - 5 - t->pkt[4];
+	if (len < 14 || p[0] != 0 || p[1] != 0 || p[2] != 1 ||
+	    (p[3] & 0xf0) != 0xe0 || !(p[7] & 0x80))
+		return;
+	pts = (int64_t)(p[9] & 0x0e) << 29 | (int64_t)p[10] << 22 |
+	    (int64_t)(p[11] & 0xfe) << 14 | (int64_t)p[12] << 7 | p[13] >> 1;
+
+	if (t->pts0 < 0)
+		t->pts0 = pts;
+	if (t->nkeys == TSHIFT_KEYS) {
+		t->key0 = (t->key0 + 1) % TSHIFT_KEYS;
+		t->nkeys--;
+	}
+	t->keys[(t->key0 + t->nkeys) % TSHIFT_KEYS].off = t->pkt_off;
+	t->keys[(t->key0 + t->nkeys) % TSHIFT_KEYS].pts = pts;
+	t->nkeys++;
+}
+
+/* Index the n bytes at t->head.  Called with t->lock held. */
+static void
+tshift_index(tshift_t *t, const uint8_t *p, size_t n)
+{
+	int64_t	 off = t->head;
+	size_t	 m;
+
+	while (n > 0) {
+		if (t->pkt_len == 0) {
+			if (*p != TS_SYNC) {
+				p++;
+				n--;
+				off++;
+				continue;
+			}
+			t->pkt_off = off;
+		}
+		m = TS_PACKET - t->pkt_len;
+		if (m > n)
+			m = n;
+		memcpy(t->pkt + t->pkt_len, p, m);
+		t->pkt_len += m;
+		p += m;
+		n -= m;
+		off += m;
+		if (t->pkt_len == TS_PACKET) {
+			t->pkt_len = 0;
+			tshift_packet(t);
+		}
+	}
+}
+
+/*
+ * Append n bytes: the oldest are given up first, so that no reader
+ * copies bytes being overwritten, then the new ones are published.
+ */
+static int
+tshift_append(tshift_t *t, const uint8_t *p, size_t n)
+{
+	size_t	 m;
+
+	for (; n > 0; p += m, n -= m) {
+		m = n > t->size / 2 ? t->size / 2 : n;
+		pthread_mutex_lock(&t->lock);
+		if (t->head + (int64_t)m - t->tail > (int64_t)t->size)
+			t->tail = t->head + m - t->size;
+		while (t->nkeys > 0 && t->keys[t->key0].off < t->tail) {
+			t->key0 = (t->key0 + 1) % TSHIFT_KEYS;
+			t->nkeys--;
+		}
+		pthread_mutex_unlock(&t->lock);
+
+		if (tshift_io(t, t->head, (uint8_t *)p, m, 1) < 0)
+			return -1;
+
+		pthread_mutex_lock(&t->lock);
+		tshift_index(t, p, m);
+		t->head += m;
+		pthread_cond_broadcast(&t->cond);
+		pthread_mutex_unlock(&t->lock);
+	}
+	return 0;
+}
+
+/* Drain the data connection, or the ring it hands over */
+static void *
+tshift_thread(void *arg)
+{
+	tshift_t	*t = arg;
+	shmring_t	*ring = NULL;
+	struct stat	 st;
+	const uint8_t	*p;
+	uint8_t		*buf;
+	size_t		 len;
+	ssize_t		 n = 0;
+
+	if ((buf = malloc(SEND2TV_BUF_SIZE)) == NULL)
+		goto done;
+	if (fstat(t->fd, &st) == 0 && S_ISSOCK(st.st_mode))
+		ring = shmring_accept(t->fd, buf, SEND2TV_BUF_SIZE, &n);
+	if (n > 0 && tshift_append(t, buf, n) < 0)
+		goto done;
+	while (t->run && n >= 0) {
+		if (ring != NULL) {
+			p = shmring_peek(ring, SEND2TV_BUF_SIZE, &len,
+			    &t->run, t->fd);
+			if (p == NULL)
+				break;
+			n = tshift_append(t, p, len);
+			shmring_consume(ring, len);
+		} else {
+			n = read(t->fd, buf, SEND2TV_BUF_SIZE);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n <= 0)
+				break;
+			n = tshift_append(t, buf, n);
+		}
+	}
+
+done:
+	DPRINTF("tshift: %lld bytes received, %lld held\n",
+	    (long long)t->head, (long long)(t->head - t->tail));
+	shmring_free(ring);
+	free(buf);
+	pthread_mutex_lock(&t->lock);
+	t->eof = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+/*
+ * Start draining data connection fd into a window of size bytes, in an
+ * unlinked file in dir or, without one, in memory.  fd stays the
+ * caller's, who shuts it down before tshift_close().  Returns NULL on
+ * failure.
+ */
+tshift_t *
+tshift_open(int fd, size_t size, const char *dir)
+{
+	tshift_t	*t;
+	char		 path[1024];
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	t->fd = fd;
+	t->file = -1;
+	t->size = size < TSHIFT_MIN ? TSHIFT_MIN : size;
+	t->pts0 = -1;
+	t->run = 1;
+	if (dir != NULL) {
+		snprintf(path, sizeof(path), "%s/send2tv-tshift.XXXXXX", dir);
+		if ((t->file = mkstemp(path)) >= 0)
+			unlink(path);
+		else
+			fprintf(stderr, "tshift: cannot create a file in %s, "
+			    "keeping the window in memory\n", dir);
+	}
+	if (t->file < 0 && (t->mem = malloc(t->size)) == NULL) {
+		free(t);
+		return NULL;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	if (pthread_create(&t->thread, NULL, tshift_thread, t) != 0) {
+		pthread_mutex_destroy(&t->lock);
+		pthread_cond_destroy(&t->cond);
+		if (t->file >= 0)
+			close(t->file);
+		free(t->mem);
+		free(t);
+		return NULL;
+	}
+	DPRINTF("tshift: %zu MiB window %s\n", t->size / (1024 * 1024),
+	    t->file >= 0 ? "on disk" : "in memory");
+	return t;
+}
+
+static void
+tshift_free(tshift_t *t)
+{
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	if (t->file >= 0)
+		close(t->file);
+	free(t->mem);
+	free(t);
+}
+
+/*
+ * Stop draining and close the window.  Readers get -1 from then on; the
+ * last of them frees it, as one may be stuck sending to a paused TV.
+ */
+void
+tshift_close(tshift_t *t)
+{
+	int	 last;
+
+	t->run = 0;
+	pthread_join(t->thread, NULL);
+	pthread_mutex_lock(&t->lock);
+	t->closed = 1;
+	pthread_cond_broadcast(&t->cond);
+	last = t->readers == 0;
+	pthread_mutex_unlock(&t->lock);
+	if (last)
+		tshift_free(t);
+}
+
+/* A reader keeps t from being freed until it releases it */
+void
+tshift_hold(tshift_t *t)
+{
+	pthread_mutex_lock(&t->lock);
+	t->readers++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+void
+tshift_release(tshift_t *t)
+{
+	int	 last;
+
+	pthread_mutex_lock(&t->lock);
+	last = --t->readers == 0 && t->closed;
+	pthread_mutex_unlock(&t->lock);
+	if (last)
+		tshift_free(t);
+}
+
+/* The oldest offset a reader can start at.  Called with t->lock held. */
+static int64_t
+tshift_oldest(tshift_t *t)
+{
+	if (t->nkeys > 0)
+		return t->keys[t->key0].off;
+	return (t->tail + TS_PACKET - 1) / TS_PACKET * TS_PACKET;
+}
+
+/*
+ * Where a new reader of the live stream starts: at the newest keyframe,
+ * so that the TV has a picture at once.
+ */
+int64_t
+tshift_live(tshift_t *t)
+{
+	int64_t	 off;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nkeys > 0)
+		off = t->keys[(t->key0 + t->nkeys - 1) % TSHIFT_KEYS].off;
+	else
+		off = tshift_oldest(t);
+	pthread_mutex_unlock(&t->lock);
+	return off;
+}
+
+/*
+ * The offset of the last keyframe at or before npt seconds from the
+ * first one, or of the nearest one if npt is out of the window; *at is
+ * set to its time.
+ */
+int64_t
+tshift_seek(tshift_t *t, double npt, double *at)
+{
+	tshift_key_t	*k;
+	int64_t		 off;
+	int		 i, best = 0;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nkeys == 0) {
+		off = tshift_oldest(t);
+		*at = 0;
+		pthread_mutex_unlock(&t->lock);
+		return off;
+	}
+	for (i = 0; i < t->nkeys; i++) {
+		k = &t->keys[(t->key0 + i) % TSHIFT_KEYS];
+		if (((k->pts - t->pts0) & TS_MASK) / 90000.0 > npt)
+			break;
+		best = i;
+	}
+	k = &t->keys[(t->key0 + best) % TSHIFT_KEYS];
+	off = k->off;
+	*at = ((k->pts - t->pts0) & TS_MASK) / 90000.0;
+	pthread_mutex_unlock(&t->lock);
+	return off;
+}
+
+/* Whether off is in the window, or the next byte to come */
+int
+tshift_holds(tshift_t *t, int64_t off)
+{
+	int	 ret;
+
+	pthread_mutex_lock(&t->lock);
+	ret = off >= t->tail && off <= t->head;
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+/*
+ * Read up to len bytes at *off, waiting for them to arrive, and advance
+ * *off.  A reader the window has overtaken goes on at its oldest
+ * keyframe.  Returns the bytes read, 0 at the end of the stream, -1 if
+ * the window is closed.
+ */
+ssize_t
+tshift_read(tshift_t *t, int64_t *off, void *buf, size_t len)
+{
+	ssize_t	 n;
+
+	pthread_mutex_lock(&t->lock);
+	for (;;) {
+		while (!t->closed && !t->eof && *off >= t->head)
+			pthread_cond_wait(&t->cond, &t->lock);
+		if (t->closed) {
+			n = -1;
+			break;
+		}
+		if (*off < t->tail) {
+			DPRINTF("tshift: reader overtaken, %lld bytes lost\n",
+			    (long long)(tshift_oldest(t) - *off));
+			*off = tshift_oldest(t);
+		}
+		if (*off >= t->head) {
+			n = 0;
+			break;
+		}
+		n = t->head - *off < (int64_t)len ? t->head - *off :
+		    (ssize_t)len;
+		pthread_mutex_unlock(&t->lock);
+		if (tshift_io(t, *off, buf, n, 0) < 0)
+			n = -1;
+		pthread_mutex_lock(&t->lock);
+		/* Overwritten while being copied: once more from the start */
+		if (n < 0 || *off >= t->tail)
+			break;
+	}
+	if (n > 0)
+		*off += n;
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
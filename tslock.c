@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send2tv.h"
+
+/*
+ * MPEG-TS lock-on check, the way a TV tunes into our stream.
+ *
+ * The scanner follows the PAT to the PMT and the PMT to the first
+ * H.264 or HEVC stream.  It is locked at the first video PES that
+ * starts with the random access indicator set and carries the
+ * parameter sets and an IDR/IRAP picture, after PAT and PMT were seen:
+ * from there on a decoder can show a picture.  Other video stream types
+ * lock on the random access indicator alone.
+ */
+
+#define TS_PACKET	188
+#define TS_SYNC		0x47
+
+void
+tslock_init(tslock_t *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->pmt_pid = -1;
+	t->video_pid = -1;
+	t->lock_off = -1;
+}
+
+/*
+ * Start of the section in a PSI payload, or NULL.
+ */
+static const uint8_t *
+psi_section(const uint8_t *p, int len, int *slen)
+{
+	int	 ptr;
+
+	if (len < 1)
+		return NULL;
+	ptr = p[0];
+	p += 1 + ptr;
+	len -= 1 + ptr;
+	if (len < 3)
+		return NULL;
+	*slen = ((p[1] & 0x0f) << 8 | p[2]) + 3;
+	if (*slen > len)
+		*slen = len;
+	return p;
+}
+
+static void
+parse_pat(tslock_t *t, const uint8_t *p, int len)
+{
+	const uint8_t	*s;
+	int		 slen, i;
+
+	if ((s = psi_section(p, len, &slen)) == NULL || s[0] != 0x00)
+		return;
+	/* Programs after the 8 byte header, 4 byte CRC at the end */
+	for (i = 8; i + 4 <= slen - 4; i += 4) {
+		if ((s[i] << 8 | s[i + 1]) == 0)
+			continue;	/* network PID */
+		t->pmt_pid = (s[i + 2] & 0x1f) << 8 | s[i + 3];
+		t->have_pat = 1;
+		return;
+	}
+}
+
+static void
+parse_pmt(tslock_t *t, const uint8_t *p, int len)
+{
+	const uint8_t	*s;
+	int		 slen, i, info, type, pid;
+
+	if ((s = psi_section(p, len, &slen)) == NULL || s[0] != 0x02 ||
+	    slen < 12)
+		return;
+	info = (s[10] & 0x0f) << 8 | s[11];
+	for (i = 12 + info; i + 5 <= slen - 4;
+	    i += 5 + ((s[i + 3] & 0x0f) << 8 | s[i + 4])) {
+		type = s[i];
+		pid = (s[i + 1] & 0x1f) << 8 | s[i + 2];
+		if (type == 0x1b || type == 0x24 || type == 0x02 ||
+		    type == 0x01) {
+			t->video_pid = pid;
+			t->video_type = type;
+			break;
+		}
+	}
+	t->have_pmt = 1;
+}
+
+/*
+ * Look for NAL units in a piece of video PES payload.  The start code
+ * state carries over between packets.
+ */
+static void
+scan_nals(tslock_t *t, const uint8_t *p, int len)
+{
+	int	 i, type;
+
+	for (i = 0; i < len; i++) {
+		if (t->nal_next) {
+			t->nal_next = 0;
+			if (t->video_type == 0x24) {
+				type = (p[i] >> 1) & 0x3f;
+				if (type >= 32 && type <= 34)
+					t->ps |= 1 << (type - 32);
+				else if (type >= 16 && type <= 21)
+					t->idr = 1;
+			} else {
+				type = p[i] & 0x1f;
+				if (type == 7)
+					t->ps |= 1;
+				else if (type == 8)
+					t->ps |= 2;
+				else if (type == 5)
+					t->idr = 1;
+			}
+		}
+		if (p[i] == 0)
+			t->zeros++;
+		else {
+			if (p[i] == 1 && t->zeros >= 2)
+				t->nal_next = 1;
+			t->zeros = 0;
+		}
+	}
+}
+
+/*
+ * Whether the video PES scanned so far starts a decodable picture.
+ */
+static int
+pes_decodable(const tslock_t *t)
+{
+	if (!t->pes_rai)
+		return 0;
+	if (t->video_type == 0x1b)
+		return t->ps == 3 && t->idr;
+	if (t->video_type == 0x24)
+		return t->ps == 7 && t->idr;
+	return 1;
+}
+
+static void
+scan_packet(tslock_t *t, const uint8_t *pkt)
+{
+	const uint8_t	*p;
+	int		 pid, pusi, afc, len, rai = 0, hdr;
+
+	if (pkt[0] != TS_SYNC)
+		return;
+	pusi = pkt[1] & 0x40;
+	pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+	afc = (pkt[3] >> 4) & 3;
+	p = pkt + 4;
+	len = TS_PACKET - 4;
+	if (afc & 2) {
+		if (p[0] > 0)
+			rai = p[1] & 0x40;
+		len -= 1 + p[0];
+		p += 1 + p[0];
+	}
+	if (!(afc & 1) || len <= 0)
+		return;
+
+	if (pid == 0 && pusi)
+		parse_pat(t, p, len);
+	else if (t->have_pat && pid == t->pmt_pid && pusi)
+		parse_pmt(t, p, len);
+	else if (t->have_pmt && pid == t->video_pid) {
+		if (pusi) {
+			/* The previous PES is complete */
+			if (pes_decodable(t)) {
+				t->locked = 1;
+				return;
+			}
+			t->pes_off = t->off;
+			t->pes_rai = rai != 0;
+			t->ps = 0;
+			t->idr = 0;
+			t->zeros = 0;
+			t->nal_next = 0;
+			/* Skip the PES header */
+			if (len < 9 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+				return;
+			hdr = 9 + p[8];
+			if (hdr > len)
+				return;
+			p += hdr;
+			len -= hdr;
+		}
+		if (t->pes_rai)
+			scan_nals(t, p, len);
+		/* Picture data is enough, the PES need not end first */
+		if (t->idr && pes_decodable(t))
+			t->locked = 1;
+	}
+}
+
+/*
+ * Scan the next len bytes of the stream.  Returns 1 once locked; the
+ * byte offset of the first TS packet of the locking PES is in lock_off.
+ */
+int
+tslock_feed(tslock_t *t, const uint8_t *buf, size_t len)
+{
+	size_t	 n;
+
+	while (len > 0 && !t->locked) {
+		if (t->carry_len > 0 || len < TS_PACKET) {
+			n = TS_PACKET - t->carry_len;
+			if (n > len)
+				n = len;
+			memcpy(t->carry + t->carry_len, buf, n);
+			t->carry_len += n;
+			buf += n;
+			len -= n;
+			if (t->carry_len < TS_PACKET)
+				break;
+			scan_packet(t, t->carry);
+			t->carry_len = 0;
+		} else {
+			scan_packet(t, buf);
+			buf += TS_PACKET;
+			len -= TS_PACKET;
+		}
+		if (t->locked)
+			t->lock_off = t->pes_off;
+		t->off += TS_PACKET;
+	}
+	return t->locked;
+}
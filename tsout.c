@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "send2tv.h"
+
+/*
+ * Write coalescing for the MPEG-TS output.
+ *
+ * With a flush after every muxed packet the AVIO callback sees a chunk
+ * per audio packet and 4 KiB pieces of every video frame, none of them
+ * on a TS packet boundary, and each used to cost a poll() and a write().
+ * Here chunks are staged until at least pkts whole TS packets are
+ * waiting or the oldest staged byte is budget_us old, and then written
+ * with one writev(): the staged bytes and the whole packets of the new
+ * chunk go out without copying the latter.  Only whole packets are
+ * written before the end; the rest stays staged.
+ *
+ * The deadline is checked on every write and by tsout_tick(), which
+ * the muxing loops call once per input packet.  A loop that is about to
+ * wait for its next frame (a screen grab, a live input) calls
+ * tsout_push() instead, so that the tail of a frame does not wait with
+ * it, past the budget.
+ */
+
+#define TS_PACKET	188
+
+/*
+ * Stage up to pkts TS packets for at most budget_us; pkts 0 writes
+ * every chunk as it comes.  Returns 0, or -1 if out of memory.
+ */
+int
+tsout_init(tsout_t *o, int pkts, int64_t budget_us,
+    int (*sink)(void *, const struct iovec *, int), void *opaque)
+{
+	memset(o, 0, sizeof(*o));
+	o->pkts = pkts;
+	o->budget_us = budget_us;
+	o->sink = sink;
+	o->opaque = opaque;
+	if (pkts <= 0)
+		return 0;
+	/* A due chunk is never staged whole, see tsout_write() */
+	o->cap = (size_t)(pkts + 1) * TS_PACKET;
+	o->buf = malloc(o->cap);
+	return o->buf == NULL ? -1 : 0;
+}
+
+static int
+tsout_sink(tsout_t *o, const struct iovec *iov, int n)
+{
+	int	 i;
+
+	o->writes++;
+	for (i = 0; i < n; i++)
+		o->bytes += iov[i].iov_len;
+	return o->sink(o->opaque, iov, n);
+}
+
+/*
+ * Write the staged bytes and the whole packets of data, stage the
+ * rest.  Returns 0 or the sink's error.
+ */
+static int
+tsout_drain(tsout_t *o, const uint8_t *data, size_t len, int64_t now_us,
+    int all)
+{
+	struct iovec	 iov[2];
+	size_t		 total = o->len + len, out;
+	int		 n = 0, ret;
+
+	out = all ? total : total - total % TS_PACKET;
+	if (out == 0) {
+		memcpy(o->buf + o->len, data, len);
+		o->len = total;
+		return 0;
+	}
+	iov[n].iov_base = o->buf;
+	iov[n].iov_len = out < o->len ? out : o->len;
+	if (iov[n].iov_len > 0)
+		n++;
+	if (out > o->len) {
+		iov[n].iov_base = (void *)data;
+		iov[n].iov_len = out - o->len;
+		n++;
+	}
+	if ((ret = tsout_sink(o, iov, n)) < 0)
+		return ret;
+
+	if (out >= o->len) {
+		if (total > out)
+			memcpy(o->buf, data + (out - o->len), total - out);
+	} else {
+		memmove(o->buf, o->buf + out, o->len - out);
+		if (len > 0)
+			memcpy(o->buf + (o->len - out), data, len);
+	}
+	o->len = total - out;
+	o->first_us = now_us;
+	return 0;
+}
+
+/*
+ * Take len bytes of muxer output at now_us.  Returns 0 or the sink's
+ * error.
+ */
+int
+tsout_write(tsout_t *o, const uint8_t *data, size_t len, int64_t now_us)
+{
+	struct iovec	 iov;
+
+	o->calls++;
+	if (o->buf == NULL) {
+		iov.iov_base = (void *)data;
+		iov.iov_len = len;
+		return len > 0 ? tsout_sink(o, &iov, 1) : 0;
+	}
+	if (o->len == 0)
+		o->first_us = now_us;
+	if (o->len + len >= (size_t)o->pkts * TS_PACKET ||
+	    now_us - o->first_us >= o->budget_us)
+		return tsout_drain(o, data, len, now_us, 0);
+	memcpy(o->buf + o->len, data, len);
+	o->len += len;
+	return 0;
+}
+
+/*
+ * Write the whole packets staged longer than the budget.
+ */
+int
+tsout_tick(tsout_t *o, int64_t now_us)
+{
+	if (o->len < TS_PACKET || now_us - o->first_us < o->budget_us)
+		return 0;
+	return tsout_drain(o, NULL, 0, now_us, 0);
+}
+
+/*
+ * Write the whole packets staged, whatever their age: the caller has
+ * muxed a frame and waits for the next one.
+ */
+int
+tsout_push(tsout_t *o, int64_t now_us)
+{
+	if (o->len < TS_PACKET)
+		return 0;
+	return tsout_drain(o, NULL, 0, now_us, 0);
+}
+
+/*
+ * Write everything staged, at the end of the stream.
+ */
+int
+tsout_flush(tsout_t *o)
+{
+	if (o->len == 0)
+		return 0;
+	return tsout_drain(o, NULL, 0, 0, 1);
+}
+
+void
+tsout_report(const tsout_t *o)
+{
+	if (o->calls == 0)
+		return;
+	DPRINTF("tsout: %lld chunks in %lld writes, %lld bytes per write\n",
+	    (long long)o->calls, (long long)o->writes,
+	    (long long)(o->writes > 0 ? o->bytes / o->writes : 0));
+}
+
+void
+tsout_free(tsout_t *o)
+{
+	free(o->buf);
+	memset(o, 0, sizeof(*o));
+}
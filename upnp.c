@@ -575,9 +575,9 @@ int
 upnp_find_transport(upnp_ctx_t *ctx)
 {
 	int	 i, resp_len;
-	char	*desc = NULL;
+	char	*desc = NULL, *scpd;
 	char	*avt_start;
-	char	 ctrl_url[254];
+	char	 ctrl_url[254], scpd_url[254], path[256];
 
 	for (i = 0; dmr_endpoints[i].path != NULL; i++) {
 		DPRINTF("upnp: trying %s:%d%s\n", ctx->tv_ip,
@@ -629,6 +629,25 @@ upnp_find_transport(upnp_ctx_t *ctx)
 	DPRINTF("upnp: AVTransport at %s:%d%s\n", ctx->tv_ip,
 	    ctx->tv_port, ctx->control_url);
 
+	/*
+	 * SetNextAVTransportURI is optional; the service description
+	 * lists the actions the TV has.
+	 */
+	ctx->can_queue = 0;
+	if (xml_extract(avt_start, "<SCPDURL>", "</SCPDURL>",
+	    scpd_url, sizeof(scpd_url)) == 0) {
+		snprintf(path, sizeof(path), "%s%s",
+		    scpd_url[0] == '/' ? "" : "/", scpd_url);
+		scpd = http_request(ctx->tv_ip, ctx->tv_port, "GET", path,
+		    NULL, NULL, &resp_len);
+		if (scpd != NULL && resp_len > 0 &&
+		    strstr(scpd, "SetNextAVTransportURI") != NULL)
+			ctx->can_queue = 1;
+		free(scpd);
+	}
+	DPRINTF("upnp: SetNextAVTransportURI %s\n",
+	    ctx->can_queue ? "supported" : "not supported");
+
 	free(desc);
 	return 0;
 }
@@ -785,18 +804,23 @@ soap_action_resp(upnp_ctx_t *ctx, const char *action, const char *body_xml)
 }
 
 /*
- * SetAVTransportURI with DIDL-Lite metadata.
+ * SetAVTransportURI or SetNextAVTransportURI (next set) with DIDL-Lite
+ * metadata.
  */
-int
-upnp_set_uri(upnp_ctx_t *ctx, const char *uri, const char *mime,
+static int
+set_uri(upnp_ctx_t *ctx, int next, const char *uri, const char *mime,
     const char *title, int is_streaming, const char *dlna_profile)
 {
-	char	 didl[2048];
-	char	*didl_encoded;
-	char	 body[4096];
-	char	 dlna_features[256];
-	char	*title_xml, *uri_xml;
-	int	 ret;
+	const char	*action, *tag;
+	char		 didl[2048];
+	char		*didl_encoded;
+	char		 body[4096];
+	char		 dlna_features[256];
+	char		*title_xml, *uri_xml;
+	int		 ret;
+
+	action = next ? "SetNextAVTransportURI" : "SetAVTransportURI";
+	tag = next ? "Next" : "Current";
 
 	title_xml = xml_encode(title);
 	uri_xml = xml_encode(uri);
@@ -830,22 +854,47 @@ upnp_set_uri(upnp_ctx_t *ctx, const char *uri, const char *mime,
 	}
 
 	snprintf(body, sizeof(body),
-	    "<u:SetAVTransportURI"
+	    "<u:%s"
 	    " xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
 	    "<InstanceID>0</InstanceID>"
-	    "<CurrentURI>%s</CurrentURI>"
-	    "<CurrentURIMetaData>%s</CurrentURIMetaData>"
-	    "</u:SetAVTransportURI>",
-	    uri_xml, didl_encoded);
+	    "<%sURI>%s</%sURI>"
+	    "<%sURIMetaData>%s</%sURIMetaData>"
+	    "</u:%s>",
+	    action, tag, uri_xml, tag, tag, didl_encoded, tag, action);
 
 	free(title_xml);
 	free(uri_xml);
 	free(didl_encoded);
 
-	ret = soap_action(ctx, "SetAVTransportURI", body);
+	ret = soap_action(ctx, action, body);
 	return ret;
 }
 
+int
+upnp_set_uri(upnp_ctx_t *ctx, const char *uri, const char *mime,
+    const char *title, int is_streaming, const char *dlna_profile)
+{
+	return set_uri(ctx, 0, uri, mime, title, is_streaming, dlna_profile);
+}
+
+/*
+ * Queue uri to play when the current one ends, for gapless playback.
+ * A TV that turns it down is not asked again.
+ */
+int
+upnp_set_next_uri(upnp_ctx_t *ctx, const char *uri, const char *mime,
+    const char *title, int is_streaming, const char *dlna_profile)
+{
+	if (!ctx->can_queue)
+		return -1;
+	if (set_uri(ctx, 1, uri, mime, title, is_streaming,
+	    dlna_profile) < 0) {
+		ctx->can_queue = 0;
+		return -1;
+	}
+	return 0;
+}
+
 int
 upnp_play(upnp_ctx_t *ctx)
 {
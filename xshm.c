@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "send2tv.h"
+
+/*
+ * Native X11 screen capture.
+ *
+ * The root window is grabbed into a MIT-SHM segment, so the server
+ * writes the pixels straight into our memory and no frame is copied on
+ * the way to the filter graph.  XDamage tells which part of the screen
+ * changed since the last frame; only those rows are fetched, and
+ * nothing at all when the screen is static.  The geometry and pixel
+ * format come from the root window, so unlike x11grab there is no
+ * stream probing that grabs and throws away frames before the first
+ * one is sent.
+ *
+ * Built with -DHAVE_XSHM (the Makefile adds it when x11, xext, xfixes
+ * and xdamage are found); otherwise xshm_open() always fails and screen
+ * capture goes through x11grab.
+ */
+
+#ifdef HAVE_XSHM
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+struct xshm_ctx {
+	Display		*dpy;
+	Window		 root;
+	XImage		*image;
+	XShmSegmentInfo	 shm;
+	int		 attached;
+	int		 width;
+	int		 height;
+
+	/* XDamage, damage_ev < 0 if the server lacks it */
+	int		 damage_ev;
+	Damage		 damage;
+	XserverRegion	 region;
+	int		 full;		/* next grab fetches all rows */
+
+	/* cursor drawn into the image, and the rows it covers */
+	int		 draw_mouse;
+	int		 cursor_x;
+	int		 cursor_y;
+	unsigned long	 cursor_serial;
+	int		 cursor_y0;
+	int		 cursor_y1;
+
+	int64_t		 frame_us;
+	int64_t		 next_us;
+};
+
+/*
+ * X errors are asynchronous and the default handler exits.  While we
+ * attach and grab, errors are only noted, and fail the call instead.
+ */
+static volatile int	xshm_error;
+
+static int
+xshm_error_handler(Display *dpy, XErrorEvent *ev)
+{
+	(void)dpy;
+	xshm_error = ev->error_code;
+	return 0;
+}
+
+/*
+ * Fetch rows y0 to y1 (exclusive) of the root window into the same rows
+ * of the image.  A band spans the full width, so it has the stride the
+ * server writes with and can use the image's segment at an offset.
+ */
+static int
+grab_rows(xshm_ctx_t *x, int y0, int y1)
+{
+	XImage	 band;
+
+	if (y0 < 0)
+		y0 = 0;
+	if (y1 > x->height)
+		y1 = x->height;
+	if (y1 <= y0)
+		return 0;
+	band = *x->image;
+	band.height = y1 - y0;
+	band.data = x->image->data + (size_t)y0 * x->image->bytes_per_line;
+	return XShmGetImage(x->dpy, x->root, &band, 0, y0, AllPlanes) ?
+	    0 : -1;
+}
+
+/*
+ * Rows of the screen damaged since the last call, or 0 to 0 if none.
+ */
+static void
+damaged_rows(xshm_ctx_t *x, int *y0, int *y1)
+{
+	XEvent		 ev;
+	XRectangle	 bounds;
+	XRectangle	*rects;
+	int		 n = 0;
+
+	*y0 = *y1 = 0;
+	while (XPending(x->dpy))
+		XNextEvent(x->dpy, &ev);
+
+	if (x->full || x->damage_ev < 0) {
+		x->full = 0;
+		if (x->damage_ev >= 0)
+			XDamageSubtract(x->dpy, x->damage, None, None);
+		*y1 = x->height;
+		return;
+	}
+	XDamageSubtract(x->dpy, x->damage, None, x->region);
+	rects = XFixesFetchRegionAndBounds(x->dpy, x->region, &n, &bounds);
+	if (rects != NULL)
+		XFree(rects);
+	if (n > 0) {
+		*y0 = bounds.y;
+		*y1 = bounds.y + bounds.height;
+	}
+}
+
+/*
+ * Blend the cursor into the image if it moved, changed shape or was
+ * grabbed over (rows y0 to y1 fetched this frame).  Its old rows are
+ * fetched again first so that nothing is blended twice.  Returns 1 if
+ * the picture changed, 0 if not, -1 on error.
+ */
+static int
+draw_cursor(xshm_ctx_t *x, int y0, int y1)
+{
+	XFixesCursorImage	*ci;
+	uint8_t			*dst;
+	unsigned long		 p;
+	int			 cx, cy, i, j, a;
+
+	ci = XFixesGetCursorImage(x->dpy);
+	if (ci == NULL)
+		return 0;
+	cx = ci->x - ci->xhot;
+	cy = ci->y - ci->yhot;
+	if (cx == x->cursor_x && cy == x->cursor_y &&
+	    ci->cursor_serial == x->cursor_serial &&
+	    (y1 <= x->cursor_y0 || y0 >= x->cursor_y1)) {
+		XFree(ci);
+		return 0;
+	}
+	if (grab_rows(x, x->cursor_y0, x->cursor_y1) < 0) {
+		XFree(ci);
+		return -1;
+	}
+
+	for (j = 0; j < ci->height; j++) {
+		if (cy + j < 0 || cy + j >= x->height)
+			continue;
+		for (i = 0; i < ci->width; i++) {
+			if (cx + i < 0 || cx + i >= x->width)
+				continue;
+			/* Premultiplied ARGB in the low 32 bits */
+			p = ci->pixels[j * ci->width + i];
+			a = (p >> 24) & 0xff;
+			if (a == 0)
+				continue;
+			dst = (uint8_t *)x->image->data +
+			    (size_t)(cy + j) * x->image->bytes_per_line +
+			    (size_t)(cx + i) * 4;
+			dst[0] = (p & 0xff) + dst[0] * (255 - a) / 255;
+			dst[1] = ((p >> 8) & 0xff) + dst[1] * (255 - a) / 255;
+			dst[2] = ((p >> 16) & 0xff) + dst[2] * (255 - a) / 255;
+		}
+	}
+	x->cursor_x = cx;
+	x->cursor_y = cy;
+	x->cursor_serial = ci->cursor_serial;
+	x->cursor_y0 = cy;
+	x->cursor_y1 = cy + ci->height;
+	XFree(ci);
+	return 1;
+}
+
+static void
+xshm_buffer_free(void *opaque, uint8_t *data)
+{
+	(void)opaque;
+	(void)data;
+}
+
+/*
+ * Open display for capture at fps frames a second.  Returns NULL if the
+ * display cannot be opened, lacks MIT-SHM (remote displays) or the root
+ * window is not 32-bit BGR0.
+ */
+xshm_ctx_t *
+xshm_open(const char *display, int fps, int draw_mouse)
+{
+	xshm_ctx_t		*x;
+	XWindowAttributes	 attr;
+	int			 (*handler)(Display *, XErrorEvent *);
+	int			 error_base, ok;
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL)
+		return NULL;
+	x->shm.shmid = -1;
+	x->damage_ev = -1;
+	x->draw_mouse = draw_mouse;
+	x->frame_us = 1000000 / (fps > 0 ? fps : 30);
+	x->full = 1;
+
+	x->dpy = XOpenDisplay(display);
+	if (x->dpy == NULL || !XShmQueryExtension(x->dpy)) {
+		DPRINTF("xshm: %s: no shared memory capture\n",
+		    display ? display : "$DISPLAY");
+		goto fail;
+	}
+	x->root = DefaultRootWindow(x->dpy);
+	if (!XGetWindowAttributes(x->dpy, x->root, &attr))
+		goto fail;
+	x->width = attr.width;
+	x->height = attr.height;
+
+	x->image = XShmCreateImage(x->dpy, attr.visual, attr.depth, ZPixmap,
+	    NULL, &x->shm, x->width, x->height);
+	if (x->image == NULL || x->image->bits_per_pixel != 32 ||
+	    x->image->byte_order != LSBFirst ||
+	    x->image->red_mask != 0xff0000 ||
+	    x->image->green_mask != 0xff00 ||
+	    x->image->blue_mask != 0xff) {
+		DPRINTF("xshm: unsupported root window format\n");
+		goto fail;
+	}
+	x->shm.shmid = shmget(IPC_PRIVATE,
+	    (size_t)x->image->bytes_per_line * x->height, IPC_CREAT | 0600);
+	if (x->shm.shmid < 0)
+		goto fail;
+	x->shm.shmaddr = x->image->data = shmat(x->shm.shmid, NULL, 0);
+	if (x->shm.shmaddr == (char *)-1) {
+		x->shm.shmaddr = x->image->data = NULL;
+		goto fail;
+	}
+	x->shm.readOnly = False;
+	/* Remote displays may offer MIT-SHM, then refuse the attach */
+	xshm_error = 0;
+	handler = XSetErrorHandler(xshm_error_handler);
+	ok = XShmAttach(x->dpy, &x->shm);
+	XSync(x->dpy, False);
+	XSetErrorHandler(handler);
+	if (!ok || xshm_error != 0) {
+		DPRINTF("xshm: cannot attach shared memory (X error %d)\n",
+		    xshm_error);
+		goto fail;
+	}
+	x->attached = 1;
+	/* Gone once both sides detach, even if we crash */
+	shmctl(x->shm.shmid, IPC_RMID, NULL);
+
+	if (XDamageQueryExtension(x->dpy, &x->damage_ev, &error_base) &&
+	    XFixesQueryExtension(x->dpy, &error_base, &error_base)) {
+		x->damage = XDamageCreate(x->dpy, x->root,
+		    XDamageReportNonEmpty);
+		x->region = XFixesCreateRegion(x->dpy, NULL, 0);
+	} else {
+		x->damage_ev = -1;
+		DPRINTF("xshm: no XDamage, grabbing full frames\n");
+	}
+
+	DPRINTF("xshm: capturing %dx%d, %s\n", x->width, x->height,
+	    x->damage_ev >= 0 ? "damage tracked" : "full frames");
+	return x;
+
+fail:
+	xshm_close(x);
+	return NULL;
+}
+
+void
+xshm_size(const xshm_ctx_t *x, int *width, int *height)
+{
+	*width = x->width;
+	*height = x->height;
+}
+
+/*
+ * Wait for the next frame time and grab the screen into frame, which
+ * then references the shared image: it is valid until the next grab and
+ * must not be kept beyond that.  Returns 1 if the picture changed since
+ * the last grab, 0 if not, -1 on error.
+ */
+int
+xshm_grab(xshm_ctx_t *x, AVFrame *frame)
+{
+	int64_t		 now;
+	int		 (*handler)(Display *, XErrorEvent *);
+	int		 y0, y1, changed, ret;
+
+	now = av_gettime_relative();
+	if (x->next_us == 0 || now - x->next_us > x->frame_us)
+		x->next_us = now;	/* first frame, or fell behind */
+	else if (x->next_us > now)
+		av_usleep((unsigned)(x->next_us - now));
+	x->next_us += x->frame_us;
+
+	/* A screen resized under us fails the grab with BadMatch */
+	xshm_error = 0;
+	handler = XSetErrorHandler(xshm_error_handler);
+	damaged_rows(x, &y0, &y1);
+	changed = y1 > y0;
+	ret = grab_rows(x, y0, y1);
+	if (ret == 0 && x->draw_mouse) {
+		switch (draw_cursor(x, y0, y1)) {
+		case -1:
+			ret = -1;
+			break;
+		case 1:
+			changed = 1;
+			break;
+		}
+	}
+	XSetErrorHandler(handler);
+	if (ret < 0 || xshm_error != 0) {
+		DPRINTF("xshm: grab failed (X error %d)\n", xshm_error);
+		return -1;
+	}
+
+	frame->buf[0] = av_buffer_create((uint8_t *)x->image->data,
+	    x->image->bytes_per_line * x->height, xshm_buffer_free, NULL,
+	    AV_BUFFER_FLAG_READONLY);
+	if (frame->buf[0] == NULL)
+		return -1;
+	frame->data[0] = frame->buf[0]->data;
+	frame->linesize[0] = x->image->bytes_per_line;
+	frame->width = x->width;
+	frame->height = x->height;
+	frame->format = AV_PIX_FMT_BGR0;
+	return changed;
+}
+
+void
+xshm_close(xshm_ctx_t *x)
+{
+	if (x == NULL)
+		return;
+	if (x->damage_ev >= 0) {
+		XFixesDestroyRegion(x->dpy, x->region);
+		XDamageDestroy(x->dpy, x->damage);
+	}
+	if (x->attached)
+		XShmDetach(x->dpy, &x->shm);
+	if (x->shm.shmaddr != NULL)
+		shmdt(x->shm.shmaddr);
+	if (x->shm.shmid >= 0 && !x->attached)
+		shmctl(x->shm.shmid, IPC_RMID, NULL);
+	if (x->image != NULL) {
+		x->image->data = NULL;
+		XDestroyImage(x->image);
+	}
+	if (x->dpy != NULL)
+		XCloseDisplay(x->dpy);
+	free(x);
+}
+
+#else /* !HAVE_XSHM */
+
+xshm_ctx_t *
+xshm_open(const char *display, int fps, int draw_mouse)
+{
+	(void)display;
+	(void)fps;
+	(void)draw_mouse;
+	return NULL;
+}
+
+void
+xshm_size(const xshm_ctx_t *x, int *width, int *height)
+{
+	(void)x;
+	*width = *height = 0;
+}
+
+int
+xshm_grab(xshm_ctx_t *x, AVFrame *frame)
+{
+	(void)x;
+	(void)frame;
+	return -1;
+}
+
+void
+xshm_close(xshm_ctx_t *x)
+{
+	(void)x;
+}
+
+#endif /* HAVE_XSHM */